@@ -17,6 +17,12 @@
 const double ahtable_max_load_factor = 100000.0; /* arbitrary large number => don't resize */
 const size_t ahtable_initial_size = 4096;
 
+static uint64_t lenbit(size_t len)
+{
+    return (uint64_t) 1 << (len < 63 ? len : 63);
+}
+
+
 static size_t keylen(slot_t s) {
     if (0x1 & *s) {
         return (size_t) (*((uint16_t*) s) >> 1);
@@ -27,6 +33,117 @@ static size_t keylen(slot_t s) {
 }
 
 
+/* An entry is the key's length, in one byte or two, the key, and its value,
+ * which is padded to begin on a multiple of sizeof(value_t) from the start of
+ * the slot, so that it may be read and written atomically. Every entry is a
+ * multiple of that size, so this holds as entries move within a slot, and
+ * slots are allocated aligned to it. */
+
+/* Bytes from the start of a key of the given length to its value. */
+static inline size_t value_offset(size_t len)
+{
+    size_t head = len < 128 ? 1 : 2;
+    return ((head + len + sizeof(value_t) - 1) & ~(sizeof(value_t) - 1)) - head;
+}
+
+
+/* Number of bytes a key and its value take in a slot. */
+static inline size_t entry_size(size_t len)
+{
+    return (len < 128 ? 1 : 2) + value_offset(len) + sizeof(value_t);
+}
+
+
+/** Inserts a key with value into slot s, and returns a pointer to the
+  * space immediately after.
+  */
+static slot_t ins_key(slot_t s, const char* key, size_t len, value_t** val)
+{
+    // key length
+    if (len < 128) {
+        s[0] = (unsigned char) (len << 1);
+        s += 1;
+    }
+    else {
+        /* The least significant bit is set to indicate that two bytes are
+         * being used to store the key length. */
+        *((uint16_t*) s) = ((uint16_t) len << 1) | 0x1;
+        s += 2;
+    }
+
+    // key, and padding
+    memcpy(s, key, len * sizeof(unsigned char));
+    memset(s + len, 0, value_offset(len) - len);
+    s += value_offset(len);
+
+    // value
+    *val = (value_t*) s;
+    **val = 0;
+    s += sizeof(value_t);
+
+    return s;
+}
+
+
+/* A shared table keeps the size of each slot in front of it as well, so that
+ * a reader that loads a slot has the size that goes with it. */
+#define SLOT_HEADER sizeof(size_t)
+
+
+/* Slot i and its size, as they are read by readers of a shared table. */
+static inline slot_t load_slot(const ahtable_t* table, size_t i, size_t* size)
+{
+    if (table->retire == NULL) {
+        *size = table->slot_sizes[i];
+        return table->slots[i];
+    }
+
+    slot_t s = __atomic_load_n(&table->slots[i], __ATOMIC_ACQUIRE);
+    *size = s ? ((size_t*) s)[-1] : 0;
+    return s;
+}
+
+
+/* Space for a new slot i of the given size, beginning with the first keep
+ * bytes of the old one, to be filled in and passed to set_slot. A table that is
+ * not shared grows the slot in place. */
+static slot_t alloc_slot(ahtable_t* table, size_t i, size_t keep, size_t size)
+{
+    if (table->retire == NULL) {
+        return realloc_or_die(table->slots[i], size);
+    }
+
+    size_t* h = malloc_or_die(SLOT_HEADER + size);
+    *h = size;
+    memcpy(h + 1, table->slots[i], keep);
+    return (slot_t) (h + 1);
+}
+
+
+/* Make s, of the given size, slot i. In a shared table it is published to
+ * readers, and the slot it replaces retired rather than freed. */
+static void set_slot(ahtable_t* table, size_t i, slot_t s, size_t size)
+{
+    slot_t old = table->slots[i];
+    table->slot_sizes[i] = size;
+
+    if (table->retire == NULL) {
+        table->slots[i] = s;
+        return;
+    }
+
+    __atomic_store_n(&table->slots[i], s, __ATOMIC_RELEASE);
+    if (old) table->retire(old - SLOT_HEADER, table->retire_ctx);
+}
+
+
+static void free_slot(const ahtable_t* table, slot_t s)
+{
+    if (s && table->retire) s -= SLOT_HEADER;
+    free(s);
+}
+
+
 ahtable_t* ahtable_create()
 {
     return ahtable_create_n(ahtable_initial_size);
@@ -38,10 +155,17 @@ ahtable_t* ahtable_create_n(size_t n)
     ahtable_t* table = malloc_or_die(sizeof(ahtable_t));
     table->flag = 0;
     table->c0 = table->c1 = '\0';
+    table->sum = 0;
+    table->min = UINTPTR_MAX;
+    table->max = 0;
+    table->refs = 1;
+    table->retire = NULL;
+    table->retire_ctx = NULL;
 
     table->n = n;
     table->m = 0;
     table->max_m = (size_t) (ahtable_max_load_factor * (double) table->n);
+    table->lengths = 0;
     table->slots = malloc_or_die(n * sizeof(slot_t));
     memset(table->slots, 0, n * sizeof(slot_t));
 
@@ -51,6 +175,35 @@ ahtable_t* ahtable_create_n(size_t n)
     return table;
 }
 
+ahtable_t* ahtable_dup(const ahtable_t* table)
+{
+    ahtable_t* copy = malloc_or_die(sizeof(ahtable_t));
+    memcpy(copy, table, sizeof(ahtable_t));
+    copy->refs = 1;
+    copy->retire = NULL;
+    copy->retire_ctx = NULL;
+
+    copy->slots = malloc_or_die(table->n * sizeof(slot_t));
+    copy->slot_sizes = malloc_or_die(table->n * sizeof(size_t));
+
+    /* values are aligned from the start of their slot, which malloc keeps */
+    size_t i, size;
+    slot_t s;
+    for (i = 0; i < table->n; ++i) {
+        s = load_slot(table, i, &size);
+        copy->slot_sizes[i] = size;
+        if (size == 0) {
+            copy->slots[i] = NULL;
+            continue;
+        }
+        copy->slots[i] = malloc_or_die(size);
+        memcpy(copy->slots[i], s, size);
+    }
+
+    return copy;
+}
+
+
 void ahtable_save(const ahtable_t* table, FILE* fd)
 {
     if (table == NULL) return;
@@ -72,13 +225,23 @@ void ahtable_save(const ahtable_t* table, FILE* fd)
     fwrite(&table->c0, sizeof(unsigned char), 1, fd);
     fwrite(&table->c1, sizeof(unsigned char), 1, fd);
 
-    size_t i;
+    /* entries are saved without the padding before their values */
+    size_t i, k, size;
     uint32_t slot_size;
+    slot_t s, end;
     for (i = 0; i < table->n; ++i) {
-        slot_size = htobe32(table->slot_sizes[i]);
+        end = table->slots[i] + table->slot_sizes[i];
+        for (s = table->slots[i], size = 0; s < end; s += entry_size(k)) {
+            k = keylen(s);
+            size += (k < 128 ? 1 : 2) + k + sizeof(value_t);
+        }
+
+        slot_size = htobe32(size);
         fwrite(&slot_size, sizeof(uint32_t), 1, fd);
-        if(table->slot_sizes[i] > 0) {
-            fwrite(table->slots[i], sizeof(unsigned char), table->slot_sizes[i], fd);
+        for (s = table->slots[i]; s < end; s += entry_size(k)) {
+            k = keylen(s);
+            fwrite(s, sizeof(unsigned char), (k < 128 ? 1 : 2) + k, fd);
+            fwrite(s + (k < 128 ? 1 : 2) + value_offset(k), sizeof(value_t), 1, fd);
         }
     }
 }
@@ -109,13 +272,31 @@ void ahtable_free(ahtable_t* table)
 {
     if (table == NULL) return;
     size_t i;
-    for (i = 0; i < table->n; ++i) free(table->slots[i]);
+    for (i = 0; i < table->n; ++i) free_slot(table, table->slots[i]);
     free(table->slots);
     free(table->slot_sizes);
     free(table);
 }
 
 
+void ahtable_share(ahtable_t* table, void (*retire)(void* ptr, void* ctx), void* ctx)
+{
+    size_t i;
+    size_t* h;
+    for (i = 0; i < table->n && table->retire == NULL; ++i) {
+        if (table->slots[i] == NULL) continue;
+        h = malloc_or_die(SLOT_HEADER + table->slot_sizes[i]);
+        *h = table->slot_sizes[i];
+        memcpy(h + 1, table->slots[i], table->slot_sizes[i]);
+        free(table->slots[i]);
+        table->slots[i] = (slot_t) (h + 1);
+    }
+
+    table->retire = retire;
+    table->retire_ctx = ctx;
+}
+
+
 ahtable_t* ahtable_load(FILE* fd)
 {
     size_t n;
@@ -131,26 +312,51 @@ ahtable_t* ahtable_load(FILE* fd)
         return NULL;
     }
 
-    size_t i;
+    /* Entries are saved without the padding before their values, so each
+     * slot is read whole and then laid out again. */
+    size_t i, k, size, buf_size = 0;
     uint32_t slot_size;
+    slot_t s, t, end;
+    slot_t buf = NULL;
+    value_t* val;
     for (i = 0; i < table->n; ++i) {
         if (fread(&slot_size, sizeof(uint32_t), 1, fd) != 1) {
+            free(buf);
             ahtable_free(table);
             return NULL;
         }
-        table->slot_sizes[i] = be32toh(slot_size);
-        if(table->slot_sizes[i] > 0) {
-            table->slots[i] = malloc_or_die(table->slot_sizes[i]);
-            if (fread(table->slots[i],
-                      sizeof(unsigned char),
-                      table->slot_sizes[i],
-                      fd) != table->slot_sizes[i]) {
-                ahtable_free(table);
-                return NULL;
-            }
+        size = be32toh(slot_size);
+        if (size == 0) continue;
+
+        if (size > buf_size) {
+            buf_size = size;
+            buf = realloc_or_die(buf, buf_size);
+        }
+        if (fread(buf, sizeof(unsigned char), size, fd) != size) {
+            free(buf);
+            ahtable_free(table);
+            return NULL;
+        }
+
+        end = buf + size;
+        for (s = buf; s < end; s += (k < 128 ? 1 : 2) + k + sizeof(value_t)) {
+            k = keylen(s);
+            table->slot_sizes[i] += entry_size(k);
+        }
+
+        table->slots[i] = t = malloc_or_die(table->slot_sizes[i]);
+        for (s = buf; s < end; s += k + sizeof(value_t)) {
+            k = keylen(s);
+            s += k < 128 ? 1 : 2;
+            t = ins_key(t, (const char*) s, k, &val);
+            memcpy(val, s + k, sizeof(value_t));
+
+            /* the length filter is not saved, so rebuild it */
+            table->lengths |= lenbit(k);
         }
     }
 
+    free(buf);
     return table;
 }
 
@@ -176,6 +382,15 @@ size_t ahtable_sizeof(const ahtable_t* table)
 void ahtable_clear(ahtable_t* table)
 {
     size_t i;
+
+    /* readers may be in the slots of a shared table, which keeps its size */
+    if (table->retire) {
+        for (i = 0; i < table->n; ++i) set_slot(table, i, NULL, 0);
+        table->m = 0;
+        table->lengths = 0;
+        return;
+    }
+
     for (i = 0; i < table->n; ++i) free(table->slots[i]);
     table->n = ahtable_initial_size;
     table->slots = realloc_or_die(table->slots, table->n * sizeof(slot_t));
@@ -183,38 +398,12 @@ void ahtable_clear(ahtable_t* table)
 
     table->slot_sizes = realloc_or_die(table->slot_sizes, table->n * sizeof(size_t));
     memset(table->slot_sizes, 0, table->n * sizeof(size_t));
-}
 
-/** Inserts a key with value into slot s, and returns a pointer to the
-  * space immediately after.
-  */
-static slot_t ins_key(slot_t s, const char* key, size_t len, value_t** val)
-{
-    // key length
-    if (len < 128) {
-        s[0] = (unsigned char) (len << 1);
-        s += 1;
-    }
-    else {
-        /* The least significant bit is set to indicate that two bytes are
-         * being used to store the key length. */
-        *((uint16_t*) s) = ((uint16_t) len << 1) | 0x1;
-        s += 2;
-    }
-
-    // key
-    memcpy(s, key, len * sizeof(unsigned char));
-    s += len;
-
-    // value
-    *val = (value_t*) s;
-    **val = 0;
-    s += sizeof(value_t);
-
-    return s;
+    table->m = 0;
+    table->max_m = (size_t) (ahtable_max_load_factor * (double) table->n);
+    table->lengths = 0;
 }
 
-
 static void ahtable_expand(ahtable_t* table)
 {
     /* Resizing a table is essentially building a brand new one.
@@ -232,8 +421,7 @@ static void ahtable_expand(ahtable_t* table)
     ahtable_iter_t* i = ahtable_iter_begin(table, false);
     while (!ahtable_iter_finished(i)) {
         key = ahtable_iter_key(i, &len);
-        slot_sizes[hash(key, len) % new_n] +=
-            len + sizeof(value_t) + (len >= 128 ? 2 : 1);
+        slot_sizes[hash(key, len) % new_n] += entry_size(len);
 
         ++m;
         ahtable_iter_next(i);
@@ -293,57 +481,63 @@ static void ahtable_expand(ahtable_t* table)
 }
 
 
-static value_t* get_key(ahtable_t* table, const char* key, size_t len, bool insert_missing)
+/* Find a key in the first size bytes of a slot, returning a pointer to its
+ * value, or NULL if it is not there. */
+static value_t* find_key(slot_t s, size_t size, const char* key, size_t len)
 {
-    /* if we are at capacity, preemptively resize */
-    if (insert_missing && table->m >= table->max_m) {
-        ahtable_expand(table);
-    }
-
-
-    uint32_t i = hash(key, len) % table->n;
+    slot_t end = s + size;
     size_t k;
-    slot_t s;
-    value_t* val;
 
-    /* search the array for our key */
-    s = table->slots[i];
-    while ((size_t) (s - table->slots[i]) < table->slot_sizes[i]) {
+    while (s < end) {
         /* get the key length */
         k = keylen(s);
         s += k < 128 ? 1 : 2;
 
-        /* skip keys that are longer than ours */
-        if (k != len) {
-            s += k + sizeof(value_t);
-            continue;
-        }
-
         /* key found. */
-        if (memcmp(s, key, len) == 0) {
-            return (value_t*) (s + len);
-        }
-        /* key not found. */
-        else {
-            s += k + sizeof(value_t);
-            continue;
+        if (k == len && memcmp(s, key, len) == 0) {
+            return (value_t*) (s + value_offset(len));
         }
+
+        /* skip keys that are not ours */
+        s += value_offset(k) + sizeof(value_t);
+    }
+
+    return NULL;
+}
+
+
+static value_t* get_key(ahtable_t* table, const char* key, size_t len, bool insert_missing,
+                        bool* inserted)
+{
+    /* if we are at capacity, preemptively resize, which a shared table, whose
+     * slots readers may be in, never does */
+    if (insert_missing && table->m >= table->max_m && table->retire == NULL) {
+        ahtable_expand(table);
     }
 
 
+    uint32_t i = hash(key, len) % table->n;
+    value_t* val;
+    size_t size;
+
+    /* search the array for our key */
+    slot_t s = load_slot(table, i, &size);
+    val = find_key(s, size, key, len);
+    if (val) return val;
+
+
     if (insert_missing) {
         /* the key was not found, so we must insert it. */
-        size_t new_size = table->slot_sizes[i];
-        new_size += 1 + (len >= 128 ? 1 : 0);    // key length
-        new_size += len * sizeof(unsigned char); // key
-        new_size += sizeof(value_t);             // value
+        size_t new_size = size + entry_size(len);
 
-        table->slots[i] = realloc_or_die(table->slots[i], new_size);
+        s = alloc_slot(table, i, size, new_size);
 
         ++table->m;
-        ins_key(table->slots[i] + table->slot_sizes[i], key, len, &val);
-        table->slot_sizes[i] = new_size;
+        ins_key(s + size, key, len, &val);
+        table->lengths |= lenbit(len);
+        set_slot(table, i, s, new_size);
 
+        if (inserted) *inserted = true;
         return val;
     }
     else return NULL;
@@ -351,19 +545,186 @@ static value_t* get_key(ahtable_t* table, const char* key, size_t len, bool inse
 
 
 value_t* ahtable_get(ahtable_t* table, const char* key, size_t len)
+{
+    return ahtable_get_ex(table, key, len, NULL);
+}
+
+
+/* Keys are stored with a 15-bit length. */
+static void check_key_len(size_t len)
 {
     if (len > 32767) {
         fprintf(stderr, "HAT-trie/AH-table cannot store keys longer than 32768\n");
         exit(EXIT_FAILURE);
     }
+}
+
+
+value_t* ahtable_get_ex(ahtable_t* table, const char* key, size_t len, bool* inserted)
+{
+    check_key_len(len);
+
+    if (inserted) *inserted = false;
+    return get_key(table, key, len, true, inserted);
+}
+
+
+value_t ahtable_add(ahtable_t* table, const char* key, size_t len, value_t delta)
+{
+    value_t* val = ahtable_get_ex(table, key, len, NULL);
+    return *val += delta;
+}
+
+
+/* Find or insert a batch of keys, unless more than max_m keys would then be
+ * stored, returning false and leaving the table as it was. */
+static bool get_batch(ahtable_t* table, const char* const* keys, const size_t* lens,
+                      size_t n, value_t** vals, bool* inserted, size_t max_m)
+{
+    size_t i, j, k;
+    for (i = 0; i < n; ++i) check_key_len(lens[i]);
+
+    /* order the keys by slot, with a counting sort */
+    uint32_t* hs    = malloc_or_die(n * sizeof(uint32_t));
+    size_t* order   = malloc_or_die(n * sizeof(size_t));
+    size_t* offsets = malloc_or_die(n * sizeof(size_t));
+    bool* fresh     = malloc_or_die(n * sizeof(bool));
+    size_t* starts  = malloc_or_die((table->n + 1) * sizeof(size_t));
+    memset(starts, 0, (table->n + 1) * sizeof(size_t));
+
+    for (i = 0; i < n; ++i) {
+        hs[i] = hash(keys[i], lens[i]) % table->n;
+        ++starts[hs[i] + 1];
+    }
+    for (j = 1; j <= table->n; ++j) starts[j] += starts[j - 1];
+    for (i = 0; i < n; ++i) order[starts[hs[i]]++] = i;
+
+    /* Each run of keys in one slot is looked up in what the slot holds, and
+     * the new ones are given places after it, in order. The offsets of values
+     * are kept rather than pointers until the slot has grown. */
+    const size_t missing = (size_t) -1;
+    size_t a, b, size, added, m = 0;
+    uint32_t h;
+    value_t* val;
+    for (a = 0; a < n; a = b) {
+        h = hs[order[a]];
+        for (b = a + 1; b < n && hs[order[b]] == h; ++b);
+
+        size  = table->slot_sizes[h];
+        added = 0;
+        for (j = a; j < b; ++j) {
+            i = order[j];
+            fresh[i] = false;
+            val = find_key(table->slots[h], size, keys[i], lens[i]);
+            if (val) {
+                offsets[i] = (slot_t) val - table->slots[h];
+                continue;
+            }
+
+            /* the same key may come more than once */
+            offsets[i] = missing;
+            for (k = a; k < j; ++k) {
+                if (fresh[order[k]] && lens[order[k]] == lens[i] &&
+                    memcmp(keys[order[k]], keys[i], lens[i]) == 0) {
+                    offsets[i] = offsets[order[k]];
+                    break;
+                }
+            }
+
+            if (offsets[i] == missing) {
+                fresh[i] = true;
+                offsets[i] = size + added + entry_size(lens[i]) - sizeof(value_t);
+                added += entry_size(lens[i]);
+                ++m;
+            }
+        }
+
+        /* keys the slot did not hold are placed past its end */
+        if (inserted) {
+            for (j = a; j < b; ++j) inserted[order[j]] = offsets[order[j]] >= size;
+        }
+    }
 
-    return get_key(table, key, len, true);
+    bool fits = table->m + m <= max_m;
+
+    if (fits) {
+        /* grow to hold the new keys first, placing them again if it does */
+        if (table->m + m > table->max_m && table->retire == NULL) {
+            while (table->m + m > table->max_m) ahtable_expand(table);
+            free(hs);
+            free(order);
+            free(offsets);
+            free(fresh);
+            free(starts);
+            return get_batch(table, keys, lens, n, vals, inserted, max_m);
+        }
+
+        /* grow each slot once for all of its new keys */
+        slot_t s;
+        for (a = 0; a < n; a = b) {
+            h = hs[order[a]];
+            size = table->slot_sizes[h];
+            added = 0;
+            for (b = a; b < n && hs[order[b]] == h; ++b) {
+                if (fresh[order[b]]) added += entry_size(lens[order[b]]);
+            }
+
+            if (added > 0) {
+                slot_t t = alloc_slot(table, h, size, size + added);
+                s = t + size;
+                for (j = a; j < b; ++j) {
+                    i = order[j];
+                    if (!fresh[i]) continue;
+
+                    s = ins_key(s, keys[i], lens[i], &val);
+                    ++table->m;
+                    table->lengths |= lenbit(lens[i]);
+                }
+                set_slot(table, h, t, size + added);
+            }
+
+            if (vals) {
+                for (j = a; j < b; ++j) {
+                    i = order[j];
+                    vals[i] = (value_t*) (table->slots[h] + offsets[i]);
+                }
+            }
+        }
+    }
+
+    free(hs);
+    free(order);
+    free(offsets);
+    free(fresh);
+    free(starts);
+    return fits;
+}
+
+
+void ahtable_get_batch(ahtable_t* table, const char* const* keys, const size_t* lens,
+                       size_t n, value_t** vals)
+{
+    get_batch(table, keys, lens, n, vals, NULL, (size_t) -1);
+}
+
+
+bool ahtable_get_batch_within(ahtable_t* table, const char* const* keys,
+                              const size_t* lens, size_t n, value_t** vals,
+                              bool* inserted, size_t max_m)
+{
+    return get_batch(table, keys, lens, n, vals, inserted, max_m);
 }
 
 
 value_t* ahtable_tryget(ahtable_t* table, const char* key, size_t len )
 {
-    return get_key(table, key, len, false);
+    return get_key(table, key, len, false, NULL);
+}
+
+
+bool ahtable_has_len(const ahtable_t* table, size_t len)
+{
+    return (table->lengths & lenbit(len)) != 0;
 }
 
 
@@ -382,23 +743,34 @@ int ahtable_del(ahtable_t* table, const char* key, size_t len)
 
         /* skip keys that are longer than ours */
         if (k != len) {
-            s += k + sizeof(value_t);
+            s += value_offset(k) + sizeof(value_t);
             continue;
         }
 
         /* key found. */
         if (memcmp(s, key, len) == 0) {
             /* move everything over, resize the array */
-            unsigned char* t = s + len + sizeof(value_t);
+            unsigned char* t = s + value_offset(len) + sizeof(value_t);
             s -= k < 128 ? 1 : 2;
-            memmove(s, t, table->slot_sizes[i] - (size_t) (t - table->slots[i]));
-            table->slot_sizes[i] -= (size_t) (t - s);
+            size_t at   = (size_t) (s - table->slots[i]);
+            size_t rest = table->slot_sizes[i] - (size_t) (t - table->slots[i]);
+
+            /* a shared table's slot is copied without the key */
+            if (table->retire) {
+                slot_t u = alloc_slot(table, i, at, at + rest);
+                memcpy(u + at, t, rest);
+                set_slot(table, i, u, at + rest);
+            }
+            else {
+                memmove(s, t, rest);
+                table->slot_sizes[i] = at + rest;
+            }
             --table->m;
             return 0;
         }
         /* key not found. */
         else {
-            s += k + sizeof(value_t);
+            s += value_offset(k) + sizeof(value_t);
             continue;
         }
     }
@@ -424,6 +796,157 @@ static int cmpkey(const void* a_, const void* b_)
 }
 
 
+/* Compare the key stored at s to the given key, ordering as cmpkey does. */
+static int cmpslot(slot_t s, const char* key, size_t len)
+{
+    size_t k = keylen(s);
+    s += k < 128 ? 1 : 2;
+
+    int c = memcmp(s, key, k < len ? k : len);
+    return c == 0 ? (k > len) - (k < len) : c;
+}
+
+
+/* Bounds lo <= key < hi on the keys visited by an iterator. A NULL bound
+ * leaves that end of the range open. */
+typedef struct ahtable_range_t_
+{
+    char* lo;
+    size_t lo_len;
+    char* hi;
+    size_t hi_len;
+} ahtable_range_t;
+
+
+static void ahtable_range_init(ahtable_range_t* r,
+                               const char* lo, size_t lo_len,
+                               const char* hi, size_t hi_len)
+{
+    r->lo = NULL;
+    r->lo_len = 0;
+    r->hi = NULL;
+    r->hi_len = 0;
+
+    /* every key is >= the empty key, so it needs no bound */
+    if (lo != NULL && lo_len > 0) {
+        r->lo = malloc_or_die(lo_len);
+        memcpy(r->lo, lo, lo_len);
+        r->lo_len = lo_len;
+    }
+
+    if (hi != NULL) {
+        r->hi = malloc_or_die(hi_len + 1);
+        memcpy(r->hi, hi, hi_len);
+        r->hi_len = hi_len;
+    }
+}
+
+
+static void ahtable_range_free(ahtable_range_t* r)
+{
+    free(r->lo);
+    free(r->hi);
+}
+
+
+static bool ahtable_range_contains(const ahtable_range_t* r, slot_t s)
+{
+    return (r->lo == NULL || cmpslot(s, r->lo, r->lo_len) >= 0) &&
+           (r->hi == NULL || cmpslot(s, r->hi, r->hi_len) < 0);
+}
+
+
+size_t ahtable_count_range(const ahtable_t* table,
+                           const char* lo, size_t lo_len,
+                           const char* hi, size_t hi_len)
+{
+    if ((lo == NULL || lo_len == 0) && hi == NULL) return table->m;
+
+    ahtable_range_t r;
+    ahtable_range_init(&r, lo, lo_len, hi, hi_len);
+
+    slot_t s, end;
+    size_t j, k, size, count = 0;
+    for (j = 0; j < table->n; ++j) {
+        s = load_slot(table, j, &size);
+        for (end = s + size; s < end;) {
+            if (ahtable_range_contains(&r, s)) ++count;
+            k = keylen(s);
+            s += k < 128 ? 1 : 2;
+            s += value_offset(k) + sizeof(value_t);
+        }
+    }
+
+    ahtable_range_free(&r);
+    return count;
+}
+
+
+static void swap_slots(slot_t* xs, size_t i, size_t j)
+{
+    slot_t t = xs[i];
+    xs[i] = xs[j];
+    xs[j] = t;
+}
+
+
+const char* ahtable_select(const ahtable_t* table, size_t k, size_t* len, value_t** val)
+{
+    if (k >= table->m) return NULL;
+
+    slot_t* xs = malloc_or_die(table->m * sizeof(slot_t));
+    slot_t s, end;
+    size_t j, n, u, size;
+    for (j = 0, u = 0; j < table->n; ++j) {
+        s = load_slot(table, j, &size);
+        for (end = s + size; s < end;) {
+            xs[u++] = s;
+            n = keylen(s);
+            s += n < 128 ? 1 : 2;
+            s += value_offset(n) + sizeof(value_t);
+        }
+    }
+
+    /* Quickselect, narrowing [lo, hi] to the part holding rank k. The middle
+     * key is the pivot, since keys are already in hash order. */
+    size_t lo = 0, hi = table->m - 1, i, p;
+    while (lo < hi) {
+        swap_slots(xs, lo + (hi - lo) / 2, hi);
+        for (i = p = lo; i < hi; ++i) {
+            if (cmpkey(&xs[i], &xs[hi]) < 0) swap_slots(xs, i, p++);
+        }
+        swap_slots(xs, p, hi);
+
+        if (k == p) break;
+        else if (k < p) hi = p - 1;
+        else            lo = p + 1;
+    }
+
+    s = xs[k];
+    free(xs);
+
+    n = keylen(s);
+    s += n < 128 ? 1 : 2;
+    if (len) *len = n;
+    if (val) *val = (value_t*) (s + value_offset(n));
+    return (const char*) s;
+}
+
+
+/* The index of the first of the m sorted keys in xs that is >= key. */
+static size_t ahtable_lower_bound(const slot_t* xs, size_t m,
+                                  const char* key, size_t len)
+{
+    size_t lo = 0, hi = m, mid;
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if (cmpslot(xs[mid], key, len) < 0) lo = mid + 1;
+        else                                hi = mid;
+    }
+    return lo;
+}
+
+
 /* Sorted/unsorted iterators are kept private and exposed by passing the
 sorted flag to ahtable_iter_begin. */
 
@@ -431,30 +954,52 @@ typedef struct ahtable_sorted_iter_t_
 {
     const ahtable_t* table; // parent
     slot_t* xs; // pointers to keys
+    size_t m; // number of keys in xs
     size_t i; // current key
+    bool reverse; // visit xs from last to first
 } ahtable_sorted_iter_t;
 
 
-static ahtable_sorted_iter_t* ahtable_sorted_iter_begin(const ahtable_t* table)
+static ahtable_sorted_iter_t* ahtable_sorted_iter_begin(const ahtable_t* table,
+                                                        const ahtable_range_t* r,
+                                                        bool reverse)
 {
     ahtable_sorted_iter_t* i = malloc_or_die(sizeof(ahtable_sorted_iter_t));
+    /* the writer of a shared table changes m as it is read */
+    size_t xs_size = table->retire ? 64 : table->m > 0 ? table->m : 1;
     i->table = table;
-    i->xs = malloc_or_die(table->m * sizeof(slot_t));
+    i->xs = malloc_or_die(xs_size * sizeof(slot_t));
     i->i = 0;
+    i->reverse = reverse;
 
-    slot_t s;
-    size_t j, k, u;
+    /* A shared table may gain keys as it is read. */
+    slot_t s, end;
+    size_t j, k, u, size;
     for (j = 0, u = 0; j < table->n; ++j) {
-        s = table->slots[j];
-        while (s < table->slots[j] + table->slot_sizes[j]) {
+        s = load_slot(table, j, &size);
+        for (end = s + size; s < end;) {
+            if (u == xs_size) {
+                xs_size *= 2;
+                i->xs = realloc_or_die(i->xs, xs_size * sizeof(slot_t));
+            }
             i->xs[u++] = s;
             k = keylen(s);
             s += k < 128 ? 1 : 2;
-            s += k + sizeof(value_t);
+            s += value_offset(k) + sizeof(value_t);
         }
     }
+    i->m = u;
 
-    qsort(i->xs, table->m, sizeof(slot_t), cmpkey);
+    qsort(i->xs, i->m, sizeof(slot_t), cmpkey);
+
+    /* The range is the run of sorted keys between the two bounds. */
+    if (r != NULL) {
+        size_t a = r->lo ? ahtable_lower_bound(i->xs, i->m, r->lo, r->lo_len) : 0;
+        size_t b = r->hi ? ahtable_lower_bound(i->xs, i->m, r->hi, r->hi_len) : i->m;
+        if (b < a) b = a;
+        memmove(i->xs, i->xs + a, (b - a) * sizeof(slot_t));
+        i->m = b - a;
+    }
 
     return i;
 }
@@ -462,7 +1007,7 @@ static ahtable_sorted_iter_t* ahtable_sorted_iter_begin(const ahtable_t* table)
 
 static bool ahtable_sorted_iter_finished(ahtable_sorted_iter_t* i)
 {
-    return i->i >= i->table->m;
+    return i->i >= i->m;
 }
 
 
@@ -481,11 +1026,17 @@ static void ahtable_sorted_iter_free(ahtable_sorted_iter_t* i)
 }
 
 
+static slot_t ahtable_sorted_iter_slot(ahtable_sorted_iter_t* i)
+{
+    return i->xs[i->reverse ? i->m - 1 - i->i : i->i];
+}
+
+
 static const char* ahtable_sorted_iter_key(ahtable_sorted_iter_t* i, size_t* len)
 {
     if (ahtable_sorted_iter_finished(i)) return NULL;
 
-    slot_t s = i->xs[i->i];
+    slot_t s = ahtable_sorted_iter_slot(i);
     if (len) *len = keylen(s);
 
     return (const char*) (s + (*len < 128 ? 1 : 2));
@@ -496,11 +1047,11 @@ static value_t*  ahtable_sorted_iter_val(ahtable_sorted_iter_t* i)
 {
     if (ahtable_sorted_iter_finished(i)) return NULL;
 
-    slot_t s = i->xs[i->i];
+    slot_t s = ahtable_sorted_iter_slot(i);
     size_t k = keylen(s);
 
     s += k < 128 ? 1 : 2;
-    s += k;
+    s += value_offset(k);
 
     return (value_t*) s;
 }
@@ -511,55 +1062,82 @@ typedef struct ahtable_unsorted_iter_t_
     const ahtable_t* table; // parent
     size_t i;           // slot index
     slot_t s;           // slot position
+    slot_t end;         // end of the slot
+    ahtable_range_t r;  // keys outside this range are skipped
 } ahtable_unsorted_iter_t;
 
 
-static ahtable_unsorted_iter_t* ahtable_unsorted_iter_begin(const ahtable_t* table)
-{
-    ahtable_unsorted_iter_t* i = malloc_or_die(sizeof(ahtable_unsorted_iter_t));
-    i->table = table;
-
-    for (i->i = 0; i->i < i->table->n; ++i->i) {
-        i->s = table->slots[i->i];
-        if ((size_t) (i->s - table->slots[i->i]) >= table->slot_sizes[i->i]) continue;
-        break;
-    }
-
-    return i;
-}
-
-
 static bool ahtable_unsorted_iter_finished(ahtable_unsorted_iter_t* i)
 {
     return i->i >= i->table->n;
 }
 
 
-static void ahtable_unsorted_iter_next(ahtable_unsorted_iter_t* i)
+/* Advance to the next key, whether or not it lies in the range. */
+static void ahtable_unsorted_iter_step(ahtable_unsorted_iter_t* i)
 {
-    if (ahtable_unsorted_iter_finished(i)) return;
-
     /* get the key length */
     size_t k = keylen(i->s);
     i->s += k < 128 ? 1 : 2;
 
     /* skip to the next key */
-    i->s += k + sizeof(value_t);
+    i->s += value_offset(k) + sizeof(value_t);
 
-    if ((size_t) (i->s - i->table->slots[i->i]) >= i->table->slot_sizes[i->i]) {
-        do {
-            ++i->i;
-        } while(i->i < i->table->n &&
-                i->table->slot_sizes[i->i] == 0);
+    size_t size = 0;
+    if (i->s >= i->end) {
+        while (++i->i < i->table->n) {
+            i->s = load_slot(i->table, i->i, &size);
+            if (size > 0) break;
+        }
 
-        if (i->i < i->table->n) i->s = i->table->slots[i->i];
-        else i->s = NULL;
+        if (i->i < i->table->n) i->end = i->s + size;
+        else i->s = i->end = NULL;
     }
 }
 
 
+static void ahtable_unsorted_iter_skip(ahtable_unsorted_iter_t* i)
+{
+    while (!ahtable_unsorted_iter_finished(i) &&
+           !ahtable_range_contains(&i->r, i->s)) {
+        ahtable_unsorted_iter_step(i);
+    }
+}
+
+
+static ahtable_unsorted_iter_t* ahtable_unsorted_iter_begin(const ahtable_t* table,
+                                                            const ahtable_range_t* r)
+{
+    ahtable_unsorted_iter_t* i = malloc_or_die(sizeof(ahtable_unsorted_iter_t));
+    i->table = table;
+
+    if (r) i->r = *r;
+    else   ahtable_range_init(&i->r, NULL, 0, NULL, 0);
+
+    size_t size = 0;
+    for (i->i = 0; i->i < i->table->n; ++i->i) {
+        i->s = load_slot(table, i->i, &size);
+        if (size > 0) break;
+    }
+    i->end = i->s + size;
+
+    ahtable_unsorted_iter_skip(i);
+
+    return i;
+}
+
+
+static void ahtable_unsorted_iter_next(ahtable_unsorted_iter_t* i)
+{
+    if (ahtable_unsorted_iter_finished(i)) return;
+    ahtable_unsorted_iter_step(i);
+    ahtable_unsorted_iter_skip(i);
+}
+
+
 static void ahtable_unsorted_iter_free(ahtable_unsorted_iter_t* i)
 {
+    ahtable_range_free(&i->r);
     free(i);
 }
 
@@ -600,7 +1178,7 @@ static value_t* ahtable_unsorted_iter_val(ahtable_unsorted_iter_t* i)
         s += 1;
     }
 
-    s += k;
+    s += value_offset(k);
     return (value_t*) s;
 }
 
@@ -618,8 +1196,53 @@ struct ahtable_iter_t_
 ahtable_iter_t* ahtable_iter_begin(const ahtable_t* table, bool sorted) {
     ahtable_iter_t* i = malloc_or_die(sizeof(ahtable_iter_t));
     i->sorted = sorted;
-    if (sorted) i->i.sorted   = ahtable_sorted_iter_begin(table);
-    else        i->i.unsorted = ahtable_unsorted_iter_begin(table);
+    if (sorted) i->i.sorted   = ahtable_sorted_iter_begin(table, NULL, false);
+    else        i->i.unsorted = ahtable_unsorted_iter_begin(table, NULL);
+    return i;
+}
+
+
+ahtable_iter_t* ahtable_iter_begin_reverse(const ahtable_t* table)
+{
+    ahtable_iter_t* i = malloc_or_die(sizeof(ahtable_iter_t));
+    i->sorted = true;
+    i->i.sorted = ahtable_sorted_iter_begin(table, NULL, true);
+    return i;
+}
+
+
+ahtable_iter_t* ahtable_iter_begin_range(const ahtable_t* table, bool sorted,
+                                         const char* lo, size_t lo_len,
+                                         const char* hi, size_t hi_len)
+{
+    ahtable_range_t r;
+    ahtable_range_init(&r, lo, lo_len, hi, hi_len);
+
+    ahtable_iter_t* i = malloc_or_die(sizeof(ahtable_iter_t));
+    i->sorted = sorted;
+    if (sorted) {
+        i->i.sorted = ahtable_sorted_iter_begin(table, &r, false);
+        ahtable_range_free(&r);
+    }
+    else {
+        /* the unsorted iterator takes ownership of the bounds */
+        i->i.unsorted = ahtable_unsorted_iter_begin(table, &r);
+    }
+    return i;
+}
+
+
+ahtable_iter_t* ahtable_iter_begin_range_reverse(const ahtable_t* table,
+                                                 const char* lo, size_t lo_len,
+                                                 const char* hi, size_t hi_len)
+{
+    ahtable_range_t r;
+    ahtable_range_init(&r, lo, lo_len, hi, hi_len);
+
+    ahtable_iter_t* i = malloc_or_die(sizeof(ahtable_iter_t));
+    i->sorted = true;
+    i->i.sorted = ahtable_sorted_iter_begin(table, &r, true);
+    ahtable_range_free(&r);
     return i;
 }
 
@@ -20,7 +20,9 @@
  * variable number of key/value pairs. Each key is preceded by its length--
  * one byte for lengths < 128 bytes, and TWO bytes for longer keys. The least
  * significant bit of the first byte indicates, if set, that the size is two
- * bytes. The slot number where a key/value pair goes is determined by finding
+ * bytes. Each value is padded to a multiple of its size from the start of the
+ * slot, so that it may be used atomically. The slot number where a key/value
+ * pair goes is determined by finding
  * the murmurhashed integer value of its key, modulus the number of slots.
  * The number of slots expands in a stepwise fashion when the number of
  # key/value pairs reaches an arbitrarily large number.
@@ -59,13 +61,22 @@ typedef struct ahtable_t_
     uint8_t flag;
     unsigned char c0;
     unsigned char c1;
+    value_t sum, min, max;
+    size_t refs;
 
     size_t n;        // number of slots
     size_t m;        // number of key/value pairs stored
     size_t max_m;    // number of stored keys before we resize
 
+    /* bit min(k, 63) is set if a key of length k may be stored */
+    uint64_t lengths;
+
     size_t*  slot_sizes;
     slot_t*  slots;
+
+    /* set for a shared table, see ahtable_share */
+    void (*retire)(void* ptr, void* ctx);
+    void* retire_ctx;
 } ahtable_t;
 
 extern const double ahtable_max_load_factor;
@@ -75,6 +86,8 @@ ahtable_t* ahtable_create   (void);         // Create an empty hash table.
 ahtable_t* ahtable_create_n (size_t n);     // Create an empty hash table, with
                                             //  n slots reserved.
 
+ahtable_t* ahtable_dup      (const ahtable_t*); // Copy a table, which is not shared.
+
 ahtable_t* ahtable_load     (FILE* fd);               // Load a hash table from a file handle.
 void       ahtable_save     (const ahtable_t* T, FILE* fd); // Save a hash table to a file handle.
 
@@ -84,6 +97,14 @@ size_t     ahtable_size   (const ahtable_t*); // Number of stored keys.
 size_t     ahtable_sizeof (const ahtable_t*); // Memory used by the table in bytes.
 
 
+/* Let other threads find keys in and iterate through the table, without
+ * locks, while one thread changes it. A slot is then never changed in place:
+ * it is copied with the change and the copy published, and the old one passed
+ * to retire, to be freed once no reader can be in it. Values are still written
+ * in place. A shared table never grows its number of slots. */
+void ahtable_share (ahtable_t*, void (*retire)(void* ptr, void* ctx), void* ctx);
+
+
 /** Find the given key in the table, inserting it if it does not exist, and
  * returning a pointer to it's value.
  *
@@ -94,6 +115,30 @@ size_t     ahtable_sizeof (const ahtable_t*); // Memory used by the table in byt
 value_t* ahtable_get (ahtable_t*, const char* key, size_t len);
 
 
+/* As ahtable_get, also setting inserted to whether the key was added. */
+value_t* ahtable_get_ex (ahtable_t*, const char* key, size_t len, bool* inserted);
+
+
+/* Add delta to the value of a key, inserting it with value 0 first if it does
+ * not exist, and return the result. */
+value_t ahtable_add (ahtable_t*, const char* key, size_t len, value_t delta);
+
+
+/* Find or insert n keys at once, storing pointers to their values in vals, if
+ * it is not NULL, in the order the keys are given. Keys are grouped by slot,
+ * and each slot is grown once for all of its new keys. The pointers are valid
+ * until the table is next changed. */
+void ahtable_get_batch (ahtable_t*, const char* const* keys, const size_t* lens,
+                        size_t n, value_t** vals);
+
+/* As ahtable_get_batch, unless more than max_m keys would then be stored, in
+ * which case the table is left as it was and false returned. Whether each key
+ * was not stored before is kept in inserted, if it is not NULL. */
+bool ahtable_get_batch_within (ahtable_t*, const char* const* keys, const size_t* lens,
+                               size_t n, value_t** vals, bool* inserted,
+                               size_t max_m);
+
+
 /* Find a given key in the table, return a NULL pointer if it does not exist. */
 value_t* ahtable_tryget (ahtable_t*, const char* key, size_t len);
 
@@ -101,9 +146,40 @@ value_t* ahtable_tryget (ahtable_t*, const char* key, size_t len);
 int ahtable_del(ahtable_t*, const char* key, size_t len);
 
 
+/* False if no key of the given length is stored. True does not guarantee one
+ * is, so the length filters probes for keys that cannot be present. */
+bool ahtable_has_len(const ahtable_t*, size_t len);
+
+
+/* Number of keys k with lo <= k < hi, counted in one pass over the table. A
+ * NULL bound leaves that end of the range open. */
+size_t ahtable_count_range(const ahtable_t*,
+                           const char* lo, size_t lo_len,
+                           const char* hi, size_t hi_len);
+
+
+/* The key of rank k, the k-th smallest counting from 0, or NULL if there are
+ * no more than k keys. Its value is stored in val, if given. Found in one pass
+ * over the table followed by a quickselect, without sorting. */
+const char* ahtable_select(const ahtable_t*, size_t k, size_t* len, value_t** val);
+
+
 typedef struct ahtable_iter_t_ ahtable_iter_t;
 
 ahtable_iter_t* ahtable_iter_begin     (const ahtable_t*, bool sorted);
+
+/* Iterate through only the keys k with lo <= k < hi. A NULL bound leaves that
+ * end of the range open. Sorted iteration sorts just the keys in the range. */
+ahtable_iter_t* ahtable_iter_begin_range (const ahtable_t*, bool sorted,
+                                          const char* lo, size_t lo_len,
+                                          const char* hi, size_t hi_len);
+
+/* Iterate through keys in descending sorted order, optionally restricted to
+ * lo <= k < hi as in ahtable_iter_begin_range. */
+ahtable_iter_t* ahtable_iter_begin_reverse       (const ahtable_t*);
+ahtable_iter_t* ahtable_iter_begin_range_reverse (const ahtable_t*,
+                                                  const char* lo, size_t lo_len,
+                                                  const char* hi, size_t hi_len);
 void            ahtable_iter_next      (ahtable_iter_t*);
 bool            ahtable_iter_finished  (ahtable_iter_t*);
 void            ahtable_iter_free      (ahtable_iter_t*);
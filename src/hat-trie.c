@@ -7,9 +7,12 @@
 
 #include "hat-trie.h"
 #include "ahtable.h"
+#include "pattern.h"
 #include "misc.h"
 #include "pstdint.h"
 #include <assert.h>
+#include <pthread.h>
+#include <sched.h>
 #include <string.h>
 
 #define HT_UNUSED(x) x=x
@@ -44,19 +47,75 @@ typedef struct trie_node_t_
     /* the value for the key that is consumed on a trie node */
     value_t val;
 
+    /* Number of keys in the subtree, including this node's, when counted,
+     * and the sum, least, and largest of its values, when kept. They are
+     * four words beside the 256 children, so every node has them, rather than
+     * only those of tries created with a summary. */
+    size_t n;
+    value_t sum, min, max;
+
+    /* number of parents, and tries whose root it is, holding the node */
+    size_t refs;
+
     /* Map a character to either a trie_node_t or a ahtable_t. The first byte
      * must be examined to determine which. */
     node_ptr xs[NODE_CHILDS];
 
 } trie_node_t;
 
+typedef struct hattrie_epochs_t_ hattrie_epochs_t;
+typedef struct hattrie_cow_t_ hattrie_cow_t;
+
 struct hattrie_t_
 {
     node_ptr root; // root node
     size_t m;      // number of stored keys
+    unsigned int flags; // options given to hattrie_create_ex
+
+    /* changed whenever trie nodes are added or freed, which invalidates any
+     * cursor holding a path through them */
+    size_t generation;
+
+    /* readers and memory waiting for them, for shared tries, else NULL */
+    hattrie_epochs_t* epochs;
+
+    /* the tries that may share nodes with this one, see hattrie_snapshot,
+     * else NULL */
+    hattrie_cow_t* cow;
 };
 
 
+/* Children, values, and the root, which the writer of a shared trie publishes
+ * to its readers, are stored with release and loaded with acquire ordering,
+ * which on common machines are ordinary moves. */
+static inline node_ptr hattrie_child(const trie_node_t* node, unsigned char c)
+{
+    node_ptr child;
+    child.t = __atomic_load_n(&node->xs[c].t, __ATOMIC_ACQUIRE);
+    return child;
+}
+
+
+static inline void hattrie_set_child(trie_node_t* node, unsigned char c, node_ptr child)
+{
+    __atomic_store_n(&node->xs[c].t, child.t, __ATOMIC_RELEASE);
+}
+
+
+static inline bool hattrie_has_val(const trie_node_t* node)
+{
+    return __atomic_load_n(&node->flag, __ATOMIC_ACQUIRE) & NODE_HAS_VAL;
+}
+
+
+static inline node_ptr hattrie_root(const hattrie_t* T)
+{
+    node_ptr root;
+    root.t = __atomic_load_n(&T->root.t, __ATOMIC_ACQUIRE);
+    return root;
+}
+
+
 
 size_t hattrie_size(const hattrie_t* T)
 {
@@ -94,6 +153,11 @@ static trie_node_t* alloc_trie_node(hattrie_t* T, node_ptr child)
     trie_node_t* node = malloc_or_die(sizeof(trie_node_t));
     node->flag = NODE_TYPE_TRIE;
     node->val  = 0;
+    node->n    = 0;
+    node->sum  = 0;
+    node->min  = UINTPTR_MAX;
+    node->max  = 0;
+    node->refs = 1;
 
     /* pass T to allow custom allocator for trie. */
     HT_UNUSED(T); /* unused now */
@@ -103,15 +167,29 @@ static trie_node_t* alloc_trie_node(hattrie_t* T, node_ptr child)
     return node;
 }
 
+/* an empty bucket for the bytes c0..c1 */
+static node_ptr hattrie_empty_bucket(unsigned int c0, unsigned int c1)
+{
+    node_ptr node;
+    node.b = ahtable_create();
+    node.b->c0 = c0;
+    node.b->c1 = c1;
+    node.b->flag = c0 == c1 ? NODE_TYPE_PURE_BUCKET : NODE_TYPE_HYBRID_BUCKET;
+    return node;
+}
+
 /* iterate trie nodes until string is consumed or bucket is found */
 static node_ptr hattrie_consume(node_ptr *p, const char **k, size_t *l, unsigned brk)
 {
-    node_ptr node = p->t->xs[(unsigned char) **k];
+    node_ptr node = hattrie_child(p->t, **k);
     while (*node.flag & NODE_TYPE_TRIE && *l > brk) {
         ++*k;
         --*l;
         *p   = node;
-        node = node.t->xs[(unsigned char) **k];
+
+        /* the key ends on this trie node, which is returned as the node */
+        if (*l == 0) break;
+        node = hattrie_child(node.t, **k);
     }
 
     /* copy and writeback variables if it's faster */
@@ -121,10 +199,11 @@ static node_ptr hattrie_consume(node_ptr *p, const char **k, size_t *l, unsigned
 }
 
 /* use node value and return pointer to it */
-static inline value_t* hattrie_useval(hattrie_t *T, node_ptr n)
+static inline value_t* hattrie_useval(hattrie_t *T, node_ptr n, bool* inserted)
 {
-    if (!(n.t->flag & NODE_HAS_VAL)) {
-        n.t->flag |= NODE_HAS_VAL;
+    *inserted = !(n.t->flag & NODE_HAS_VAL);
+    if (*inserted) {
+        __atomic_store_n(&n.t->flag, n.t->flag | NODE_HAS_VAL, __ATOMIC_RELEASE);
         ++T->m;
     }
     return &n.t->val;
@@ -134,8 +213,8 @@ static inline value_t* hattrie_useval(hattrie_t *T, node_ptr n)
 static inline int hattrie_clrval(hattrie_t *T, node_ptr n)
 {
     if (n.t->flag & NODE_HAS_VAL) {
-        n.t->flag &= ~NODE_HAS_VAL;
-        n.t->val = 0;
+        __atomic_store_n(&n.t->flag, n.t->flag & ~NODE_HAS_VAL, __ATOMIC_RELEASE);
+        __atomic_store_n(&n.t->val, 0, __ATOMIC_RELAXED);
         --T->m;
         return 0;
     }
@@ -145,16 +224,19 @@ static inline int hattrie_clrval(hattrie_t *T, node_ptr n)
 /* find node in trie */
 static node_ptr hattrie_find(hattrie_t* T, const char **key, size_t *len)
 {
-    node_ptr parent = T->root;
+    node_ptr parent = hattrie_root(T);
     assert(*parent.flag & NODE_TYPE_TRIE);
 
-    if (*len == 0) return parent;
+    if (*len == 0) {
+        if (!hattrie_has_val(parent.t)) parent.flag = NULL;
+        return parent;
+    }
 
     node_ptr node = hattrie_consume(&parent, key, len, 1);
 
     /* if the trie node consumes value, use it */
     if (*node.flag & NODE_TYPE_TRIE) {
-        if (!(node.t->flag & NODE_HAS_VAL)) {
+        if (!hattrie_has_val(node.t)) {
             node.flag = NULL;
         }
         return node;
@@ -170,24 +252,244 @@ static node_ptr hattrie_find(hattrie_t* T, const char **key, size_t *len)
     return node;
 }
 
+/* Shared tries:
+ * One thread may change a shared trie while others read it without locks.
+ * The writer never changes anything a reader may be looking at in place,
+ * except values: slots are copied and the copies published, by ahtable, and a
+ * bucket that is split is rebuilt, and its replacements published in its
+ * parent, only once they are complete. What is replaced is retired, tagged
+ * with the current epoch, rather than freed.
+ *
+ * A reader announces the epoch it enters in, with a store and a fence, and
+ * clears it when it leaves, so reading costs no locks and no atomic
+ * read-modify-writes. Now and then the writer begins a new epoch and frees
+ * what was retired before the oldest epoch a reader is still in. A reader that
+ * entered in a later epoch cannot have seen it, since it was unlinked before
+ * that epoch began. */
+
+typedef struct hattrie_retired_t_
+{
+    void* ptr;
+    void (*free)(void*);
+    size_t epoch;
+} hattrie_retired_t;
+
+
+struct hattrie_reader_t_
+{
+    /* the epoch the reader entered in, or 0 if it is outside, on a cache
+     * line of its own, since the writer reads it */
+    union {
+        size_t epoch;
+        char pad[128];
+    } u;
+
+    hattrie_epochs_t* E;
+    hattrie_reader_t* prev;
+    hattrie_reader_t* next;
+};
+
+
+struct hattrie_epochs_t_
+{
+    size_t epoch;   // the current epoch, counting from 1
+
+    /* guards the list of readers and what is retired, which the writers of
+     * an optimistic concurrent trie add to at once */
+    pthread_mutex_t lock;
+    hattrie_reader_t* readers;
+
+    /* memory readers may still be using, oldest first */
+    hattrie_retired_t* retired;
+    size_t num_retired, retired_size;
+
+    /* how many retired were still in use after the last reclaim */
+    size_t kept;
+};
+
+
+static hattrie_epochs_t* hattrie_epochs_create()
+{
+    hattrie_epochs_t* E = malloc_or_die(sizeof(hattrie_epochs_t));
+    E->epoch = 1;
+    pthread_mutex_init(&E->lock, NULL);
+    E->readers = NULL;
+    E->retired_size = 64;
+    E->retired = malloc_or_die(E->retired_size * sizeof(hattrie_retired_t));
+    E->num_retired = 0;
+    E->kept = 0;
+    return E;
+}
+
+
+/* Begin a new epoch, and free what was retired before the oldest epoch a
+ * reader is still in. The lock must be held. */
+static void hattrie_reclaim(hattrie_epochs_t* E)
+{
+    size_t oldest = E->epoch + 1, e;
+    __atomic_store_n(&E->epoch, oldest, __ATOMIC_SEQ_CST);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    hattrie_reader_t* r;
+    for (r = E->readers; r; r = r->next) {
+        e = __atomic_load_n(&r->u.epoch, __ATOMIC_ACQUIRE);
+        if (e != 0 && e < oldest) oldest = e;
+    }
+
+    size_t i, j = 0;
+    for (i = 0; i < E->num_retired; ++i) {
+        if (E->retired[i].epoch < oldest) E->retired[i].free(E->retired[i].ptr);
+        else E->retired[j++] = E->retired[i];
+    }
+    E->num_retired = E->kept = j;
+}
+
+
+/* Free what was retired and the epochs themselves, once there are no readers. */
+static void hattrie_epochs_free(hattrie_epochs_t* E)
+{
+    if (E == NULL) return;
+    assert(E->readers == NULL);
+
+    size_t i;
+    for (i = 0; i < E->num_retired; ++i) E->retired[i].free(E->retired[i].ptr);
+    pthread_mutex_destroy(&E->lock);
+    free(E->retired);
+    free(E);
+}
+
+
+/* Hand memory to be freed with fn once no reader can be using it. */
+static void hattrie_retire(hattrie_epochs_t* E, void* ptr, void (*fn)(void*))
+{
+    pthread_mutex_lock(&E->lock);
+
+    if (E->num_retired == E->retired_size) {
+        E->retired_size *= 2;
+        E->retired = realloc_or_die(E->retired,
+                                    E->retired_size * sizeof(hattrie_retired_t));
+    }
+
+    E->retired[E->num_retired].ptr   = ptr;
+    E->retired[E->num_retired].free  = fn;
+    E->retired[E->num_retired].epoch = E->epoch;
+    ++E->num_retired;
+
+    /* reclaiming scans the readers, so it is put off until there is much to
+     * free compared to what was still in use last time */
+    if (E->num_retired >= 2 * E->kept + 64) hattrie_reclaim(E);
+
+    pthread_mutex_unlock(&E->lock);
+}
+
+
+/* The retire function given to the buckets of a shared trie, for slots. */
+static void hattrie_retire_slot(void* ptr, void* ctx)
+{
+    hattrie_retire(ctx, ptr, free);
+}
+
+
+static void hattrie_free_bucket(void* b)
+{
+    ahtable_free(b);
+}
+
+
+/* Let readers of a shared trie into a bucket that is complete. */
+static void hattrie_share_bucket(hattrie_t* T, ahtable_t* b)
+{
+    if (T->epochs) ahtable_share(b, hattrie_retire_slot, T->epochs);
+}
+
+
+hattrie_reader_t* hattrie_reader_create(hattrie_t* T)
+{
+    assert(T->epochs != NULL);
+    hattrie_reader_t* r = malloc_or_die(sizeof(hattrie_reader_t));
+    r->u.epoch = 0;
+    r->E = T->epochs;
+    r->prev = NULL;
+
+    pthread_mutex_lock(&r->E->lock);
+    r->next = r->E->readers;
+    if (r->next) r->next->prev = r;
+    r->E->readers = r;
+    pthread_mutex_unlock(&r->E->lock);
+
+    return r;
+}
+
+
+void hattrie_reader_free(hattrie_reader_t* r)
+{
+    if (r == NULL) return;
+
+    pthread_mutex_lock(&r->E->lock);
+    if (r->prev) r->prev->next = r->next;
+    else         r->E->readers = r->next;
+    if (r->next) r->next->prev = r->prev;
+    pthread_mutex_unlock(&r->E->lock);
+
+    free(r);
+}
+
+
+void hattrie_reader_enter(hattrie_reader_t* r)
+{
+    size_t e = __atomic_load_n(&r->E->epoch, __ATOMIC_ACQUIRE);
+    __atomic_store_n(&r->u.epoch, e, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+
+void hattrie_reader_leave(hattrie_reader_t* r)
+{
+    __atomic_store_n(&r->u.epoch, 0, __ATOMIC_RELEASE);
+}
+
+
 hattrie_t* hattrie_create()
+{
+    return hattrie_create_ex(0);
+}
+
+
+hattrie_t* hattrie_create_ex(unsigned int flags)
 {
     hattrie_t* T = malloc_or_die(sizeof(hattrie_t));
     T->m = 0;
+    T->flags = flags;
+    T->generation = 0;
+    T->epochs = flags & HATTRIE_SHARED ? hattrie_epochs_create() : NULL;
+    T->cow = NULL;
 
     node_ptr node;
     node.b = ahtable_create();
     node.b->flag = NODE_TYPE_HYBRID_BUCKET;
     node.b->c0 = 0x00;
     node.b->c1 = NODE_MAXCHAR;
+    hattrie_share_bucket(T, node.b);
     T->root.t = alloc_trie_node(T, node);
 
     return T;
 }
 
 
+/* Where the number of holders of a trie node or bucket is kept. */
+static inline size_t* hattrie_refs(node_ptr node)
+{
+    return *node.flag & NODE_TYPE_TRIE ? &node.t->refs : &node.b->refs;
+}
+
+
 static void hattrie_free_node(node_ptr node)
 {
+    /* a node shared with a snapshot is freed by the last to let it go */
+    size_t* refs = hattrie_refs(node);
+    if (__atomic_load_n(refs, __ATOMIC_ACQUIRE) > 1 &&
+        __atomic_sub_fetch(refs, 1, __ATOMIC_ACQ_REL) > 0) return;
+
     if (*node.flag & NODE_TYPE_TRIE) {
         size_t i;
         for (i = 0; i < NODE_CHILDS; ++i) {
@@ -205,582 +507,4988 @@ static void hattrie_free_node(node_ptr node)
 }
 
 
+static void hattrie_cow_leave(hattrie_t* T);
+
+
 void hattrie_free(hattrie_t* T)
 {
     hattrie_free_node(T->root);
+    hattrie_cow_leave(T);
+    hattrie_epochs_free(T->epochs);
     free(T);
 }
 
 
+static void hattrie_free_subtree(void* node)
+{
+    node_ptr p;
+    p.t = node;
+    hattrie_free_node(p);
+}
+
+
 void hattrie_clear(hattrie_t* T)
 {
-    hattrie_free_node(T->root);
+    node_ptr old = T->root;
     node_ptr node;
     node.b = ahtable_create();
     node.b->flag = NODE_TYPE_HYBRID_BUCKET;
     node.b->c0 = 0x00;
     node.b->c1 = 0xff;
-    T->root.t = alloc_trie_node(T, node);
-}
+    hattrie_share_bucket(T, node.b);
+    __atomic_store_n(&T->root.t, alloc_trie_node(T, node), __ATOMIC_RELEASE);
+    T->m = 0;
+    ++T->generation;
 
+    if (T->epochs) hattrie_retire(T->epochs, old.t, hattrie_free_subtree);
+    else           hattrie_free_node(old);
+    hattrie_cow_leave(T);
+}
 
-/* Perform one split operation on the given node with the given parent.
- */
-static void hattrie_split(hattrie_t* T, node_ptr parent, node_ptr node)
-{
-    /* only buckets may be split */
-    assert(*node.flag & NODE_TYPE_PURE_BUCKET ||
-           *node.flag & NODE_TYPE_HYBRID_BUCKET);
 
-    assert(*parent.flag & NODE_TYPE_TRIE);
+/* Snapshots:
+ * A snapshot shares every node of the trie it is taken of. Each trie node and
+ * bucket counts the parents, and tries whose root it is, that hold it. Before
+ * changing the nodes on a key's path, a trie copies those still held by
+ * another, from the root down; a copied trie node holds the same children as
+ * the original, which is let go, and freed by the last trie to let go of it.
+ * So nodes are copied only once a trie changes them, and never changed while
+ * another trie can reach them.
+ *
+ * The tries sharing nodes count themselves, so that once the others are freed
+ * a trie stops looking for nodes to copy. Threads counting into a trie with
+ * hattrie_fetch_add look for the path of a key without copying it, and copy it
+ * one at a time, under the lock, only when a node on it is still shared. */
 
-    if (*node.flag & NODE_TYPE_PURE_BUCKET) {
-        /* turn the pure bucket into a hybrid bucket */
-        parent.t->xs[node.b->c0].t = alloc_trie_node(T, node);
+struct hattrie_cow_t_
+{
+    size_t tries;   // number of tries sharing nodes
 
-        /* if the bucket had an empty key, move it to the new trie node */
-        value_t* val = ahtable_tryget(node.b, NULL, 0);
-        if (val) {
-            parent.t->xs[node.b->c0].t->val     = *val;
-            parent.t->xs[node.b->c0].t->flag |= NODE_HAS_VAL;
-            *val = 0;
-            ahtable_del(node.b, NULL, 0);
-        }
+    /* serializes copying the paths of keys whose values are looked up */
+    pthread_mutex_t lock;
+};
 
-        node.b->c0   = 0x00;
-        node.b->c1   = NODE_MAXCHAR;
-        node.b->flag = NODE_TYPE_HYBRID_BUCKET;
 
-        return;
-    }
+static void hattrie_cow_leave(hattrie_t* T)
+{
+    hattrie_cow_t* cow = T->cow;
+    if (cow == NULL) return;
 
-    /* This is a hybrid bucket. Perform a proper split. */
+    T->cow = NULL;
+    if (__atomic_sub_fetch(&cow->tries, 1, __ATOMIC_ACQ_REL) > 0) return;
+    pthread_mutex_destroy(&cow->lock);
+    free(cow);
+}
 
-    /* count the number of occourances of every leading character */
-    unsigned int cs[NODE_CHILDS]; // occurance count for leading chars
-    memset(cs, 0, NODE_CHILDS * sizeof(unsigned int));
-    size_t len;
-    const char* key;
 
-    ahtable_iter_t* i = ahtable_iter_begin(node.b, false);
-    while (!ahtable_iter_finished(i)) {
-        key = ahtable_iter_key(i, &len);
-        assert(len > 0);
-        cs[(unsigned char) key[0]] += 1;
-        ahtable_iter_next(i);
-    }
-    ahtable_iter_free(i);
+/* Whether T may share nodes, leaving the others once they are all freed. */
+static bool hattrie_cow(hattrie_t* T)
+{
+    if (T->cow == NULL) return false;
+    if (__atomic_load_n(&T->cow->tries, __ATOMIC_ACQUIRE) > 1) return true;
+    hattrie_cow_leave(T);
+    return false;
+}
 
-    /* choose a split point */
-    unsigned int left_m, right_m, all_m;
-    unsigned char j = node.b->c0;
-    all_m   = ahtable_size(node.b);
-    left_m  = cs[j];
-    right_m = all_m - left_m;
-    int d;
 
-    while (j + 1 < node.b->c1) {
-        d = abs((int) (left_m + cs[j + 1]) - (int) (right_m - cs[j + 1]));
-        if (d <= ((int)(left_m - right_m)) && left_m + cs[j + 1] < all_m) {
-            j += 1;
-            left_m  += cs[j];
-            right_m -= cs[j];
-        }
-        else break;
-    }
+static inline bool hattrie_node_shared(node_ptr node)
+{
+    return __atomic_load_n(hattrie_refs(node), __ATOMIC_ACQUIRE) > 1;
+}
 
-    /* now split into two node cooresponding to ranges [0, j] and
-     * [j + 1, NODE_MAXCHAR], respectively. */
 
+static inline void hattrie_node_hold(node_ptr node)
+{
+    __atomic_add_fetch(hattrie_refs(node), 1, __ATOMIC_RELAXED);
+}
 
-    /* create new left and right nodes */
 
-    /* TODO: Add a special case if either node is a hybrid bucket containing all
-     * the keys. In such a case, do not build a new table, just use the old one.
-     * */
-    size_t num_slots;
+/* A trie node with the same contents, pointing to the same children. */
+static trie_node_t* hattrie_dup_trie_node(const trie_node_t* node)
+{
+    trie_node_t* copy = malloc_or_die(sizeof(trie_node_t));
+    memcpy(copy, node, sizeof(trie_node_t));
+    copy->refs = 1;
+    return copy;
+}
 
 
-    for (num_slots = ahtable_initial_size;
-            (double) left_m > ahtable_max_load_factor * (double) num_slots;
-            num_slots *= 2);
+/* A copy of a node, holding the same children. */
+static node_ptr hattrie_node_copy(node_ptr node)
+{
+    node_ptr copy;
+    if (!(*node.flag & NODE_TYPE_TRIE)) {
+        copy.b = ahtable_dup(node.b);
+        return copy;
+    }
 
-    node_ptr left, right;
-    left.b  = ahtable_create_n(num_slots);
-    left.b->c0   = node.b->c0;
-    left.b->c1   = j;
-    left.b->flag = left.b->c0 == left.b->c1 ?
-                      NODE_TYPE_PURE_BUCKET : NODE_TYPE_HYBRID_BUCKET;
+    copy.t = hattrie_dup_trie_node(node.t);
 
+    size_t i;
+    for (i = 0; i < NODE_CHILDS; ++i) {
+        if (i > 0 && node.t->xs[i].t == node.t->xs[i - 1].t) continue;
+        if (node.t->xs[i].t) hattrie_node_hold(node.t->xs[i]);
+    }
+    return copy;
+}
 
-    for (num_slots = ahtable_initial_size;
-            (double) right_m > ahtable_max_load_factor * (double) num_slots;
-            num_slots *= 2);
 
-    right.b = ahtable_create_n(num_slots);
-    right.b->c0   = j + 1;
-    right.b->c1   = node.b->c1;
-    right.b->flag = right.b->c0 == right.b->c1 ?
-                      NODE_TYPE_PURE_BUCKET : NODE_TYPE_HYBRID_BUCKET;
+/* Replace the shared child of a node for the byte c with a copy of its own. */
+static node_ptr hattrie_unshare_child(hattrie_t* T, trie_node_t* node, unsigned char c)
+{
+    node_ptr child = node->xs[c];
+    node_ptr copy = hattrie_node_copy(child);
 
+    unsigned int c0 = c, c1 = c;
+    if (!(*child.flag & NODE_TYPE_TRIE)) {
+        c0 = child.b->c0;
+        c1 = child.b->c1;
+    }
+    for (; c0 <= c1; ++c0) hattrie_set_child(node, c0, copy);
 
-    /* update the parent's pointer */
+    /* the generation changes before the original may be let go, for
+     * hattrie_path_owned */
+    __atomic_add_fetch(&T->generation, 1, __ATOMIC_RELEASE);
+    hattrie_free_node(child);
+    return copy;
+}
 
-    unsigned int c;
-    for (c = node.b->c0; c <= j; ++c) parent.t->xs[c] = left;
-    for (; c <= node.b->c1; ++c)      parent.t->xs[c] = right;
 
+static void hattrie_unshare_root(hattrie_t* T)
+{
+    node_ptr root = T->root;
+    if (!hattrie_node_shared(root)) return;
 
+    __atomic_store_n(&T->root.t, hattrie_node_copy(root).t, __ATOMIC_RELEASE);
+    __atomic_add_fetch(&T->generation, 1, __ATOMIC_RELEASE);
+    hattrie_free_node(root);
+}
 
-    /* distribute keys to the new left or right node */
-    value_t* u;
-    value_t* v;
-    i = ahtable_iter_begin(node.b, false);
-    while (!ahtable_iter_finished(i)) {
-        key = ahtable_iter_key(i, &len);
-        u   = ahtable_iter_val(i);
-        assert(len > 0);
 
-        /* left */
-        if ((unsigned char) key[0] <= j) {
-            if (*left.flag & NODE_TYPE_PURE_BUCKET) {
-                v = ahtable_get(left.b, key + 1, len - 1);
-            }
-            else {
-                v = ahtable_get(left.b, key, len);
-            }
-            *v = *u;
+static void hattrie_unshare_path_nodes(hattrie_t* T, const char* key, size_t len)
+{
+    hattrie_unshare_root(T);
+
+    trie_node_t* node = T->root.t;
+    node_ptr child;
+    for (; len > 0; ++key, --len) {
+        child = node->xs[(unsigned char) *key];
+        if (child.t == NULL) return;
+        if (hattrie_node_shared(child)) {
+            child = hattrie_unshare_child(T, node, *key);
         }
+        if (!(*child.flag & NODE_TYPE_TRIE)) return;
+        node = child.t;
+    }
+}
 
-        /* right */
-        else {
-            if (*right.flag & NODE_TYPE_PURE_BUCKET) {
-                v = ahtable_get(right.b, key + 1, len - 1);
-            }
-            else {
-                v = ahtable_get(right.b, key, len);
-            }
-            *v = *u;
-        }
 
-        ahtable_iter_next(i);
+static void hattrie_unshare_node(hattrie_t* T, trie_node_t* node)
+{
+    size_t i;
+    node_ptr child;
+    for (i = 0; i < NODE_CHILDS; ++i) {
+        child = node->xs[i];
+        if (child.t == NULL || (i > 0 && child.t == node->xs[i - 1].t)) continue;
+        if (hattrie_node_shared(child)) child = hattrie_unshare_child(T, node, i);
+        if (*child.flag & NODE_TYPE_TRIE) hattrie_unshare_node(T, child.t);
     }
-
-    ahtable_iter_free(i);
-    ahtable_free(node.b);
 }
 
-value_t* hattrie_get(hattrie_t* T, const char* key, size_t len)
+
+/* Copy the shared nodes on the path of a key, down to the trie node it ends
+ * on or the bucket it belongs in, before any of them is changed. */
+static void hattrie_unshare_path(hattrie_t* T, const char* key, size_t len)
 {
-    node_ptr parent = T->root;
-    assert(*parent.flag & NODE_TYPE_TRIE);
+    if (hattrie_cow(T)) hattrie_unshare_path_nodes(T, key, len);
+}
 
-    if (len == 0) {
-        *parent.flag |= NODE_HAS_VAL;
-        return &parent.t->val;
+
+/* Whether T alone holds every node on the path of a key. It is read without
+ * copying, alongside other threads copying paths of T: a node is let go only
+ * after the generation changes, so a path read from nodes copied meanwhile is
+ * not taken for T's own. */
+static bool hattrie_path_owned(const hattrie_t* T, const char* key, size_t len)
+{
+    size_t generation = __atomic_load_n(&T->generation, __ATOMIC_ACQUIRE);
+
+    node_ptr node = hattrie_root(T);
+    while (!hattrie_node_shared(node)) {
+        if (!(*node.flag & NODE_TYPE_TRIE) || len == 0) {
+            return __atomic_load_n(&T->generation, __ATOMIC_ACQUIRE) == generation;
+        }
+        node = hattrie_child(node.t, (unsigned char) *key);
+        ++key;
+        --len;
+        if (node.t == NULL) {
+            return __atomic_load_n(&T->generation, __ATOMIC_ACQUIRE) == generation;
+        }
     }
+    return false;
+}
+
+
+/* Copy the shared nodes on the path of a key whose value is written in place,
+ * which other threads may be doing at once for other keys of T. Once the
+ * others sharing nodes are freed, T's next change leaves them, and until then
+ * nothing is looked for. */
+static void hattrie_own_path(hattrie_t* T, const char* key, size_t len)
+{
+    if (T->cow == NULL ||
+        __atomic_load_n(&T->cow->tries, __ATOMIC_ACQUIRE) == 1 ||
+        hattrie_path_owned(T, key, len)) return;
+
+    pthread_mutex_lock(&T->cow->lock);
+    hattrie_unshare_path_nodes(T, key, len);
+    pthread_mutex_unlock(&T->cow->lock);
+}
+
+
+/* Copy every shared node, before changes that may reach any of them. */
+static void hattrie_unshare(hattrie_t* T)
+{
+    if (!hattrie_cow(T)) return;
+    hattrie_unshare_root(T);
+    hattrie_unshare_node(T, T->root.t);
+    hattrie_cow_leave(T);
+}
+
+
+hattrie_t* hattrie_snapshot(hattrie_t* T)
+{
+    assert(T->epochs == NULL);
+
+    hattrie_t* S = malloc_or_die(sizeof(hattrie_t));
+    S->root = T->root;
+    S->m = T->m;
+    S->flags = T->flags;
+    S->generation = 0;
+    S->epochs = NULL;
+
+    if (T->cow == NULL) {
+        T->cow = malloc_or_die(sizeof(hattrie_cow_t));
+        T->cow->tries = 1;
+        pthread_mutex_init(&T->cow->lock, NULL);
+    }
+    __atomic_add_fetch(&T->cow->tries, 1, __ATOMIC_RELAXED);
+    S->cow = T->cow;
+
+    hattrie_node_hold(T->root);
+    return S;
+}
+
+
+/* Duplicating:
+ * A trie is copied node for node, each bucket by ahtable_dup, which copies its
+ * slots whole rather than hashing every key again. In parallel, the upper trie
+ * nodes are copied first, down to children of no more than a grain of keys,
+ * which are copied as tasks, the largest first, by a pool of threads. */
+
+typedef struct hattrie_dup_task_t_
+{
+    node_ptr node;  // the child to copy
+    size_t n;       // number of keys under it
+
+    /* the copy becomes parent->xs[c0..c1] */
+    trie_node_t* parent;
+    unsigned int c0, c1;
+
+    node_ptr result;
+} hattrie_dup_task_t;
+
+
+typedef struct hattrie_dup_plan_t_
+{
+    const hattrie_t* T;
+    hattrie_t* U;   // the copy
+    size_t grain;   // children with more keys are copied before the tasks
+
+    hattrie_dup_task_t* tasks;
+    size_t num_tasks, tasks_size;
+
+    size_t next;    // next task to hand out
+    pthread_mutex_t lock;
+} hattrie_dup_plan_t;
+
+
+static size_t hattrie_node_count(const hattrie_t* T, node_ptr node);
+
+
+static node_ptr hattrie_dup_node(hattrie_t* U, node_ptr node)
+{
+    node_ptr copy;
+    if (!(*node.flag & NODE_TYPE_TRIE)) {
+        copy.b = ahtable_dup(node.b);
+        hattrie_share_bucket(U, copy.b);
+        return copy;
+    }
+
+    copy.t = hattrie_dup_trie_node(node.t);
+    size_t i;
+    for (i = 0; i < NODE_CHILDS; ++i) {
+        if (i > 0 && node.t->xs[i].t == node.t->xs[i - 1].t) {
+            copy.t->xs[i] = copy.t->xs[i - 1];
+        }
+        else if (node.t->xs[i].t) {
+            copy.t->xs[i] = hattrie_dup_node(U, node.t->xs[i]);
+        }
+    }
+    return copy;
+}
+
+
+/* Copy a trie node, planning a task for each child that is not copied
+ * itself. */
+static trie_node_t* hattrie_dup_plan_node(hattrie_dup_plan_t* P, const trie_node_t* node)
+{
+    trie_node_t* copy = hattrie_dup_trie_node(node);
+    node_ptr child;
+    size_t n;
+    unsigned int c0, c1;
+    for (c0 = 0; c0 < NODE_CHILDS; c0 = c1 + 1) {
+        child = node->xs[c0];
+        for (c1 = c0; c1 + 1 < NODE_CHILDS && node->xs[c1 + 1].t == child.t; ++c1);
+        if (child.t == NULL) continue;
+
+        n = hattrie_node_count(P->T, child);
+        if (*child.flag & NODE_TYPE_TRIE && n > P->grain) {
+            copy->xs[c0].t = hattrie_dup_plan_node(P, child.t);
+            continue;
+        }
+
+        if (P->num_tasks == P->tasks_size) {
+            P->tasks_size *= 2;
+            P->tasks = realloc_or_die(P->tasks, P->tasks_size * sizeof(hattrie_dup_task_t));
+        }
+        hattrie_dup_task_t* task = &P->tasks[P->num_tasks++];
+        task->node = child;
+        task->n = n;
+        task->parent = copy;
+        task->c0 = c0;
+        task->c1 = c1;
+        task->result.t = NULL;
+    }
+    return copy;
+}
+
+
+static void* hattrie_dup_worker(void* arg)
+{
+    hattrie_dup_plan_t* P = arg;
+    hattrie_dup_task_t* task;
+    size_t i;
+
+    while (true) {
+        pthread_mutex_lock(&P->lock);
+        i = P->next++;
+        pthread_mutex_unlock(&P->lock);
+
+        if (i >= P->num_tasks) break;
+        task = &P->tasks[i];
+        task->result = hattrie_dup_node(P->U, task->node);
+    }
+
+    return NULL;
+}
+
+
+static int hattrie_dup_task_cmp(const void* a_, const void* b_)
+{
+    const hattrie_dup_task_t* a = a_;
+    const hattrie_dup_task_t* b = b_;
+    return a->n > b->n ? -1 : a->n < b->n;
+}
+
+
+hattrie_t* hattrie_dup(const hattrie_t* T)
+{
+    return hattrie_dup_parallel(T, 1);
+}
+
+
+hattrie_t* hattrie_dup_parallel(const hattrie_t* T, size_t nthreads)
+{
+    if (nthreads == 0) nthreads = 1;
+
+    hattrie_t* U = malloc_or_die(sizeof(hattrie_t));
+    U->m = T->m;
+    U->flags = T->flags;
+    U->generation = 0;
+    U->epochs = T->flags & HATTRIE_SHARED ? hattrie_epochs_create() : NULL;
+    U->cow = NULL;
+
+    /* too few keys to be worth the threads */
+    if (nthreads == 1 || T->m < 2 * MAX_BUCKET_SIZE) {
+        U->root = hattrie_dup_node(U, T->root);
+        return U;
+    }
+
+    hattrie_dup_plan_t P;
+    P.T = T;
+    P.U = U;
+
+    /* a few times more tasks than threads, so that they even out */
+    P.grain = T->m / (8 * nthreads);
+    if (P.grain < MAX_BUCKET_SIZE) P.grain = MAX_BUCKET_SIZE;
+
+    P.tasks_size = 256;
+    P.tasks = malloc_or_die(P.tasks_size * sizeof(hattrie_dup_task_t));
+    P.num_tasks = 0;
+    P.next = 0;
+    pthread_mutex_init(&P.lock, NULL);
+
+    U->root.t = hattrie_dup_plan_node(&P, T->root.t);
+    qsort(P.tasks, P.num_tasks, sizeof(hattrie_dup_task_t), hattrie_dup_task_cmp);
+
+    /* the calling thread is one of the pool, as in hattrie_build_parallel */
+    pthread_t* threads = malloc_or_die(nthreads * sizeof(pthread_t));
+    size_t i, started = 0;
+    while (started + 1 < nthreads &&
+           pthread_create(&threads[started], NULL, hattrie_dup_worker, &P) == 0) {
+        ++started;
+    }
+    hattrie_dup_worker(&P);
+    for (i = 0; i < started; ++i) pthread_join(threads[i], NULL);
+    free(threads);
+
+    unsigned int c;
+    hattrie_dup_task_t* task;
+    for (i = 0; i < P.num_tasks; ++i) {
+        task = &P.tasks[i];
+        for (c = task->c0; c <= task->c1; ++c) task->parent->xs[c] = task->result;
+    }
+
+    pthread_mutex_destroy(&P.lock);
+    free(P.tasks);
+    return U;
+}
+
+
+/* Fold a value into a bucket's summary. */
+static inline void hattrie_bucket_fold(ahtable_t* b, value_t val)
+{
+    b->sum += val;
+    if (val < b->min) b->min = val;
+    if (val > b->max) b->max = val;
+}
+
+
+/* Recompute the summary of a bucket's values. */
+static void hattrie_bucket_summarize(ahtable_t* b)
+{
+    b->sum = 0;
+    b->min = UINTPTR_MAX;
+    b->max = 0;
+
+    ahtable_iter_t* i = ahtable_iter_begin(b, false);
+    while (!ahtable_iter_finished(i)) {
+        hattrie_bucket_fold(b, *ahtable_iter_val(i));
+        ahtable_iter_next(i);
+    }
+    ahtable_iter_free(i);
+}
+
+
+/* Number of slots for a new bucket to hold m keys without growing. */
+static size_t hattrie_bucket_slots(size_t m)
+{
+    size_t num_slots;
+    for (num_slots = ahtable_initial_size;
+            (double) m > ahtable_max_load_factor * (double) num_slots;
+            num_slots *= 2);
+    return num_slots;
+}
+
+
+/* Perform one split operation on the given node with the given parent.
+ */
+static void hattrie_split(hattrie_t* T, node_ptr parent, node_ptr node)
+{
+    /* only buckets may be split */
+    assert(*node.flag & NODE_TYPE_PURE_BUCKET ||
+           *node.flag & NODE_TYPE_HYBRID_BUCKET);
 
-    /* consume all trie nodes, now parent must be trie and child anything */
-    node_ptr node = hattrie_consume(&parent, &key, &len, 0);
     assert(*parent.flag & NODE_TYPE_TRIE);
 
-    /* if the key has been consumed on a trie node, use its value */
-    if (len == 0) {
-        if (*node.flag & NODE_TYPE_TRIE) {
-            return hattrie_useval(T, node);
+    ++T->generation;
+
+    if (*node.flag & NODE_TYPE_PURE_BUCKET && T->epochs) {
+        /* readers may be in the bucket, so rather than change it in place,
+         * copy it into a new hybrid bucket under a new trie node */
+        node_ptr copy;
+        copy.b = ahtable_create_n(hattrie_bucket_slots(ahtable_size(node.b)));
+        copy.b->c0   = 0x00;
+        copy.b->c1   = NODE_MAXCHAR;
+        copy.b->flag = NODE_TYPE_HYBRID_BUCKET;
+
+        node_ptr t;
+        t.t = alloc_trie_node(T, copy);
+        t.t->n   = ahtable_size(node.b);
+        t.t->sum = node.b->sum;
+        t.t->min = node.b->min;
+        t.t->max = node.b->max;
+
+        size_t len;
+        const char* key;
+        ahtable_iter_t* i = ahtable_iter_begin(node.b, false);
+        while (!ahtable_iter_finished(i)) {
+            key = ahtable_iter_key(i, &len);
+            if (len == 0) {
+                t.t->val   = *ahtable_iter_val(i);
+                t.t->flag |= NODE_HAS_VAL;
+            }
+            else {
+                *ahtable_get(copy.b, key, len) = *ahtable_iter_val(i);
+                hattrie_bucket_fold(copy.b, *ahtable_iter_val(i));
+            }
+            ahtable_iter_next(i);
         }
-        else if (*node.flag & NODE_TYPE_HYBRID_BUCKET) {
-            return hattrie_useval(T, parent);
+        ahtable_iter_free(i);
+
+        hattrie_share_bucket(T, copy.b);
+        hattrie_set_child(parent.t, node.b->c0, t);
+        hattrie_retire(T->epochs, node.b, hattrie_free_bucket);
+        return;
+    }
+
+    if (*node.flag & NODE_TYPE_PURE_BUCKET) {
+        /* turn the pure bucket into a hybrid bucket */
+        parent.t->xs[node.b->c0].t = alloc_trie_node(T, node);
+        parent.t->xs[node.b->c0].t->n   = ahtable_size(node.b);
+        parent.t->xs[node.b->c0].t->sum = node.b->sum;
+        parent.t->xs[node.b->c0].t->min = node.b->min;
+        parent.t->xs[node.b->c0].t->max = node.b->max;
+
+        /* if the bucket had an empty key, move it to the new trie node */
+        value_t* val = ahtable_tryget(node.b, NULL, 0);
+        if (val) {
+            parent.t->xs[node.b->c0].t->val     = *val;
+            parent.t->xs[node.b->c0].t->flag |= NODE_HAS_VAL;
+            *val = 0;
+            ahtable_del(node.b, NULL, 0);
+
+            if (T->flags & (HATTRIE_MAXIMA | HATTRIE_SUMS)) {
+                hattrie_bucket_summarize(node.b);
+            }
         }
+
+        node.b->c0   = 0x00;
+        node.b->c1   = NODE_MAXCHAR;
+        node.b->flag = NODE_TYPE_HYBRID_BUCKET;
+
+        return;
     }
 
+    /* This is a hybrid bucket. Perform a proper split. */
 
-    /* preemptively split the bucket if it is full */
-    while (ahtable_size(node.b) >= MAX_BUCKET_SIZE) {
-        hattrie_split(T, parent, node);
+    /* count the number of occourances of every leading character */
+    unsigned int cs[NODE_CHILDS]; // occurance count for leading chars
+    memset(cs, 0, NODE_CHILDS * sizeof(unsigned int));
+    size_t len;
+    const char* key;
 
-        /* after the split, the node pointer is invalidated, so we search from
-         * the parent again. */
-        node = hattrie_consume(&parent, &key, &len, 0);
+    ahtable_iter_t* i = ahtable_iter_begin(node.b, false);
+    while (!ahtable_iter_finished(i)) {
+        key = ahtable_iter_key(i, &len);
+        assert(len > 0);
+        cs[(unsigned char) key[0]] += 1;
+        ahtable_iter_next(i);
+    }
+    ahtable_iter_free(i);
 
-        /* if the key has been consumed on a trie node, use its value */
-        if (len == 0) {
-            if (*node.flag & NODE_TYPE_TRIE) {
-                return hattrie_useval(T, node);
+    /* choose a split point */
+    unsigned int left_m, right_m, all_m;
+    unsigned char j = node.b->c0;
+    all_m   = ahtable_size(node.b);
+    left_m  = cs[j];
+    right_m = all_m - left_m;
+    int d;
+
+    while (j + 1 < node.b->c1) {
+        d = abs((int) (left_m + cs[j + 1]) - (int) (right_m - cs[j + 1]));
+        if (d <= abs((int) left_m - (int) right_m) && left_m + cs[j + 1] < all_m) {
+            j += 1;
+            left_m  += cs[j];
+            right_m -= cs[j];
+        }
+        else break;
+    }
+
+    /* now split into two node cooresponding to ranges [0, j] and
+     * [j + 1, NODE_MAXCHAR], respectively. */
+
+
+    /* create new left and right nodes */
+
+    /* TODO: Add a special case if either node is a hybrid bucket containing all
+     * the keys. In such a case, do not build a new table, just use the old one.
+     * */
+    node_ptr left, right;
+    left.b  = ahtable_create_n(hattrie_bucket_slots(left_m));
+    left.b->c0   = node.b->c0;
+    left.b->c1   = j;
+    left.b->flag = left.b->c0 == left.b->c1 ?
+                      NODE_TYPE_PURE_BUCKET : NODE_TYPE_HYBRID_BUCKET;
+
+
+    right.b = ahtable_create_n(hattrie_bucket_slots(right_m));
+    right.b->c0   = j + 1;
+    right.b->c1   = node.b->c1;
+    right.b->flag = right.b->c0 == right.b->c1 ?
+                      NODE_TYPE_PURE_BUCKET : NODE_TYPE_HYBRID_BUCKET;
+
+
+    /* distribute keys to the new left or right node */
+    value_t* u;
+    value_t* v;
+    i = ahtable_iter_begin(node.b, false);
+    while (!ahtable_iter_finished(i)) {
+        key = ahtable_iter_key(i, &len);
+        u   = ahtable_iter_val(i);
+        assert(len > 0);
+
+        /* left */
+        if ((unsigned char) key[0] <= j) {
+            if (*left.flag & NODE_TYPE_PURE_BUCKET) {
+                v = ahtable_get(left.b, key + 1, len - 1);
             }
-            else if (*node.flag & NODE_TYPE_HYBRID_BUCKET) {
-                return hattrie_useval(T, parent);
+            else {
+                v = ahtable_get(left.b, key, len);
             }
+            *v = *u;
+            hattrie_bucket_fold(left.b, *u);
+        }
+
+        /* right */
+        else {
+            if (*right.flag & NODE_TYPE_PURE_BUCKET) {
+                v = ahtable_get(right.b, key + 1, len - 1);
+            }
+            else {
+                v = ahtable_get(right.b, key, len);
+            }
+            *v = *u;
+            hattrie_bucket_fold(right.b, *u);
         }
+
+        ahtable_iter_next(i);
     }
 
-    assert(*node.flag & NODE_TYPE_PURE_BUCKET || *node.flag & NODE_TYPE_HYBRID_BUCKET);
+    ahtable_iter_free(i);
 
-    assert(len > 0);
-    size_t m_old = node.b->m;
-    value_t* val;
-    if (*node.flag & NODE_TYPE_PURE_BUCKET) {
-        val = ahtable_get(node.b, key + 1, len - 1);
+
+    /* update the parent's pointer, once readers of a shared trie may use the
+     * new nodes */
+
+    hattrie_share_bucket(T, left.b);
+    hattrie_share_bucket(T, right.b);
+
+    unsigned int c;
+    for (c = node.b->c0; c <= j; ++c) hattrie_set_child(parent.t, c, left);
+    for (; c <= node.b->c1; ++c)      hattrie_set_child(parent.t, c, right);
+
+    if (T->epochs) hattrie_retire(T->epochs, node.b, hattrie_free_bucket);
+    else           ahtable_free(node.b);
+}
+
+/* Fold the summary of a child into its parent trie node. */
+static void hattrie_node_fold(trie_node_t* node, node_ptr child)
+{
+    if (*child.flag & NODE_TYPE_TRIE) {
+        node->n   += child.t->n;
+        node->sum += child.t->sum;
+        if (child.t->min < node->min) node->min = child.t->min;
+        if (child.t->max > node->max) node->max = child.t->max;
     }
     else {
-        val = ahtable_get(node.b, key, len);
+        node->n   += ahtable_size(child.b);
+        node->sum += child.b->sum;
+        if (child.b->min < node->min) node->min = child.b->min;
+        if (child.b->max > node->max) node->max = child.b->max;
+    }
+}
+
+
+/* Compute the summary and count of a trie node from its own value and those
+ * of its children. */
+static void hattrie_node_summarize(trie_node_t* node)
+{
+    node->n   = 0;
+    node->sum = 0;
+    node->min = UINTPTR_MAX;
+    node->max = 0;
+
+    if (node->flag & NODE_HAS_VAL) {
+        node->n   = 1;
+        node->sum = node->val;
+        node->min = node->max = node->val;
     }
-    T->m += (node.b->m - m_old);
 
-    return val;
-}
+    size_t c;
+    for (c = 0; c < NODE_CHILDS; ++c) {
+        if (c > 0 && node->xs[c].t == node->xs[c - 1].t) continue;
+        hattrie_node_fold(node, node->xs[c]);
+    }
+}
+
+
+/* Build a bucket of T holding xs[0..n), which all begin with prefix of length
+ * d followed by a byte in [c0, c1], in any order. */
+static ahtable_t* hattrie_build_bucket(hattrie_t* T, const hattrie_entry_t* xs,
+                                       size_t n, size_t d,
+                                       unsigned char c0, unsigned char c1)
+{
+    ahtable_t* b = ahtable_create_n(hattrie_bucket_slots(n));
+    b->c0 = c0;
+    b->c1 = c1;
+    b->flag = c0 == c1 ? NODE_TYPE_PURE_BUCKET : NODE_TYPE_HYBRID_BUCKET;
+
+    /* pure buckets hold the keys without their leading byte */
+    if (c0 == c1) ++d;
+
+    size_t i;
+    for (i = 0; i < n; ++i) {
+        *ahtable_get(b, xs[i].key + d, xs[i].len - d) = xs[i].val;
+        hattrie_bucket_fold(b, xs[i].val);
+    }
+
+    /* of equal keys, the last is kept, and the others were folded in */
+    if (ahtable_size(b) < n) hattrie_bucket_summarize(b);
+
+    hattrie_share_bucket(T, b);
+    return b;
+}
+
+
+/* Given where the keys continuing with each byte begin, the last byte of the
+ * child beginning at byte c0: c0 itself for a trie node, which bytes that begin
+ * at least MAX_BUCKET_SIZE keys get, or else the last byte that fits in a
+ * bucket with it. */
+static unsigned int hattrie_build_span(const size_t* bounds, unsigned int c0)
+{
+    unsigned int c1 = c0;
+    if (bounds[c0 + 1] - bounds[c0] >= MAX_BUCKET_SIZE) return c1;
+
+    while (c1 + 1 < NODE_CHILDS &&
+           bounds[c1 + 2] - bounds[c0] < MAX_BUCKET_SIZE) ++c1;
+    return c1;
+}
+
+
+/* Build the trie node for xs[0..n), which all begin with the same prefix of
+ * length d. Bytes after the prefix that begin at least MAX_BUCKET_SIZE keys get
+ * a trie node of their own; runs of the other bytes are packed into buckets of
+ * fewer than MAX_BUCKET_SIZE keys. The node's summary and count are always
+ * filled in, and the count is the number of distinct keys. */
+static trie_node_t* hattrie_build_node(hattrie_t* T, const hattrie_entry_t* xs,
+                                       size_t n, size_t d)
+{
+    node_ptr none = { NULL };
+    trie_node_t* node = alloc_trie_node(T, none);
+    size_t i = 0;
+
+    /* keys ending here come first, and the last of them is kept */
+    while (i < n && xs[i].len == d) {
+        node->flag |= NODE_HAS_VAL;
+        node->val = xs[i++].val;
+    }
+
+    /* xs[bounds[c] .. bounds[c + 1]) continue with byte c */
+    size_t bounds[NODE_CHILDS + 1];
+    unsigned int c = 0;
+    for (; i < n; ++i) {
+        assert(xs[i].len > d && (unsigned char) xs[i].key[d] + 1u >= c);
+        while (c <= (unsigned char) xs[i].key[d]) bounds[c++] = i;
+    }
+    while (c <= NODE_CHILDS) bounds[c++] = n;
+
+    node_ptr child;
+    unsigned int c0, c1;
+    for (c0 = 0; c0 < NODE_CHILDS; c0 = c1 + 1) {
+        c1 = hattrie_build_span(bounds, c0);
+        if (bounds[c0 + 1] - bounds[c0] >= MAX_BUCKET_SIZE) {
+            child.t = hattrie_build_node(T, xs + bounds[c0],
+                                         bounds[c0 + 1] - bounds[c0], d + 1);
+        }
+        else {
+            child.b = hattrie_build_bucket(T, xs + bounds[c0],
+                                           bounds[c1 + 1] - bounds[c0], d, c0, c1);
+        }
+
+        for (c = c0; c <= c1; ++c) node->xs[c] = child;
+    }
+
+    hattrie_node_summarize(node);
+    return node;
+}
+
+
+hattrie_t* hattrie_build_sorted(unsigned int flags, const hattrie_entry_t* xs, size_t n)
+{
+    hattrie_t* T = malloc_or_die(sizeof(hattrie_t));
+    T->flags = flags;
+    T->generation = 0;
+    T->epochs = flags & HATTRIE_SHARED ? hattrie_epochs_create() : NULL;
+    T->cow = NULL;
+    T->root.t = hattrie_build_node(T, xs, n, 0);
+    T->m = T->root.t->n;
+    return T;
+}
+
+
+/* Building in parallel:
+ * Keys are split into subtries by stably partitioning them on their next
+ * byte, one level at a time, which needs no sorting: buckets take their keys
+ * in the order given. The upper levels of the trie are laid out on the calling
+ * thread. A child with more keys than the grain is laid out the same way, so
+ * that a hot prefix is split further rather than left to one thread. Every
+ * other child becomes a task, building its subtrie or bucket. Tasks are handed
+ * out largest first to a pool of threads. Last, each task's result is linked
+ * into its parent, and the summaries of the upper trie nodes are computed from
+ * the bottom up. */
+
+typedef struct hattrie_build_task_t_
+{
+    hattrie_entry_t* xs;
+    hattrie_entry_t* tmp;   // scratch space for partitioning xs
+    size_t n;
+
+    /* the task builds parent->xs[c0..c1], where the parent consumes d bytes */
+    trie_node_t* parent;
+    size_t d;
+    unsigned int c0, c1;
+
+    node_ptr result;
+} hattrie_build_task_t;
+
+
+typedef struct hattrie_build_plan_t_
+{
+    hattrie_t* T;
+    size_t grain;   // children with more keys are laid out before building
+
+    hattrie_build_task_t* tasks;
+    size_t num_tasks, tasks_size;
+
+    /* upper trie nodes, each after its parent */
+    trie_node_t** upper;
+    size_t num_upper, upper_size;
+
+    size_t next;    // next task to hand out
+    pthread_mutex_t lock;
+} hattrie_build_plan_t;
+
+
+/* Stably partition xs[0..n), which all begin with the same d bytes, putting
+ * the keys that end there first, followed by those continuing with each byte in
+ * turn, and setting bounds as hattrie_build_node does. */
+static void hattrie_partition_entries(hattrie_entry_t* xs, hattrie_entry_t* tmp,
+                                      size_t n, size_t d, size_t* bounds)
+{
+    size_t i, c;
+    size_t ending = 0;
+    memset(bounds, 0, (NODE_CHILDS + 1) * sizeof(size_t));
+
+    for (i = 0; i < n; ++i) {
+        if (xs[i].len == d) ++ending;
+        else ++bounds[(unsigned char) xs[i].key[d] + 1];
+    }
+
+    bounds[0] = ending;
+    for (c = 1; c <= NODE_CHILDS; ++c) bounds[c] += bounds[c - 1];
+
+    size_t end = 0;
+    for (i = 0; i < n; ++i) {
+        if (xs[i].len == d) tmp[end++] = xs[i];
+        else tmp[bounds[(unsigned char) xs[i].key[d]]++] = xs[i];
+    }
+    memcpy(xs, tmp, n * sizeof(hattrie_entry_t));
+
+    /* scattering advanced each bound to the next */
+    for (c = NODE_CHILDS; c > 0; --c) bounds[c] = bounds[c - 1];
+    bounds[0] = ending;
+}
+
+
+/* Partition xs[0..n), which all begin with the same d bytes, for a new trie
+ * node, setting its value. */
+static trie_node_t* hattrie_partition_node(hattrie_entry_t* xs, hattrie_entry_t* tmp,
+                                           size_t n, size_t d, size_t* bounds)
+{
+    node_ptr none = { NULL };
+    trie_node_t* node = alloc_trie_node(NULL, none);
+
+    hattrie_partition_entries(xs, tmp, n, d, bounds);
+
+    /* of the keys ending here, the last given is kept */
+    if (bounds[0] > 0) {
+        node->flag |= NODE_HAS_VAL;
+        node->val = xs[bounds[0] - 1].val;
+    }
+
+    return node;
+}
+
+
+static trie_node_t* hattrie_build_unsorted(hattrie_t* T, hattrie_entry_t* xs,
+                                           hattrie_entry_t* tmp, size_t n, size_t d);
+
+/* Build the children of a trie node for the bytes first..last, from keys in
+ * any order that were partitioned for it. */
+static void hattrie_build_children(hattrie_t* T, trie_node_t* node, hattrie_entry_t* xs,
+                                   hattrie_entry_t* tmp, size_t d, const size_t* bounds,
+                                   unsigned int first, unsigned int last)
+{
+    node_ptr child;
+    unsigned int c, c0, c1;
+    for (c0 = first; c0 <= last; c0 = c1 + 1) {
+        c1 = hattrie_build_span(bounds, c0);
+        if (c1 > last) c1 = last;
+
+        if (bounds[c0 + 1] - bounds[c0] >= MAX_BUCKET_SIZE) {
+            child.t = hattrie_build_unsorted(T, xs + bounds[c0], tmp + bounds[c0],
+                                             bounds[c0 + 1] - bounds[c0], d + 1);
+        }
+        else {
+            child.b = hattrie_build_bucket(T, xs + bounds[c0],
+                                           bounds[c1 + 1] - bounds[c0], d, c0, c1);
+        }
+
+        for (c = c0; c <= c1; ++c) node->xs[c] = child;
+    }
+}
+
+
+/* As hattrie_build_node, for keys in any order. */
+static trie_node_t* hattrie_build_unsorted(hattrie_t* T, hattrie_entry_t* xs,
+                                           hattrie_entry_t* tmp, size_t n, size_t d)
+{
+    size_t bounds[NODE_CHILDS + 1];
+    trie_node_t* node = hattrie_partition_node(xs, tmp, n, d, bounds);
+    hattrie_build_children(T, node, xs, tmp, d, bounds, 0, NODE_MAXCHAR);
+    hattrie_node_summarize(node);
+    return node;
+}
+
+
+static void hattrie_plan_task(hattrie_build_plan_t* P, hattrie_entry_t* xs,
+                              hattrie_entry_t* tmp, size_t n, trie_node_t* parent,
+                              size_t d, unsigned int c0, unsigned int c1)
+{
+    if (P->num_tasks == P->tasks_size) {
+        P->tasks_size *= 2;
+        P->tasks = realloc_or_die(P->tasks, P->tasks_size * sizeof(hattrie_build_task_t));
+    }
+
+    hattrie_build_task_t* task = &P->tasks[P->num_tasks++];
+    task->xs = xs;
+    task->tmp = tmp;
+    task->n = n;
+    task->parent = parent;
+    task->d = d;
+    task->c0 = c0;
+    task->c1 = c1;
+    task->result.t = NULL;
+}
+
+
+/* Lay out the trie node for xs[0..n), which all begin with the same d bytes,
+ * planning a task for each child that is not laid out itself. */
+static trie_node_t* hattrie_plan_node(hattrie_build_plan_t* P, hattrie_entry_t* xs,
+                                      hattrie_entry_t* tmp, size_t n, size_t d)
+{
+    size_t bounds[NODE_CHILDS + 1];
+    trie_node_t* node = hattrie_partition_node(xs, tmp, n, d, bounds);
+
+    if (P->num_upper == P->upper_size) {
+        P->upper_size *= 2;
+        P->upper = realloc_or_die(P->upper, P->upper_size * sizeof(trie_node_t*));
+    }
+    P->upper[P->num_upper++] = node;
+
+    size_t m;
+    unsigned int c0, c1;
+    for (c0 = 0; c0 < NODE_CHILDS; c0 = c1 + 1) {
+        c1 = hattrie_build_span(bounds, c0);
+        m  = bounds[c1 + 1] - bounds[c0];
+        if (c0 == c1 && m > P->grain) {
+            node->xs[c0].t = hattrie_plan_node(P, xs + bounds[c0], tmp + bounds[c0],
+                                               m, d + 1);
+        }
+        else {
+            hattrie_plan_task(P, xs + bounds[c0], tmp + bounds[c0], m, node, d, c0, c1);
+        }
+    }
+
+    return node;
+}
+
+
+static void hattrie_build_task(hattrie_t* T, hattrie_build_task_t* task)
+{
+    if (task->n >= MAX_BUCKET_SIZE) {
+        task->result.t = hattrie_build_unsorted(T, task->xs, task->tmp, task->n,
+                                                task->d + 1);
+    }
+    else {
+        task->result.b = hattrie_build_bucket(T, task->xs, task->n, task->d,
+                                              task->c0, task->c1);
+    }
+}
+
+
+static void* hattrie_build_worker(void* arg)
+{
+    hattrie_build_plan_t* P = arg;
+    size_t i;
+
+    while (true) {
+        pthread_mutex_lock(&P->lock);
+        i = P->next++;
+        pthread_mutex_unlock(&P->lock);
+
+        if (i >= P->num_tasks) break;
+        hattrie_build_task(P->T, &P->tasks[i]);
+    }
+
+    return NULL;
+}
+
+
+static int hattrie_build_task_cmp(const void* a_, const void* b_)
+{
+    const hattrie_build_task_t* a = a_;
+    const hattrie_build_task_t* b = b_;
+    return a->n > b->n ? -1 : a->n < b->n;
+}
+
+
+hattrie_t* hattrie_build_parallel(unsigned int flags, hattrie_entry_t* xs, size_t n,
+                                  size_t nthreads)
+{
+    if (nthreads == 0) nthreads = 1;
+
+    hattrie_build_plan_t P;
+    P.T = malloc_or_die(sizeof(hattrie_t));
+    P.T->flags = flags;
+    P.T->generation = 0;
+    P.T->epochs = flags & HATTRIE_SHARED ? hattrie_epochs_create() : NULL;
+    P.T->cow = NULL;
+
+    /* a few times more tasks than threads, so that they even out */
+    P.grain = n / (8 * nthreads);
+    if (P.grain < MAX_BUCKET_SIZE) P.grain = MAX_BUCKET_SIZE;
+
+    P.tasks_size = 256;
+    P.tasks = malloc_or_die(P.tasks_size * sizeof(hattrie_build_task_t));
+    P.num_tasks = 0;
+    P.upper_size = 16;
+    P.upper = malloc_or_die(P.upper_size * sizeof(trie_node_t*));
+    P.num_upper = 0;
+    P.next = 0;
+    pthread_mutex_init(&P.lock, NULL);
+
+    hattrie_entry_t* tmp = malloc_or_die((n > 0 ? n : 1) * sizeof(hattrie_entry_t));
+    P.T->root.t = hattrie_plan_node(&P, xs, tmp, n, 0);
+
+    qsort(P.tasks, P.num_tasks, sizeof(hattrie_build_task_t), hattrie_build_task_cmp);
+
+    /* the calling thread is one of the pool, and does all the work if no
+     * other thread can be started */
+    pthread_t* threads = malloc_or_die(nthreads * sizeof(pthread_t));
+    size_t i, started = 0;
+    while (started + 1 < nthreads &&
+           pthread_create(&threads[started], NULL, hattrie_build_worker, &P) == 0) {
+        ++started;
+    }
+    hattrie_build_worker(&P);
+    for (i = 0; i < started; ++i) pthread_join(threads[i], NULL);
+    free(threads);
+
+    unsigned int c;
+    hattrie_build_task_t* task;
+    for (i = 0; i < P.num_tasks; ++i) {
+        task = &P.tasks[i];
+        for (c = task->c0; c <= task->c1; ++c) task->parent->xs[c] = task->result;
+    }
+
+    for (i = P.num_upper; i > 0; --i) hattrie_node_summarize(P.upper[i - 1]);
+    P.T->m = P.T->root.t->n;
+
+    pthread_mutex_destroy(&P.lock);
+    free(P.tasks);
+    free(P.upper);
+    free(tmp);
+
+    return P.T;
+}
+
+
+/* Find or insert a key, the rest of which is below the trie node parent,
+ * with one walk down the trie and, if it ends in a bucket, one probe of the
+ * bucket. */
+static value_t* hattrie_insert_at(hattrie_t* T, node_ptr parent,
+                                  const char* key, size_t len, bool* inserted)
+{
+    assert(*parent.flag & NODE_TYPE_TRIE);
+
+    if (len == 0) {
+        return hattrie_useval(T, parent, inserted);
+    }
+
+    /* consume all trie nodes, now parent must be trie and child anything */
+    node_ptr node = hattrie_consume(&parent, &key, &len, 0);
+    assert(*parent.flag & NODE_TYPE_TRIE);
+
+    /* if the key has been consumed on a trie node, use its value */
+    if (len == 0) {
+        if (*node.flag & NODE_TYPE_TRIE) {
+            return hattrie_useval(T, node, inserted);
+        }
+        else if (*node.flag & NODE_TYPE_HYBRID_BUCKET) {
+            return hattrie_useval(T, parent, inserted);
+        }
+    }
+
+
+    /* preemptively split the bucket if it is full */
+    while (ahtable_size(node.b) >= MAX_BUCKET_SIZE) {
+        hattrie_split(T, parent, node);
+
+        /* after the split, the node pointer is invalidated, so we search from
+         * the parent again. */
+        node = hattrie_consume(&parent, &key, &len, 0);
+
+        /* if the key has been consumed on a trie node, use its value */
+        if (len == 0) {
+            if (*node.flag & NODE_TYPE_TRIE) {
+                return hattrie_useval(T, node, inserted);
+            }
+            else if (*node.flag & NODE_TYPE_HYBRID_BUCKET) {
+                return hattrie_useval(T, parent, inserted);
+            }
+        }
+    }
+
+    assert(*node.flag & NODE_TYPE_PURE_BUCKET || *node.flag & NODE_TYPE_HYBRID_BUCKET);
+
+    assert(len > 0);
+    value_t* val;
+    if (*node.flag & NODE_TYPE_PURE_BUCKET) {
+        val = ahtable_get_ex(node.b, key + 1, len - 1, inserted);
+    }
+    else {
+        val = ahtable_get_ex(node.b, key, len, inserted);
+    }
+    if (*inserted) ++T->m;
+
+    return val;
+}
+
+
+/* Largest value under a node, as an upper bound, which is exact when maxima
+ * are kept and unbounded otherwise. */
+static value_t hattrie_node_max(const hattrie_t* T, node_ptr node)
+{
+    if (!(T->flags & HATTRIE_MAXIMA)) return UINTPTR_MAX;
+    if (*node.flag & NODE_TYPE_TRIE) return node.t->max;
+    return node.b->max;
+}
+
+
+/* Summaries:
+ * Counts, sums, and extremes of the values under each trie node and in each
+ * bucket are kept as requested by the trie's flags. A change to one key folds
+ * into every summary along its path in one walk, except that when the key held
+ * a least or largest value that it no longer does, the summaries it may have
+ * decided are recomputed, bottom up, until one comes out unchanged. */
+
+/* Fold a key's change into the summaries along its path: count is added to
+ * the counts, sum to the sums, and val, if set, to the extremes. */
+static void hattrie_summary_fold(hattrie_t* T, const char* key, size_t len,
+                                 int count, value_t sum, bool set, value_t val)
+{
+    bool sums   = T->flags & HATTRIE_SUMS;
+    bool maxima = T->flags & HATTRIE_MAXIMA;
+    node_ptr node = T->root;
+
+    while (true) {
+        node.t->n += count;
+        if (sums) {
+            node.t->sum += sum;
+            if (set && val < node.t->min) node.t->min = val;
+        }
+        if (maxima && set && val > node.t->max) node.t->max = val;
+
+        if (len == 0) break;
+        node = node.t->xs[(unsigned char) *key];
+        if (!(*node.flag & NODE_TYPE_TRIE)) {
+            if (sums) {
+                node.b->sum += sum;
+                if (set && val < node.b->min) node.b->min = val;
+            }
+            if (maxima && set && val > node.b->max) node.b->max = val;
+            break;
+        }
+        ++key;
+        --len;
+    }
+}
+
+
+/* Recompute the extremes along the path of a key that no longer holds the
+ * value old. */
+static void hattrie_summary_redo(hattrie_t* T, const char* key, size_t len, value_t old)
+{
+    bool sums   = T->flags & HATTRIE_SUMS;
+    bool maxima = T->flags & HATTRIE_MAXIMA;
+
+    trie_node_t** path = malloc_or_die((len + 1) * sizeof(trie_node_t*));
+    size_t depth = 0;
+    node_ptr node = T->root;
+    node_ptr child;
+    path[depth++] = node.t;
+
+    while (len > 0) {
+        child = node.t->xs[(unsigned char) *key];
+        if (!(*child.flag & NODE_TYPE_TRIE)) {
+            /* nothing changes if the key held neither extreme of the bucket */
+            if ((!maxima || child.b->max > old) && (!sums || child.b->min < old)) {
+                free(path);
+                return;
+            }
+            hattrie_bucket_summarize(child.b);
+            break;
+        }
+        node = child;
+        path[depth++] = node.t;
+        ++key;
+        --len;
+    }
+
+    trie_node_t* t;
+    value_t min, max, cmin, cmax;
+    size_t j;
+    while (depth > 0) {
+        t = path[--depth];
+        min = UINTPTR_MAX;
+        max = 0;
+        if (t->flag & NODE_HAS_VAL) min = max = t->val;
+
+        for (j = 0; j < NODE_CHILDS; ++j) {
+            if (j > 0 && t->xs[j].t == t->xs[j - 1].t) continue;
+            child = t->xs[j];
+            if (*child.flag & NODE_TYPE_TRIE) {
+                cmin = child.t->min;
+                cmax = child.t->max;
+            }
+            else {
+                cmin = child.b->min;
+                cmax = child.b->max;
+            }
+            if (cmin < min) min = cmin;
+            if (cmax > max) max = cmax;
+        }
+
+        if ((!maxima || max == t->max) && (!sums || min == t->min)) break;
+        if (maxima) t->max = max;
+        if (sums)   t->min = min;
+    }
+
+    free(path);
+}
+
+
+/* Keep the summaries up to date with a change to a key, which had the value
+ * old if had is set, and has the value val if has is set. */
+static void hattrie_summary_update(hattrie_t* T, const char* key, size_t len,
+                                   bool had, value_t old, bool has, value_t val)
+{
+    if (!(T->flags & (HATTRIE_COUNTS | HATTRIE_MAXIMA | HATTRIE_SUMS))) return;
+    if (had && has && old == val) return;
+
+    hattrie_summary_fold(T, key, len, (int) has - (int) had,
+                         (has ? val : 0) - (had ? old : 0), has, val);
+
+    if (had && T->flags & (HATTRIE_MAXIMA | HATTRIE_SUMS)) {
+        hattrie_summary_redo(T, key, len, old);
+    }
+}
+
+
+static inline value_t* hattrie_insert(hattrie_t* T, const char* key, size_t len,
+                                      bool* inserted)
+{
+    hattrie_unshare_path(T, key, len);
+    return hattrie_insert_at(T, T->root, key, len, inserted);
+}
+
+
+value_t* hattrie_get(hattrie_t* T, const char* key, size_t len)
+{
+    bool inserted;
+    return hattrie_get_ex(T, key, len, &inserted);
+}
+
+
+value_t* hattrie_get_ex(hattrie_t* T, const char* key, size_t len, bool* inserted)
+{
+    value_t* val = hattrie_insert(T, key, len, inserted);
+    if (*inserted) hattrie_summary_update(T, key, len, false, 0, true, 0);
+    return val;
+}
+
+
+void hattrie_set(hattrie_t* T, const char* key, size_t len, value_t val)
+{
+    bool inserted;
+    value_t* u = hattrie_insert(T, key, len, &inserted);
+    value_t old = *u;
+    *u = val;
+    hattrie_summary_update(T, key, len, !inserted, old, true, val);
+}
+
+
+value_t hattrie_add(hattrie_t* T, const char* key, size_t len, value_t delta)
+{
+    bool inserted;
+    value_t* u = hattrie_insert(T, key, len, &inserted);
+    value_t old = *u;
+    *u += delta;
+    hattrie_summary_update(T, key, len, !inserted, old, true, old + delta);
+    return old + delta;
+}
+
+
+/* Batches:
+ * A batch of keys is stably partitioned on each byte in turn, following the
+ * trie down, so that every bucket takes all of its keys together. The val of
+ * each partitioned entry holds the key's place in the batch. A bucket with room
+ * for the keys it lacks takes them with ahtable_get_batch, growing each slot
+ * once. One without room is split, or, if it holds few keys, rebuilt with them into the
+ * children hattrie_build_parallel would make, which splits it as many times as
+ * needed at once. New keys have the value 0, or one given for each, and their
+ * counts and values are folded into the summaries along their path once per
+ * bucket. */
+
+typedef struct hattrie_batch_t_
+{
+    hattrie_t* T;
+    value_t** vals;     // where each key's value is, in batch order
+    bool* inserted;     // whether each key was new, in batch order, or NULL
+    const value_t* new_vals;    // the values of new keys, or NULL for 0
+
+    /* scratch space for the keys and values of one bucket */
+    const char** keys;
+    size_t* lens;
+    value_t** bucket_vals;
+    bool* bucket_inserted;
+} hattrie_batch_t;
+
+
+/* Fold count new keys, with values summing to sum, between min and max, into
+ * the summaries along a path. */
+static void hattrie_batch_fold(hattrie_t* T, const char* key, size_t len, size_t count,
+                               value_t sum, value_t min, value_t max)
+{
+    if (count == 0 || !(T->flags & (HATTRIE_COUNTS | HATTRIE_MAXIMA | HATTRIE_SUMS))) {
+        return;
+    }
+    hattrie_summary_fold(T, key, len, (int) count, sum, true, min);
+    if (max != min) hattrie_summary_fold(T, key, len, 0, 0, true, max);
+}
+
+
+/* Replace the bucket for bytes c0..c1 below node, which consumes d bytes, with
+ * children built from its keys and xs[0..n). */
+static void hattrie_batch_rebuild(hattrie_batch_t* B, trie_node_t* node,
+                                  hattrie_entry_t* xs, size_t n, size_t d,
+                                  unsigned int c0, unsigned int c1)
+{
+    hattrie_t* T = B->T;
+    ahtable_t* b = node->xs[c0].b;
+    size_t pure = *node->xs[c0].flag & NODE_TYPE_PURE_BUCKET ? 1 : 0;
+    size_t m_old = ahtable_size(b);
+    size_t m = n + m_old;
+    size_t i, len, textsize = 0;
+    const char* key;
+    ahtable_iter_t* it;
+
+    /* The new keys come first, and the keys the bucket held after them, so
+     * that those keep their values. Keys are taken from d bytes in, and the
+     * bucket's keys are copied out whole, since it is freed. */
+    hattrie_entry_t* ys  = malloc_or_die(m * sizeof(hattrie_entry_t));
+    hattrie_entry_t* tmp = malloc_or_die(m * sizeof(hattrie_entry_t));
+    for (i = 0; i < n; ++i) {
+        ys[i].key = xs[i].key + d;
+        ys[i].len = xs[i].len - d;
+        ys[i].val = B->new_vals ? B->new_vals[xs[i].val] : 0;
+    }
+
+    it = ahtable_iter_begin(b, false);
+    for (; !ahtable_iter_finished(it); ahtable_iter_next(it)) {
+        ahtable_iter_key(it, &len);
+        textsize += pure + len;
+    }
+    ahtable_iter_free(it);
+
+    char* text = malloc_or_die(textsize + 1);
+    char* t = text;
+    it = ahtable_iter_begin(b, false);
+    for (i = n; !ahtable_iter_finished(it); ahtable_iter_next(it), ++i) {
+        key = ahtable_iter_key(it, &len);
+        ys[i].key = t;
+        if (pure) *t++ = (char) c0;
+        memcpy(t, key, len);
+        t += len;
+        ys[i].len = pure + len;
+        ys[i].val = *ahtable_iter_val(it);
+    }
+    ahtable_iter_free(it);
+
+    /* the values of the keys the bucket lacks, to fold in above it */
+    value_t sum = 0, min = UINTPTR_MAX, max = 0;
+    bool fresh;
+    for (i = 0; i < n && (B->inserted || B->new_vals); ++i) {
+        fresh = ahtable_tryget(b, xs[i].key + d + pure, xs[i].len - d - pure) == NULL;
+        if (B->inserted) B->inserted[xs[i].val] = fresh;
+        if (fresh) {
+            sum += ys[i].val;
+            if (ys[i].val < min) min = ys[i].val;
+            if (ys[i].val > max) max = ys[i].val;
+        }
+    }
+    if (B->new_vals == NULL) min = max = 0;
+
+    size_t bounds[NODE_CHILDS + 1];
+    hattrie_partition_entries(ys, tmp, m, 0, bounds);
+    hattrie_build_children(T, node, ys, tmp, 0, bounds, c0, c1);
+    ahtable_free(b);
+    ++T->generation;
+
+    /* count what the new children hold */
+    node_ptr child;
+    unsigned int c;
+    m = 0;
+    for (c = c0; c <= c1; ++c) {
+        child = node->xs[c];
+        if (c > c0 && child.t == node->xs[c - 1].t) continue;
+        m += *child.flag & NODE_TYPE_TRIE ? child.t->n : ahtable_size(child.b);
+    }
+    T->m += m - m_old;
+    hattrie_batch_fold(T, xs[0].key, d, m - m_old, sum, min, max);
+
+    for (i = 0; i < n; ++i) {
+        B->vals[xs[i].val] = hattrie_tryget(T, xs[i].key, xs[i].len);
+    }
+
+    free(text);
+    free(ys);
+    free(tmp);
+}
+
+
+/* Insert xs[0..n) into the bucket beginning at byte c0 below node, which
+ * consumes d bytes, unless they would fill it, returning false. */
+static bool hattrie_batch_bucket(hattrie_batch_t* B, trie_node_t* node,
+                                 hattrie_entry_t* xs, size_t n, size_t d,
+                                 unsigned int c0)
+{
+    hattrie_t* T = B->T;
+    ahtable_t* b = node->xs[c0].b;
+    size_t m_old = ahtable_size(b);
+    size_t i;
+
+    /* pure buckets hold the keys without their leading byte */
+    size_t e = *node->xs[c0].flag & NODE_TYPE_PURE_BUCKET ? d + 1 : d;
+    for (i = 0; i < n; ++i) {
+        B->keys[i] = xs[i].key + e;
+        B->lens[i] = xs[i].len - e;
+    }
+
+    if (!ahtable_get_batch_within(b, B->keys, B->lens, n, B->bucket_vals,
+                                  B->bucket_inserted, MAX_BUCKET_SIZE - 1)) {
+        return false;
+    }
+    for (i = 0; i < n; ++i) B->vals[xs[i].val] = B->bucket_vals[i];
+    if (B->inserted) {
+        for (i = 0; i < n; ++i) B->inserted[xs[i].val] = B->bucket_inserted[i];
+    }
+
+    value_t sum = 0, min = 0, max = 0, val;
+    if (B->new_vals) {
+        min = UINTPTR_MAX;
+        for (i = 0; i < n; ++i) {
+            if (!B->bucket_inserted[i]) continue;
+            val = *B->bucket_vals[i] = B->new_vals[xs[i].val];
+            sum += val;
+            if (val < min) min = val;
+            if (val > max) max = val;
+        }
+    }
+
+    T->m += ahtable_size(b) - m_old;
+    hattrie_batch_fold(T, xs[0].key, d + 1, ahtable_size(b) - m_old, sum, min, max);
+    return true;
+}
+
+
+/* Insert xs[0..n), which all begin with the d bytes node consumes. */
+static void hattrie_batch_node(hattrie_batch_t* B, trie_node_t* node,
+                               hattrie_entry_t* xs, hattrie_entry_t* tmp,
+                               size_t n, size_t d)
+{
+    size_t bounds[NODE_CHILDS + 1];
+    hattrie_partition_entries(xs, tmp, n, d, bounds);
+
+    size_t i, m;
+    bool inserted;
+    value_t val;
+    node_ptr parent, child;
+    parent.t = node;
+    for (i = 0; i < bounds[0]; ++i) {
+        B->vals[xs[i].val] = hattrie_useval(B->T, parent, &inserted);
+        if (B->inserted) B->inserted[xs[i].val] = inserted;
+        if (!inserted) continue;
+
+        val = B->new_vals ? B->new_vals[xs[i].val] : 0;
+        *B->vals[xs[i].val] = val;
+        hattrie_batch_fold(B->T, xs[i].key, d, 1, val, val, val);
+    }
+
+    unsigned int c0 = 0, c1;
+    while (c0 < NODE_CHILDS) {
+        child = node->xs[c0];
+        if (*child.flag & NODE_TYPE_TRIE) {
+            c1 = c0;
+            if (bounds[c0 + 1] > bounds[c0]) {
+                hattrie_batch_node(B, child.t, xs + bounds[c0], tmp + bounds[c0],
+                                   bounds[c0 + 1] - bounds[c0], d + 1);
+            }
+            c0 = c1 + 1;
+            continue;
+        }
+
+        assert(child.b->c0 == c0);
+        c1 = child.b->c1;
+        m = bounds[c1 + 1] - bounds[c0];
+
+        /* A bucket the keys would fill, counting only those it lacks, is split
+         * as it would be by inserting them one at a time, and its children
+         * looked at again. One that holds fewer keys than come into it is
+         * rebuilt instead, since splitting it would make little progress. */
+        if (m == 0) {
+            c0 = c1 + 1;
+        }
+        else if (ahtable_size(child.b) < m &&
+                 ahtable_size(child.b) + m >= MAX_BUCKET_SIZE) {
+            hattrie_batch_rebuild(B, node, xs + bounds[c0], m, d, c0, c1);
+            c0 = c1 + 1;
+        }
+        else if (hattrie_batch_bucket(B, node, xs + bounds[c0], m, d, c0)) {
+            c0 = c1 + 1;
+        }
+        else {
+            hattrie_split(B->T, parent, child);
+        }
+    }
+}
+
+
+/* Insert a batch, returning the partitioned entries, to be freed by the
+ * caller, with the val of each holding its place in the batch. */
+static hattrie_entry_t* hattrie_batch(hattrie_t* T, const char* const* keys,
+                                      const size_t* lens, size_t n, value_t** vals)
+{
+    hattrie_batch_t B;
+    B.T = T;
+    B.vals = vals;
+    B.inserted = NULL;
+    B.new_vals = NULL;
+    B.keys = malloc_or_die(MAX_BUCKET_SIZE * sizeof(const char*));
+    B.lens = malloc_or_die(MAX_BUCKET_SIZE * sizeof(size_t));
+    B.bucket_vals = malloc_or_die(MAX_BUCKET_SIZE * sizeof(value_t*));
+    B.bucket_inserted = NULL;
+
+    hattrie_entry_t* xs  = malloc_or_die((n > 0 ? n : 1) * sizeof(hattrie_entry_t));
+    hattrie_entry_t* tmp = malloc_or_die((n > 0 ? n : 1) * sizeof(hattrie_entry_t));
+    size_t i;
+    for (i = 0; i < n; ++i) {
+        xs[i].key = (char*) keys[i];
+        xs[i].len = lens[i];
+        xs[i].val = i;
+    }
+
+    /* only the nodes on the paths of the keys are changed */
+    if (hattrie_cow(T)) {
+        for (i = 0; i < n; ++i) hattrie_unshare_path_nodes(T, keys[i], lens[i]);
+    }
+
+    /* Buckets of a shared trie copy a slot each time a key is added to it, so
+     * keys are added one at a time, and their values found once all are in. */
+    if (T->epochs) {
+        bool inserted;
+        for (i = 0; i < n; ++i) hattrie_get_ex(T, keys[i], lens[i], &inserted);
+        for (i = 0; i < n; ++i) vals[i] = hattrie_tryget(T, keys[i], lens[i]);
+    }
+    else hattrie_batch_node(&B, T->root.t, xs, tmp, n, 0);
+
+    free(B.keys);
+    free(B.lens);
+    free(B.bucket_vals);
+    free(tmp);
+    return xs;
+}
+
+
+void hattrie_get_batch(hattrie_t* T, const char* const* keys, const size_t* lens,
+                       size_t n, value_t** vals)
+{
+    free(hattrie_batch(T, keys, lens, n, vals));
+}
+
+
+void hattrie_insert_batch(hattrie_t* T, const hattrie_entry_t* entries, size_t n)
+{
+    const char** keys = malloc_or_die((n > 0 ? n : 1) * sizeof(const char*));
+    size_t* lens      = malloc_or_die((n > 0 ? n : 1) * sizeof(size_t));
+    value_t** vals    = malloc_or_die((n > 0 ? n : 1) * sizeof(value_t*));
+    size_t i;
+    for (i = 0; i < n; ++i) {
+        keys[i] = entries[i].key;
+        lens[i] = entries[i].len;
+    }
+
+    hattrie_entry_t* xs = hattrie_batch(T, keys, lens, n, vals);
+
+    /* Set values in partitioned order, which is still the given order among
+     * equal keys, so the last of them is kept. */
+    bool summed = T->flags & (HATTRIE_MAXIMA | HATTRIE_SUMS);
+    value_t* u;
+    value_t old, val;
+    for (i = 0; i < n; ++i) {
+        u = vals[xs[i].val];
+        old = *u;
+        val = entries[xs[i].val].val;
+        *u = val;
+        if (summed) hattrie_summary_update(T, xs[i].key, xs[i].len, true, old, true, val);
+    }
+
+    free(xs);
+    free(keys);
+    free(lens);
+    free(vals);
+}
+
+
+/* Merging:
+ * Two tries are walked in lockstep from their roots. Where the destination has
+ * nothing, the source's bucket or subtree is moved over whole, with what
+ * remains of an empty destination bucket's bytes kept around it. Otherwise a
+ * source bucket's keys are inserted as one batch at the destination node, or,
+ * with no summaries to fold in, a key at a time from that node, and a source
+ * subtree is met by splitting the destination's bucket until it is a trie
+ * node too. Values are combined as each batch comes back, and the summaries of
+ * the nodes along the walk are recomputed on the way up. hattrie_union walks
+ * the same way, but places copies of the source's buckets and subtrees, and
+ * frees nothing of it. */
+
+typedef struct hattrie_merge_t_
+{
+    hattrie_t* dst;
+    const hattrie_t* src;
+    hattrie_combine_fn combine;
+    void* ctx;
+    bool movable;       // whether src keeps every summary dst does
+    bool keep;          // whether src is left as it was, and copies placed
+
+    char* path;         // the bytes consumed down to the current node
+    size_t pathsize;
+
+    /* a batch, and scratch space for the keys and values of one bucket */
+    hattrie_batch_t B;
+    hattrie_entry_t* xs;
+    hattrie_entry_t* tmp;
+    value_t* src_vals;
+    value_t** vals;
+    bool* inserted;
+    char* text;
+    size_t textsize;
+} hattrie_merge_t;
+
+
+static inline value_t hattrie_merge_value(hattrie_merge_t* M, value_t dst,
+                                          value_t src)
+{
+    return M->combine ? M->combine(dst, src, M->ctx) : src;
+}
+
+
+/* Insert the keys of bucket b one at a time, each from node, when there are
+ * no summaries to fold in along the way. */
+static void hattrie_merge_keys(hattrie_merge_t* M, trie_node_t* node,
+                               ahtable_t* b, bool swapped)
+{
+    size_t pure = b->flag & NODE_TYPE_PURE_BUCKET ? 1 : 0;
+    size_t len;
+    const char* key;
+    value_t* u;
+    bool inserted;
+    node_ptr parent;
+    parent.t = node;
+
+    ahtable_iter_t* it = ahtable_iter_begin(b, false);
+    for (; !ahtable_iter_finished(it); ahtable_iter_next(it)) {
+        key = ahtable_iter_key(it, &len);
+        if (pure + len > M->textsize) {
+            M->textsize = pure + len;
+            M->text = realloc_or_die(M->text, M->textsize);
+        }
+        if (pure) M->text[0] = (char) b->c0;
+        memcpy(M->text + pure, key, len);
+
+        u = hattrie_insert_at(M->dst, parent, M->text, pure + len, &inserted);
+        if (inserted)     *u = *ahtable_iter_val(it);
+        else if (swapped) *u = hattrie_merge_value(M, *ahtable_iter_val(it), *u);
+        else              *u = hattrie_merge_value(M, *u, *ahtable_iter_val(it));
+    }
+    ahtable_iter_free(it);
+}
+
+
+/* Insert the keys of bucket b, which continue the d bytes of the path, into
+ * the destination below node, which consumes them. If swapped, b came from the
+ * destination, and the values met there from the source. */
+static void hattrie_merge_bucket(hattrie_merge_t* M, trie_node_t* node, size_t d,
+                                 ahtable_t* b, bool swapped)
+{
+    size_t n = ahtable_size(b);
+    if (n == 0) return;
+
+    if (!(M->dst->flags & (HATTRIE_COUNTS | HATTRIE_MAXIMA | HATTRIE_SUMS))) {
+        hattrie_merge_keys(M, node, b, swapped);
+        return;
+    }
+
+    size_t pure = b->flag & NODE_TYPE_PURE_BUCKET ? 1 : 0;
+    size_t i, len, textsize = 0;
+    const char* key;
+    ahtable_iter_t* it;
+
+    it = ahtable_iter_begin(b, false);
+    for (; !ahtable_iter_finished(it); ahtable_iter_next(it)) {
+        ahtable_iter_key(it, &len);
+        textsize += d + pure + len;
+    }
+    ahtable_iter_free(it);
+
+    if (textsize > M->textsize) {
+        M->textsize = textsize;
+        M->text = realloc_or_die(M->text, M->textsize);
+    }
+
+    /* whole keys, since the batch finds values from the root */
+    char* t = M->text;
+    it = ahtable_iter_begin(b, false);
+    for (i = 0; !ahtable_iter_finished(it); ahtable_iter_next(it), ++i) {
+        key = ahtable_iter_key(it, &len);
+        M->xs[i].key = t;
+        M->xs[i].len = d + pure + len;
+        M->xs[i].val = i;
+        memcpy(t, M->path, d);
+        t += d;
+        if (pure) *t++ = (char) b->c0;
+        memcpy(t, key, len);
+        t += len;
+        M->src_vals[i] = *ahtable_iter_val(it);
+    }
+    ahtable_iter_free(it);
+
+    hattrie_batch_node(&M->B, node, M->xs, M->tmp, n, d);
+
+    bool summed = M->dst->flags & (HATTRIE_MAXIMA | HATTRIE_SUMS);
+    value_t* u;
+    value_t old, val;
+    size_t j;
+    for (i = 0; i < n; ++i) {
+        j = M->xs[i].val;
+        if (M->inserted[j]) continue;
+
+        u = M->vals[j];
+        old = *u;
+        if (swapped) val = hattrie_merge_value(M, M->src_vals[j], old);
+        else         val = hattrie_merge_value(M, old, M->src_vals[j]);
+        *u = val;
+        if (summed) {
+            hattrie_summary_update(M->dst, M->xs[i].key, M->xs[i].len,
+                                   true, old, true, val);
+        }
+    }
+}
+
+
+/* Put child in place of bytes c0..c1 of the empty bucket b below node, which
+ * keeps whichever bytes around them it covered. */
+static void hattrie_merge_place(trie_node_t* node, ahtable_t* b, unsigned int c0,
+                                unsigned int c1, node_ptr child)
+{
+    unsigned int c, b0 = b->c0, b1 = b->c1;
+    node_ptr rest;
+
+    assert(ahtable_size(b) == 0);
+
+    if (b0 < c0) {
+        b->c1 = c0 - 1;
+        b->flag = b->c0 == b->c1 ? NODE_TYPE_PURE_BUCKET : NODE_TYPE_HYBRID_BUCKET;
+        if (c1 < b1) {
+            rest.b = ahtable_create();
+            rest.b->c0 = c1 + 1;
+            rest.b->c1 = b1;
+            rest.b->flag = rest.b->c0 == rest.b->c1 ?
+                              NODE_TYPE_PURE_BUCKET : NODE_TYPE_HYBRID_BUCKET;
+            for (c = c1 + 1; c <= b1; ++c) node->xs[c] = rest;
+        }
+    }
+    else if (c1 < b1) {
+        b->c0 = c1 + 1;
+        b->flag = b->c0 == b->c1 ? NODE_TYPE_PURE_BUCKET : NODE_TYPE_HYBRID_BUCKET;
+    }
+    else ahtable_free(b);
+
+    for (c = c0; c <= c1; ++c) node->xs[c] = child;
+}
+
+
+/* Merge the source trie node s into the destination trie node node, both of
+ * which consume the d bytes of the path, freeing s and whatever of its
+ * subtree is not moved, unless the source is kept. */
+static void hattrie_merge_reserve(hattrie_merge_t* M, size_t len)
+{
+    if (M->pathsize >= len) return;
+    while (M->pathsize < len) M->pathsize *= 2;
+    M->path = realloc_or_die(M->path, M->pathsize);
+}
+
+
+/* A bucket or subtree of src to place in dst whole: itself, or its copy when
+ * src is left as it was. */
+static node_ptr hattrie_merge_take(hattrie_merge_t* M, node_ptr child)
+{
+    return M->keep ? hattrie_dup_node(M->dst, child) : child;
+}
+
+
+static void hattrie_merge_node(hattrie_merge_t* M, trie_node_t* node,
+                               trie_node_t* s, size_t d)
+{
+    hattrie_merge_reserve(M, d + 1);
+
+    if (s->flag & NODE_HAS_VAL) {
+        if (node->flag & NODE_HAS_VAL) {
+            node->val = hattrie_merge_value(M, node->val, s->val);
+        }
+        else {
+            node->val = s->val;
+            node->flag |= NODE_HAS_VAL;
+            ++M->dst->m;
+        }
+    }
+
+    node_ptr parent, child, other;
+    parent.t = node;
+    unsigned int c0, c1;
+    for (c0 = 0; c0 < NODE_CHILDS; c0 = c1 + 1) {
+        child = s->xs[c0];
+        assert(*child.flag & NODE_TYPE_TRIE || child.b->c0 == c0);
+        c1 = *child.flag & NODE_TYPE_TRIE ? c0 : child.b->c1;
+        M->path[d] = (char) c0;
+        other = node->xs[c0];
+
+        if (*child.flag & NODE_TYPE_TRIE) {
+            while (!(*other.flag & NODE_TYPE_TRIE) &&
+                   (ahtable_size(other.b) > 0 || !M->movable)) {
+                hattrie_split(M->dst, parent, other);
+                other = node->xs[c0];
+            }
+
+            if (*other.flag & NODE_TYPE_TRIE) {
+                hattrie_merge_node(M, other.t, child.t, d + 1);
+            }
+            else {
+                M->dst->m += hattrie_node_count(M->src, child);
+                hattrie_merge_place(node, other.b, c0, c0,
+                                    hattrie_merge_take(M, child));
+            }
+            continue;
+        }
+
+        /* the destination has nothing for the bucket's bytes */
+        if (M->movable && !(*other.flag & NODE_TYPE_TRIE) &&
+            other.b->c1 >= c1 && ahtable_size(other.b) == 0) {
+            M->dst->m += ahtable_size(child.b);
+            hattrie_merge_place(node, other.b, c0, c1,
+                                hattrie_merge_take(M, child));
+        }
+
+        /* or a smaller bucket for the same bytes, which is merged into it */
+        else if (M->movable && !(*other.flag & NODE_TYPE_TRIE) &&
+                 other.b->c0 == c0 && other.b->c1 == c1 &&
+                 ahtable_size(other.b) < ahtable_size(child.b)) {
+            unsigned int c;
+            child = hattrie_merge_take(M, child);
+            for (c = c0; c <= c1; ++c) node->xs[c] = child;
+            M->dst->m += ahtable_size(child.b) - ahtable_size(other.b);
+            hattrie_merge_bucket(M, node, d, other.b, true);
+            ahtable_free(other.b);
+        }
+
+        else {
+            hattrie_merge_bucket(M, node, d, child.b, false);
+            if (!M->keep) ahtable_free(child.b);
+        }
+    }
+
+    if (M->dst->flags & (HATTRIE_COUNTS | HATTRIE_MAXIMA | HATTRIE_SUMS)) {
+        hattrie_node_summarize(node);
+    }
+    if (!M->keep) free(s);
+}
+
+
+/* Merge src into dst, leaving src as it was if keep, and otherwise moving
+ * what can be and freeing the rest, except its root. */
+static void hattrie_merge(hattrie_t* dst, const hattrie_t* src,
+                          hattrie_combine_fn combine, void* ctx, bool keep)
+{
+    assert(dst != src);
+    assert(dst->epochs == NULL && src->epochs == NULL);
+
+    hattrie_unshare(dst);
+
+    const unsigned int summaries = HATTRIE_COUNTS | HATTRIE_MAXIMA | HATTRIE_SUMS;
+
+    hattrie_merge_t* M = malloc_or_die(sizeof(hattrie_merge_t));
+    M->dst = dst;
+    M->src = src;
+    M->combine = combine;
+    M->ctx = ctx;
+    M->movable = (dst->flags & summaries & ~src->flags) == 0;
+    M->keep = keep;
+    M->pathsize = 16;
+    M->path = malloc_or_die(M->pathsize);
+
+    M->xs       = malloc_or_die(MAX_BUCKET_SIZE * sizeof(hattrie_entry_t));
+    M->tmp      = malloc_or_die(MAX_BUCKET_SIZE * sizeof(hattrie_entry_t));
+    M->src_vals = malloc_or_die(MAX_BUCKET_SIZE * sizeof(value_t));
+    M->vals     = malloc_or_die(MAX_BUCKET_SIZE * sizeof(value_t*));
+    M->inserted = malloc_or_die(MAX_BUCKET_SIZE * sizeof(bool));
+    M->textsize = 4096;
+    M->text     = malloc_or_die(M->textsize);
+
+    M->B.T = dst;
+    M->B.vals = M->vals;
+    M->B.inserted = M->inserted;
+    M->B.new_vals = M->src_vals;
+    M->B.keys = malloc_or_die(MAX_BUCKET_SIZE * sizeof(const char*));
+    M->B.lens = malloc_or_die(MAX_BUCKET_SIZE * sizeof(size_t));
+    M->B.bucket_vals = malloc_or_die(MAX_BUCKET_SIZE * sizeof(value_t*));
+    M->B.bucket_inserted = malloc_or_die(MAX_BUCKET_SIZE * sizeof(bool));
+
+    hattrie_merge_node(M, dst->root.t, src->root.t, 0);
+    ++dst->generation;
+
+    free(M->B.keys);
+    free(M->B.lens);
+    free(M->B.bucket_vals);
+    free(M->B.bucket_inserted);
+    free(M->xs);
+    free(M->tmp);
+    free(M->src_vals);
+    free(M->vals);
+    free(M->inserted);
+    free(M->text);
+    free(M->path);
+    free(M);
+}
+
+
+void hattrie_merge_into(hattrie_t* dst, hattrie_t* src,
+                        hattrie_combine_fn combine, void* ctx)
+{
+    hattrie_unshare(src);
+    hattrie_merge(dst, src, combine, ctx, false);
+
+    /* the source is left empty */
+    node_ptr node;
+    node.b = ahtable_create();
+    node.b->flag = NODE_TYPE_HYBRID_BUCKET;
+    node.b->c0 = 0x00;
+    node.b->c1 = NODE_MAXCHAR;
+    src->root.t = alloc_trie_node(src, node);
+    src->m = 0;
+    ++src->generation;
+}
+
+
+void hattrie_union(hattrie_t* dst, const hattrie_t* src,
+                   hattrie_combine_fn combine, void* ctx)
+{
+    hattrie_merge(dst, src, combine, ctx, true);
+}
+
+
+/* Intersection and difference:
+ * Either only removes keys from the destination, so it alone is walked, along
+ * with the deepest trie node of the source on the same path. Where the source
+ * holds nothing under a child's bytes, the whole child is dropped from an
+ * intersection and left untouched by a difference. Elsewhere the keys of each
+ * bucket are looked up in the source from that node, which leaves only a walk
+ * down through the rest of the source's trie nodes and its bucket. Keys are
+ * deleted from the bucket if fewer go than stay, and otherwise it is rebuilt
+ * with those that stay. */
+
+typedef struct hattrie_filter_t_
+{
+    hattrie_t* T;
+    hattrie_combine_fn combine;
+    void* ctx;
+    bool intersect;     // whether the keys src holds are kept, or removed
+
+    char* path;         // the bytes consumed down to the current node
+    size_t pathsize;
+
+    bool* keep;         // which keys of a bucket are kept
+    size_t* lens;       // and the lengths of those removed
+    size_t keepsize;
+    char* text;         // whose bytes follow one another here
+    size_t textsize;
+} hattrie_filter_t;
+
+
+static void hattrie_filter_reserve(hattrie_filter_t* F, size_t len)
+{
+    if (F->pathsize >= len) return;
+    while (F->pathsize < len) F->pathsize *= 2;
+    F->path = realloc_or_die(F->path, F->pathsize);
+}
+
+
+/* Find the value of the key held in the first len bytes of the path in the
+ * source, below its trie node s, which consumes the first sd of them. */
+static value_t* hattrie_filter_find(hattrie_filter_t* F, trie_node_t* s, size_t sd,
+                                    size_t len)
+{
+    if (len == sd) return s->flag & NODE_HAS_VAL ? &s->val : NULL;
+
+    const char* key = F->path + sd;
+    len -= sd;
+
+    node_ptr parent;
+    parent.t = s;
+    node_ptr node = hattrie_consume(&parent, &key, &len, 1);
+    if (*node.flag & NODE_TYPE_TRIE) {
+        return node.t->flag & NODE_HAS_VAL ? &node.t->val : NULL;
+    }
+
+    /* pure buckets hold the keys without their leading byte */
+    if (*node.flag & NODE_TYPE_PURE_BUCKET) {
+        ++key;
+        --len;
+    }
+    return ahtable_tryget(node.b, key, len);
+}
+
+
+/* Whether the source holds no key below its trie node s, which consumes the
+ * first sd bytes of the path, that continues the d bytes of the path with a
+ * byte in c0..c1. */
+static bool hattrie_filter_empty(hattrie_filter_t* F, trie_node_t* s, size_t sd,
+                                 size_t d, unsigned int c0, unsigned int c1)
+{
+    node_ptr child;
+
+    /* a bucket of the source holds the path's keys */
+    if (sd < d) {
+        child = s->xs[(unsigned char) F->path[sd]];
+        return ahtable_size(child.b) == 0;
+    }
+
+    unsigned int c;
+    for (c = c0; c <= c1; c = (*child.flag & NODE_TYPE_TRIE ? c : child.b->c1) + 1) {
+        child = s->xs[c];
+        if (*child.flag & NODE_TYPE_TRIE || ahtable_size(child.b) > 0) return false;
+    }
+    return true;
+}
+
+
+/* Whether a key the source holds, with value u, or does not, if u is NULL,
+ * is kept, combining its value val if so. */
+static inline bool hattrie_filter_key(hattrie_filter_t* F, value_t* val,
+                                      const value_t* u)
+{
+    if (!F->intersect) return u == NULL;
+    if (u == NULL) return false;
+    *val = F->combine ? F->combine(*val, *u, F->ctx) : *u;
+    return true;
+}
+
+
+/* Filter the bucket b, whose keys continue the d bytes of the path, below the
+ * trie node node. */
+static void hattrie_filter_bucket(hattrie_filter_t* F, trie_node_t* node, ahtable_t* b,
+                                  size_t d, trie_node_t* s, size_t sd)
+{
+    size_t n = ahtable_size(b);
+    if (n == 0) return;
+
+    if (n > F->keepsize) {
+        F->keepsize = n;
+        F->keep = realloc_or_die(F->keep, F->keepsize * sizeof(bool));
+        F->lens = realloc_or_die(F->lens, F->keepsize * sizeof(size_t));
+    }
+
+    /* pure buckets hold the keys without their leading byte */
+    if (b->flag & NODE_TYPE_PURE_BUCKET) F->path[d++] = (char) b->c0;
+
+    size_t i, len, kept = 0, removed = 0, textlen = 0;
+    const char* key;
+    ahtable_iter_t* it;
+
+    it = ahtable_iter_begin(b, false);
+    for (i = 0; !ahtable_iter_finished(it); ahtable_iter_next(it), ++i) {
+        key = ahtable_iter_key(it, &len);
+        hattrie_filter_reserve(F, d + len);
+        memcpy(F->path + d, key, len);
+        F->keep[i] = hattrie_filter_key(F, ahtable_iter_val(it),
+                                        hattrie_filter_find(F, s, sd, d + len));
+        if (F->keep[i]) {
+            ++kept;
+            continue;
+        }
+
+        if (textlen + len > F->textsize) {
+            while (textlen + len > F->textsize) F->textsize *= 2;
+            F->text = realloc_or_die(F->text, F->textsize);
+        }
+        memcpy(F->text + textlen, key, len);
+        textlen += len;
+        F->lens[removed++] = len;
+    }
+    ahtable_iter_free(it);
+
+    F->T->m -= removed;
+
+    bool summed = F->T->flags & (HATTRIE_MAXIMA | HATTRIE_SUMS);
+    if (removed <= kept) {
+        for (i = 0, textlen = 0; i < removed; textlen += F->lens[i++]) {
+            ahtable_del(b, F->text + textlen, F->lens[i]);
+        }
+        if (summed && (removed > 0 || F->intersect)) hattrie_bucket_summarize(b);
+        return;
+    }
+
+    node_ptr rest;
+    rest.b = ahtable_create_n(hattrie_bucket_slots(kept));
+    rest.b->c0 = b->c0;
+    rest.b->c1 = b->c1;
+    rest.b->flag = b->flag;
+
+    it = ahtable_iter_begin(b, false);
+    for (i = 0; !ahtable_iter_finished(it); ahtable_iter_next(it), ++i) {
+        if (!F->keep[i]) continue;
+        key = ahtable_iter_key(it, &len);
+        *ahtable_get(rest.b, key, len) = *ahtable_iter_val(it);
+    }
+    ahtable_iter_free(it);
+
+    if (summed) hattrie_bucket_summarize(rest.b);
+
+    unsigned int c;
+    for (c = b->c0; c <= b->c1; ++c) node->xs[c] = rest;
+    ahtable_free(b);
+}
+
+
+/* Filter the keys below the trie node node, which consumes the first d bytes
+ * of the path, against those of the source below its trie node s, which
+ * consumes the first sd. */
+static void hattrie_filter_node(hattrie_filter_t* F, trie_node_t* node, size_t d,
+                                trie_node_t* s, size_t sd)
+{
+    hattrie_filter_reserve(F, d + 1);
+
+    if (node->flag & NODE_HAS_VAL &&
+        !hattrie_filter_key(F, &node->val, hattrie_filter_find(F, s, sd, d))) {
+        node_ptr parent;
+        parent.t = node;
+        hattrie_clrval(F->T, parent);
+    }
+
+    node_ptr child, other;
+    unsigned int c, c0, c1;
+    size_t count;
+    for (c0 = 0; c0 < NODE_CHILDS; c0 = c1 + 1) {
+        child = node->xs[c0];
+        c1 = *child.flag & NODE_TYPE_TRIE ? c0 : child.b->c1;
+
+        if (hattrie_filter_empty(F, s, sd, d, c0, c1)) {
+            if (!F->intersect) continue;
+            count = hattrie_node_count(F->T, child);
+            if (count == 0) continue;
+            F->T->m -= count;
+            hattrie_free_node(child);
+            child = hattrie_empty_bucket(c0, c1);
+            for (c = c0; c <= c1; ++c) node->xs[c] = child;
+            continue;
+        }
+
+        F->path[d] = (char) c0;
+        if (*child.flag & NODE_TYPE_TRIE) {
+            /* the source follows along while it has trie nodes */
+            other = s->xs[c0];
+            if (sd == d && *other.flag & NODE_TYPE_TRIE) {
+                hattrie_filter_node(F, child.t, d + 1, other.t, d + 1);
+            }
+            else hattrie_filter_node(F, child.t, d + 1, s, sd);
+        }
+        else hattrie_filter_bucket(F, node, child.b, d, s, sd);
+    }
+
+    if (F->T->flags & (HATTRIE_COUNTS | HATTRIE_MAXIMA | HATTRIE_SUMS)) {
+        hattrie_node_summarize(node);
+    }
+}
+
+
+static void hattrie_filter(hattrie_t* dst, const hattrie_t* src,
+                           hattrie_combine_fn combine, void* ctx, bool intersect)
+{
+    assert(dst != src);
+    assert(dst->epochs == NULL);
+
+    hattrie_unshare(dst);
+
+    hattrie_filter_t F;
+    F.T = dst;
+    F.combine = combine;
+    F.ctx = ctx;
+    F.intersect = intersect;
+    F.pathsize = 16;
+    F.path = malloc_or_die(F.pathsize);
+    F.keepsize = 0;
+    F.keep = NULL;
+    F.lens = NULL;
+    F.textsize = 4096;
+    F.text = malloc_or_die(F.textsize);
+
+    hattrie_filter_node(&F, dst->root.t, 0, src->root.t, 0);
+    ++dst->generation;
+
+    free(F.path);
+    free(F.keep);
+    free(F.lens);
+    free(F.text);
+}
+
+
+void hattrie_intersect(hattrie_t* dst, const hattrie_t* src,
+                       hattrie_combine_fn combine, void* ctx)
+{
+    hattrie_filter(dst, src, combine, ctx, true);
+}
+
+
+void hattrie_difference(hattrie_t* dst, const hattrie_t* src)
+{
+    hattrie_filter(dst, src, NULL, NULL, false);
+}
+
+
+value_t* hattrie_tryget(hattrie_t* T, const char* key, size_t len)
+{
+    /* find node for given key */
+    node_ptr node = hattrie_find(T, &key, &len);
+    if (node.flag == NULL) {
+        return NULL;
+    }
+
+    /* if the trie node consumes value, use it */
+    if (*node.flag & NODE_TYPE_TRIE) {
+        return &node.t->val;
+    }
+
+    return ahtable_tryget(node.b, key, len);
+}
+
+
+bool hattrie_fetch_add(hattrie_t* T, const char* key, size_t len,
+                       value_t delta, value_t* old)
+{
+    assert(!(T->flags & (HATTRIE_MAXIMA | HATTRIE_SUMS)));
+
+    hattrie_own_path(T, key, len);
+    value_t* u = hattrie_tryget(T, key, len);
+    if (u == NULL) return false;
+
+    value_t val = __atomic_fetch_add(u, delta, __ATOMIC_RELAXED);
+    if (old) *old = val;
+    return true;
+}
+
+
+bool hattrie_compare_exchange(hattrie_t* T, const char* key, size_t len,
+                              value_t* expected, value_t desired)
+{
+    assert(!(T->flags & (HATTRIE_MAXIMA | HATTRIE_SUMS)));
+
+    hattrie_own_path(T, key, len);
+    value_t* u = hattrie_tryget(T, key, len);
+    if (u == NULL) return false;
+
+    return __atomic_compare_exchange_n(u, expected, desired, false,
+                                       __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+}
+
+
+static int hattrie_remove(hattrie_t* T, const char* key, size_t len)
+{
+    hattrie_unshare_path(T, key, len);
+
+    node_ptr parent = T->root;
+    HT_UNUSED(parent);
+    assert(*parent.flag & NODE_TYPE_TRIE);
+
+    /* find node for deletion */
+    node_ptr node = hattrie_find(T, &key, &len);
+    if (node.flag == NULL) {
+        return -1;
+    }
+
+    /* if consumed on a trie node, clear the value */
+    if (*node.flag & NODE_TYPE_TRIE) {
+        return hattrie_clrval(T, node);
+    }
+
+    /* remove from bucket */
+    size_t m_old = ahtable_size(node.b);
+    int ret =  ahtable_del(node.b, key, len);
+    T->m -= (m_old - ahtable_size(node.b));
+
+    /* merge empty buckets */
+    /*! \todo */
+
+    return ret;
+}
+
+
+int hattrie_del(hattrie_t* T, const char* key, size_t len)
+{
+    value_t old = 0;
+    if (T->flags & (HATTRIE_MAXIMA | HATTRIE_SUMS)) {
+        value_t* u = hattrie_tryget(T, key, len);
+        if (u == NULL) return -1;
+        old = *u;
+    }
+
+    int ret = hattrie_remove(T, key, len);
+    if (ret == 0) hattrie_summary_update(T, key, len, true, old, false, 0);
+    return ret;
+}
+
+
+/* Cursors:
+ * A cursor keeps the trie nodes along the path of the last key it was used
+ * with. The next key starts from the deepest of them on the prefix it shares
+ * with that key, rather than from the root. Since a split may free or replace
+ * the nodes on the path, the trie's generation is recorded with it, and the
+ * path is dropped when it no longer matches. */
+
+struct hattrie_cursor_t_
+{
+    hattrie_t* T;
+    size_t generation;
+
+    /* nodes[d] is the trie node reached by consuming key[0..d) */
+    char* key;
+    node_ptr* nodes;
+    size_t depth;
+    size_t size;    // space reserved for key and nodes
+};
+
+
+hattrie_cursor_t* hattrie_cursor_create(hattrie_t* T)
+{
+    hattrie_cursor_t* c = malloc_or_die(sizeof(hattrie_cursor_t));
+    c->T = T;
+    c->generation = T->generation;
+    c->size  = 16;
+    c->key   = malloc_or_die(c->size * sizeof(char));
+    c->nodes = malloc_or_die((c->size + 1) * sizeof(node_ptr));
+    c->nodes[0] = T->root;
+    c->depth = 0;
+    return c;
+}
+
+
+void hattrie_cursor_free(hattrie_cursor_t* c)
+{
+    if (c == NULL) return;
+    free(c->key);
+    free(c->nodes);
+    free(c);
+}
+
+
+/* Walk the trie nodes along key from the deepest remembered one, recording
+ * them, and return the depth of the last. */
+static size_t hattrie_cursor_descend(hattrie_cursor_t* c, const char* key, size_t len)
+{
+    if (c->generation != c->T->generation) {
+        c->generation = c->T->generation;
+        c->nodes[0] = c->T->root;
+        c->depth = 0;
+    }
+
+    size_t d = 0;
+    while (d < c->depth && d < len && c->key[d] == key[d]) ++d;
+
+    if (len > c->size) {
+        while (len > c->size) c->size *= 2;
+        c->key   = realloc_or_die(c->key, c->size * sizeof(char));
+        c->nodes = realloc_or_die(c->nodes, (c->size + 1) * sizeof(node_ptr));
+    }
+
+    node_ptr node = c->nodes[d];
+    node_ptr child;
+    while (d < len) {
+        child = node.t->xs[(unsigned char) key[d]];
+        if (!(*child.flag & NODE_TYPE_TRIE)) break;
+        c->key[d] = key[d];
+        c->nodes[++d] = node = child;
+    }
+
+    c->depth = d;
+    return d;
+}
+
+
+value_t* hattrie_cursor_get(hattrie_cursor_t* c, const char* key, size_t len)
+{
+    bool inserted;
+    hattrie_unshare_path(c->T, key, len);
+    size_t d = hattrie_cursor_descend(c, key, len);
+    value_t* val = hattrie_insert_at(c->T, c->nodes[d], key + d, len - d, &inserted);
+    if (inserted) hattrie_summary_update(c->T, key, len, false, 0, true, 0);
+    return val;
+}
+
+
+value_t* hattrie_cursor_tryget(hattrie_cursor_t* c, const char* key, size_t len)
+{
+    size_t d = hattrie_cursor_descend(c, key, len);
+    node_ptr node = c->nodes[d];
+
+    if (d == len) {
+        return node.t->flag & NODE_HAS_VAL ? &node.t->val : NULL;
+    }
+
+    node = node.t->xs[(unsigned char) key[d]];
+    if (*node.flag & NODE_TYPE_PURE_BUCKET) {
+        return ahtable_tryget(node.b, key + d + 1, len - d - 1);
+    }
+    return ahtable_tryget(node.b, key + d, len - d);
+}
+
+
+/* Concurrent tries:
+ * Trie nodes are guarded by a fixed table of reader-writer locks, a node
+ * taking the one its address hashes to. A node's lock covers its value, its
+ * children, and the buckets directly below it. Since a trie node, once made,
+ * is never freed or replaced until the trie is, a thread walks down holding
+ * only the lock of the node it is on, and takes the lock of the next after
+ * letting go of it. The walk stops on the node whose value or bucket holds
+ * the key, locking it for writing if the key is to be changed. A bucket is
+ * split only under the write lock of its parent, so the new nodes it is
+ * replaced with are published whole when that lock is released, and no other
+ * thread can be looking into the bucket as it is freed.
+ *
+ * Taking a read lock still writes to it, so every walk writes to the lock of
+ * the root, and the cache line holding it moves between cores on every
+ * operation. With HATTRIE_OPTIMISTIC, each lock has a version beside it
+ * instead, odd while a writer holds it. A walk reads the version of each node
+ * before looking at its children, and checks it again after, starting over
+ * from the root if it changed, so that walks write nothing until they reach
+ * the node to be changed, whose version a writer then takes by
+ * compare-and-swap from the one it read. The trie is a shared one (see
+ * HATTRIE_SHARED), so that a walk that looks into a bucket as it changes finds
+ * whole slots, and memory it may be reading is not freed under it; each thread
+ * gets a reader of its own for the trie, which it is in for each operation.
+ *
+ * The trie code counts keys and bumps the generation in the hattrie_t it is
+ * given. Each writer gives it one of its own, sharing the root, and adds the
+ * count to that of the lock it holds. */
+
+#define HATTRIE_STRIPES 1024
+
+typedef union hattrie_stripe_t_
+{
+    struct {
+        pthread_rwlock_t lock;
+        size_t version; // for optimistic tries, odd while a writer holds it
+        size_t m;   // keys added less keys deleted under the lock, mod 2^n
+    } s;
+
+    char pad[128];  // one lock to a cache line
+} hattrie_stripe_t;
+
+
+struct hattrie_concurrent_t_
+{
+    hattrie_t* T;
+    hattrie_stripe_t stripes[HATTRIE_STRIPES];
+
+    bool optimistic;
+    pthread_key_t readers;  // each thread's reader, for optimistic tries
+};
+
+
+hattrie_concurrent_t* hattrie_concurrent_create()
+{
+    return hattrie_concurrent_create_ex(0);
+}
+
+
+static void hattrie_concurrent_reader_free(void* r)
+{
+    hattrie_reader_free(r);
+}
+
+
+hattrie_concurrent_t* hattrie_concurrent_create_ex(unsigned int flags)
+{
+    hattrie_concurrent_t* C = malloc_or_die(sizeof(hattrie_concurrent_t));
+    C->optimistic = flags & HATTRIE_OPTIMISTIC;
+    C->T = hattrie_create_ex(C->optimistic ? HATTRIE_SHARED : 0);
+    if (C->optimistic) pthread_key_create(&C->readers, hattrie_concurrent_reader_free);
+
+    size_t i;
+    for (i = 0; i < HATTRIE_STRIPES; ++i) {
+        pthread_rwlock_init(&C->stripes[i].s.lock, NULL);
+        C->stripes[i].s.version = 0;
+        C->stripes[i].s.m = 0;
+    }
+    return C;
+}
+
+
+void hattrie_concurrent_free(hattrie_concurrent_t* C)
+{
+    if (C == NULL) return;
+
+    size_t i;
+    for (i = 0; i < HATTRIE_STRIPES; ++i) {
+        pthread_rwlock_destroy(&C->stripes[i].s.lock);
+    }
+
+    /* threads that have not exited still have readers */
+    if (C->optimistic) {
+        pthread_key_delete(C->readers);
+        while (C->T->epochs->readers) hattrie_reader_free(C->T->epochs->readers);
+    }
+
+    hattrie_free(C->T);
+    free(C);
+}
+
+
+static inline hattrie_stripe_t* hattrie_stripe(hattrie_concurrent_t* C,
+                                               const trie_node_t* node)
+{
+    return &C->stripes[(uintptr_t) node / sizeof(trie_node_t) % HATTRIE_STRIPES];
+}
+
+
+/* Enter the epoch of an optimistic trie, through the calling thread's reader,
+ * which is returned for hattrie_concurrent_leave. */
+static hattrie_reader_t* hattrie_concurrent_enter(hattrie_concurrent_t* C)
+{
+    if (!C->optimistic) return NULL;
+
+    hattrie_reader_t* r = pthread_getspecific(C->readers);
+    if (r == NULL) {
+        r = hattrie_reader_create(C->T);
+        pthread_setspecific(C->readers, r);
+    }
+    hattrie_reader_enter(r);
+    return r;
+}
+
+
+static inline void hattrie_concurrent_leave(hattrie_reader_t* r)
+{
+    if (r) hattrie_reader_leave(r);
+}
+
+
+/* The version of a stripe, once no writer holds it. */
+static inline size_t hattrie_version_read(hattrie_stripe_t* s)
+{
+    size_t v;
+    while ((v = __atomic_load_n(&s->s.version, __ATOMIC_ACQUIRE)) & 1) sched_yield();
+    return v;
+}
+
+
+/* Whether nothing read since the version was read can have changed. */
+static inline bool hattrie_version_check(hattrie_stripe_t* s, size_t v)
+{
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(&s->s.version, __ATOMIC_RELAXED) == v;
+}
+
+
+/* Walk down an optimistic trie, without locks, to the trie node whose value,
+ * if the key is consumed on it, or bucket holds the key, returning it and the
+ * version it was read at, having consumed the key up to it, or NULL if a
+ * version changed under the walk. */
+static trie_node_t* hattrie_optimistic_walk(hattrie_concurrent_t* C,
+                                            const char** key, size_t* len,
+                                            size_t* version)
+{
+    trie_node_t* node = hattrie_root(C->T).t;
+    hattrie_stripe_t* s = hattrie_stripe(C, node);
+    size_t v = hattrie_version_read(s);
+    node_ptr child;
+
+    while (*len > 0) {
+        child = hattrie_child(node, (unsigned char) **key);
+        if (!(*child.flag & NODE_TYPE_TRIE)) break;
+        if (!hattrie_version_check(s, v)) return NULL;
+
+        node = child.t;
+        s = hattrie_stripe(C, node);
+        v = hattrie_version_read(s);
+        ++*key;
+        --*len;
+    }
+
+    *version = v;
+    return node;
+}
+
+
+/* Walk down to the trie node whose value, if the key is consumed on it, or
+ * bucket holds the key, and return it locked, having consumed the key up to
+ * it. An optimistic trie is locked only to write. */
+static trie_node_t* hattrie_concurrent_lock(hattrie_concurrent_t* C,
+                                            const char** key, size_t* len,
+                                            bool write)
+{
+    trie_node_t* node;
+    const char* k;
+    size_t l, v;
+
+    if (C->optimistic) {
+        assert(write);
+        while (true) {
+            k = *key;
+            l = *len;
+            node = hattrie_optimistic_walk(C, &k, &l, &v);
+            if (node && __atomic_compare_exchange_n(&hattrie_stripe(C, node)->s.version,
+                                                    &v, v + 1, false,
+                                                    __ATOMIC_ACQUIRE,
+                                                    __ATOMIC_RELAXED)) {
+                *key = k;
+                *len = l;
+                return node;
+            }
+        }
+    }
+
+    node = C->T->root.t;
+    pthread_rwlock_t* lock;
+    node_ptr child;
+
+    while (true) {
+        lock = &hattrie_stripe(C, node)->s.lock;
+        pthread_rwlock_rdlock(lock);
+
+        if (*len > 0) {
+            child = node->xs[(unsigned char) **key];
+            if (*child.flag & NODE_TYPE_TRIE) {
+                pthread_rwlock_unlock(lock);
+                node = child.t;
+                ++*key;
+                --*len;
+                continue;
+            }
+        }
+        if (!write) return node;
+
+        /* Trade the read lock for a write lock. The bucket may have been split
+         * into a trie node in between, in which case the walk goes on. */
+        pthread_rwlock_unlock(lock);
+        pthread_rwlock_wrlock(lock);
+        if (*len == 0 || !(*node->xs[(unsigned char) **key].flag & NODE_TYPE_TRIE)) {
+            return node;
+        }
+        pthread_rwlock_unlock(lock);
+    }
+}
+
+
+static inline void hattrie_concurrent_unlock(hattrie_concurrent_t* C,
+                                             const trie_node_t* node)
+{
+    if (C->optimistic) {
+        __atomic_fetch_add(&hattrie_stripe(C, node)->s.version, 1, __ATOMIC_RELEASE);
+    }
+    else pthread_rwlock_unlock(&hattrie_stripe(C, node)->s.lock);
+}
+
+
+/* Find or insert a key below a node locked for writing. In an optimistic trie,
+ * other walks may go into nodes a split makes as soon as they are published,
+ * so a full bucket is split alone, and NULL returned for the caller to start
+ * over. */
+static value_t* hattrie_concurrent_insert(hattrie_concurrent_t* C, trie_node_t* node,
+                                          const char* key, size_t len)
+{
+    hattrie_t U = *C->T;
+    U.m = 0;
+
+    node_ptr parent;
+    parent.t = node;
+
+    if (C->optimistic && len > 0) {
+        node_ptr child = node->xs[(unsigned char) *key];
+        if (ahtable_size(child.b) >= MAX_BUCKET_SIZE) {
+            hattrie_split(&U, parent, child);
+            return NULL;
+        }
+    }
+
+    bool inserted;
+    value_t* val = hattrie_insert_at(&U, parent, key, len, &inserted);
+    __atomic_fetch_add(&hattrie_stripe(C, node)->s.m, U.m, __ATOMIC_RELAXED);
+    return val;
+}
+
+
+/* The value of a key below a node, which is locked or whose version is read. */
+static value_t* hattrie_concurrent_find(trie_node_t* node, const char* key, size_t len)
+{
+    if (len == 0) return hattrie_has_val(node) ? &node->val : NULL;
+
+    node_ptr child = hattrie_child(node, (unsigned char) *key);
+    if (*child.flag & NODE_TYPE_PURE_BUCKET) {
+        return ahtable_tryget(child.b, key + 1, len - 1);
+    }
+    return ahtable_tryget(child.b, key, len);
+}
+
+
+bool hattrie_concurrent_tryget(hattrie_concurrent_t* C, const char* key, size_t len,
+                               value_t* val)
+{
+    trie_node_t* node;
+    value_t* u;
+
+    if (C->optimistic) {
+        hattrie_reader_t* r = hattrie_concurrent_enter(C);
+        const char* k;
+        size_t l, v;
+        u = NULL;
+        do {
+            k = key;
+            l = len;
+            node = hattrie_optimistic_walk(C, &k, &l, &v);
+            if (node == NULL) continue;
+            u = hattrie_concurrent_find(node, k, l);
+            if (u) *val = __atomic_load_n(u, __ATOMIC_RELAXED);
+        } while (node == NULL || !hattrie_version_check(hattrie_stripe(C, node), v));
+        hattrie_concurrent_leave(r);
+        return u != NULL;
+    }
+
+    node = hattrie_concurrent_lock(C, &key, &len, false);
+    u = hattrie_concurrent_find(node, key, len);
+    if (u) *val = *u;
+    hattrie_concurrent_unlock(C, node);
+    return u != NULL;
+}
+
+
+void hattrie_concurrent_set(hattrie_concurrent_t* C, const char* key, size_t len,
+                            value_t val)
+{
+    hattrie_reader_t* r = hattrie_concurrent_enter(C);
+    trie_node_t* node;
+    value_t* u;
+    const char* k;
+    size_t l;
+
+    do {
+        k = key;
+        l = len;
+        node = hattrie_concurrent_lock(C, &k, &l, true);
+        u = hattrie_concurrent_insert(C, node, k, l);
+        if (u) __atomic_store_n(u, val, __ATOMIC_RELAXED);
+        hattrie_concurrent_unlock(C, node);
+    } while (u == NULL);
+
+    hattrie_concurrent_leave(r);
+}
+
+
+value_t hattrie_concurrent_add(hattrie_concurrent_t* C, const char* key, size_t len,
+                               value_t delta)
+{
+    hattrie_reader_t* r = hattrie_concurrent_enter(C);
+    trie_node_t* node;
+    value_t* u;
+    value_t val = 0;
+    const char* k;
+    size_t l;
+
+    do {
+        k = key;
+        l = len;
+        node = hattrie_concurrent_lock(C, &k, &l, true);
+        u = hattrie_concurrent_insert(C, node, k, l);
+        if (u) {
+            val = *u + delta;
+            __atomic_store_n(u, val, __ATOMIC_RELAXED);
+        }
+        hattrie_concurrent_unlock(C, node);
+    } while (u == NULL);
+
+    hattrie_concurrent_leave(r);
+    return val;
+}
+
+
+int hattrie_concurrent_del(hattrie_concurrent_t* C, const char* key, size_t len)
+{
+    hattrie_reader_t* r = hattrie_concurrent_enter(C);
+    trie_node_t* node = hattrie_concurrent_lock(C, &key, &len, true);
+    int ret = -1;
+
+    if (len == 0) {
+        node_ptr n;
+        n.t = node;
+        hattrie_t U = *C->T;
+        ret = hattrie_clrval(&U, n);
+    }
+    else {
+        node_ptr child = node->xs[(unsigned char) *key];
+        if (*child.flag & NODE_TYPE_PURE_BUCKET) {
+            ret = ahtable_del(child.b, key + 1, len - 1);
+        }
+        else {
+            ret = ahtable_del(child.b, key, len);
+        }
+    }
+
+    if (ret == 0) __atomic_fetch_sub(&hattrie_stripe(C, node)->s.m, 1, __ATOMIC_RELAXED);
+    hattrie_concurrent_unlock(C, node);
+    hattrie_concurrent_leave(r);
+    return ret;
+}
+
+
+size_t hattrie_concurrent_size(hattrie_concurrent_t* C)
+{
+    size_t i, m = 0;
+    for (i = 0; i < HATTRIE_STRIPES; ++i) {
+        if (C->optimistic) {
+            m += __atomic_load_n(&C->stripes[i].s.m, __ATOMIC_RELAXED);
+            continue;
+        }
+        pthread_rwlock_rdlock(&C->stripes[i].s.lock);
+        m += C->stripes[i].s.m;
+        pthread_rwlock_unlock(&C->stripes[i].s.lock);
+    }
+    return m;
+}
+
+
+hattrie_t* hattrie_concurrent_trie(hattrie_concurrent_t* C)
+{
+    C->T->m = hattrie_concurrent_size(C);
+    ++C->T->generation;
+    return C->T;
+}
+
+
+/* Number of keys stored under a node, which is kept on trie nodes of counted
+ * tries and otherwise summed over the subtree. */
+static size_t hattrie_node_count(const hattrie_t* T, node_ptr node)
+{
+    if (!(*node.flag & NODE_TYPE_TRIE)) return ahtable_size(node.b);
+    if (T->flags & HATTRIE_COUNTS) return node.t->n;
+
+    size_t count = node.t->flag & NODE_HAS_VAL ? 1 : 0;
+    size_t j;
+    for (j = 0; j < NODE_CHILDS; ++j) {
+        if (j > 0 && node.t->xs[j].t == node.t->xs[j - 1].t) continue;
+        count += hattrie_node_count(T, node.t->xs[j]);
+    }
+    return count;
+}
+
+
+/* The keys beginning with a prefix are those up to, but excluding, the prefix
+ * with its last byte that is not NODE_MAXCHAR incremented and the rest
+ * dropped, which is written to end. Without such a byte there is no upper
+ * bound, and 0 is returned. */
+static size_t hattrie_prefix_end(const char* prefix, size_t len, char* end)
+{
+    memcpy(end, prefix, len);
+    while (len > 0 && (unsigned char) end[len - 1] == NODE_MAXCHAR) --len;
+    if (len > 0) ++end[len - 1];
+    return len;
+}
+
+
+size_t hattrie_count_prefix(const hattrie_t* T, const char* prefix, size_t len)
+{
+    node_ptr node = T->root;
+    node_ptr child = node;
+
+    while (len > 0) {
+        child = node.t->xs[(unsigned char) *prefix];
+        if (!(*child.flag & NODE_TYPE_TRIE)) break;
+        node = child;
+        ++prefix;
+        --len;
+    }
+
+    if (len == 0) return hattrie_node_count(T, node);
+
+    /* the rest of the prefix is matched against the keys in a bucket */
+    if (*child.flag & NODE_TYPE_PURE_BUCKET) {
+        ++prefix;
+        --len;
+    }
+
+    if (len == 0) return ahtable_size(child.b);
+
+    char* end = malloc_or_die(len);
+    size_t end_len = hattrie_prefix_end(prefix, len, end);
+    size_t count = ahtable_count_range(child.b, prefix, len,
+                                       end_len > 0 ? end : NULL, end_len);
+    free(end);
+    return count;
+}
+
+
+hattrie_aggregate_t hattrie_aggregate_prefix(const hattrie_t* T,
+                                             const char* prefix, size_t len)
+{
+    hattrie_aggregate_t a;
+    a.count = 0;
+    a.sum = a.min = a.max = 0;
+
+    node_ptr node = T->root;
+    node_ptr child;
+    size_t depth = 0;
+
+    if ((T->flags & HATTRIE_AGGREGATES) == HATTRIE_AGGREGATES) {
+        while (depth < len) {
+            child = node.t->xs[(unsigned char) prefix[depth]];
+            if (!(*child.flag & NODE_TYPE_TRIE)) break;
+            node = child;
+            ++depth;
+        }
+
+        /* the prefix ends on a trie node, which summarizes its keys */
+        if (depth == len) {
+            a.count = node.t->n;
+            a.sum   = node.t->sum;
+            if (a.count > 0) {
+                a.min = node.t->min;
+                a.max = node.t->max;
+            }
+            return a;
+        }
+    }
+
+    /* otherwise the keys are visited, which for a prefix ending in a bucket is
+     * one pass over the bucket */
+    hattrie_iter_t* i = hattrie_iter_begin_with_prefix(T, false, prefix, len);
+    value_t val;
+    while (!hattrie_iter_finished(i)) {
+        val = *hattrie_iter_val(i);
+        if (a.count == 0 || val < a.min) a.min = val;
+        if (a.count == 0 || val > a.max) a.max = val;
+        a.sum += val;
+        ++a.count;
+        hattrie_iter_next(i);
+    }
+    hattrie_iter_free(i);
+
+    return a;
+}
+
+
+size_t hattrie_rank(const hattrie_t* T, const char* key, size_t len)
+{
+    node_ptr node = T->root;
+    node_ptr child;
+    size_t rank = 0;
+    unsigned int c, j;
+
+    while (len > 0) {
+        /* a key ending on this node is a proper prefix of the key */
+        if (node.t->flag & NODE_HAS_VAL) ++rank;
+
+        /* as are the keys under children for smaller bytes, but for a hybrid
+         * bucket that also holds keys for c */
+        c = (unsigned char) *key;
+        child = node.t->xs[c];
+        for (j = 0; j < c; ++j) {
+            if (node.t->xs[j].t == child.t) break;
+            if (j > 0 && node.t->xs[j].t == node.t->xs[j - 1].t) continue;
+            rank += hattrie_node_count(T, node.t->xs[j]);
+        }
+
+        if (*child.flag & NODE_TYPE_TRIE) {
+            node = child;
+            ++key;
+            --len;
+        }
+        else if (*child.flag & NODE_TYPE_PURE_BUCKET) {
+            return rank + ahtable_count_range(child.b, NULL, 0, key + 1, len - 1);
+        }
+        else {
+            return rank + ahtable_count_range(child.b, NULL, 0, key, len);
+        }
+    }
+
+    return rank;
+}
+
+
+hattrie_iter_t* hattrie_select(const hattrie_t* T, size_t k)
+{
+    if (k >= T->m) return NULL;
+
+    size_t keysize = 16, level = 0;
+    char* key = malloc_or_die(keysize);
+    node_ptr node = T->root;
+    node_ptr child;
+    const char* suffix = NULL;
+    size_t suffix_len = 0, count;
+    unsigned int j;
+
+    /* descend to the node or bucket holding the key, skipping past the keys
+     * that precede it */
+    while (true) {
+        if (node.t->flag & NODE_HAS_VAL) {
+            if (k == 0) break;
+            --k;
+        }
+
+        for (j = 0; j < NODE_CHILDS; ++j) {
+            child = node.t->xs[j];
+            if (j > 0 && child.t == node.t->xs[j - 1].t) continue;
+            count = hattrie_node_count(T, child);
+            if (k < count) break;
+            k -= count;
+        }
+        assert(j < NODE_CHILDS);
+
+        if (level + 1 > keysize) {
+            keysize *= 2;
+            key = realloc_or_die(key, keysize);
+        }
+
+        if (*child.flag & NODE_TYPE_TRIE) {
+            key[level++] = (char) j;
+            node = child;
+            continue;
+        }
+
+        /* a hybrid bucket's keys are ordered among themselves as in the trie */
+        if (*child.flag & NODE_TYPE_PURE_BUCKET) key[level++] = (char) j;
+        suffix = ahtable_select(child.b, k, &suffix_len, NULL);
+        break;
+    }
+
+    if (level + suffix_len > keysize) {
+        keysize = level + suffix_len;
+        key = realloc_or_die(key, keysize);
+    }
+    if (suffix_len > 0) memcpy(key + level, suffix, suffix_len);
+
+    hattrie_iter_t* i = hattrie_iter_begin_range(T, key, level + suffix_len, NULL, 0);
+    free(key);
+    return i;
+}
+
+
+/* Top-k search:
+ * Subtrees are visited best first, in order of the largest value they hold,
+ * while the k best keys found so far are kept in a min-heap. The search ends
+ * once no unvisited subtree holds a value greater than the k-th best, so with
+ * maxima kept only the few buckets holding the best values are scanned. */
+
+typedef struct hattrie_topk_node_t_
+{
+    node_ptr node;
+    value_t max;
+    char* path;     // bytes leading to the node
+    size_t len;
+} hattrie_topk_node_t;
+
+
+typedef struct hattrie_topk_t_
+{
+    /* subtrees yet to be visited, a max-heap by max */
+    hattrie_topk_node_t* frontier;
+    size_t frontier_n, frontier_size;
+
+    /* best keys found, a min-heap by value of at most k entries */
+    hattrie_entry_t* best;
+    size_t n, k;
+} hattrie_topk_t;
+
+
+static void hattrie_topk_push(hattrie_topk_t* s, node_ptr node, value_t max,
+                              const char* path, size_t len)
+{
+    if (s->frontier_n == s->frontier_size) {
+        s->frontier_size *= 2;
+        s->frontier = realloc_or_die(s->frontier,
+                                     s->frontier_size * sizeof(hattrie_topk_node_t));
+    }
+
+    hattrie_topk_node_t u;
+    u.node = node;
+    u.max  = max;
+    u.len  = len;
+    u.path = malloc_or_die(len + 1);
+    memcpy(u.path, path, len);
+
+    size_t i = s->frontier_n++, p;
+    while (i > 0) {
+        p = (i - 1) / 2;
+        if (s->frontier[p].max >= max) break;
+        s->frontier[i] = s->frontier[p];
+        i = p;
+    }
+    s->frontier[i] = u;
+}
+
+
+static hattrie_topk_node_t hattrie_topk_pop(hattrie_topk_t* s)
+{
+    hattrie_topk_node_t top = s->frontier[0];
+    hattrie_topk_node_t u = s->frontier[--s->frontier_n];
+    size_t i = 0, c;
+    while ((c = 2 * i + 1) < s->frontier_n) {
+        if (c + 1 < s->frontier_n && s->frontier[c + 1].max > s->frontier[c].max) ++c;
+        if (u.max >= s->frontier[c].max) break;
+        s->frontier[i] = s->frontier[c];
+        i = c;
+    }
+    s->frontier[i] = u;
+    return top;
+}
+
+
+/* Whether a value would enter the k best. */
+static inline bool hattrie_topk_wants(const hattrie_topk_t* s, value_t val)
+{
+    return s->n < s->k || val > s->best[0].val;
+}
+
+
+/* Offer a key, made of a path and a suffix, to the k best. */
+static void hattrie_topk_offer(hattrie_topk_t* s, const char* path, size_t len,
+                               const char* suffix, size_t suffix_len, value_t val)
+{
+    if (!hattrie_topk_wants(s, val)) return;
+
+    hattrie_entry_t e;
+    size_t i, c;
+
+    if (s->n == s->k) {
+        /* replace the least of the best, reusing its key if large enough */
+        e = s->best[0];
+        if (e.len < len + suffix_len) e.key = realloc_or_die(e.key, len + suffix_len + 1);
+        i = 0;
+        while ((c = 2 * i + 1) < s->n) {
+            if (c + 1 < s->n && s->best[c + 1].val < s->best[c].val) ++c;
+            if (val <= s->best[c].val) break;
+            s->best[i] = s->best[c];
+            i = c;
+        }
+    }
+    else {
+        e.key = malloc_or_die(len + suffix_len + 1);
+        i = s->n++;
+        while (i > 0 && s->best[(i - 1) / 2].val > val) {
+            s->best[i] = s->best[(i - 1) / 2];
+            i = (i - 1) / 2;
+        }
+    }
+
+    memcpy(e.key, path, len);
+    if (suffix_len > 0) memcpy(e.key + len, suffix, suffix_len);
+    e.key[len + suffix_len] = '\0';
+    e.len = len + suffix_len;
+    e.val = val;
+    s->best[i] = e;
+}
+
+
+/* Offer every key of a bucket in [lo, hi) to the k best. */
+static void hattrie_topk_bucket(hattrie_topk_t* s, ahtable_t* b,
+                                const char* path, size_t len,
+                                const char* lo, size_t lo_len,
+                                const char* hi, size_t hi_len)
+{
+    ahtable_iter_t* i = lo || hi ? ahtable_iter_begin_range(b, false, lo, lo_len, hi, hi_len)
+                                 : ahtable_iter_begin(b, false);
+    const char* key;
+    size_t key_len;
+    value_t val;
+
+    while (!ahtable_iter_finished(i)) {
+        val = *ahtable_iter_val(i);
+        if (hattrie_topk_wants(s, val)) {
+            key = ahtable_iter_key(i, &key_len);
+            hattrie_topk_offer(s, path, len, key, key_len, val);
+        }
+        ahtable_iter_next(i);
+    }
+    ahtable_iter_free(i);
+}
+
+
+static int hattrie_entry_cmp(const void* a_, const void* b_)
+{
+    const hattrie_entry_t* a = a_;
+    const hattrie_entry_t* b = b_;
+    return (a->val < b->val) - (a->val > b->val);
+}
+
+
+size_t hattrie_topk_prefix(hattrie_t* T, const char* prefix, size_t len,
+                           size_t k, hattrie_entry_t* out)
+{
+    if (k == 0) return 0;
+
+    hattrie_topk_t s;
+    s.frontier_n = 0;
+    s.frontier_size = 64;
+    s.frontier = malloc_or_die(s.frontier_size * sizeof(hattrie_topk_node_t));
+    s.best = out;
+    s.n = 0;
+    s.k = k;
+
+    /* follow the prefix down the trie */
+    node_ptr node = T->root;
+    node_ptr child = node;
+    size_t depth = 0;
+    while (depth < len) {
+        child = node.t->xs[(unsigned char) prefix[depth]];
+        if (!(*child.flag & NODE_TYPE_TRIE)) break;
+        node = child;
+        ++depth;
+    }
+
+    if (depth == len) {
+        hattrie_topk_push(&s, node, hattrie_node_max(T, node), prefix, len);
+    }
+    else {
+        /* the prefix ends inside a bucket, which holds every match */
+        size_t path_len = *child.flag & NODE_TYPE_PURE_BUCKET ? depth + 1 : depth;
+        size_t rest = len - path_len;
+        char* hi = malloc_or_die(rest + 1);
+        size_t hi_len = hattrie_prefix_end(prefix + path_len, rest, hi);
+
+        hattrie_topk_bucket(&s, child.b, prefix, path_len,
+                            rest > 0 ? prefix + path_len : NULL, rest,
+                            hi_len > 0 ? hi : NULL, hi_len);
+        free(hi);
+    }
+
+    hattrie_topk_node_t u;
+    unsigned int j;
+    while (s.frontier_n > 0) {
+        u = hattrie_topk_pop(&s);
+
+        /* nothing left can beat the k-th best */
+        if (!hattrie_topk_wants(&s, u.max)) {
+            free(u.path);
+            break;
+        }
+
+        if (*u.node.flag & NODE_TYPE_TRIE) {
+            if (u.node.t->flag & NODE_HAS_VAL) {
+                hattrie_topk_offer(&s, u.path, u.len, NULL, 0, u.node.t->val);
+            }
+
+            u.path = realloc_or_die(u.path, u.len + 2);
+            for (j = 0; j < NODE_CHILDS; ++j) {
+                child = u.node.t->xs[j];
+                if (j > 0 && child.t == u.node.t->xs[j - 1].t) continue;
+                if (!hattrie_topk_wants(&s, hattrie_node_max(T, child))) continue;
+
+                /* a hybrid bucket stores the byte with each key */
+                u.path[u.len] = (char) j;
+                hattrie_topk_push(&s, child, hattrie_node_max(T, child), u.path,
+                                  *child.flag & NODE_TYPE_HYBRID_BUCKET ? u.len : u.len + 1);
+            }
+        }
+        else {
+            hattrie_topk_bucket(&s, u.node.b, u.path, u.len, NULL, 0, NULL, 0);
+        }
+
+        free(u.path);
+    }
+
+    while (s.frontier_n > 0) free(hattrie_topk_pop(&s).path);
+    free(s.frontier);
+
+    qsort(out, s.n, sizeof(hattrie_entry_t), hattrie_entry_cmp);
+    return s.n;
+}
+
+
+/* Walk the trie along key, calling fn with the length and value of each
+ * stored key that is a prefix of it, shortest first, until fn returns nonzero.
+ * Trie nodes on the path are checked as they are consumed. In the bucket that
+ * ends the path only suffix lengths the bucket may hold are probed.
+ *
+ * If longest is set, fn is called only for the longest such key, so the bucket
+ * is probed longest first and trie node values are held back until the bucket
+ * has none. Returns the last value of fn. */
+static int hattrie_walk_prefixes(hattrie_t* T, const char* key, size_t len,
+                                 bool longest, hattrie_prefix_fn fn, void* ctx)
+{
+    node_ptr node = T->root;
+    node_ptr child;
+    size_t depth = 0;
+    value_t* val;
+    int ret;
+
+    value_t* best = NULL;
+    size_t best_len = 0;
+
+    if (node.t->flag & NODE_HAS_VAL) {
+        best = &node.t->val;
+        if (!longest && (ret = fn(0, best, ctx))) return ret;
+    }
+
+    while (depth < len) {
+        child = node.t->xs[(unsigned char) key[depth]];
+
+        if (!(*child.flag & NODE_TYPE_TRIE)) {
+            /* a pure bucket stores what follows its character, including
+             * the empty suffix, and a hybrid bucket stores non-empty keys */
+            bool pure = *child.flag & NODE_TYPE_PURE_BUCKET;
+            size_t off = depth + (pure ? 1 : 0);
+            size_t k0 = pure ? 0 : 1;
+            size_t k1 = len - off;
+            size_t k, j;
+
+            for (k = k0; k <= k1; ++k) {
+                j = longest ? k1 - (k - k0) : k;
+                if (!ahtable_has_len(child.b, j)) continue;
+                val = ahtable_tryget(child.b, key + off, j);
+                if (val == NULL) continue;
+                if (longest) return fn(off + j, val, ctx);
+                if ((ret = fn(off + j, val, ctx))) return ret;
+            }
+            break;
+        }
+
+        node = child;
+        ++depth;
+        if (node.t->flag & NODE_HAS_VAL) {
+            best = &node.t->val;
+            best_len = depth;
+            if (!longest && (ret = fn(depth, best, ctx))) return ret;
+        }
+    }
+
+    if (longest && best) return fn(best_len, best, ctx);
+    return 0;
+}
+
+
+void hattrie_prefixes(hattrie_t* T, const char* key, size_t len,
+                      hattrie_prefix_fn fn, void* ctx)
+{
+    hattrie_walk_prefixes(T, key, len, false, fn, ctx);
+}
+
+
+typedef struct hattrie_match_t_
+{
+    size_t   len;
+    value_t* val;
+} hattrie_match_t;
+
+
+static int hattrie_match_set(size_t len, value_t* val, void* ctx)
+{
+    hattrie_match_t* m = ctx;
+    m->len = len;
+    m->val = val;
+    return 1;
+}
+
+
+value_t* hattrie_longest_prefix(hattrie_t* T, const char* key, size_t len,
+                                size_t* matched_len)
+{
+    hattrie_match_t m = { 0, NULL };
+    hattrie_walk_prefixes(T, key, len, true, hattrie_match_set, &m);
+    if (m.val && matched_len) *matched_len = m.len;
+    return m.val;
+}
+
+
+/* plan for iteration:
+ * This is tricky, as we have no parent pointers currently, and I would like to
+ * avoid adding them. That means maintaining a stack
+ *
+ */
+
+typedef struct hattrie_node_stack_t_
+{
+    /* the run of bytes along which the node's parent points to it */
+    unsigned char   c;
+    unsigned char   last;
+    size_t level;
+
+    /* In descending order a trie node's own key follows its children, so it
+     * is pushed separately, with val set, beneath them. */
+    bool val;
+
+    /* state of the pattern after the node's path, when iterating by pattern */
+    uint32_t state;
+
+    node_ptr node;
+    struct hattrie_node_stack_t_* next;
+
+} hattrie_node_stack_t;
+
+
+struct hattrie_iter_t_
+{
+    char* key;
+    size_t keysize; // space reserved for the key
+    size_t level;
+
+    /* leading bytes of every key that are not reported by hattrie_iter_key */
+    size_t prefixsize;
+
+    /* only keys lo <= key < hi are visited, where a NULL bound is open */
+    char* lo;
+    size_t lo_len;
+    char* hi;
+    size_t hi_len;
+
+    /* the bounds the iterator began with, which hattrie_iter_seek may move
+     * lo (or, in descending order, hi) inside of */
+    char* begin;
+    size_t begin_len;
+    char* end;
+    size_t end_len;
+
+    /* keep track of keys stored in trie nodes */
+    bool    has_nil_key;
+    value_t nil_val;
+
+    /* only keys matching the pattern are visited, when it is not NULL */
+    hattrie_pattern_t* pattern;
+    uint32_t state; // state of the pattern after the current bucket's path
+
+    const hattrie_t* T;
+    bool sorted;
+    bool reverse;
+    ahtable_iter_t* i;
+    hattrie_node_stack_t* stack;
+};
+
+
+static void hattrie_iter_push(hattrie_iter_t* i, node_ptr node, size_t level,
+                              unsigned char c, unsigned char last, bool val,
+                              uint32_t state)
+{
+    hattrie_node_stack_t* next = i->stack;
+    i->stack = malloc_or_die(sizeof(hattrie_node_stack_t));
+    i->stack->node  = node;
+    i->stack->next  = next;
+    i->stack->level = level;
+    i->stack->c     = c;
+    i->stack->last  = last;
+    i->stack->val   = val;
+    i->stack->state = state;
+}
+
+
+/* The state of the pattern for the child of a trie node along byte c, or
+ * HATTRIE_PATTERN_DEAD if no key in the child can match. A hybrid bucket holds
+ * keys for a run of bytes, of which any may match, and since it stores the
+ * byte with each key, its keys are matched from the parent's state. */
+static uint32_t hattrie_iter_childstate(hattrie_iter_t* i, node_ptr child,
+                                        uint32_t state, unsigned char c)
+{
+    if (i->pattern == NULL) return state;
+
+    if (*child.flag & NODE_TYPE_HYBRID_BUCKET) {
+        int j;
+        for (j = child.b->c0; j <= child.b->c1; ++j) {
+            if (hattrie_pattern_step(i->pattern, state, (unsigned char) j) !=
+                HATTRIE_PATTERN_DEAD) return state;
+        }
+        return HATTRIE_PATTERN_DEAD;
+    }
+
+    return hattrie_pattern_step(i->pattern, state, c);
+}
+
+
+static void hattrie_iter_pushchar(hattrie_iter_t* i, size_t level, char c)
+{
+    if (i->keysize < level) {
+        i->keysize *= 2;
+        i->key = realloc_or_die(i->key, i->keysize * sizeof(char));
+    }
+
+    if (level > 0) {
+        i->key[level - 1] = c;
+    }
+
+    i->level = level;
+}
+
+
+/* Compare the keys beginning with path to a bound. Returns a negative number
+ * if every such key is less than the bound, a positive number if every such
+ * key is greater than or equal to it, and zero if the path is a proper prefix
+ * of the bound, so that the bound splits the keys. */
+static int hattrie_iter_cmpbound(const char* path, size_t len,
+                                 const char* bound, size_t bound_len)
+{
+    int c = memcmp(path, bound, len < bound_len ? len : bound_len);
+    if (c != 0) return c;
+    return len >= bound_len ? 1 : 0;
+}
+
+
+static void hattrie_iter_nextnode(hattrie_iter_t* i)
+{
+    if (i->stack == NULL) return;
+
+    /* pop the stack */
+    node_ptr node;
+    hattrie_node_stack_t* next;
+    unsigned char   c;
+    size_t level;
+    uint32_t state, child_state;
+
+    node  = i->stack->node;
+    next  = i->stack->next;
+    c     = i->stack->c;
+    unsigned char last = i->stack->last;
+    level = i->stack->level;
+    state = i->stack->state;
+    bool val = i->stack->val;
+
+    free(i->stack);
+    i->stack = next;
+
+    if (val) {
+        hattrie_iter_pushchar(i, level, c);
+        i->has_nil_key = true;
+        i->nil_val = node.t->val;
+    }
+    else if (*node.flag & NODE_TYPE_TRIE) {
+        hattrie_iter_pushchar(i, level, c);
+
+        /* prune subtrees that lie entirely outside the range */
+        int lo_cmp = i->lo ? hattrie_iter_cmpbound(i->key, level, i->lo, i->lo_len) : 1;
+        int hi_cmp = i->hi ? hattrie_iter_cmpbound(i->key, level, i->hi, i->hi_len) : -1;
+        if (lo_cmp < 0 || hi_cmp > 0) return;
+
+        /* if lo extends this key, this key is less than lo */
+        bool has_val = hattrie_has_val(node.t) && lo_cmp > 0;
+        if (i->pattern) has_val = has_val && hattrie_pattern_accepts(i->pattern, state);
+
+        /* a bound that splits the subtree also limits the children */
+        int j0 = lo_cmp == 0 ? (unsigned char) i->lo[level] : 0;
+        int j1 = hi_cmp == 0 ? (unsigned char) i->hi[level] : NODE_MAXCHAR;
+        int j, k;
+
+        /* read the children once, since in a shared trie they may change */
+        node_ptr xs[NODE_CHILDS];
+        for (j = j0; j <= j1; ++j) xs[j] = hattrie_child(node.t, j);
+
+        if (i->reverse) {
+            if (has_val) hattrie_iter_push(i, node, level, c, c, true, state);
+
+            /* push all child nodes from left to right */
+            for (j = j0; j <= j1; j = k + 1) {
+
+                /* skip repeated pointers to hybrid bucket */
+                for (k = j; k < j1 && xs[k + 1].t == xs[j].t; ++k);
+
+                child_state = hattrie_iter_childstate(i, xs[j], state, j);
+                if (i->pattern && child_state == HATTRIE_PATTERN_DEAD) continue;
+
+                hattrie_iter_push(i, xs[j], level + 1, (unsigned char) j,
+                                  (unsigned char) k, false, child_state);
+            }
+            return;
+        }
+
+        if (has_val) {
+            i->has_nil_key = true;
+            i->nil_val = node.t->val;
+        }
+
+        /* push all child nodes from right to left */
+        for (k = j1; k >= j0; k = j - 1) {
+
+            /* skip repeated pointers to hybrid bucket */
+            for (j = k; j > j0 && xs[j - 1].t == xs[k].t; --j);
+
+            child_state = hattrie_iter_childstate(i, xs[j], state, j);
+            if (i->pattern && child_state == HATTRIE_PATTERN_DEAD) continue;
+
+            // push stack
+            hattrie_iter_push(i, xs[j], level + 1, (unsigned char) j,
+                              (unsigned char) k, false, child_state);
+        }
+    }
+    else {
+        if (*node.flag & NODE_TYPE_PURE_BUCKET) {
+            hattrie_iter_pushchar(i, level, c);
+        }
+        else {
+            i->level = level - 1;
+        }
+        i->state = state;
+
+        /* bounds that split the bucket apply to the suffixes it stores */
+        const char* lo = NULL;
+        const char* hi = NULL;
+        size_t lo_len = 0, hi_len = 0;
+        int cmp;
+
+        if (i->lo) {
+            cmp = hattrie_iter_cmpbound(i->key, i->level, i->lo, i->lo_len);
+            if (cmp < 0) return;
+            if (cmp == 0) {
+                lo     = i->lo + i->level;
+                lo_len = i->lo_len - i->level;
+            }
+        }
+
+        if (i->hi) {
+            cmp = hattrie_iter_cmpbound(i->key, i->level, i->hi, i->hi_len);
+            if (cmp > 0) return;
+            if (cmp == 0) {
+                hi     = i->hi + i->level;
+                hi_len = i->hi_len - i->level;
+            }
+        }
+
+        /* While a shared trie's hybrid bucket is being split, its parent
+         * points to it along only part of its bytes, the rest already
+         * pointing to its replacements, so only its keys beginning with the
+         * run of bytes it was reached by are visited. */
+        char first_byte = c, end_byte = last + 1;
+        if (i->T->epochs && *node.flag & NODE_TYPE_HYBRID_BUCKET) {
+            if (c > node.b->c0 && (lo == NULL || lo_len == 0 ||
+                                   (unsigned char) lo[0] < c)) {
+                lo     = &first_byte;
+                lo_len = 1;
+            }
+            if (last < node.b->c1 && (hi == NULL || (hi_len > 0 &&
+                                      (unsigned char) hi[0] > last))) {
+                hi     = &end_byte;
+                hi_len = 1;
+            }
+        }
+
+        if (i->reverse) {
+            i->i = ahtable_iter_begin_range_reverse(node.b, lo, lo_len, hi, hi_len);
+        }
+        else if (lo || hi) {
+            i->i = ahtable_iter_begin_range(node.b, i->sorted, lo, lo_len, hi, hi_len);
+        }
+        else {
+            i->i = ahtable_iter_begin(node.b, i->sorted);
+        }
+    }
+}
+
+
+static inline bool hattrie_ahtable_iter_finished(ahtable_iter_t* i)
+{
+    return i == NULL || ahtable_iter_finished(i);
+}
+
+
+/* Skip keys in the current bucket that do not match the pattern. */
+static void hattrie_iter_match(hattrie_iter_t* i)
+{
+    const char* key;
+    size_t len;
+    uint32_t state;
+
+    while (!hattrie_ahtable_iter_finished(i->i)) {
+        key = ahtable_iter_key(i->i, &len);
+        state = hattrie_pattern_run(i->pattern, i->state, key, len);
+        if (hattrie_pattern_accepts(i->pattern, state)) break;
+        ahtable_iter_next(i->i);
+    }
+}
+
+
+void hattrie_iter_continue(hattrie_iter_t* i)
+{
+    while (true) {
+        if (i->pattern) hattrie_iter_match(i);
+
+        if (!hattrie_ahtable_iter_finished(i->i) ||
+            i->has_nil_key ||
+            i->stack == NULL) break;
+
+        ahtable_iter_free(i->i);
+        i->i = NULL;
+        hattrie_iter_nextnode(i);
+    }
+
+    if (hattrie_ahtable_iter_finished(i->i)) {
+        ahtable_iter_free(i->i);
+        i->i = NULL;
+    }
+}
+
+
+static char* hattrie_iter_dupbound(const char* bound, size_t len)
+{
+    if (bound == NULL) return NULL;
+    char* dup = malloc_or_die((len + 1) * sizeof(char));
+    memcpy(dup, bound, len);
+    return dup;
+}
+
+
+/* Position the iterator at the first key in range. Every key in range shares
+ * its leading bytes with lo, so the search starts from the deepest trie node
+ * along that path, rather than the root. */
+static void hattrie_iter_start(hattrie_iter_t* i)
+{
+    hattrie_node_stack_t* next;
+    while (i->stack) {
+        next = i->stack->next;
+        free(i->stack);
+        i->stack = next;
+    }
+
+    ahtable_iter_free(i->i);
+    i->i = NULL;
+    i->has_nil_key = false;
+    i->nil_val     = 0;
+
+    /* keys between two bounds share their common prefix */
+    size_t shared = 0;
+    if (i->lo && i->hi) {
+        while (shared < i->lo_len && shared < i->hi_len &&
+               i->lo[shared] == i->hi[shared]) ++shared;
+    }
+    if (shared < i->prefixsize) shared = i->prefixsize;
+
+    if (i->keysize < shared) {
+        while (i->keysize < shared) i->keysize *= 2;
+        i->key = realloc_or_die(i->key, i->keysize * sizeof(char));
+    }
+
+    node_ptr start = hattrie_root(i->T);
+    size_t level = 0;
+    node_ptr child;
+    while (level < shared) {
+        child = hattrie_child(start.t, (unsigned char) i->lo[level]);
+        if (!(*child.flag & NODE_TYPE_TRIE)) break;
+        start = child;
+        ++level;
+    }
+    memcpy(i->key, i->lo, level);
+
+    uint32_t state = 0;
+    if (i->pattern) {
+        state = hattrie_pattern_run(i->pattern, hattrie_pattern_start(i->pattern),
+                                    i->key, level);
+    }
+
+    unsigned char c = level > 0 ? i->lo[level - 1] : '\0';
+    hattrie_iter_push(i, start, level, c, c, false, state);
+
+    hattrie_iter_continue(i);
+}
+
+
+/* Begin iterating through keys lo <= key < hi, omitting the first prefixsize
+ * bytes, which every key in range shares, when reporting keys. */
+static hattrie_iter_t* hattrie_iter_begin_range_(const hattrie_t* T,
+                                                 bool sorted, bool reverse,
+                                                 const char* lo, size_t lo_len,
+                                                 const char* hi, size_t hi_len,
+                                                 size_t prefixsize,
+                                                 hattrie_pattern_t* pattern)
+{
+    hattrie_iter_t* i = malloc_or_die(sizeof(hattrie_iter_t));
+    i->T       = T;
+    i->sorted  = sorted || reverse;
+    i->reverse = reverse;
+    i->i       = NULL;
+    i->stack   = NULL;
+    i->keysize = 16;
+    i->key     = malloc_or_die(i->keysize * sizeof(char));
+    i->level   = 0;
+    i->prefixsize = prefixsize;
+    i->pattern = pattern;
+    i->state   = 0;
+
+    /* every key is >= the empty key, so it needs no bound */
+    if (lo_len == 0) lo = NULL;
+
+    i->lo        = hattrie_iter_dupbound(lo, lo_len);
+    i->lo_len    = lo_len;
+    i->hi        = hattrie_iter_dupbound(hi, hi_len);
+    i->hi_len    = hi_len;
+    i->begin     = hattrie_iter_dupbound(lo, lo_len);
+    i->begin_len = lo_len;
+    i->end       = hattrie_iter_dupbound(hi, hi_len);
+    i->end_len   = hi_len;
+
+    hattrie_iter_start(i);
+    return i;
+}
+
+
+static hattrie_iter_t* hattrie_iter_begin_prefix_(const hattrie_t* T,
+                                                  bool sorted, bool reverse,
+                                                  const char* prefix, size_t prefixsize,
+                                                  hattrie_pattern_t* pattern)
+{
+    if (prefixsize == 0) {
+        return hattrie_iter_begin_range_(T, sorted, reverse, NULL, 0, NULL, 0, 0,
+                                         pattern);
+    }
+
+    char* hi = malloc_or_die(prefixsize * sizeof(char));
+    size_t hi_len = hattrie_prefix_end(prefix, prefixsize, hi);
+
+    hattrie_iter_t* i = hattrie_iter_begin_range_(T, sorted, reverse,
+                                                  prefix, prefixsize,
+                                                  hi_len > 0 ? hi : NULL, hi_len,
+                                                  pattern ? 0 : prefixsize, pattern);
+    free(hi);
+    return i;
+}
+
+
+hattrie_iter_t* hattrie_iter_begin_with_prefix(const hattrie_t* T, bool sorted,
+                                               const char* prefix, size_t prefixsize)
+{
+    return hattrie_iter_begin_prefix_(T, sorted, false, prefix, prefixsize, NULL);
+}
+
+
+hattrie_iter_t* hattrie_iter_begin_with_prefix_reverse(const hattrie_t* T,
+                                                       const char* prefix,
+                                                       size_t prefixsize)
+{
+    return hattrie_iter_begin_prefix_(T, true, true, prefix, prefixsize, NULL);
+}
+
+
+hattrie_iter_t* hattrie_iter_begin_range(const hattrie_t* T,
+                                         const char* lo, size_t lo_len,
+                                         const char* hi, size_t hi_len)
+{
+    return hattrie_iter_begin_range_(T, true, false, lo, lo_len, hi, hi_len, 0, NULL);
+}
+
+
+hattrie_iter_t* hattrie_iter_begin_range_reverse(const hattrie_t* T,
+                                                 const char* lo, size_t lo_len,
+                                                 const char* hi, size_t hi_len)
+{
+    return hattrie_iter_begin_range_(T, true, true, lo, lo_len, hi, hi_len, 0, NULL);
+}
+
+
+/* Compare keys a and b, returning a negative, zero, or positive number. */
+static int hattrie_iter_cmpkey(const char* a, size_t a_len, const char* b, size_t b_len)
+{
+    int c = memcmp(a, b, a_len < b_len ? a_len : b_len);
+    return c == 0 ? (a_len > b_len) - (a_len < b_len) : c;
+}
+
+
+void hattrie_iter_seek(hattrie_iter_t* i, const char* key, size_t len)
+{
+    /* keys are given relative to the prefix, as hattrie_iter_key reports them */
+    size_t k_len = i->prefixsize + len;
+    char* k = malloc_or_die((k_len + 1) * sizeof(char));
+    if (i->prefixsize > 0) memcpy(k, i->begin, i->prefixsize);
+    memcpy(k + i->prefixsize, key, len);
+
+    if (i->reverse) {
+        /* the keys <= k are those < k followed by a NUL byte */
+        k[k_len++] = '\0';
+
+        /* never move past the end of the range */
+        free(i->hi);
+        if (i->end && hattrie_iter_cmpkey(k, k_len, i->end, i->end_len) > 0) {
+            free(k);
+            i->hi     = hattrie_iter_dupbound(i->end, i->end_len);
+            i->hi_len = i->end_len;
+        }
+        else {
+            i->hi     = k;
+            i->hi_len = k_len;
+        }
+    }
+    else {
+        /* never move before the beginning of the range */
+        free(i->lo);
+        if (k_len == 0 ||
+            (i->begin && hattrie_iter_cmpkey(k, k_len, i->begin, i->begin_len) < 0)) {
+            free(k);
+            i->lo     = hattrie_iter_dupbound(i->begin, i->begin_len);
+            i->lo_len = i->begin_len;
+        }
+        else {
+            i->lo     = k;
+            i->lo_len = k_len;
+        }
+    }
+
+    hattrie_iter_start(i);
+}
+
+
+hattrie_iter_t* hattrie_iter_begin_reverse(const hattrie_t* T)
+{
+    return hattrie_iter_begin_prefix_(T, true, true, NULL, 0, NULL);
+}
+
+
+hattrie_iter_t* hattrie_iter_begin_with_pattern(const hattrie_t* T, bool sorted,
+                                                hattrie_pattern_t* pattern)
+{
+    /* every matching key begins with the pattern's literal prefix, so only
+     * that range of the trie need be searched */
+    const char* prefix;
+    size_t prefixsize = hattrie_pattern_prefix(pattern, &prefix);
+    return hattrie_iter_begin_prefix_(T, sorted, false, prefix, prefixsize, pattern);
+}
+
+
+hattrie_iter_t* hattrie_iter_begin(const hattrie_t* T, bool sorted)
+{
+    return hattrie_iter_begin_with_prefix(T, sorted, NULL, 0);
+}
+
+
+void hattrie_iter_next(hattrie_iter_t* i)
+{
+    if (hattrie_iter_finished(i)) return;
+    if (i->i != NULL && !ahtable_iter_finished(i->i)) {
+        ahtable_iter_next(i->i);
+    }
+    else if (i->has_nil_key) {
+        i->has_nil_key = false;
+        i->nil_val = 0;
+        hattrie_iter_nextnode(i);
+    }
+
+    hattrie_iter_continue(i);
+}
+
+
+bool hattrie_iter_finished(hattrie_iter_t* i)
+{
+    return i->stack == NULL && i->i == NULL && !i->has_nil_key;
+}
+
+
+void hattrie_iter_free(hattrie_iter_t* i)
+{
+    if (i == NULL) return;
+    if (i->i) ahtable_iter_free(i->i);
+
+    hattrie_node_stack_t* next;
+    while (i->stack) {
+        next = i->stack->next;
+        free(i->stack);
+        i->stack = next;
+    }
+
+    free(i->lo);
+    free(i->hi);
+    free(i->begin);
+    free(i->end);
+    free(i->key);
+    free(i);
+}
+
+
+const char* hattrie_iter_key(hattrie_iter_t* i, size_t* len)
+{
+    if (hattrie_iter_finished(i)) return NULL;
+
+    size_t sublen;
+    const char* subkey;
+
+    if (i->has_nil_key) {
+        subkey = NULL;
+        sublen = 0;
+    }
+    else subkey = ahtable_iter_key(i->i, &sublen);
+
+    size_t desired = i->level + sublen + 1;
+    if (i->keysize < desired) {
+        while (i->keysize < desired) i->keysize *= 2;
+        i->key = realloc_or_die(i->key, i->keysize * sizeof(char));
+    }
+
+    memcpy(i->key + i->level, subkey, sublen);
+    i->key[i->level + sublen] = '\0';
+
+    if (len) *len = i->level + sublen - i->prefixsize;
+    return i->key + i->prefixsize;
+}
+
+
+value_t* hattrie_iter_val(hattrie_iter_t* i)
+{
+    if (i->has_nil_key) return &i->nil_val;
+
+    if (hattrie_iter_finished(i)) return NULL;
+
+    return ahtable_iter_val(i->i);
+}
+
+
+
+bool hattrie_iter_equal(const hattrie_iter_t* a,
+                        const hattrie_iter_t* b)
+{
+    return a->T      == b->T &&
+           a->sorted == b->sorted &&
+           a->i      == b->i;
+}
+
+
+/* Splitting:
+ * A range is cut at the ranks that divide its keys evenly, by walking down the
+ * trie from where the range begins, counting the keys under each child. A cut
+ * within slack keys of the start or end of a child falls on that boundary;
+ * otherwise the walk descends into the child, or, for a bucket, cuts at its
+ * key of that rank. Each part is then iterated as a range. With no slack, each
+ * cut is the key of its rank, which gives quantiles. */
+
+typedef struct hattrie_cuts_t_
+{
+    const hattrie_t* T;
+    size_t n;       // how many parts are wanted
+    size_t m;       // how many keys are in range
+    size_t slack;   // how far from its rank a cut may fall
+    size_t next;    // the next cut to place, from 1 to n - 1
+
+    char* path;     // bytes consumed down to the current node
+    size_t pathsize;
+
+    /* the cuts placed, in order, each the first key of a part */
+    char** keys;
+    size_t* lens;
+    size_t* ranks;  // the rank each was placed for
+    size_t num;
+} hattrie_cuts_t;
+
+
+/* Rank, among the keys in range, at which the j-th cut belongs. */
+static inline size_t hattrie_cuts_rank(const hattrie_cuts_t* C, size_t j)
+{
+    return j * C->m / C->n;
+}
+
+
+static void hattrie_cuts_reserve(hattrie_cuts_t* C, size_t len)
+{
+    if (C->pathsize >= len) return;
+    while (C->pathsize < len) C->pathsize *= 2;
+    C->path = realloc_or_die(C->path, C->pathsize);
+}
+
+
+/* Place the next cut at the first level bytes of the path followed by
+ * suffix, unless the last cut was placed there already. */
+static void hattrie_cuts_add(hattrie_cuts_t* C, size_t level,
+                             const char* suffix, size_t len)
+{
+    size_t rank = hattrie_cuts_rank(C, C->next++);
+
+    if (C->num > 0 && C->lens[C->num - 1] == level + len &&
+        memcmp(C->keys[C->num - 1], C->path, level) == 0 &&
+        memcmp(C->keys[C->num - 1] + level, suffix, len) == 0) return;
+
+    char* key = malloc_or_die(level + len + 1);
+    memcpy(key, C->path, level);
+    if (len > 0) memcpy(key + level, suffix, len);
+    key[level + len] = '\0';
+    C->keys[C->num]  = key;
+    C->lens[C->num]  = level + len;
+    C->ranks[C->num] = rank;
+    ++C->num;
+}
+
+
+/* Skip the next cut if its rank is that of the last one placed, which it
+ * would only repeat, as happens when there are more parts than keys. */
+static inline bool hattrie_cuts_repeat(hattrie_cuts_t* C, size_t t)
+{
+    if (C->num == 0 || C->ranks[C->num - 1] != t) return false;
+    ++C->next;
+    return true;
+}
+
+
+/* Place the cuts with ranks from s up to end in the bucket below the level
+ * bytes of the path, the cut of rank t at its key of rank below + t - s. One
+ * cut selects its key, and more take the keys in order, sorting just once. */
+static void hattrie_cuts_bucket(hattrie_cuts_t* C, ahtable_t* b, size_t level,
+                                size_t below, size_t s, size_t end)
+{
+    /* pure buckets hold the keys without their leading byte */
+    if (b->flag & NODE_TYPE_PURE_BUCKET) {
+        C->path[level] = (char) b->c0;
+        ++level;
+    }
+
+    ahtable_iter_t* i = NULL;
+    const char* suffix;
+    size_t t, k = 0, len;
+    while (C->next < C->n && (t = hattrie_cuts_rank(C, C->next)) < end) {
+        if (hattrie_cuts_repeat(C, t)) continue;
+
+        if (i == NULL && C->next + 1 < C->n && hattrie_cuts_rank(C, C->next + 1) < end) {
+            i = ahtable_iter_begin(b, true);
+        }
+
+        if (i == NULL) suffix = ahtable_select(b, below + t - s, &len, NULL);
+        else {
+            for (; k < below + t - s; ++k) ahtable_iter_next(i);
+            suffix = ahtable_iter_key(i, &len);
+        }
+        hattrie_cuts_add(C, level, suffix, len);
+    }
+
+    if (i != NULL) ahtable_iter_free(i);
+}
+
+
+/* Place the cuts that fall among the keys below node, which consumes the
+ * level bytes of the path, and the first of which has rank s. */
+static void hattrie_cuts_node(hattrie_cuts_t* C, trie_node_t* node, size_t level,
+                              size_t s)
+{
+    hattrie_cuts_reserve(C, level + 1);
+
+    /* the key ending here is the first below the node */
+    if (node->flag & NODE_HAS_VAL) {
+        while (C->next < C->n && hattrie_cuts_rank(C, C->next) == s) {
+            hattrie_cuts_add(C, level, NULL, 0);
+        }
+        ++s;
+    }
+
+    node_ptr child;
+    size_t count, t;
+    unsigned int c0, c1;
+    for (c0 = 0; c0 < NODE_CHILDS && C->next < C->n; c0 = c1 + 1) {
+        child = node->xs[c0];
+        c1 = *child.flag & NODE_TYPE_TRIE ? c0 : child.b->c1;
+        count = hattrie_node_count(C->T, child);
+
+        while (C->next < C->n && (t = hattrie_cuts_rank(C, C->next)) < s + count) {
+            if (hattrie_cuts_repeat(C, t)) continue;
+
+            /* at the start of the child */
+            if (t <= s + C->slack) {
+                C->path[level] = (char) c0;
+                hattrie_cuts_add(C, level + 1, NULL, 0);
+            }
+
+            /* at its end, where the next child starts */
+            else if (s + count - t <= C->slack && c1 < NODE_MAXCHAR) {
+                C->path[level] = (char) (c1 + 1);
+                hattrie_cuts_add(C, level + 1, NULL, 0);
+            }
+
+            /* or inside it, which takes every cut that falls there */
+            else if (*child.flag & NODE_TYPE_TRIE) {
+                C->path[level] = (char) c0;
+                hattrie_cuts_node(C, child.t, level + 1, s);
+            }
+            else {
+                hattrie_cuts_bucket(C, child.b, level, 0, s,
+                                    c1 < NODE_MAXCHAR ? s + count - C->slack : s + count);
+            }
+        }
+
+        s += count;
+    }
+}
+
+
+/* Place the cuts dividing the keys with a prefix into n parts, each cut at
+ * its rank if exact, and otherwise within an eighth of a part of it. */
+static void hattrie_cuts_place(hattrie_cuts_t* C, const hattrie_t* T,
+                               const char* prefix, size_t len,
+                               size_t n, bool exact)
+{
+    C->T = T;
+    C->n = n;
+    C->m = hattrie_count_prefix(T, prefix, len);
+    C->slack = exact ? 0 : C->m / n / 8;
+    C->next = 1;
+    C->pathsize = 16;
+    C->path = malloc_or_die(C->pathsize);
+    C->keys = malloc_or_die(n * sizeof(char*));
+    C->lens = malloc_or_die(n * sizeof(size_t));
+    C->ranks = malloc_or_die(n * sizeof(size_t));
+    C->num = 0;
+
+    hattrie_cuts_reserve(C, len + 1);
+    if (len > 0) memcpy(C->path, prefix, len);
+
+    /* follow the prefix down as far as trie nodes go */
+    node_ptr node = T->root;
+    node_ptr child = node;
+    size_t level = 0;
+    while (level < len) {
+        child = node.t->xs[(unsigned char) prefix[level]];
+        if (!(*child.flag & NODE_TYPE_TRIE)) break;
+        node = child;
+        ++level;
+    }
+
+    if (level == len) {
+        hattrie_cuts_node(C, node.t, len, 0);
+    }
+    else {
+        /* the range lies in one bucket, after the keys less than the prefix */
+        size_t pure = *child.flag & NODE_TYPE_PURE_BUCKET ? 1 : 0;
+        size_t below = ahtable_count_range(child.b, NULL, 0, prefix + level + pure,
+                                           len - level - pure);
+        hattrie_cuts_bucket(C, child.b, level, below, 0, C->m);
+    }
+}
+
+
+size_t hattrie_iter_split(const hattrie_t* T, bool sorted,
+                          const char* prefix, size_t len,
+                          size_t n, hattrie_iter_t** out)
+{
+    if (n == 0) return 0;
+
+    hattrie_cuts_t C;
+    hattrie_cuts_place(&C, T, prefix, len, n, false);
+
+    /* the range's own end bounds the last part */
+    char* end = malloc_or_die(len + 1);
+    size_t end_len = len > 0 ? hattrie_prefix_end(prefix, len, end) : 0;
+
+    size_t j;
+    for (j = 0; j <= C.num; ++j) {
+        out[j] = hattrie_iter_begin_range_(
+                    T, sorted, false,
+                    j > 0 ? C.keys[j - 1] : prefix, j > 0 ? C.lens[j - 1] : len,
+                    j < C.num ? C.keys[j] : (end_len > 0 ? end : NULL),
+                    j < C.num ? C.lens[j] : end_len,
+                    len, NULL);
+    }
+
+    for (j = 0; j < C.num; ++j) free(C.keys[j]);
+    free(C.keys);
+    free(C.lens);
+    free(C.ranks);
+    free(C.path);
+    free(end);
+
+    return C.num + 1;
+}
+
+
+size_t hattrie_quantiles(const hattrie_t* T, size_t n, hattrie_entry_t* out)
+{
+    if (n == 0) return 0;
+
+    hattrie_cuts_t C;
+    hattrie_cuts_place(&C, T, NULL, 0, n, true);
+
+    size_t j;
+    for (j = 0; j < C.num; ++j) {
+        out[j].key = C.keys[j];
+        out[j].len = C.lens[j];
+        out[j].val = C.ranks[j];
+    }
+
+    free(C.keys);
+    free(C.lens);
+    free(C.ranks);
+    free(C.path);
+
+    return C.num;
+}
+
+
+/* Extraction:
+ * The trie is walked within the range's bounds, as a range iterator walks it.
+ * A child whose keys all lie in range is moved to the new trie whole, leaving
+ * an empty bucket in its place, and one whose keys straddle a bound is walked
+ * into, or, for a bucket, divided into the keys that stay and those that go.
+ * The new trie gets a trie node for each one walked through that gives up
+ * keys, and its other bytes are filled with empty buckets. */
+
+typedef struct hattrie_extract_t_
+{
+    hattrie_t* T;   // the trie keys are taken from
+    hattrie_t* U;   // and the new trie they are moved to
+
+    const char* lo;
+    size_t lo_len;
+    const char* hi;
+    size_t hi_len;
+
+    char* path;     // bytes consumed down to the current node
+    size_t pathsize;
+} hattrie_extract_t;
 
 
-value_t* hattrie_tryget(hattrie_t* T, const char* key, size_t len)
+static void hattrie_extract_reserve(hattrie_extract_t* E, size_t len)
 {
-    /* find node for given key */
-    node_ptr node = hattrie_find(T, &key, &len);
-    if (node.flag == NULL) {
-        return NULL;
-    }
+    if (E->pathsize >= len) return;
+    while (E->pathsize < len) E->pathsize *= 2;
+    E->path = realloc_or_die(E->path, E->pathsize);
+}
 
-    /* if the trie node consumes value, use it */
-    if (*node.flag & NODE_TYPE_TRIE) {
-        return &node.t->val;
-    }
 
-    return ahtable_tryget(node.b, key, len);
+static bool hattrie_extract_within(const hattrie_extract_t* E, const char* key,
+                                   size_t len)
+{
+    return (E->lo == NULL || hattrie_iter_cmpkey(key, len, E->lo, E->lo_len) >= 0) &&
+           (E->hi == NULL || hattrie_iter_cmpkey(key, len, E->hi, E->hi_len) < 0);
 }
 
 
-int hattrie_del(hattrie_t* T, const char* key, size_t len)
+/* Move the keys in range of bucket b, below the level bytes of the path, to a
+ * new bucket, returning it, or NULL if there are none. */
+static ahtable_t* hattrie_extract_bucket(hattrie_extract_t* E, trie_node_t* node,
+                                         ahtable_t* b, size_t level)
 {
-    node_ptr parent = T->root;
-    HT_UNUSED(parent);
-    assert(*parent.flag & NODE_TYPE_TRIE);
+    /* pure buckets hold the keys without their leading byte */
+    if (b->flag & NODE_TYPE_PURE_BUCKET) E->path[level++] = (char) b->c0;
 
-    /* find node for deletion */
-    node_ptr node = hattrie_find(T, &key, &len);
-    if (node.flag == NULL) {
-        return -1;
+    size_t len, count = 0;
+    const char* key;
+    ahtable_iter_t* i;
+
+    i = ahtable_iter_begin(b, false);
+    for (; !ahtable_iter_finished(i); ahtable_iter_next(i)) {
+        key = ahtable_iter_key(i, &len);
+        hattrie_extract_reserve(E, level + len);
+        memcpy(E->path + level, key, len);
+        if (hattrie_extract_within(E, E->path, level + len)) ++count;
     }
+    ahtable_iter_free(i);
 
-    /* if consumed on a trie node, clear the value */
-    if (*node.flag & NODE_TYPE_TRIE) {
-        return hattrie_clrval(T, node);
+    if (count == 0) return NULL;
+
+    E->T->m -= count;
+    E->U->m += count;
+
+    unsigned int c;
+    node_ptr keep;
+    if (count == ahtable_size(b)) {
+        keep = hattrie_empty_bucket(b->c0, b->c1);
+        for (c = b->c0; c <= b->c1; ++c) node->xs[c] = keep;
+        return b;
     }
 
-    /* remove from bucket */
-    size_t m_old = ahtable_size(node.b);
-    int ret =  ahtable_del(node.b, key, len);
-    T->m -= (m_old - ahtable_size(node.b));
+    node_ptr move;
+    move.b = ahtable_create_n(hattrie_bucket_slots(count));
+    keep.b = ahtable_create_n(hattrie_bucket_slots(ahtable_size(b) - count));
+    move.b->c0 = keep.b->c0 = b->c0;
+    move.b->c1 = keep.b->c1 = b->c1;
+    move.b->flag = keep.b->flag = b->flag;
 
-    /* merge empty buckets */
-    /*! \todo */
+    i = ahtable_iter_begin(b, false);
+    for (; !ahtable_iter_finished(i); ahtable_iter_next(i)) {
+        key = ahtable_iter_key(i, &len);
+        memcpy(E->path + level, key, len);
+        if (hattrie_extract_within(E, E->path, level + len)) {
+            *ahtable_get(move.b, key, len) = *ahtable_iter_val(i);
+        }
+        else {
+            *ahtable_get(keep.b, key, len) = *ahtable_iter_val(i);
+        }
+    }
+    ahtable_iter_free(i);
 
-    return ret;
-}
+    if (E->T->flags & (HATTRIE_MAXIMA | HATTRIE_SUMS)) {
+        hattrie_bucket_summarize(move.b);
+        hattrie_bucket_summarize(keep.b);
+    }
 
+    for (c = b->c0; c <= b->c1; ++c) node->xs[c] = keep;
+    ahtable_free(b);
+    return move.b;
+}
 
-/* plan for iteration:
- * This is tricky, as we have no parent pointers currently, and I would like to
- * avoid adding them. That means maintaining a stack
- *
- */
 
-typedef struct hattrie_node_stack_t_
+/* Move the keys in range below node, which consumes the level bytes of the
+ * path, returning the trie node of the new trie that holds them, or NULL if
+ * there are none. */
+static trie_node_t* hattrie_extract_node(hattrie_extract_t* E, trie_node_t* node,
+                                         size_t level)
 {
-    unsigned char   c;
-    size_t level;
+    node_ptr none = { NULL };
+    trie_node_t* dst = NULL;
+
+    hattrie_extract_reserve(E, level + 1);
+
+    if (node->flag & NODE_HAS_VAL && hattrie_extract_within(E, E->path, level)) {
+        dst = alloc_trie_node(E->U, none);
+        dst->val = node->val;
+        dst->flag |= NODE_HAS_VAL;
+        ++E->U->m;
+        node_ptr parent;
+        parent.t = node;
+        hattrie_clrval(E->T, parent);
+    }
 
-    node_ptr node;
-    struct hattrie_node_stack_t_* next;
+    node_ptr child, moved;
+    unsigned int c, c0, c1;
+    int lo_cmp, hi_cmp;
+    size_t count;
+    for (c0 = 0; c0 < NODE_CHILDS; c0 = c1 + 1) {
+        child = node->xs[c0];
+        c1 = *child.flag & NODE_TYPE_TRIE ? c0 : child.b->c1;
+
+        /* how the keys beginning with the child's first and last bytes lie
+         * against the bounds */
+        E->path[level] = (char) c0;
+        lo_cmp = E->lo ? hattrie_iter_cmpbound(E->path, level + 1, E->lo, E->lo_len) : 1;
+        hi_cmp = E->hi ? hattrie_iter_cmpbound(E->path, level + 1, E->hi, E->hi_len) : -1;
+        if (hi_cmp > 0) break;
+
+        E->path[level] = (char) c1;
+        if (E->lo && hattrie_iter_cmpbound(E->path, level + 1, E->lo, E->lo_len) < 0) {
+            continue;
+        }
+        if (E->hi) hi_cmp = hattrie_iter_cmpbound(E->path, level + 1, E->hi, E->hi_len);
+        E->path[level] = (char) c0;
+
+        moved = none;
+        if (lo_cmp > 0 && hi_cmp < 0) {
+            count = hattrie_node_count(E->T, child);
+            E->T->m -= count;
+            E->U->m += count;
+            moved = child;
+            node_ptr empty = hattrie_empty_bucket(c0, c1);
+            for (c = c0; c <= c1; ++c) node->xs[c] = empty;
+        }
+        else if (*child.flag & NODE_TYPE_TRIE) {
+            moved.t = hattrie_extract_node(E, child.t, level + 1);
+        }
+        else {
+            moved.b = hattrie_extract_bucket(E, node, child.b, level);
+        }
 
-} hattrie_node_stack_t;
+        if (moved.t == NULL) continue;
+        if (dst == NULL) dst = alloc_trie_node(E->U, none);
+        for (c = c0; c <= c1; ++c) dst->xs[c] = moved;
+    }
 
+    if (E->T->flags & (HATTRIE_COUNTS | HATTRIE_MAXIMA | HATTRIE_SUMS)) {
+        hattrie_node_summarize(node);
+    }
 
-struct hattrie_iter_t_
-{
-    char* key;
-    size_t keysize; // space reserved for the key
-    size_t level;
+    if (dst == NULL) return NULL;
 
-    char* prefix;
-    size_t prefixsize; // space reserved for prefix
+    /* the bytes nothing was moved along get empty buckets */
+    for (c0 = 0; c0 < NODE_CHILDS; c0 = c1 + 1) {
+        c1 = c0;
+        if (dst->xs[c0].t != NULL) continue;
+        while (c1 + 1 < NODE_CHILDS && dst->xs[c1 + 1].t == NULL) ++c1;
+        child = hattrie_empty_bucket(c0, c1);
+        for (c = c0; c <= c1; ++c) dst->xs[c] = child;
+    }
 
-    /* keep track of keys stored in trie nodes */
-    bool    has_nil_key;
-    value_t nil_val;
+    if (E->U->flags & (HATTRIE_COUNTS | HATTRIE_MAXIMA | HATTRIE_SUMS)) {
+        hattrie_node_summarize(dst);
+    }
 
-    const hattrie_t* T;
-    bool sorted;
-    ahtable_iter_t* i;
-    hattrie_node_stack_t* stack;
-};
+    return dst;
+}
 
 
-static void hattrie_iter_pushchar(hattrie_iter_t* i, size_t level, char c)
+hattrie_t* hattrie_extract_range(hattrie_t* T, const char* lo, size_t lo_len,
+                                 const char* hi, size_t hi_len)
 {
-    if (i->keysize < level) {
-        i->keysize *= 2;
-        i->key = realloc_or_die(i->key, i->keysize * sizeof(char));
-    }
-
-    if (level > 0) {
-        i->key[level - 1] = c;
+    assert(T->epochs == NULL);
+
+    hattrie_unshare(T);
+
+    hattrie_t* U = malloc_or_die(sizeof(hattrie_t));
+    U->m = 0;
+    U->flags = T->flags;
+    U->generation = 0;
+    U->epochs = NULL;
+    U->cow = NULL;
+
+    hattrie_extract_t E;
+    E.T = T;
+    E.U = U;
+    E.lo = lo_len > 0 ? lo : NULL;  // every key is >= the empty key
+    E.lo_len = lo_len;
+    E.hi = hi;
+    E.hi_len = hi_len;
+    E.pathsize = 16;
+    E.path = malloc_or_die(E.pathsize);
+
+    U->root.t = hattrie_extract_node(&E, T->root.t, 0);
+    if (U->root.t == NULL) {
+        U->root.t = alloc_trie_node(U, hattrie_empty_bucket(0x00, NODE_MAXCHAR));
     }
+    ++T->generation;
 
-    i->level = level;
+    free(E.path);
+    return U;
 }
 
 
-static void hattrie_iter_nextnode(hattrie_iter_t* i)
+/* Each thread of hattrie_parallel_for_each takes parts from the front of its
+ * own run of them, and once that is empty, from the back of another's. */
+typedef struct hattrie_for_each_run_t_
 {
-    if (i->stack == NULL) return;
+    pthread_mutex_t lock;
+    size_t next, end;
+} hattrie_for_each_run_t;
 
-    /* pop the stack */
-    node_ptr node;
-    hattrie_node_stack_t* next;
-    unsigned char   c;
-    size_t level;
 
-    node  = i->stack->node;
-    next  = i->stack->next;
-    c     = i->stack->c;
-    level = i->stack->level;
+typedef struct hattrie_for_each_t_
+{
+    hattrie_t* T;
+    hattrie_iter_t** parts;
+    hattrie_visit_fn fn;
+    void* ctx;
+    size_t nthreads;
+    hattrie_for_each_run_t* runs;
+} hattrie_for_each_t;
 
-    free(i->stack);
-    i->stack = next;
 
-    if (*node.flag & NODE_TYPE_TRIE) {
-        hattrie_iter_pushchar(i, level, c);
+typedef struct hattrie_for_each_worker_t_
+{
+    hattrie_for_each_t* F;
+    size_t id;
+} hattrie_for_each_worker_t;
 
-        if(node.t->flag & NODE_HAS_VAL) {
-            i->has_nil_key = true;
-            i->nil_val = node.t->val;
-        }
 
-        /* push all child nodes from right to left */
-        int j;
-        for (j = NODE_MAXCHAR; j >= 0; --j) {
+static bool hattrie_for_each_take(hattrie_for_each_t* F, size_t id, size_t* part)
+{
+    hattrie_for_each_run_t* run;
+    size_t j;
+    bool found;
+    for (j = 0; j < F->nthreads; ++j) {
+        run = &F->runs[(id + j) % F->nthreads];
+        pthread_mutex_lock(&run->lock);
+        found = run->next < run->end;
+        if (found) *part = j == 0 ? run->next++ : --run->end;
+        pthread_mutex_unlock(&run->lock);
+        if (found) return true;
+    }
+    return false;
+}
 
-            /* skip repeated pointers to hybrid bucket */
-            if (j < NODE_MAXCHAR && node.t->xs[j].t == node.t->xs[j + 1].t) continue;
 
-            // push stack
-            next = i->stack;
-            i->stack = malloc_or_die(sizeof(hattrie_node_stack_t));
-            i->stack->node  = node.t->xs[j];
-            i->stack->next  = next;
-            i->stack->level = level + 1;
-            i->stack->c     = (unsigned char) j;
+static void* hattrie_for_each_worker(void* arg)
+{
+    hattrie_for_each_worker_t* w = arg;
+    hattrie_for_each_t* F = w->F;
+    hattrie_iter_t* i;
+    const char* key;
+    value_t* val;
+    size_t part, len;
+
+    while (hattrie_for_each_take(F, w->id, &part)) {
+        i = F->parts[part];
+        while (!hattrie_iter_finished(i)) {
+            key = hattrie_iter_key(i, &len);
+
+            /* the iterator holds a copy of a value kept on a trie node */
+            if (i->has_nil_key) val = hattrie_tryget(F->T, key, len);
+            else                val = hattrie_iter_val(i);
+
+            F->fn(key, len, val, F->ctx);
+            hattrie_iter_next(i);
         }
     }
-    else {
-        if (*node.flag & NODE_TYPE_PURE_BUCKET) {
-            hattrie_iter_pushchar(i, level, c);
-        }
-        else {
-            i->level = level - 1;
-        }
 
-        i->i = ahtable_iter_begin(node.b, i->sorted);
-    }
+    return NULL;
 }
 
 
-bool hattrie_iter_prefix_satisfied(hattrie_iter_t* i) {
-    assert(i->prefixsize > 0);
-    if (i->level >= i->prefixsize) {
-        // early exit, entire prefix fits inside parent key
-        return (memcmp(i->key, i->prefix, i->prefixsize) == 0);
-    } else if (i->has_nil_key) {
-        // early exit, child key is too short to match prefix
-        return false;
-    } else if (memcmp(i->key, i->prefix, i->level) != 0) {
-        // early exit, parent key does not match prefix at this depth
-        return false;
+void hattrie_parallel_for_each(hattrie_t* T, hattrie_visit_fn fn, void* ctx,
+                               size_t nthreads)
+{
+    if (nthreads == 0) nthreads = 1;
+
+    /* a few times more parts than threads, so that they even out */
+    hattrie_for_each_t F;
+    size_t n = 8 * nthreads;
+    F.parts = malloc_or_die(n * sizeof(hattrie_iter_t*));
+    n = hattrie_iter_split(T, false, NULL, 0, n, F.parts);
+    F.T = T;
+    F.fn = fn;
+    F.ctx = ctx;
+    F.nthreads = nthreads;
+    F.runs = malloc_or_die(nthreads * sizeof(hattrie_for_each_run_t));
+
+    hattrie_for_each_worker_t* ws =
+        malloc_or_die(nthreads * sizeof(hattrie_for_each_worker_t));
+    size_t i;
+    for (i = 0; i < nthreads; ++i) {
+        pthread_mutex_init(&F.runs[i].lock, NULL);
+        F.runs[i].next = i * n / nthreads;
+        F.runs[i].end  = (i + 1) * n / nthreads;
+        ws[i].F = &F;
+        ws[i].id = i;
     }
 
-    size_t size;
-    const char* key;
-    key = ahtable_iter_key(i->i, &size);
-    if (i->level + size < i->prefixsize) {
-        // early exit, child key is too short to match prefix
-        return false;
-    } else {
-        return (memcmp(key, i->prefix + i->level, i->prefixsize - i->level) == 0);
+    /* the calling thread is one of the pool, and takes every part if no
+     * other thread can be started */
+    pthread_t* threads = malloc_or_die(nthreads * sizeof(pthread_t));
+    size_t started = 0;
+    while (started + 1 < nthreads &&
+           pthread_create(&threads[started], NULL, hattrie_for_each_worker,
+                          &ws[started + 1]) == 0) {
+        ++started;
     }
+    hattrie_for_each_worker(&ws[0]);
+    for (i = 0; i < started; ++i) pthread_join(threads[i], NULL);
+
+    for (i = 0; i < n; ++i) hattrie_iter_free(F.parts[i]);
+    for (i = 0; i < nthreads; ++i) pthread_mutex_destroy(&F.runs[i].lock);
+    free(threads);
+    free(ws);
+    free(F.runs);
+    free(F.parts);
 }
 
 
-/* "Satisfied" here, meaning "previously iterated key (i->key) matches prefix (i->prefix)".
- * Either the requested prefix matches the key traversed during iteration,
- * or no prefix was specified, and any node satisfies.
+/* Approximate search:
+ * The trie is walked depth first carrying a row of the edit distance table,
+ * holding the distance from the key consumed so far to each prefix of the
+ * query. A subtree is skipped once every entry of the row exceeds the bound,
+ * since extending the key can never bring it back within it. Keys in buckets
+ * are finished with the bit-parallel algorithm of,
+ *
+ *    Myers, G. (1999). A fast bit-vector algorithm for approximate string
+ *    matching based on dynamic programming. Journal of the ACM, 46(3),
+ *    395–415.
+ *
+ * started from the row at the bucket, when the query fits in a machine word.
+ * Matches are collected when the iterator begins.
  */
-static inline bool hattrie_iter_satisfied(hattrie_iter_t* i) {
-    return hattrie_iter_finished(i) || i->prefixsize == 0 ||
-        hattrie_iter_prefix_satisfied(i);
-}
 
-
-static inline bool hattrie_ahtable_iter_finished(ahtable_iter_t* i)
+typedef struct hattrie_fuzzy_match_t_
 {
-    return i == NULL || ahtable_iter_finished(i);
-}
+    size_t   key;  // offset of the key in the key buffer
+    size_t   len;
+    value_t* val;
+    size_t   dist;
+} hattrie_fuzzy_match_t;
 
 
-void hattrie_iter_continue(hattrie_iter_t* i)
+struct hattrie_fuzzy_iter_t_
 {
-    while (hattrie_ahtable_iter_finished(i->i) &&
-           !i->has_nil_key &&
-           i->stack != NULL) {
-        ahtable_iter_free(i->i);
-        i->i = NULL;
-        hattrie_iter_nextnode(i);
-    }
+    const char* q;    // the query
+    size_t m;         // query length
+    size_t k;         // maximum edit distance
+    uint64_t peq[NODE_CHILDS]; // query positions of each character, if m <= 64
 
-    if (hattrie_ahtable_iter_finished(i->i)) {
-        ahtable_iter_free(i->i);
-        i->i = NULL;
-    }
-}
+    char* path;       // key consumed on the walk so far
+    size_t pathsize;
 
+    hattrie_fuzzy_match_t* xs;
+    size_t n, size;   // matches found, and space reserved for them
+    size_t i;         // current match
 
-hattrie_iter_t* hattrie_iter_begin_with_prefix(const hattrie_t* T, bool sorted,
-                                               const char* prefix, size_t prefixsize)
+    char* keys;       // all matching keys, back to back
+    size_t keys_len, keys_size;
+};
+
+
+static void hattrie_fuzzy_add(hattrie_fuzzy_iter_t* it, size_t depth,
+                              const char* suffix, size_t suffix_len,
+                              value_t* val, size_t dist)
 {
-    hattrie_iter_t* i = malloc_or_die(sizeof(hattrie_iter_t));
-    i->T       = T;
-    i->sorted  = sorted;
-    i->i       = NULL;
-    i->keysize = (prefixsize > 8) ? prefixsize * 2 : 16;
-    i->key     = malloc_or_die(i->keysize * sizeof(char));
-    i->level   = 0;
-    i->has_nil_key = false;
-    i->nil_val     = 0;
+    if (it->n == it->size) {
+        it->size *= 2;
+        it->xs = realloc_or_die(it->xs, it->size * sizeof(hattrie_fuzzy_match_t));
+    }
 
-    node_ptr start;
-    if (prefixsize > 0) {
-        i->prefixsize = prefixsize;
-        start = hattrie_find((hattrie_t*)T, &prefix, &prefixsize);
-        if (prefixsize > 0) {  // prefix not entirely satisfied
-            if (i->prefixsize == prefixsize) // entirely unsatisfied
-                start = T->root;  // TODO: optimize start from root behavior
-            else  // prefix partially satisfied by bucket
-                i->prefixsize = prefixsize;
-            i->prefix = malloc_or_die(i->prefixsize * sizeof(char));
-            memcpy(i->prefix, prefix, i->prefixsize);
-        } else {  // prefix entirely satisfied by bucket
-            i->prefixsize = 0;
-            i->prefix = NULL;
-        }
-    } else {
-        i->prefixsize = 0;
-        i->prefix = NULL;
-        start = T->root;
+    size_t len = depth + suffix_len;
+    if (it->keys_size < it->keys_len + len + 1) {
+        while (it->keys_size < it->keys_len + len + 1) it->keys_size *= 2;
+        it->keys = realloc_or_die(it->keys, it->keys_size);
     }
 
-    i->stack = malloc_or_die(sizeof(hattrie_node_stack_t));
-    i->stack->node   = start;
-    i->stack->next   = NULL;
-    i->stack->c      = '\0';
-    i->stack->level  = 0;
+    hattrie_fuzzy_match_t* x = &it->xs[it->n++];
+    x->key  = it->keys_len;
+    x->len  = len;
+    x->val  = val;
+    x->dist = dist;
 
-    hattrie_iter_continue(i);
-    if (i->prefixsize > 0 && !hattrie_iter_prefix_satisfied(i)) hattrie_iter_next(i);
-    return i;
+    memcpy(it->keys + it->keys_len, it->path, depth);
+    memcpy(it->keys + it->keys_len + depth, suffix, suffix_len);
+    it->keys[it->keys_len + len] = '\0';
+    it->keys_len += len + 1;
 }
 
 
-hattrie_iter_t* hattrie_iter_begin(const hattrie_t* T, bool sorted)
+/* Extend the key behind row by c, returning the least entry of the new row. */
+static size_t hattrie_fuzzy_step(const hattrie_fuzzy_iter_t* it, const size_t* row,
+                                 size_t* next, unsigned char c)
 {
-    return hattrie_iter_begin_with_prefix(T, sorted, NULL, 0);
+    size_t j, d, least;
+    least = next[0] = row[0] + 1;
+    for (j = 1; j <= it->m; ++j) {
+        d = row[j - 1] + ((unsigned char) it->q[j - 1] != c);
+        if (row[j] + 1 < d)     d = row[j] + 1;
+        if (next[j - 1] + 1 < d) d = next[j - 1] + 1;
+        next[j] = d;
+        if (d < least) least = d;
+    }
+    return least;
 }
 
 
-void hattrie_iter_next(hattrie_iter_t* i)
+/* Distance from the key behind row, extended by s, to the query, or k + 1 if it
+ * exceeds k. */
+static size_t hattrie_fuzzy_suffix(const hattrie_fuzzy_iter_t* it, const size_t* row,
+                                   const unsigned char* s, size_t len, size_t* scratch)
 {
-    do {
-        if (hattrie_iter_finished(i)) return;
-        if (i->i != NULL && !ahtable_iter_finished(i->i)) {
-            ahtable_iter_next(i->i);
-        }
-        else if (i->has_nil_key) {
-            i->has_nil_key = false;
-            i->nil_val = 0;
-            hattrie_iter_nextnode(i);
+    size_t j;
+
+    if (it->m == 0 || it->m > 64) {
+        size_t* a = scratch;
+        size_t* b = scratch + it->m + 1;
+        size_t* t;
+        memcpy(a, row, (it->m + 1) * sizeof(size_t));
+        for (j = 0; j < len; ++j) {
+            if (hattrie_fuzzy_step(it, a, b, s[j]) > it->k) return it->k + 1;
+            t = a; a = b; b = t;
         }
+        return a[it->m] <= it->k ? a[it->m] : it->k + 1;
+    }
+
+    /* encode the row as vertical differences between adjacent entries */
+    uint64_t pv = 0, mv = 0, eq, xv, xh, ph, mh;
+    const uint64_t top = (uint64_t) 1 << (it->m - 1);
+    size_t score = row[it->m];
+    for (j = 1; j <= it->m; ++j) {
+        if (row[j] > row[j - 1])      pv |= (uint64_t) 1 << (j - 1);
+        else if (row[j] < row[j - 1]) mv |= (uint64_t) 1 << (j - 1);
+    }
 
-        hattrie_iter_continue(i);
-    } while (!hattrie_iter_satisfied(i));
+    for (j = 0; j < len; ++j) {
+        eq = it->peq[s[j]];
+        xv = eq | mv;
+        xh = (((eq & pv) + pv) ^ pv) | eq;
+        ph = mv | ~(xh | pv);
+        mh = pv & xh;
+
+        if (ph & top)      ++score;
+        else if (mh & top) --score;
+
+        /* the first entry of each row grows by one */
+        ph = (ph << 1) | 1;
+        mh = mh << 1;
+        pv = mh | ~(xv | ph);
+        mv = ph & xv;
+
+        /* the final entry can fall by at most one per remaining character */
+        if (score > it->k + (len - j - 1)) return it->k + 1;
+    }
+
+    return score;
 }
 
 
-bool hattrie_iter_finished(hattrie_iter_t* i)
+static void hattrie_fuzzy_bucket(hattrie_fuzzy_iter_t* it, ahtable_t* b,
+                                 size_t depth, const size_t* row, size_t* scratch)
 {
-    return i->stack == NULL && i->i == NULL && !i->has_nil_key;
+    ahtable_iter_t* i;
+    const char* key;
+    size_t len, total, dist;
+
+    for (i = ahtable_iter_begin(b, false);
+         !ahtable_iter_finished(i);
+         ahtable_iter_next(i)) {
+        key = ahtable_iter_key(i, &len);
+
+        /* keys whose length differs from the query's by more than k are out
+         * of reach */
+        total = depth + len;
+        if (total > it->m + it->k || total + it->k < it->m) continue;
+
+        dist = hattrie_fuzzy_suffix(it, row, (const unsigned char*) key, len, scratch);
+        if (dist <= it->k) {
+            hattrie_fuzzy_add(it, depth, key, len, ahtable_iter_val(i), dist);
+        }
+    }
+    ahtable_iter_free(i);
 }
 
 
-void hattrie_iter_free(hattrie_iter_t* i)
+static void hattrie_fuzzy_node(hattrie_fuzzy_iter_t* it, node_ptr node,
+                               size_t depth, const size_t* row)
 {
-    if (i == NULL) return;
-    if (i->i) ahtable_iter_free(i->i);
+    size_t* next    = malloc_or_die(3 * (it->m + 1) * sizeof(size_t));
+    size_t* scratch = next + it->m + 1;
 
-    hattrie_node_stack_t* next;
-    while (i->stack) {
-        next = i->stack->next;
-        free(i->stack);
-        i->stack = next;
+    if (node.t->flag & NODE_HAS_VAL && row[it->m] <= it->k) {
+        hattrie_fuzzy_add(it, depth, NULL, 0, &node.t->val, row[it->m]);
     }
 
-    if (i->prefixsize > 0) {
-        free(i->prefix);
+    if (it->pathsize < depth + 1) {
+        it->pathsize *= 2;
+        it->path = realloc_or_die(it->path, it->pathsize);
     }
 
-    free(i->key);
-    free(i);
+    node_ptr child;
+    size_t j;
+    for (j = 0; j < NODE_CHILDS; ++j) {
+        child = node.t->xs[j];
+        if (j > 0 && child.t == node.t->xs[j - 1].t) continue;
+
+        if (*child.flag & NODE_TYPE_HYBRID_BUCKET) {
+            hattrie_fuzzy_bucket(it, child.b, depth, row, scratch);
+            continue;
+        }
+
+        /* subtrees whose every key is more than k edits away are skipped */
+        if (hattrie_fuzzy_step(it, row, next, (unsigned char) j) > it->k) continue;
+        it->path[depth] = (char) j;
+
+        if (*child.flag & NODE_TYPE_TRIE) {
+            hattrie_fuzzy_node(it, child, depth + 1, next);
+        }
+        else {
+            hattrie_fuzzy_bucket(it, child.b, depth + 1, next, scratch);
+        }
+    }
+
+    free(next);
 }
 
 
-const char* hattrie_iter_key(hattrie_iter_t* i, size_t* len)
+hattrie_fuzzy_iter_t* hattrie_fuzzy_iter_begin(const hattrie_t* T,
+                                               const char* query, size_t len,
+                                               size_t max_edits)
 {
-    if (hattrie_iter_finished(i)) return NULL;
+    hattrie_fuzzy_iter_t* it = malloc_or_die(sizeof(hattrie_fuzzy_iter_t));
+    it->q = query;
+    it->m = len;
+    it->k = max_edits;
+
+    size_t j;
+    memset(it->peq, 0, sizeof(it->peq));
+    for (j = 0; j < len && j < 64; ++j) {
+        it->peq[(unsigned char) query[j]] |= (uint64_t) 1 << j;
+    }
 
-    size_t sublen;
-    const char* subkey;
+    it->pathsize  = 16;
+    it->path      = malloc_or_die(it->pathsize);
+    it->n         = 0;
+    it->size      = 16;
+    it->xs        = malloc_or_die(it->size * sizeof(hattrie_fuzzy_match_t));
+    it->i         = 0;
+    it->keys_len  = 0;
+    it->keys_size = 256;
+    it->keys      = malloc_or_die(it->keys_size);
+
+    /* the empty key is this far from each prefix of the query */
+    size_t* row = malloc_or_die((len + 1) * sizeof(size_t));
+    for (j = 0; j <= len; ++j) row[j] = j;
+    hattrie_fuzzy_node(it, T->root, 0, row);
+    free(row);
+
+    /* the query is not kept past the walk */
+    it->q = NULL;
+    return it;
+}
 
-    if (i->has_nil_key) {
-        subkey = NULL;
-        sublen = 0;
-    }
-    else subkey = ahtable_iter_key(i->i, &sublen);
 
-    size_t desired = i->level + sublen + 1;
-    if (i->keysize < desired) {
-        while (i->keysize < desired) i->keysize *= 2;
-        i->key = realloc_or_die(i->key, i->keysize * sizeof(char));
-    }
+void hattrie_fuzzy_iter_next(hattrie_fuzzy_iter_t* it)
+{
+    if (it->i < it->n) ++it->i;
+}
 
-    memcpy(i->key + i->level, subkey, sublen);
-    i->key[i->level + sublen] = '\0';
 
-    if (len) *len = i->level + sublen - i->prefixsize;
-    return i->key + i->prefixsize;
+bool hattrie_fuzzy_iter_finished(hattrie_fuzzy_iter_t* it)
+{
+    return it->i >= it->n;
 }
 
 
-value_t* hattrie_iter_val(hattrie_iter_t* i)
+void hattrie_fuzzy_iter_free(hattrie_fuzzy_iter_t* it)
 {
-    if (i->has_nil_key) return &i->nil_val;
+    if (it == NULL) return;
+    free(it->path);
+    free(it->xs);
+    free(it->keys);
+    free(it);
+}
 
-    if (hattrie_iter_finished(i)) return NULL;
 
-    return ahtable_iter_val(i->i);
+const char* hattrie_fuzzy_iter_key(hattrie_fuzzy_iter_t* it, size_t* len)
+{
+    if (hattrie_fuzzy_iter_finished(it)) return NULL;
+    if (len) *len = it->xs[it->i].len;
+    return it->keys + it->xs[it->i].key;
 }
 
 
+value_t* hattrie_fuzzy_iter_val(hattrie_fuzzy_iter_t* it)
+{
+    if (hattrie_fuzzy_iter_finished(it)) return NULL;
+    return it->xs[it->i].val;
+}
 
-bool hattrie_iter_equal(const hattrie_iter_t* a,
-                        const hattrie_iter_t* b)
+
+size_t hattrie_fuzzy_iter_dist(hattrie_fuzzy_iter_t* it)
 {
-    return a->T      == b->T &&
-           a->sorted == b->sorted &&
-           a->i      == b->i;
+    if (hattrie_fuzzy_iter_finished(it)) return 0;
+    return it->xs[it->i].dist;
 }
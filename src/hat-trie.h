@@ -35,6 +35,64 @@ size_t     hattrie_size   (const hattrie_t*); // Number of stored keys.
 size_t     hattrie_sizeof (const hattrie_t*); // Memory used in structure in bytes.
 
 
+/* Options for hattrie_create_ex. */
+
+/* Keep the number of keys under each trie node, so that hattrie_count_prefix,
+ * hattrie_rank, and hattrie_select cost a walk down the trie and a pass over
+ * one bucket, rather than a scan of the subtree. Inserting or deleting a key
+ * then walks its path a second time. */
+#define HATTRIE_COUNTS 0x1
+
+/* Keep the largest value under each trie node and in each bucket, so that
+ * hattrie_topk_prefix skips subtrees that cannot hold one of the best keys. */
+#define HATTRIE_MAXIMA 0x2
+
+/* Keep the sum and the least of the values under each trie node and in each
+ * bucket. With counts and maxima, this lets hattrie_aggregate_prefix answer
+ * from the summary on the node the prefix ends on. */
+#define HATTRIE_SUMS 0x4
+#define HATTRIE_AGGREGATES (HATTRIE_COUNTS | HATTRIE_MAXIMA | HATTRIE_SUMS)
+
+/* Let other threads read the trie, through readers (see hattrie_reader_t),
+ * while the thread that owns it changes it. Adding a key to a bucket copies
+ * the slot it goes in, and splitting a bucket copies it, so that readers never
+ * see a structure half changed; what is replaced is freed once no reader can
+ * still be using it. Values are still written in place. */
+#define HATTRIE_SHARED 0x8
+
+/* With HATTRIE_MAXIMA or HATTRIE_SUMS, values must be changed only through
+ * hattrie_set and hattrie_add, never by writing through the pointer
+ * hattrie_get returns, which would leave the summaries stale. Changing a value
+ * walks the key's path once more, and again from the bottom when the key held
+ * the least or largest value of its bucket. */
+
+hattrie_t* hattrie_create_ex (unsigned int flags); // Create with the given options.
+
+
+/** A key and its value. */
+typedef struct hattrie_entry_t_
+{
+    char* key;
+    size_t len;
+    value_t val;
+} hattrie_entry_t;
+
+/** Build a trie with the given options from n entries sorted by key, as
+ * memcmp orders them with shorter keys first, such as a dump of another trie
+ * taken with a sorted iterator. Of equal keys, the last is kept. Buckets are
+ * sized for their keys up front, so each key is hashed once and no bucket is
+ * ever split or grown. */
+hattrie_t* hattrie_build_sorted (unsigned int flags, const hattrie_entry_t*, size_t n);
+
+/** Build a trie with the given options from n entries in any order, using up
+ * to nthreads threads. Of equal keys, the last given is kept. The entries are
+ * reordered. Subtries are built independently on a pool of threads, splitting
+ * keys by as many leading bytes as it takes to make enough subtries of
+ * moderate size, even when many keys share a prefix. */
+hattrie_t* hattrie_build_parallel (unsigned int flags, hattrie_entry_t*, size_t n,
+                                   size_t nthreads);
+
+
 /** Find the given key in the trie, inserting it if it does not exist, and
  * returning a pointer to it's key.
  *
@@ -45,19 +103,229 @@ size_t     hattrie_sizeof (const hattrie_t*); // Memory used in structure in byt
 value_t* hattrie_get (hattrie_t*, const char* key, size_t len);
 
 
+/** As hattrie_get, also setting inserted to whether the key was added, in the
+ * same single walk down the trie. */
+value_t* hattrie_get_ex (hattrie_t*, const char* key, size_t len, bool* inserted);
+
+
+/** Set the value of a key, or add delta to it and return the result,
+ * inserting the key with value 0 first if it does not exist. Any summaries
+ * the trie was created with are kept up to date. Sums wrap around, as unsigned
+ * arithmetic does. */
+void    hattrie_set (hattrie_t*, const char* key, size_t len, value_t val);
+value_t hattrie_add (hattrie_t*, const char* key, size_t len, value_t delta);
+
+
 /** Find a given key in the table, returning a NULL pointer if it does not
  * exist. */
 value_t* hattrie_tryget (hattrie_t*, const char* key, size_t len);
 
+
+/** Atomically add delta to the value of a key, storing what it was in old, if
+ * not NULL, or replace the value with desired if it is expected, and otherwise
+ * store what it is in expected. Values are aligned for this, so that threads
+ * may count into a trie at once, alongside lookups, as long as none adds or
+ * deletes keys meanwhile. On a trie with a snapshot, the first to count into a
+ * key copies its path, one thread at a time; the tries it shares nodes with
+ * may then be read, but not changed or freed, until the threads are done.
+ * Both return false if the key does not exist, leaving old or expected as they
+ * were. Summaries are not kept up to date, so neither may be used on a trie
+ * with HATTRIE_MAXIMA or HATTRIE_SUMS. */
+bool hattrie_fetch_add        (hattrie_t*, const char* key, size_t len,
+                               value_t delta, value_t* old);
+bool hattrie_compare_exchange (hattrie_t*, const char* key, size_t len,
+                               value_t* expected, value_t desired);
+
+
+/** Find or insert n keys at once, storing pointers to their values in vals in
+ * the order the keys are given. The pointers are valid until the trie is next
+ * changed. The keys are partitioned by their leading bytes, following the trie
+ * down, so that each bucket takes all of its keys together, growing each of
+ * its slots once, and a bucket they overflow is split as far as needed at
+ * once. For large batches this avoids a cache miss per key. */
+void hattrie_get_batch (hattrie_t*, const char* const* keys, const size_t* lens,
+                        size_t n, value_t** vals);
+
+/** Set the values of n keys at once, as hattrie_get_batch finds them. Of equal
+ * keys, the last is kept. */
+void hattrie_insert_batch (hattrie_t*, const hattrie_entry_t*, size_t n);
+
+
+/** Move every key of src into dst, leaving src empty. A key both hold gets the
+ * value combine returns for its value in dst and its value in src, or, if
+ * combine is NULL, its value in src. The two tries are walked together, so
+ * that whole buckets and subtrees of src are moved where dst holds nothing,
+ * and the keys of each other bucket of src are inserted from the trie node of
+ * dst that holds them, rather than from the root, and as a batch, as by
+ * hattrie_get_batch, if dst keeps summaries. Threads may each fill a trie of
+ * their own, to be merged into a shared one now and then. Neither trie may be
+ * shared, and buckets and subtrees are only moved if src keeps every summary
+ * dst does. */
+typedef value_t (*hattrie_combine_fn)(value_t dst, value_t src, void* ctx);
+void hattrie_merge_into (hattrie_t* dst, hattrie_t* src,
+                         hattrie_combine_fn combine, void* ctx);
+
+/** As hattrie_merge_into, but leaving src as it was: where it would be moved,
+ * a bucket or subtree of src is copied whole into dst instead, and the keys of
+ * the others are inserted. */
+void hattrie_union (hattrie_t* dst, const hattrie_t* src,
+                    hattrie_combine_fn combine, void* ctx);
+
+/** Remove from dst every key src does not hold, and give each key left the
+ * value combine returns for its values in dst and src, or, if combine is
+ * NULL, its value in src. Subtrees of dst under bytes src holds nothing under
+ * are freed whole, and other keys are looked up in src from the deepest of its
+ * trie nodes on their path, which is followed down alongside dst's. */
+void hattrie_intersect (hattrie_t* dst, const hattrie_t* src,
+                        hattrie_combine_fn combine, void* ctx);
+
+/** Remove from dst every key src holds. Subtrees of dst under bytes src holds
+ * nothing under are never visited, and other keys are looked up as by
+ * hattrie_intersect. Neither may be shared. */
+void hattrie_difference (hattrie_t* dst, const hattrie_t* src);
+
+
+/** A cursor remembers the trie nodes along the last key it found, so that a
+ * following key with a shared prefix is found starting from the deepest node
+ * on that prefix. It speeds runs of sorted or clustered keys. A cursor stays
+ * valid as the trie changes, falling back to the root after a bucket is split,
+ * but must be freed before the trie is. */
+typedef struct hattrie_cursor_t_ hattrie_cursor_t;
+
+hattrie_cursor_t* hattrie_cursor_create (hattrie_t*);
+void              hattrie_cursor_free   (hattrie_cursor_t*);
+value_t*          hattrie_cursor_get    (hattrie_cursor_t*, const char* key, size_t len);
+value_t*          hattrie_cursor_tryget (hattrie_cursor_t*, const char* key, size_t len);
+
+/** A trie that many threads may use at once, through the functions below,
+ * which copy values in and out rather than hand out pointers into the trie.
+ * Threads lock only the trie nodes they pass through, one at a time, reading,
+ * and the one whose bucket or value they change, writing, so that changes to
+ * different buckets go ahead in parallel once the trie has grown past its
+ * first few buckets. Summaries are not kept. */
+
+/* Let threads pass through trie nodes, and look up keys, without taking
+ * locks, reading a version of each node instead and starting over if it
+ * changes, so that they write to nothing they share until they change a
+ * value or bucket. Buckets then copy slots as a shared trie's do (see
+ * HATTRIE_SHARED). An option for hattrie_concurrent_create_ex. */
+#define HATTRIE_OPTIMISTIC 0x10
+typedef struct hattrie_concurrent_t_ hattrie_concurrent_t;
+
+hattrie_concurrent_t* hattrie_concurrent_create (void);
+hattrie_concurrent_t* hattrie_concurrent_create_ex (unsigned int flags);
+void                  hattrie_concurrent_free   (hattrie_concurrent_t*);
+size_t                hattrie_concurrent_size   (hattrie_concurrent_t*);
+
+/** Copy a key's value into val, returning false if the key does not exist. */
+bool    hattrie_concurrent_tryget (hattrie_concurrent_t*, const char* key, size_t len,
+                                   value_t* val);
+
+/** As hattrie_set, hattrie_add, and hattrie_del. */
+void    hattrie_concurrent_set (hattrie_concurrent_t*, const char* key, size_t len,
+                                value_t val);
+value_t hattrie_concurrent_add (hattrie_concurrent_t*, const char* key, size_t len,
+                                value_t delta);
+int     hattrie_concurrent_del (hattrie_concurrent_t*, const char* key, size_t len);
+
+/** The trie itself, for iterating or any other use once no other thread is
+ * using it, and until one does again. */
+hattrie_t* hattrie_concurrent_trie (hattrie_concurrent_t*);
+
+/** A thread that reads a trie created with HATTRIE_SHARED while its owner
+ * changes it. Between hattrie_reader_enter and hattrie_reader_leave, the
+ * reader's thread may call hattrie_tryget and iterate over the trie, taking no
+ * locks, and anything it finds stays valid until it leaves. A reader should
+ * leave now and then, since memory the owner replaces is kept until every
+ * reader that entered before then has left. Readers are created and freed
+ * by any thread, but entered and left only by the one using them, and must
+ * all be freed before the trie is. */
+typedef struct hattrie_reader_t_ hattrie_reader_t;
+
+hattrie_reader_t* hattrie_reader_create (hattrie_t*);
+void              hattrie_reader_free   (hattrie_reader_t*);
+void              hattrie_reader_enter  (hattrie_reader_t*);
+void              hattrie_reader_leave  (hattrie_reader_t*);
+
 /** Delete a given key from trie. Returns 0 if successful or -1 if not found.
  */
 int hattrie_del(hattrie_t* T, const char* key, size_t len);
 
+/** Find the longest stored key that is a prefix of the given key, returning a
+ * pointer to its value and setting matched_len to its length, or returning
+ * NULL if no stored key is a prefix of it. The trie is walked once. */
+value_t* hattrie_longest_prefix(hattrie_t*, const char* key, size_t len,
+                                size_t* matched_len);
+
+/** Call fn with the length and value of every stored key that is a prefix of
+ * the given key, shortest first, stopping early if fn returns nonzero. */
+typedef int (*hattrie_prefix_fn)(size_t len, value_t* val, void* ctx);
+void hattrie_prefixes(hattrie_t*, const char* key, size_t len,
+                      hattrie_prefix_fn fn, void* ctx);
+
 typedef struct hattrie_iter_t_ hattrie_iter_t;
 
+/** Number of keys beginning with the given prefix. */
+size_t hattrie_count_prefix(const hattrie_t*, const char* prefix, size_t len);
+
+/** The number, sum, least, and largest of the values of keys beginning with
+ * a prefix. The least and largest are 0 if there are no such keys. */
+typedef struct hattrie_aggregate_t_
+{
+    size_t count;
+    value_t sum;
+    value_t min;
+    value_t max;
+} hattrie_aggregate_t;
+
+/** Aggregate the values of keys beginning with the given prefix. With
+ * HATTRIE_AGGREGATES this is a walk down the trie, plus a pass over one bucket
+ * if the prefix ends inside one; otherwise every such key is visited. */
+hattrie_aggregate_t hattrie_aggregate_prefix(const hattrie_t*,
+                                             const char* prefix, size_t len);
+
+/** Number of keys less than the given key, which need not be stored. */
+size_t hattrie_rank(const hattrie_t*, const char* key, size_t len);
+
+/** Begin a sorted iterator at the key of rank k, the k-th smallest counting
+ * from 0, or return NULL if there are no more than k keys. Selecting a rank
+ * uniformly at random below hattrie_size samples keys uniformly. */
+hattrie_iter_t* hattrie_select(const hattrie_t*, size_t k);
+
+/** Find up to k keys beginning with the given prefix that have the largest
+ * values, storing them in out in descending order of value, with ties in no
+ * particular order. Returns how many were found. Keys are stored whole,
+ * including the prefix. Without HATTRIE_MAXIMA every key with the prefix is
+ * examined. The keys are NUL terminated, allocated with malloc, and owned by
+ * the caller. */
+size_t hattrie_topk_prefix(hattrie_t*, const char* prefix, size_t len,
+                           size_t k, hattrie_entry_t* out);
+
 hattrie_iter_t* hattrie_iter_begin     (const hattrie_t*, bool sorted);
 hattrie_iter_t* hattrie_iter_begin_with_prefix (
     const hattrie_t* T, bool sorted, const char* prefix, size_t prefixsize);
+
+/** Iterate in sorted order through the keys lo <= key < hi. A NULL bound
+ * leaves that end of the range open. Subtrees outside the range are never
+ * visited. */
+hattrie_iter_t* hattrie_iter_begin_range (const hattrie_t* T,
+                                          const char* lo, size_t lo_len,
+                                          const char* hi, size_t hi_len);
+
+/** Iterate in descending sorted order through all keys, the keys with a given
+ * prefix, or the keys lo <= key < hi. */
+hattrie_iter_t* hattrie_iter_begin_reverse (const hattrie_t*);
+hattrie_iter_t* hattrie_iter_begin_with_prefix_reverse (
+    const hattrie_t* T, const char* prefix, size_t prefixsize);
+hattrie_iter_t* hattrie_iter_begin_range_reverse (const hattrie_t* T,
+                                                  const char* lo, size_t lo_len,
+                                                  const char* hi, size_t hi_len);
+
+/** Reposition a sorted iterator at the first key in its range that is >= the
+ * given key, or for descending iterators, the first that is <= it. For prefix
+ * iterators the key excludes the prefix, as it does for hattrie_iter_key. */
+void            hattrie_iter_seek      (hattrie_iter_t*, const char* key, size_t len);
+
 void            hattrie_iter_next      (hattrie_iter_t*);
 bool            hattrie_iter_finished  (hattrie_iter_t*);
 void            hattrie_iter_free      (hattrie_iter_t*);
@@ -69,6 +337,88 @@ value_t*        hattrie_iter_val       (hattrie_iter_t*);
 bool            hattrie_iter_equal     (const hattrie_iter_t* a,
                                         const hattrie_iter_t* b);
 
+
+/** Split the keys beginning with a prefix into at most n iterators over
+ * disjoint ranges holding roughly equal numbers of keys, storing them in out
+ * and returning how many there are, which is fewer than n only if there are
+ * fewer keys. The ranges follow one another in order, so sorted iterators
+ * taken in turn visit the keys as one sorted iterator would. Cuts fall between
+ * the children of trie nodes where that keeps the parts within an eighth of
+ * their size, and otherwise inside a bucket. Keys exclude the prefix, as with
+ * hattrie_iter_begin_with_prefix. Counting the keys under each child is
+ * immediate with HATTRIE_COUNTS, and otherwise walks the trie nodes. */
+size_t hattrie_iter_split (const hattrie_t*, bool sorted,
+                           const char* prefix, size_t len,
+                           size_t n, hattrie_iter_t** out);
+
+/** Call fn with every key and its value, in no particular order, from
+ * nthreads threads at once, the calling thread among them. The trie is split
+ * into a few parts per thread, as by hattrie_iter_split, and a thread that
+ * finishes its own takes parts from another. Values may be changed through
+ * the pointer fn is given, but keys may not be added or removed meanwhile, and
+ * summaries of HATTRIE_MAXIMA or HATTRIE_SUMS do not follow changed values. */
+typedef void (*hattrie_visit_fn)(const char* key, size_t len, value_t* val, void* ctx);
+void hattrie_parallel_for_each (hattrie_t*, hattrie_visit_fn fn, void* ctx,
+                                size_t nthreads);
+
+/** Find keys dividing the trie into n ranges holding equal numbers of keys,
+ * to within one, storing up to n - 1 of them in out in ascending order and
+ * returning how many there are. Each range runs from one key up to, but
+ * excluding, the next, and out[j].val is the number of keys less than
+ * out[j].key. Bounds are found by rank, descending through the counts of
+ * subtrees and into a single bucket, so they need not be stored keys, and
+ * fewer are returned if there are fewer than n keys. Keys are NUL terminated,
+ * allocated with malloc, and owned by the caller. */
+size_t hattrie_quantiles (const hattrie_t*, size_t n, hattrie_entry_t* out);
+
+/** Remove the keys with lo <= key < hi from the trie and return them in a new
+ * one with the same flags. A NULL bound leaves that end open. Subtrees and
+ * buckets whose keys all lie in range are moved whole, without copying, and
+ * only the buckets a bound falls inside are divided key by key. Neither trie
+ * may be HATTRIE_SHARED. */
+hattrie_t* hattrie_extract_range (hattrie_t*, const char* lo, size_t lo_len,
+                                  const char* hi, size_t hi_len);
+
+/** Take a snapshot of the trie in constant time: a trie holding the keys and
+ * values it holds now, which shares all of its nodes. Either may then be
+ * changed without the other seeing it, as each copies the trie nodes and
+ * buckets on a key's path that the other still holds before changing them,
+ * and so one thread may iterate through a snapshot while another changes the
+ * trie. Lookups copy nothing: values must not be written through the pointers
+ * hattrie_tryget, hattrie_cursor_tryget, the prefix functions, or iterators
+ * return while nodes are shared, but only through hattrie_get and the other
+ * functions that change a key. hattrie_fetch_add and hattrie_compare_exchange
+ * copy a key's path only while a node on it is still shared, under a lock, so
+ * that threads may keep counting into the trie. Merging and the set
+ * operations copy whatever is still shared first. A snapshot is freed with
+ * hattrie_free, in any order with the trie. Neither may be HATTRIE_SHARED or
+ * belong to a hattrie_concurrent_t. */
+hattrie_t* hattrie_snapshot (hattrie_t*);
+
+/** Copy a trie into a new one with the same options, node for node: trie
+ * nodes are copied with the same children, and buckets slot by slot, so no key
+ * is hashed again and no bucket split. hattrie_dup_parallel uses up to
+ * nthreads threads, copying the children of the upper trie nodes on a pool of
+ * them, the largest first. The trie must not change meanwhile. */
+hattrie_t* hattrie_dup          (const hattrie_t*);
+hattrie_t* hattrie_dup_parallel (const hattrie_t*, size_t nthreads);
+
+
+/** Iterate through the keys within max_edits insertions, deletions, or
+ * substitutions of a query, in no particular order, along with their edit
+ * distance. Subtrees with no key that close are never visited. */
+typedef struct hattrie_fuzzy_iter_t_ hattrie_fuzzy_iter_t;
+
+hattrie_fuzzy_iter_t* hattrie_fuzzy_iter_begin    (const hattrie_t*,
+                                                   const char* query, size_t len,
+                                                   size_t max_edits);
+void                  hattrie_fuzzy_iter_next     (hattrie_fuzzy_iter_t*);
+bool                  hattrie_fuzzy_iter_finished (hattrie_fuzzy_iter_t*);
+void                  hattrie_fuzzy_iter_free     (hattrie_fuzzy_iter_t*);
+const char*           hattrie_fuzzy_iter_key      (hattrie_fuzzy_iter_t*, size_t* len);
+value_t*              hattrie_fuzzy_iter_val      (hattrie_fuzzy_iter_t*);
+size_t                hattrie_fuzzy_iter_dist     (hattrie_fuzzy_iter_t*);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,308 @@
+/*
+ * This file is part of hat-trie.
+ *
+ * Copyright (c) 2011 by Daniel C. Jones <dcjones@cs.washington.edu>
+ *
+ * See matcher.h for a description of the matcher.
+ *
+ */
+
+#include "matcher.h"
+#include "misc.h"
+#include "pstdint.h"
+#include <assert.h>
+#include <string.h>
+
+/* State 0 is the root, which stands for the empty prefix. Since no other state
+ * can lead back to it, 0 also marks a missing transition or output link. */
+static const uint32_t ROOT = 0;
+
+typedef struct ac_state_t_
+{
+    uint32_t edges;   // index of the first outgoing edge
+    uint32_t n_edges; // number of outgoing edges, sorted by label
+    uint32_t fail;    // state for the longest proper suffix of this prefix
+    uint32_t out;     // nearest final state on the failure chain, or ROOT
+    uint32_t depth;   // length of the prefix
+    bool     final;   // true if the prefix is a key
+    value_t  val;     // the key's value
+} ac_state_t;
+
+
+struct hattrie_matcher_t_
+{
+    size_t n;  // number of states
+    ac_state_t* states;
+
+    unsigned char* labels; // edge labels, grouped by source state
+    uint32_t* targets;     // edge targets
+
+    /* the root is left on nearly every character of a text, so its
+     * transitions are kept in a table */
+    uint32_t root[256];
+};
+
+
+struct hattrie_match_stream_t_
+{
+    const hattrie_matcher_t* M;
+    uint32_t state;
+    uint32_t out;  // next key to report where fn stopped the scan, else ROOT
+    size_t offset; // number of characters consumed so far
+};
+
+
+/* Follow the edge labeled c out of s, returning ROOT if there is none. */
+static inline uint32_t ac_goto(const hattrie_matcher_t* M, uint32_t s, unsigned char c)
+{
+    if (s == ROOT) return M->root[c];
+
+    const ac_state_t* st = &M->states[s];
+    const unsigned char* labels = M->labels + st->edges;
+    uint32_t lo = 0, hi = st->n_edges, mid;
+
+    /* binary search, finishing with a short linear scan */
+    while (hi - lo > 8) {
+        mid = lo + (hi - lo) / 2;
+        if (labels[mid] < c) lo = mid + 1;
+        else                 hi = mid;
+    }
+
+    for (; lo < hi; ++lo) {
+        if (labels[lo] == c) return M->targets[st->edges + lo];
+        if (labels[lo] > c) break;
+    }
+
+    return ROOT;
+}
+
+
+hattrie_matcher_t* hattrie_matcher_create(const hattrie_t* T)
+{
+    hattrie_matcher_t* M = malloc_or_die(sizeof(hattrie_matcher_t));
+
+    /* Build the trie of key prefixes. Keys arrive in sorted order, so each
+     * key adds states only past the prefix it shares with the previous one,
+     * and the children of a state are created in order of their labels. */
+    size_t cap = 1024;
+    M->n = 1;
+    M->states = malloc_or_die(cap * sizeof(ac_state_t));
+    uint32_t* parents = malloc_or_die(cap * sizeof(uint32_t));
+    unsigned char* chars = malloc_or_die(cap * sizeof(unsigned char));
+
+    memset(&M->states[ROOT], 0, sizeof(ac_state_t));
+    parents[ROOT] = ROOT;
+    chars[ROOT] = '\0';
+
+    size_t pathsize = 16;
+    uint32_t* path = malloc_or_die(pathsize * sizeof(uint32_t));
+    char* prev = malloc_or_die(pathsize * sizeof(char));
+    size_t prev_len = 0;
+    path[0] = ROOT;
+
+    hattrie_iter_t* i = hattrie_iter_begin(T, true);
+    const char* key;
+    size_t len, d;
+    uint32_t s;
+
+    for (; !hattrie_iter_finished(i); hattrie_iter_next(i)) {
+        key = hattrie_iter_key(i, &len);
+        if (len == 0) continue;
+
+        if (pathsize < len + 1) {
+            while (pathsize < len + 1) pathsize *= 2;
+            path = realloc_or_die(path, pathsize * sizeof(uint32_t));
+            prev = realloc_or_die(prev, pathsize * sizeof(char));
+        }
+
+        for (d = 0; d < prev_len && d < len && prev[d] == key[d]; ++d);
+
+        for (; d < len; ++d) {
+            if (M->n == cap) {
+                if (cap >= UINT32_MAX / 2) {
+                    fprintf(stderr, "Too many key prefixes to build a matcher.\n");
+                    exit(EXIT_FAILURE);
+                }
+                cap *= 2;
+                M->states = realloc_or_die(M->states, cap * sizeof(ac_state_t));
+                parents = realloc_or_die(parents, cap * sizeof(uint32_t));
+                chars = realloc_or_die(chars, cap * sizeof(unsigned char));
+            }
+
+            s = (uint32_t) M->n++;
+            memset(&M->states[s], 0, sizeof(ac_state_t));
+            M->states[s].depth = (uint32_t) (d + 1);
+            parents[s] = path[d];
+            chars[s] = (unsigned char) key[d];
+            path[d + 1] = s;
+        }
+
+        M->states[path[len]].final = true;
+        M->states[path[len]].val = *hattrie_iter_val(i);
+
+        memcpy(prev, key, len);
+        prev_len = len;
+    }
+    hattrie_iter_free(i);
+    free(path);
+    free(prev);
+
+
+    /* lay out the edges of each state contiguously, in order of label */
+    for (s = 1; s < M->n; ++s) ++M->states[parents[s]].n_edges;
+
+    uint32_t e = 0;
+    for (s = 0; s < M->n; ++s) {
+        M->states[s].edges = e;
+        e += M->states[s].n_edges;
+        M->states[s].n_edges = 0;
+    }
+
+    M->labels  = malloc_or_die((M->n - 1) * sizeof(unsigned char));
+    M->targets = malloc_or_die((M->n - 1) * sizeof(uint32_t));
+    memset(M->root, 0, sizeof(M->root));
+
+    ac_state_t* p;
+    for (s = 1; s < M->n; ++s) {
+        p = &M->states[parents[s]];
+        M->labels[p->edges + p->n_edges]  = chars[s];
+        M->targets[p->edges + p->n_edges] = s;
+        ++p->n_edges;
+        if (parents[s] == ROOT) M->root[chars[s]] = s;
+    }
+    free(chars);
+
+
+    /* Set failure and output links breadth-first, so that every shallower
+     * state has its links by the time they are followed. */
+    uint32_t* queue = parents; // no longer needed, and exactly large enough
+    size_t head = 0, tail = 0;
+    uint32_t t, f, j;
+
+    for (j = 0; j < M->states[ROOT].n_edges; ++j) {
+        queue[tail++] = M->targets[M->states[ROOT].edges + j];
+    }
+
+    while (head < tail) {
+        s = queue[head++];
+        for (j = 0; j < M->states[s].n_edges; ++j) {
+            t = M->targets[M->states[s].edges + j];
+            unsigned char c = M->labels[M->states[s].edges + j];
+
+            f = M->states[s].fail;
+            while (f != ROOT && ac_goto(M, f, c) == ROOT) f = M->states[f].fail;
+            f = ac_goto(M, f, c);
+
+            M->states[t].fail = f;
+            M->states[t].out  = M->states[f].final ? f : M->states[f].out;
+            queue[tail++] = t;
+        }
+    }
+    free(queue);
+
+    return M;
+}
+
+
+void hattrie_matcher_free(hattrie_matcher_t* M)
+{
+    if (M == NULL) return;
+    free(M->states);
+    free(M->labels);
+    free(M->targets);
+    free(M);
+}
+
+
+size_t hattrie_matcher_sizeof(const hattrie_matcher_t* M)
+{
+    return sizeof(hattrie_matcher_t) +
+           M->n * sizeof(ac_state_t) +
+           (M->n - 1) * (sizeof(unsigned char) + sizeof(uint32_t));
+}
+
+
+/* Advance from state *state through text, which begins offset characters into
+ * the whole text, reporting matches, first those from *out on that end where
+ * the last run stopped. If fn stops the run, *used is the number of characters
+ * consumed and *out the next key ending there. */
+static int hattrie_matcher_run(const hattrie_matcher_t* M, uint32_t* state,
+                               uint32_t* out, size_t offset,
+                               const char* text, size_t len,
+                               hattrie_match_fn fn, void* ctx, size_t* used)
+{
+    uint32_t s = *state, t = ROOT, u = *out;
+    unsigned char c;
+    size_t i;
+    int ret;
+
+    for (i = 0; ; ++i) {
+        /* report keys ending before text[i], longest first */
+        while (u != ROOT) {
+            ret = fn(offset + i - M->states[u].depth, M->states[u].depth,
+                     M->states[u].val, ctx);
+            u = M->states[u].out;
+            if (ret) {
+                *state = s;
+                *out = u;
+                *used = i;
+                return ret;
+            }
+        }
+
+        if (i == len) break;
+        c = (unsigned char) text[i];
+
+        while (s != ROOT && (t = ac_goto(M, s, c)) == ROOT) s = M->states[s].fail;
+        s = s == ROOT ? M->root[c] : t;
+        u = M->states[s].final ? s : M->states[s].out;
+    }
+
+    *state = s;
+    *out = ROOT;
+    *used = len;
+    return 0;
+}
+
+
+int hattrie_matcher_scan(const hattrie_matcher_t* M, const char* text, size_t len,
+                         hattrie_match_fn fn, void* ctx)
+{
+    uint32_t s = ROOT, out = ROOT;
+    size_t used;
+    return hattrie_matcher_run(M, &s, &out, 0, text, len, fn, ctx, &used);
+}
+
+
+hattrie_match_stream_t* hattrie_match_stream_begin(const hattrie_matcher_t* M)
+{
+    hattrie_match_stream_t* S = malloc_or_die(sizeof(hattrie_match_stream_t));
+    S->M = M;
+    S->state = ROOT;
+    S->out = ROOT;
+    S->offset = 0;
+    return S;
+}
+
+
+int hattrie_match_stream_feed(hattrie_match_stream_t* S, const char* chunk, size_t len,
+                              hattrie_match_fn fn, void* ctx)
+{
+    size_t used;
+    int ret = hattrie_matcher_run(S->M, &S->state, &S->out, S->offset,
+                                  chunk, len, fn, ctx, &used);
+    S->offset += used;
+    return ret;
+}
+
+
+size_t hattrie_match_stream_offset(const hattrie_match_stream_t* S)
+{
+    return S->offset;
+}
+
+
+void hattrie_match_stream_free(hattrie_match_stream_t* S)
+{
+    free(S);
+}
@@ -0,0 +1,74 @@
+/*
+ * This file is part of hat-trie.
+ *
+ * Copyright (c) 2011 by Daniel C. Jones <dcjones@cs.washington.edu>
+ *
+ *
+ * A matcher finds every occurrence of the keys of a hat-trie in a text, in a
+ * single pass, using the automaton of,
+ *
+ *    Aho, A. V., & Corasick, M. J. (1975). Efficient string matching: an aid to
+ *    bibliographic search. Communications of the ACM, 18(6), 333–340.
+ *
+ * The hat-trie's buckets hold key suffixes in no particular order, which does
+ * not allow following a text one character at a time, so the matcher is
+ * compiled into a separate automaton: a trie with one state per distinct key
+ * prefix, failure links from each state to the state for its longest proper
+ * suffix, and output links from each state to the nearest state on its failure
+ * chain that ends a key.
+ *
+ * The matcher copies the keys and values it is compiled from, so it is not
+ * affected by later changes to the trie.
+ *
+ */
+
+#ifndef HATTRIE_MATCHER_H
+#define HATTRIE_MATCHER_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "common.h"
+#include "hat-trie.h"
+#include <stdlib.h>
+
+typedef struct hattrie_matcher_t_ hattrie_matcher_t;
+
+/** Compile a matcher for the non-empty keys of T. */
+hattrie_matcher_t* hattrie_matcher_create (const hattrie_t* T);
+void               hattrie_matcher_free   (hattrie_matcher_t*);
+size_t             hattrie_matcher_sizeof (const hattrie_matcher_t*);
+
+
+/** Called for each match with the offset at which the key occurs, its length,
+ * and its value. Returning nonzero stops the scan. */
+typedef int (*hattrie_match_fn)(size_t offset, size_t len, value_t val, void* ctx);
+
+
+/** Report every occurrence of a key in text, in order of where the occurrences
+ * end, and for occurrences ending at the same place, longest first. Returns
+ * the nonzero value fn stopped the scan with, or 0. */
+int hattrie_matcher_scan (const hattrie_matcher_t*, const char* text, size_t len,
+                          hattrie_match_fn fn, void* ctx);
+
+
+/** Scan a text given in consecutive chunks. Occurrences spanning chunks are
+ * found, and offsets are from the start of the first chunk. If fn stops the
+ * scan, the stream stops where the match ends, having consumed only the part
+ * of the chunk hattrie_match_stream_offset counts, and feeding it the rest of
+ * the chunk resumes the scan, with any shorter keys ending there first. */
+typedef struct hattrie_match_stream_t_ hattrie_match_stream_t;
+
+hattrie_match_stream_t* hattrie_match_stream_begin (const hattrie_matcher_t*);
+int                     hattrie_match_stream_feed  (hattrie_match_stream_t*,
+                                                    const char* chunk, size_t len,
+                                                    hattrie_match_fn fn, void* ctx);
+size_t                  hattrie_match_stream_offset(const hattrie_match_stream_t*);
+void                    hattrie_match_stream_free  (hattrie_match_stream_t*);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
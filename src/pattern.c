@@ -0,0 +1,649 @@
+/*
+ * This file is part of hat-trie.
+ *
+ * Copyright (c) 2011 by Daniel C. Jones <dcjones@cs.washington.edu>
+ *
+ * See pattern.h for the supported syntax.
+ *
+ */
+
+#include "pattern.h"
+#include "misc.h"
+#include <assert.h>
+#include <string.h>
+
+/* Nondeterministic automaton states, in the style of Thompson. A CHAR state
+ * consumes a byte in its class and moves to out, a SPLIT moves to both out and
+ * out1 without consuming anything, and an EPS moves to out. */
+static const uint8_t NFA_CHAR  = 0;
+static const uint8_t NFA_SPLIT = 1;
+static const uint8_t NFA_EPS   = 2;
+static const uint8_t NFA_MATCH = 3;
+
+static const uint32_t NFA_NONE = UINT32_MAX;
+
+/* marks a transition of the deterministic automaton not yet built */
+static const uint32_t DFA_UNKNOWN = UINT32_MAX;
+
+typedef struct nfa_state_t_
+{
+    uint8_t  type;
+    uint32_t out, out1;
+    uint32_t cls; // index of the class of bytes a CHAR state consumes
+} nfa_state_t;
+
+
+typedef struct nfa_class_t_
+{
+    uint64_t bits[4];
+} nfa_class_t;
+
+
+/* A piece of the automaton under construction. Its end is an EPS state whose
+ * out is filled in by whatever follows. */
+typedef struct nfa_frag_t_
+{
+    uint32_t start, end;
+} nfa_frag_t;
+
+
+struct hattrie_pattern_t_
+{
+    nfa_state_t* nfa;
+    size_t nfa_n, nfa_size;
+
+    nfa_class_t* classes;
+    size_t classes_n, classes_size;
+
+    /* Deterministic states. Each is a set of nfa states, stored in order as a
+     * run of set_pool. State HATTRIE_PATTERN_DEAD is the empty set. */
+    uint32_t* set_pool;
+    size_t set_pool_n, set_pool_size;
+    size_t* set_off;
+    size_t* set_len;
+    bool* accept;
+    uint32_t* trans; // 256 transitions per state
+    size_t dfa_n, dfa_size;
+    uint32_t start;
+
+    /* open addressing hash table from sets to states */
+    uint32_t* index;
+    size_t index_size;
+
+    /* scratch space for computing sets */
+    uint32_t* work;
+    uint32_t* stack;
+    uint32_t* mark;
+    uint32_t gen;
+
+    char* prefix;
+    size_t prefix_len;
+    bool has_prefix;
+};
+
+
+typedef struct pattern_parser_t_
+{
+    hattrie_pattern_t* P;
+    const unsigned char* s;
+    size_t pos, len;
+    bool error;
+} pattern_parser_t;
+
+
+static uint32_t nfa_add(hattrie_pattern_t* P, uint8_t type, uint32_t out,
+                        uint32_t out1, uint32_t cls)
+{
+    if (P->nfa_n == P->nfa_size) {
+        P->nfa_size *= 2;
+        P->nfa = realloc_or_die(P->nfa, P->nfa_size * sizeof(nfa_state_t));
+    }
+
+    nfa_state_t* u = &P->nfa[P->nfa_n];
+    u->type = type;
+    u->out  = out;
+    u->out1 = out1;
+    u->cls  = cls;
+    return (uint32_t) P->nfa_n++;
+}
+
+
+static uint32_t nfa_add_class(hattrie_pattern_t* P)
+{
+    if (P->classes_n == P->classes_size) {
+        P->classes_size *= 2;
+        P->classes = realloc_or_die(P->classes, P->classes_size * sizeof(nfa_class_t));
+    }
+    memset(&P->classes[P->classes_n], 0, sizeof(nfa_class_t));
+    return (uint32_t) P->classes_n++;
+}
+
+
+static inline void class_set(nfa_class_t* cls, unsigned char c)
+{
+    cls->bits[c >> 6] |= (uint64_t) 1 << (c & 63);
+}
+
+
+static inline bool class_has(const nfa_class_t* cls, unsigned char c)
+{
+    return (cls->bits[c >> 6] >> (c & 63)) & 1;
+}
+
+
+static nfa_frag_t frag_empty(hattrie_pattern_t* P)
+{
+    nfa_frag_t f;
+    f.start = f.end = nfa_add(P, NFA_EPS, NFA_NONE, NFA_NONE, 0);
+    return f;
+}
+
+
+static nfa_frag_t frag_class(hattrie_pattern_t* P, uint32_t cls)
+{
+    nfa_frag_t f;
+    f.end   = nfa_add(P, NFA_EPS, NFA_NONE, NFA_NONE, 0);
+    f.start = nfa_add(P, NFA_CHAR, f.end, NFA_NONE, cls);
+    return f;
+}
+
+
+static nfa_frag_t frag_byte(hattrie_pattern_t* P, unsigned char c)
+{
+    uint32_t cls = nfa_add_class(P);
+    class_set(&P->classes[cls], c);
+    return frag_class(P, cls);
+}
+
+
+static nfa_frag_t frag_any(hattrie_pattern_t* P)
+{
+    uint32_t cls = nfa_add_class(P);
+    memset(P->classes[cls].bits, 0xff, sizeof(P->classes[cls].bits));
+    return frag_class(P, cls);
+}
+
+
+static nfa_frag_t frag_cat(hattrie_pattern_t* P, nfa_frag_t a, nfa_frag_t b)
+{
+    P->nfa[a.end].out = b.start;
+    a.end = b.end;
+    return a;
+}
+
+
+static nfa_frag_t frag_alt(hattrie_pattern_t* P, nfa_frag_t a, nfa_frag_t b)
+{
+    nfa_frag_t f;
+    f.end   = nfa_add(P, NFA_EPS, NFA_NONE, NFA_NONE, 0);
+    f.start = nfa_add(P, NFA_SPLIT, a.start, b.start, 0);
+    P->nfa[a.end].out = f.end;
+    P->nfa[b.end].out = f.end;
+    return f;
+}
+
+
+/* a*, a+, or a? */
+static nfa_frag_t frag_repeat(hattrie_pattern_t* P, nfa_frag_t a, char op)
+{
+    nfa_frag_t f;
+    f.end = nfa_add(P, NFA_EPS, NFA_NONE, NFA_NONE, 0);
+    uint32_t s = nfa_add(P, NFA_SPLIT, a.start, f.end, 0);
+
+    if (op == '?') P->nfa[a.end].out = f.end;
+    else           P->nfa[a.end].out = s;
+
+    f.start = op == '+' ? a.start : s;
+    return f;
+}
+
+
+static bool parser_done(const pattern_parser_t* p)
+{
+    return p->error || p->pos >= p->len;
+}
+
+
+/* Parse a class, with the opening '[' already consumed. */
+static nfa_frag_t parse_class(pattern_parser_t* p)
+{
+    uint32_t cls = nfa_add_class(p->P);
+    nfa_class_t c;
+    memset(&c, 0, sizeof(c));
+
+    bool negate = false;
+    if (!parser_done(p) && (p->s[p->pos] == '^' || p->s[p->pos] == '!')) {
+        negate = true;
+        ++p->pos;
+    }
+
+    bool first = true;
+    unsigned int lo, hi, x;
+    while (true) {
+        if (parser_done(p)) {
+            p->error = true;
+            break;
+        }
+
+        if (p->s[p->pos] == ']' && !first) {
+            ++p->pos;
+            break;
+        }
+        first = false;
+
+        if (p->s[p->pos] == '\\' && p->pos + 1 < p->len) ++p->pos;
+        lo = hi = p->s[p->pos++];
+
+        if (p->pos + 1 < p->len && p->s[p->pos] == '-' && p->s[p->pos + 1] != ']') {
+            ++p->pos;
+            if (p->s[p->pos] == '\\' && p->pos + 1 < p->len) ++p->pos;
+            hi = p->s[p->pos++];
+        }
+
+        for (x = lo; x <= hi; ++x) class_set(&c, (unsigned char) x);
+    }
+
+    if (negate) {
+        for (x = 0; x < 4; ++x) c.bits[x] = ~c.bits[x];
+    }
+
+    p->P->classes[cls] = c;
+    return frag_class(p->P, cls);
+}
+
+
+static nfa_frag_t parse_alt(pattern_parser_t* p);
+
+
+static nfa_frag_t parse_atom(pattern_parser_t* p)
+{
+    unsigned char c = p->s[p->pos++];
+    nfa_frag_t f;
+
+    switch (c) {
+        case '(':
+            f = parse_alt(p);
+            if (parser_done(p) || p->s[p->pos] != ')') p->error = true;
+            else ++p->pos;
+            return f;
+
+        case '.':
+            return frag_any(p->P);
+
+        case '[':
+            return parse_class(p);
+
+        case '\\':
+            if (parser_done(p)) {
+                p->error = true;
+                return frag_empty(p->P);
+            }
+            return frag_byte(p->P, p->s[p->pos++]);
+
+        case '*':
+        case '+':
+        case '?':
+            /* nothing to repeat */
+            p->error = true;
+            return frag_empty(p->P);
+
+        default:
+            return frag_byte(p->P, c);
+    }
+}
+
+
+static nfa_frag_t parse_cat(pattern_parser_t* p)
+{
+    nfa_frag_t f = frag_empty(p->P);
+    nfa_frag_t g;
+    unsigned char c;
+
+    while (!parser_done(p) && p->s[p->pos] != '|' && p->s[p->pos] != ')') {
+        g = parse_atom(p);
+        while (!parser_done(p)) {
+            c = p->s[p->pos];
+            if (c != '*' && c != '+' && c != '?') break;
+            g = frag_repeat(p->P, g, (char) c);
+            ++p->pos;
+        }
+        f = frag_cat(p->P, f, g);
+    }
+
+    return f;
+}
+
+
+static nfa_frag_t parse_alt(pattern_parser_t* p)
+{
+    nfa_frag_t f = parse_cat(p);
+    while (!parser_done(p) && p->s[p->pos] == '|') {
+        ++p->pos;
+        f = frag_alt(p->P, f, parse_cat(p));
+    }
+    return f;
+}
+
+
+static nfa_frag_t parse_glob(pattern_parser_t* p)
+{
+    nfa_frag_t f = frag_empty(p->P);
+    unsigned char c;
+
+    while (!parser_done(p)) {
+        c = p->s[p->pos++];
+        if (c == '*') {
+            f = frag_cat(p->P, f, frag_repeat(p->P, frag_any(p->P), '*'));
+        }
+        else if (c == '?') {
+            f = frag_cat(p->P, f, frag_any(p->P));
+        }
+        else if (c == '[') {
+            f = frag_cat(p->P, f, parse_class(p));
+        }
+        else {
+            if (c == '\\' && !parser_done(p)) c = p->s[p->pos++];
+            f = frag_cat(p->P, f, frag_byte(p->P, c));
+        }
+    }
+
+    return f;
+}
+
+
+static hattrie_pattern_t* pattern_alloc(void)
+{
+    hattrie_pattern_t* P = malloc_or_die(sizeof(hattrie_pattern_t));
+
+    P->nfa_n = 0;
+    P->nfa_size = 64;
+    P->nfa = malloc_or_die(P->nfa_size * sizeof(nfa_state_t));
+
+    P->classes_n = 0;
+    P->classes_size = 16;
+    P->classes = malloc_or_die(P->classes_size * sizeof(nfa_class_t));
+
+    P->set_pool_n = 0;
+    P->set_pool_size = 256;
+    P->set_pool = malloc_or_die(P->set_pool_size * sizeof(uint32_t));
+
+    P->dfa_n = 0;
+    P->dfa_size = 16;
+    P->set_off = malloc_or_die(P->dfa_size * sizeof(size_t));
+    P->set_len = malloc_or_die(P->dfa_size * sizeof(size_t));
+    P->accept  = malloc_or_die(P->dfa_size * sizeof(bool));
+    P->trans   = malloc_or_die(P->dfa_size * 256 * sizeof(uint32_t));
+
+    P->index_size = 64;
+    P->index = malloc_or_die(P->index_size * sizeof(uint32_t));
+    memset(P->index, 0xff, P->index_size * sizeof(uint32_t));
+
+    P->work  = NULL;
+    P->stack = NULL;
+    P->mark  = NULL;
+    P->gen   = 0;
+
+    P->prefix = NULL;
+    P->prefix_len = 0;
+    P->has_prefix = false;
+
+    return P;
+}
+
+
+static size_t pattern_hash(const uint32_t* set, size_t n)
+{
+    size_t h = 2166136261u, i;
+    for (i = 0; i < n; ++i) h = (h ^ set[i]) * 16777619u;
+    return h ^ n;
+}
+
+
+static void pattern_reindex(hattrie_pattern_t* P)
+{
+    size_t i, h;
+    free(P->index);
+    P->index_size *= 2;
+    P->index = malloc_or_die(P->index_size * sizeof(uint32_t));
+    memset(P->index, 0xff, P->index_size * sizeof(uint32_t));
+
+    for (i = 0; i < P->dfa_n; ++i) {
+        h = pattern_hash(P->set_pool + P->set_off[i], P->set_len[i]);
+        while (P->index[h & (P->index_size - 1)] != UINT32_MAX) ++h;
+        P->index[h & (P->index_size - 1)] = (uint32_t) i;
+    }
+}
+
+
+static int cmp_uint32(const void* a_, const void* b_)
+{
+    uint32_t a = *(const uint32_t*) a_;
+    uint32_t b = *(const uint32_t*) b_;
+    return (a > b) - (a < b);
+}
+
+
+/* Find or add the deterministic state for a set of nfa states. */
+static uint32_t pattern_state(hattrie_pattern_t* P, uint32_t* set, size_t n)
+{
+    qsort(set, n, sizeof(uint32_t), cmp_uint32);
+
+    size_t h = pattern_hash(set, n);
+    uint32_t d;
+    while ((d = P->index[h & (P->index_size - 1)]) != UINT32_MAX) {
+        if (P->set_len[d] == n &&
+            memcmp(P->set_pool + P->set_off[d], set, n * sizeof(uint32_t)) == 0) {
+            return d;
+        }
+        ++h;
+    }
+
+    if (P->dfa_n == P->dfa_size) {
+        P->dfa_size *= 2;
+        P->set_off = realloc_or_die(P->set_off, P->dfa_size * sizeof(size_t));
+        P->set_len = realloc_or_die(P->set_len, P->dfa_size * sizeof(size_t));
+        P->accept  = realloc_or_die(P->accept, P->dfa_size * sizeof(bool));
+        P->trans   = realloc_or_die(P->trans, P->dfa_size * 256 * sizeof(uint32_t));
+    }
+
+    if (P->set_pool_n + n > P->set_pool_size) {
+        while (P->set_pool_n + n > P->set_pool_size) P->set_pool_size *= 2;
+        P->set_pool = realloc_or_die(P->set_pool, P->set_pool_size * sizeof(uint32_t));
+    }
+
+    d = (uint32_t) P->dfa_n++;
+    P->set_off[d] = P->set_pool_n;
+    P->set_len[d] = n;
+    memcpy(P->set_pool + P->set_pool_n, set, n * sizeof(uint32_t));
+    P->set_pool_n += n;
+
+    P->accept[d] = false;
+    size_t i;
+    for (i = 0; i < n; ++i) {
+        if (P->nfa[set[i]].type == NFA_MATCH) P->accept[d] = true;
+    }
+
+    for (i = 0; i < 256; ++i) P->trans[256 * d + i] = DFA_UNKNOWN;
+
+    P->index[h & (P->index_size - 1)] = d;
+    if (2 * P->dfa_n > P->index_size) pattern_reindex(P);
+
+    return d;
+}
+
+
+/* Add the nfa states reachable from s without consuming a byte to the set,
+ * skipping those already marked. Only CHAR and MATCH states are kept, since
+ * they alone decide transitions and acceptance. */
+static void pattern_closure(hattrie_pattern_t* P, uint32_t s, uint32_t* set, size_t* n)
+{
+    size_t top = 0;
+    P->stack[top++] = s;
+
+    while (top > 0) {
+        s = P->stack[--top];
+        if (s == NFA_NONE || P->mark[s] == P->gen) continue;
+        P->mark[s] = P->gen;
+
+        if (P->nfa[s].type == NFA_CHAR || P->nfa[s].type == NFA_MATCH) {
+            set[(*n)++] = s;
+        }
+        else {
+            if (P->nfa[s].type == NFA_SPLIT) P->stack[top++] = P->nfa[s].out1;
+            P->stack[top++] = P->nfa[s].out;
+        }
+    }
+}
+
+
+static hattrie_pattern_t* pattern_compile(hattrie_pattern_t* P, pattern_parser_t* p,
+                                          nfa_frag_t f)
+{
+    if (p->error || p->pos < p->len) {
+        hattrie_pattern_free(P);
+        return NULL;
+    }
+
+    uint32_t match = nfa_add(P, NFA_MATCH, NFA_NONE, NFA_NONE, 0);
+    P->nfa[f.end].out = match;
+
+    /* every state is on the stack at most twice, once from each edge into it */
+    P->work  = malloc_or_die(P->nfa_n * sizeof(uint32_t));
+    P->stack = malloc_or_die(2 * P->nfa_n * sizeof(uint32_t));
+    P->mark  = malloc_or_die(P->nfa_n * sizeof(uint32_t));
+    memset(P->mark, 0, P->nfa_n * sizeof(uint32_t));
+
+    size_t n = 0;
+    pattern_state(P, P->work, 0);
+    assert(P->dfa_n == HATTRIE_PATTERN_DEAD + 1);
+
+    ++P->gen;
+    pattern_closure(P, f.start, P->work, &n);
+    P->start = pattern_state(P, P->work, n);
+
+    return P;
+}
+
+
+hattrie_pattern_t* hattrie_pattern_glob(const char* glob, size_t len)
+{
+    hattrie_pattern_t* P = pattern_alloc();
+    pattern_parser_t p = { P, (const unsigned char*) glob, 0, len, false };
+    nfa_frag_t f = parse_glob(&p);
+    return pattern_compile(P, &p, f);
+}
+
+
+hattrie_pattern_t* hattrie_pattern_regex(const char* re, size_t len)
+{
+    hattrie_pattern_t* P = pattern_alloc();
+    pattern_parser_t p = { P, (const unsigned char*) re, 0, len, false };
+    nfa_frag_t f = parse_alt(&p);
+    return pattern_compile(P, &p, f);
+}
+
+
+void hattrie_pattern_free(hattrie_pattern_t* P)
+{
+    if (P == NULL) return;
+    free(P->nfa);
+    free(P->classes);
+    free(P->set_pool);
+    free(P->set_off);
+    free(P->set_len);
+    free(P->accept);
+    free(P->trans);
+    free(P->index);
+    free(P->work);
+    free(P->stack);
+    free(P->mark);
+    free(P->prefix);
+    free(P);
+}
+
+
+uint32_t hattrie_pattern_start(const hattrie_pattern_t* P)
+{
+    return P->start;
+}
+
+
+uint32_t hattrie_pattern_step(hattrie_pattern_t* P, uint32_t d, unsigned char c)
+{
+    uint32_t t = P->trans[256 * d + c];
+    if (t != DFA_UNKNOWN) return t;
+
+    size_t i, n = 0;
+    uint32_t s;
+    ++P->gen;
+    for (i = 0; i < P->set_len[d]; ++i) {
+        s = P->set_pool[P->set_off[d] + i];
+        if (P->nfa[s].type == NFA_CHAR && class_has(&P->classes[P->nfa[s].cls], c)) {
+            pattern_closure(P, P->nfa[s].out, P->work, &n);
+        }
+    }
+
+    t = pattern_state(P, P->work, n);
+    P->trans[256 * d + c] = t;
+    return t;
+}
+
+
+uint32_t hattrie_pattern_run(hattrie_pattern_t* P, uint32_t d, const char* s, size_t len)
+{
+    size_t i;
+    for (i = 0; i < len && d != HATTRIE_PATTERN_DEAD; ++i) {
+        d = hattrie_pattern_step(P, d, (unsigned char) s[i]);
+    }
+    return d;
+}
+
+
+bool hattrie_pattern_accepts(const hattrie_pattern_t* P, uint32_t d)
+{
+    return P->accept[d];
+}
+
+
+bool hattrie_pattern_match(hattrie_pattern_t* P, const char* key, size_t len)
+{
+    return P->accept[hattrie_pattern_run(P, P->start, key, len)];
+}
+
+
+size_t hattrie_pattern_prefix(hattrie_pattern_t* P, const char** prefix)
+{
+    if (!P->has_prefix) {
+        size_t size = 16;
+        P->prefix = malloc_or_die(size);
+        P->prefix_len = 0;
+
+        /* Follow the automaton while exactly one byte keeps it alive. A chain
+         * longer than the number of states loops without accepting. */
+        uint32_t d = P->start, t, next;
+        unsigned int c, only = 0;
+        while (!P->accept[d] && P->prefix_len < P->dfa_n) {
+            next = HATTRIE_PATTERN_DEAD;
+            for (c = 0; c < 256; ++c) {
+                t = hattrie_pattern_step(P, d, (unsigned char) c);
+                if (t == HATTRIE_PATTERN_DEAD) continue;
+                if (next != HATTRIE_PATTERN_DEAD) break;
+                next = t;
+                only = c;
+            }
+            if (c < 256 || next == HATTRIE_PATTERN_DEAD) break;
+
+            if (P->prefix_len == size) {
+                size *= 2;
+                P->prefix = realloc_or_die(P->prefix, size);
+            }
+            P->prefix[P->prefix_len++] = (char) only;
+            d = next;
+        }
+
+        P->has_prefix = true;
+    }
+
+    *prefix = P->prefix;
+    return P->prefix_len;
+}
@@ -0,0 +1,79 @@
+/*
+ * This file is part of hat-trie.
+ *
+ * Copyright (c) 2011 by Daniel C. Jones <dcjones@cs.washington.edu>
+ *
+ *
+ * Patterns match whole keys, and are written either as globs or as a
+ * restricted form of regular expressions.
+ *
+ * Globs support '*' (any run of bytes), '?' (any one byte), '[...]' classes,
+ * and '\' to escape the next byte.
+ *
+ * Regular expressions support concatenation, '|', grouping with '(...)', the
+ * repetitions '*', '+', and '?', '.' (any one byte), '[...]' classes, and '\'
+ * to escape the next byte. They are always anchored at both ends.
+ *
+ * Classes list bytes and ranges such as 'a-z', and are negated by a leading
+ * '^' or '!'. A ']' right after the opening '[' (and negation) is literal.
+ *
+ * A pattern is compiled to a nondeterministic automaton, which is made
+ * deterministic lazily, one state at a time, as keys are fed to it. Trie
+ * iteration follows the deterministic automaton down the trie, so subtrees
+ * where it reaches the dead state, from which no key can match, are skipped.
+ *
+ * Since states are built on demand, a pattern must not be used from more than
+ * one thread at a time, even just to match keys.
+ *
+ */
+
+#ifndef HATTRIE_PATTERN_H
+#define HATTRIE_PATTERN_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "hat-trie.h"
+#include "pstdint.h"
+#include <stdlib.h>
+#include <stdbool.h>
+
+typedef struct hattrie_pattern_t_ hattrie_pattern_t;
+
+/* Compile a pattern, returning NULL if it is malformed. */
+hattrie_pattern_t* hattrie_pattern_glob  (const char* glob, size_t len);
+hattrie_pattern_t* hattrie_pattern_regex (const char* re, size_t len);
+void               hattrie_pattern_free  (hattrie_pattern_t*);
+
+/* True if the pattern matches the whole key. */
+bool hattrie_pattern_match (hattrie_pattern_t*, const char* key, size_t len);
+
+
+/* Stepping through the deterministic automaton a byte at a time. */
+
+/* The state from which no key can match. */
+#define HATTRIE_PATTERN_DEAD 0
+
+uint32_t hattrie_pattern_start   (const hattrie_pattern_t*);
+uint32_t hattrie_pattern_step    (hattrie_pattern_t*, uint32_t state, unsigned char c);
+uint32_t hattrie_pattern_run     (hattrie_pattern_t*, uint32_t state,
+                                  const char* s, size_t len);
+bool     hattrie_pattern_accepts (const hattrie_pattern_t*, uint32_t state);
+
+/* The longest string every matching key begins with, stored in *prefix and
+ * valid until the pattern is freed. Returns its length. */
+size_t hattrie_pattern_prefix (hattrie_pattern_t*, const char** prefix);
+
+
+/* Iterate through the keys of T matching the pattern, which must outlive the
+ * iterator. Keys are reported whole, and subtrees where the pattern dies are
+ * never visited. */
+hattrie_iter_t* hattrie_iter_begin_with_pattern (const hattrie_t*, bool sorted,
+                                                 hattrie_pattern_t*);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,104 @@
+/* Compare inserting an unordered batch of keys into a large trie one at a
+ * time, against hattrie_get_batch and hattrie_insert_batch. The batch size and
+ * the number of keys stored beforehand may be given as arguments. */
+
+#include "../src/hat-trie.h"
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+
+/* Keys like "<word>/<number>", drawn from about 70 million. */
+void make_keys(hattrie_entry_t* xs, char* text, size_t n, size_t keysize)
+{
+    size_t i;
+    for (i = 0; i < n; ++i) {
+        xs[i].key = text + i * keysize;
+        xs[i].len = snprintf(xs[i].key, keysize, "%c%c%c/%zu",
+                             'a' + rand() % 26, 'a' + rand() % 26, 'a' + rand() % 26,
+                             (size_t) rand() % 4000);
+        xs[i].val = i;
+    }
+}
+
+
+int main(int argc, char* argv[])
+{
+    size_t n = 2000000;    // how many keys in a batch
+    size_t m = 10000000;   // how many keys are stored beforehand
+    if (argc > 1) n = strtoul(argv[1], NULL, 10);
+    if (argc > 2) m = strtoul(argv[2], NULL, 10);
+
+    const size_t keysize = 16;
+    char* base_text = malloc(m * keysize);
+    char* text = malloc(n * keysize);
+    hattrie_entry_t* base = malloc(m * sizeof(hattrie_entry_t));
+    hattrie_entry_t* xs = malloc(n * sizeof(hattrie_entry_t));
+    const char** keys = malloc(n * sizeof(char*));
+    size_t* lens = malloc(n * sizeof(size_t));
+    value_t** vals = malloc(n * sizeof(value_t*));
+    size_t i;
+    value_t sum;
+    hattrie_t* T;
+    clock_t t0, t;
+
+    make_keys(base, base_text, m, keysize);
+    make_keys(xs, text, n, keysize);
+    for (i = 0; i < n; ++i) {
+        keys[i] = xs[i].key;
+        lens[i] = xs[i].len;
+    }
+
+    T = hattrie_create();
+    for (i = 0; i < m; ++i) *hattrie_get(T, base[i].key, base[i].len) = base[i].val;
+    fprintf(stderr, "finding %zu keys one at a time ... ", n);
+    sum = 0;
+    t0 = clock();
+    for (i = 0; i < n; ++i) sum += *hattrie_get(T, keys[i], lens[i]);
+    t = clock();
+    fprintf(stderr, "finished. (%0.2f seconds, sum %zu)\n",
+            (double) (t - t0) / (double) CLOCKS_PER_SEC, (size_t) sum);
+    hattrie_free(T);
+
+    T = hattrie_create();
+    for (i = 0; i < m; ++i) *hattrie_get(T, base[i].key, base[i].len) = base[i].val;
+    fprintf(stderr, "finding %zu keys with hattrie_get_batch ... ", n);
+    sum = 0;
+    t0 = clock();
+    hattrie_get_batch(T, keys, lens, n, vals);
+    for (i = 0; i < n; ++i) sum += *vals[i];
+    t = clock();
+    fprintf(stderr, "finished. (%0.2f seconds, sum %zu)\n",
+            (double) (t - t0) / (double) CLOCKS_PER_SEC, (size_t) sum);
+    hattrie_free(T);
+
+    T = hattrie_create();
+    for (i = 0; i < m; ++i) *hattrie_get(T, base[i].key, base[i].len) = base[i].val;
+    fprintf(stderr, "setting %zu keys one at a time ... ", n);
+    t0 = clock();
+    for (i = 0; i < n; ++i) *hattrie_get(T, xs[i].key, xs[i].len) = xs[i].val;
+    t = clock();
+    fprintf(stderr, "finished. (%0.2f seconds)\n",
+            (double) (t - t0) / (double) CLOCKS_PER_SEC);
+    hattrie_free(T);
+
+    T = hattrie_create();
+    for (i = 0; i < m; ++i) *hattrie_get(T, base[i].key, base[i].len) = base[i].val;
+    fprintf(stderr, "setting %zu keys with hattrie_insert_batch ... ", n);
+    t0 = clock();
+    hattrie_insert_batch(T, xs, n);
+    t = clock();
+    fprintf(stderr, "finished. (%0.2f seconds)\n",
+            (double) (t - t0) / (double) CLOCKS_PER_SEC);
+    hattrie_free(T);
+
+    free(base_text);
+    free(text);
+    free(base);
+    free(xs);
+    free(keys);
+    free(lens);
+    free(vals);
+
+    return 0;
+}
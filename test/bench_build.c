@@ -0,0 +1,56 @@
+/* Compare building a trie from sorted keys by inserting them one at a time,
+ * against hattrie_build_sorted. The number of keys may be given as the first
+ * argument; a hundred million take about 8GB. */
+
+#include "../src/hat-trie.h"
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+
+int main(int argc, char* argv[])
+{
+    size_t n = 10000000;    // how many keys
+    if (argc > 1) n = strtoul(argv[1], NULL, 10);
+
+    /* sorted keys like "item:<category>:<id>", with ids increasing by random
+     * steps */
+    const size_t keysize = 24;
+    char* text = malloc(n * keysize);
+    hattrie_entry_t* xs = malloc(n * sizeof(hattrie_entry_t));
+    size_t i, id = 0;
+    for (i = 0; i < n; ++i) {
+        id += 1 + rand() % 16;
+        xs[i].key = text + i * keysize;
+        xs[i].len = snprintf(xs[i].key, keysize, "item:%03zu:%012zu",
+                             i * 1000 / n, id);
+        xs[i].val = i;
+    }
+
+    hattrie_t* T;
+    clock_t t0, t;
+
+    fprintf(stderr, "inserting %zu sorted keys one at a time ... ", n);
+    t0 = clock();
+    T = hattrie_create();
+    for (i = 0; i < n; ++i) {
+        *hattrie_get(T, xs[i].key, xs[i].len) = xs[i].val;
+    }
+    t = clock();
+    fprintf(stderr, "finished. (%0.2f seconds, %zu bytes)\n",
+            (double) (t - t0) / (double) CLOCKS_PER_SEC, hattrie_sizeof(T));
+    hattrie_free(T);
+
+    fprintf(stderr, "building from %zu sorted keys ... ", n);
+    t0 = clock();
+    T = hattrie_build_sorted(0, xs, n);
+    t = clock();
+    fprintf(stderr, "finished. (%0.2f seconds, %zu bytes)\n",
+            (double) (t - t0) / (double) CLOCKS_PER_SEC, hattrie_sizeof(T));
+    hattrie_free(T);
+
+    free(xs);
+    free(text);
+
+    return 0;
+}
@@ -0,0 +1,154 @@
+/* Measure how a mix of inserts and lookups from many threads scales, on a trie
+ * behind one global lock against a hattrie_concurrent_t, with a lock per trie
+ * node and with optimistic walks. The number of operations and the most
+ * threads to use may be given as arguments. Times are wall clock times. */
+
+#include "../src/hat-trie.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+
+double now()
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (double) t.tv_sec + 1e-9 * (double) t.tv_nsec;
+}
+
+
+typedef struct {
+    hattrie_entry_t* xs;   // the keys this thread inserts or looks up
+    size_t n;
+
+    hattrie_t* T;          // with lock, or
+    pthread_mutex_t* lock;
+    hattrie_concurrent_t* C;
+
+    size_t found;
+} worker;
+
+
+/* Every other key is inserted, and the others looked up. */
+void* work_locked(void* arg)
+{
+    worker* w = arg;
+    size_t i;
+    value_t* u;
+    for (i = 0; i < w->n; ++i) {
+        pthread_mutex_lock(w->lock);
+        if (i % 2 == 0) {
+            *hattrie_get(w->T, w->xs[i].key, w->xs[i].len) = w->xs[i].val;
+        }
+        else {
+            u = hattrie_tryget(w->T, w->xs[i].key, w->xs[i].len);
+            if (u) ++w->found;
+        }
+        pthread_mutex_unlock(w->lock);
+    }
+    return NULL;
+}
+
+
+void* work_concurrent(void* arg)
+{
+    worker* w = arg;
+    size_t i;
+    value_t u;
+    for (i = 0; i < w->n; ++i) {
+        if (i % 2 == 0) {
+            hattrie_concurrent_set(w->C, w->xs[i].key, w->xs[i].len, w->xs[i].val);
+        }
+        else if (hattrie_concurrent_tryget(w->C, w->xs[i].key, w->xs[i].len, &u)) {
+            ++w->found;
+        }
+    }
+    return NULL;
+}
+
+
+/* How the threads share the trie. */
+typedef enum { GLOBAL_LOCK, NODE_LOCKS, OPTIMISTIC } sharing;
+
+
+double run(hattrie_entry_t* xs, size_t n, size_t nthreads, sharing how)
+{
+    worker* ws = malloc(nthreads * sizeof(worker));
+    pthread_t* threads = malloc(nthreads * sizeof(pthread_t));
+    pthread_mutex_t lock;
+    pthread_mutex_init(&lock, NULL);
+    hattrie_t* T = hattrie_create();
+    hattrie_concurrent_t* C =
+        hattrie_concurrent_create_ex(how == OPTIMISTIC ? HATTRIE_OPTIMISTIC : 0);
+    size_t i, found = 0;
+
+    double t0 = now();
+    for (i = 0; i < nthreads; ++i) {
+        ws[i].xs = xs + i * (n / nthreads);
+        ws[i].n = n / nthreads;
+        ws[i].T = T;
+        ws[i].lock = &lock;
+        ws[i].C = C;
+        ws[i].found = 0;
+        pthread_create(&threads[i], NULL,
+                       how == GLOBAL_LOCK ? work_locked : work_concurrent, &ws[i]);
+    }
+    for (i = 0; i < nthreads; ++i) {
+        pthread_join(threads[i], NULL);
+        found += ws[i].found;
+    }
+    double t = now() - t0;
+
+    fprintf(stderr, "finished. (%0.2f seconds, %zu found)\n", t, found);
+
+    hattrie_free(T);
+    hattrie_concurrent_free(C);
+    pthread_mutex_destroy(&lock);
+    free(ws);
+    free(threads);
+    return t;
+}
+
+
+int main(int argc, char* argv[])
+{
+    size_t n = 8000000;    // how many operations
+    size_t max_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (argc > 1) n = strtoul(argv[1], NULL, 10);
+    if (argc > 2) max_threads = strtoul(argv[2], NULL, 10);
+    if (max_threads < 4) max_threads = 4;
+
+    /* keys like "<host>/<path>", drawn from a few million */
+    const size_t keysize = 32;
+    char* text = malloc(n * keysize);
+    hattrie_entry_t* xs = malloc(n * sizeof(hattrie_entry_t));
+    size_t i, nthreads;
+    for (i = 0; i < n; ++i) {
+        xs[i].key = text + i * keysize;
+        xs[i].len = snprintf(xs[i].key, keysize, "host%zu.net/%zu",
+                             (size_t) rand() % 1000, (size_t) rand() % 5000);
+        xs[i].val = i;
+    }
+
+    double t1 = 0.0, t;
+    for (nthreads = 1; nthreads <= max_threads; nthreads *= 2) {
+        fprintf(stderr, "%zu threads, global lock ... ", nthreads);
+        t = run(xs, n, nthreads, GLOBAL_LOCK);
+        if (nthreads == 1) t1 = t;
+
+        fprintf(stderr, "%zu threads, node locks ... ", nthreads);
+        t = run(xs, n, nthreads, NODE_LOCKS);
+        fprintf(stderr, "    %0.2fx the global lock on one thread\n", t1 / t);
+
+        fprintf(stderr, "%zu threads, optimistic ... ", nthreads);
+        t = run(xs, n, nthreads, OPTIMISTIC);
+        fprintf(stderr, "    %0.2fx the global lock on one thread\n", t1 / t);
+    }
+
+    free(text);
+    free(xs);
+
+    return 0;
+}
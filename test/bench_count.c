@@ -0,0 +1,165 @@
+
+/* Compare ways of counting keys, where a new key's payload must be set up when
+ * it is first seen: looking the key up before inserting it, comparing the size
+ * of the trie before and after inserting it, or a single upsert. */
+
+#include "../src/hat-trie.h"
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+
+typedef struct {
+    const char* name;
+    char* text;      // keys, laid end to end
+    size_t* offset;  // where each key begins in text
+    size_t* len;
+    size_t n;
+} workload;
+
+
+/* Words drawn with a skewed distribution from a vocabulary of random words. */
+void make_words(workload* w, size_t n, size_t vocab)
+{
+    size_t i, j, m;
+    char** words = malloc(vocab * sizeof(char*));
+    for (i = 0; i < vocab; ++i) {
+        m = 3 + rand() % 10;
+        words[i] = malloc(m + 1);
+        for (j = 0; j < m; ++j) words[i][j] = 'a' + rand() % 26;
+        words[i][m] = '\0';
+    }
+
+    w->name = "word counts";
+    w->n = n;
+    w->text = malloc(n * 13);
+    w->offset = malloc(n * sizeof(size_t));
+    w->len = malloc(n * sizeof(size_t));
+    size_t pos = 0;
+    for (i = 0; i < n; ++i) {
+        /* the product of two uniform ranks favors small ones */
+        j = (size_t) ((double) (rand() % vocab) * (double) (rand() % vocab) / (double) vocab);
+        w->offset[i] = pos;
+        w->len[i] = strlen(words[j]);
+        memcpy(w->text + pos, words[j], w->len[i]);
+        pos += w->len[i];
+    }
+
+    for (i = 0; i < vocab; ++i) free(words[i]);
+    free(words);
+}
+
+
+/* Every k-mer of a random DNA sequence. */
+void make_kmers(workload* w, size_t n, size_t k)
+{
+    static const char nt[] = "ACGT";
+    size_t i;
+
+    w->name = "k-mer counts";
+    w->n = n;
+    w->text = malloc(n + k);
+    w->offset = malloc(n * sizeof(size_t));
+    w->len = malloc(n * sizeof(size_t));
+    for (i = 0; i < n + k; ++i) w->text[i] = nt[rand() % 4];
+    for (i = 0; i < n; ++i) {
+        w->offset[i] = i;
+        w->len[i] = k;
+    }
+}
+
+
+void free_workload(workload* w)
+{
+    free(w->text);
+    free(w->offset);
+    free(w->len);
+}
+
+
+/* A new key's payload, here just a nonzero starting count. */
+static const value_t initial = 1000;
+
+
+void bench(workload* w)
+{
+    hattrie_t* T;
+    value_t* u;
+    size_t i, m;
+    bool inserted;
+    clock_t t0, t;
+    const char* key;
+
+    fprintf(stderr, "%s, %zu keys:\n", w->name, w->n);
+
+    fprintf(stderr, "  tryget, then get if missing ... ");
+    T = hattrie_create();
+    t0 = clock();
+    for (i = 0; i < w->n; ++i) {
+        key = w->text + w->offset[i];
+        u = hattrie_tryget(T, key, w->len[i]);
+        if (u == NULL) {
+            u = hattrie_get(T, key, w->len[i]);
+            *u = initial;
+        }
+        ++*u;
+    }
+    t = clock();
+    fprintf(stderr, "finished. (%0.2f seconds, %zu distinct)\n",
+            (double) (t - t0) / (double) CLOCKS_PER_SEC, hattrie_size(T));
+    hattrie_free(T);
+
+    fprintf(stderr, "  get, comparing sizes ... ");
+    T = hattrie_create();
+    t0 = clock();
+    for (i = 0; i < w->n; ++i) {
+        m = hattrie_size(T);
+        u = hattrie_get(T, w->text + w->offset[i], w->len[i]);
+        if (hattrie_size(T) != m) *u = initial;
+        ++*u;
+    }
+    t = clock();
+    fprintf(stderr, "finished. (%0.2f seconds, %zu distinct)\n",
+            (double) (t - t0) / (double) CLOCKS_PER_SEC, hattrie_size(T));
+    hattrie_free(T);
+
+    fprintf(stderr, "  get_ex ... ");
+    T = hattrie_create();
+    t0 = clock();
+    for (i = 0; i < w->n; ++i) {
+        u = hattrie_get_ex(T, w->text + w->offset[i], w->len[i], &inserted);
+        if (inserted) *u = initial;
+        ++*u;
+    }
+    t = clock();
+    fprintf(stderr, "finished. (%0.2f seconds, %zu distinct)\n",
+            (double) (t - t0) / (double) CLOCKS_PER_SEC, hattrie_size(T));
+    hattrie_free(T);
+
+    fprintf(stderr, "  add, without a payload ... ");
+    T = hattrie_create();
+    t0 = clock();
+    for (i = 0; i < w->n; ++i) {
+        hattrie_add(T, w->text + w->offset[i], w->len[i], 1);
+    }
+    t = clock();
+    fprintf(stderr, "finished. (%0.2f seconds, %zu distinct)\n",
+            (double) (t - t0) / (double) CLOCKS_PER_SEC, hattrie_size(T));
+    hattrie_free(T);
+}
+
+
+int main()
+{
+    workload w;
+
+    make_words(&w, 20000000, 1000000);
+    bench(&w);
+    free_workload(&w);
+
+    make_kmers(&w, 5000000, 12);
+    bench(&w);
+    free_workload(&w);
+
+    return 0;
+}
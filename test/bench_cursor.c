@@ -0,0 +1,78 @@
+/* Compare inserting and then looking up sorted keys with hattrie_get and
+ * hattrie_tryget, which walk from the root each time, against doing so
+ * through a cursor, which resumes from the path the previous key took. The
+ * keys are long and share long prefixes, like paths or log records. */
+
+#include "../src/hat-trie.h"
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+
+/* Keys shaped like "/srv/logs/<host>/<yyyy>/<mm>/<dd>/<seq>", in order. */
+size_t make_key(char* x, size_t size, size_t i)
+{
+    return snprintf(x, size, "/srv/logs/host%02zu/2011/%02zu/%02zu/%06zu",
+                    i / 400000, (i / 40000) % 10 + 1, (i / 2000) % 20 + 1, i % 2000);
+}
+
+
+int main()
+{
+    const size_t n = 4000000;   // how many keys
+    char x[64];
+    size_t i, len;
+    value_t sum;
+    clock_t t0, t;
+
+    hattrie_t* T = hattrie_create();
+    fprintf(stderr, "inserting %zu sorted keys with hattrie_get ... ", n);
+    t0 = clock();
+    for (i = 0; i < n; ++i) {
+        len = make_key(x, sizeof(x), i);
+        *hattrie_get(T, x, len) = i;
+    }
+    t = clock();
+    fprintf(stderr, "finished. (%0.2f seconds)\n",
+            (double) (t - t0) / (double) CLOCKS_PER_SEC);
+
+    fprintf(stderr, "looking them up with hattrie_tryget ... ");
+    sum = 0;
+    t0 = clock();
+    for (i = 0; i < n; ++i) {
+        len = make_key(x, sizeof(x), i);
+        sum += *hattrie_tryget(T, x, len);
+    }
+    t = clock();
+    fprintf(stderr, "finished. (%0.2f seconds, sum %zu)\n",
+            (double) (t - t0) / (double) CLOCKS_PER_SEC, (size_t) sum);
+    hattrie_free(T);
+
+    T = hattrie_create();
+    hattrie_cursor_t* c = hattrie_cursor_create(T);
+    fprintf(stderr, "inserting %zu sorted keys through a cursor ... ", n);
+    t0 = clock();
+    for (i = 0; i < n; ++i) {
+        len = make_key(x, sizeof(x), i);
+        *hattrie_cursor_get(c, x, len) = i;
+    }
+    t = clock();
+    fprintf(stderr, "finished. (%0.2f seconds)\n",
+            (double) (t - t0) / (double) CLOCKS_PER_SEC);
+
+    fprintf(stderr, "looking them up through the cursor ... ");
+    sum = 0;
+    t0 = clock();
+    for (i = 0; i < n; ++i) {
+        len = make_key(x, sizeof(x), i);
+        sum += *hattrie_cursor_tryget(c, x, len);
+    }
+    t = clock();
+    fprintf(stderr, "finished. (%0.2f seconds, sum %zu)\n",
+            (double) (t - t0) / (double) CLOCKS_PER_SEC, (size_t) sum);
+
+    hattrie_cursor_free(c);
+    hattrie_free(T);
+
+    return 0;
+}
@@ -0,0 +1,77 @@
+/* Measure copying a trie, by iterating through it and inserting every key into
+ * a new one, against hattrie_dup and hattrie_dup_parallel, which copy its
+ * nodes directly. The number of keys may be given as an argument. */
+
+#include "../src/hat-trie.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+
+double now()
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (double) t.tv_sec + 1e-9 * (double) t.tv_nsec;
+}
+
+
+hattrie_t* copy(hattrie_t* T)
+{
+    hattrie_t* U = hattrie_create();
+    hattrie_iter_t* it = hattrie_iter_begin(T, false);
+    const char* key;
+    size_t len;
+    for (; !hattrie_iter_finished(it); hattrie_iter_next(it)) {
+        key = hattrie_iter_key(it, &len);
+        *hattrie_get(U, key, len) = *hattrie_iter_val(it);
+    }
+    hattrie_iter_free(it);
+    return U;
+}
+
+
+int main(int argc, char* argv[])
+{
+    size_t n = 4000000;   // how many keys
+    if (argc > 1) n = strtoul(argv[1], NULL, 10);
+
+    hattrie_t* T = hattrie_create();
+    hattrie_t* U;
+    char x[32];
+    size_t i, len, nthreads;
+    double t0, t1, t2;
+
+    for (i = 0; i < n; ++i) {
+        len = snprintf(x, sizeof(x), "host%zu.net/%zu", (size_t) rand() % 10000,
+                       (size_t) rand() % (n / 5000));
+        *hattrie_get(T, x, len) = i;
+    }
+    fprintf(stderr, "%zu keys\n", hattrie_size(T));
+
+    t0 = now();
+    U = copy(T);
+    t1 = now() - t0;
+    fprintf(stderr, "copying every key ... %0.3f seconds\n", t1);
+    hattrie_free(U);
+
+    t0 = now();
+    U = hattrie_dup(T);
+    t2 = now() - t0;
+    fprintf(stderr, "hattrie_dup ... %0.3f seconds, %0.2fx\n", t2, t1 / t2);
+    hattrie_free(U);
+
+    for (nthreads = 2; nthreads <= 8; nthreads *= 2) {
+        t0 = now();
+        U = hattrie_dup_parallel(T, nthreads);
+        t2 = now() - t0;
+        fprintf(stderr, "hattrie_dup_parallel with %zu threads ... %0.3f seconds, %0.2fx\n",
+                nthreads, t2, t1 / t2);
+        hattrie_free(U);
+    }
+
+    hattrie_free(T);
+
+    return 0;
+}
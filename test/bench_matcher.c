@@ -0,0 +1,107 @@
+
+/* Compare finding every occurrence of a dictionary's keys in a text with a
+ * compiled matcher, against looking up every position and length. */
+
+#include "../src/hat-trie.h"
+#include "../src/matcher.h"
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+
+/* Random words over a small alphabet, so that keys occur in the text. */
+void randstr(char* x, size_t len)
+{
+    x[len] = '\0';
+    while (len > 0) {
+        x[--len] = 'a' + (rand() % 8);
+    }
+}
+
+
+int count_match(size_t offset, size_t len, value_t val, void* ctx)
+{
+    (void) offset; (void) len; (void) val;
+    ++*(size_t*) ctx;
+    return 0;
+}
+
+
+int count_prefix(size_t len, value_t* val, void* ctx)
+{
+    (void) len; (void) val;
+    ++*(size_t*) ctx;
+    return 0;
+}
+
+
+int main()
+{
+    hattrie_t* T = hattrie_create();
+    const size_t n = 1000000;       // how many keys
+    const size_t m_low  = 4;        // minimum length of each key
+    const size_t m_high = 24;       // maximum length of each key
+    const size_t text_len = 10000000;
+    char x[25];
+
+    size_t i, m;
+    for (i = 0; i < n; ++i) {
+        m = m_low + rand() % (m_high - m_low);
+        randstr(x, m);
+        *hattrie_get(T, x, m) = 1;
+    }
+
+    char* text = malloc(text_len + 1);
+    randstr(text, text_len);
+
+    clock_t t0, t;
+    size_t count, len;
+
+    fprintf(stderr, "compiling matcher ... ");
+    t0 = clock();
+    hattrie_matcher_t* M = hattrie_matcher_create(T);
+    t = clock();
+    fprintf(stderr, "finished. (%0.2f seconds, %zu bytes)\n",
+            (double) (t - t0) / (double) CLOCKS_PER_SEC, hattrie_matcher_sizeof(M));
+
+
+    fprintf(stderr, "looking up every position and length ... ");
+    count = 0;
+    t0 = clock();
+    for (i = 0; i < text_len; ++i) {
+        for (len = 1; len <= m_high && i + len <= text_len; ++len) {
+            if (hattrie_tryget(T, text + i, len)) ++count;
+        }
+    }
+    t = clock();
+    fprintf(stderr, "finished. (%0.2f seconds, %zu matches)\n",
+            (double) (t - t0) / (double) CLOCKS_PER_SEC, count);
+
+
+    fprintf(stderr, "matching prefixes at every position ... ");
+    count = 0;
+    t0 = clock();
+    for (i = 0; i < text_len; ++i) {
+        len = text_len - i < m_high ? text_len - i : m_high;
+        hattrie_prefixes(T, text + i, len, count_prefix, &count);
+    }
+    t = clock();
+    fprintf(stderr, "finished. (%0.2f seconds, %zu matches)\n",
+            (double) (t - t0) / (double) CLOCKS_PER_SEC, count);
+
+
+    fprintf(stderr, "scanning with the matcher ... ");
+    count = 0;
+    t0 = clock();
+    hattrie_matcher_scan(M, text, text_len, count_match, &count);
+    t = clock();
+    fprintf(stderr, "finished. (%0.2f seconds, %zu matches)\n",
+            (double) (t - t0) / (double) CLOCKS_PER_SEC, count);
+
+
+    hattrie_matcher_free(M);
+    hattrie_free(T);
+    free(text);
+
+    return 0;
+}
@@ -0,0 +1,139 @@
+/* Measure counting keys from many threads into one trie behind a global lock,
+ * against each thread counting into a trie of its own and merging it into the
+ * shared one, under the lock, every so many keys. The number of keys, the most
+ * threads to use and how many keys a thread counts between merges may be given
+ * as arguments. Times are wall clock times. */
+
+#include "../src/hat-trie.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+
+double now()
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (double) t.tv_sec + 1e-9 * (double) t.tv_nsec;
+}
+
+
+typedef struct {
+    hattrie_entry_t* xs;   // the keys this thread counts
+    size_t n;
+    size_t period;         // keys between merges, or 0 to take the lock for each
+
+    hattrie_t* T;
+    pthread_mutex_t* lock;
+} worker;
+
+
+void* work_locked(void* arg)
+{
+    worker* w = arg;
+    size_t i;
+    for (i = 0; i < w->n; ++i) {
+        pthread_mutex_lock(w->lock);
+        hattrie_add(w->T, w->xs[i].key, w->xs[i].len, 1);
+        pthread_mutex_unlock(w->lock);
+    }
+    return NULL;
+}
+
+
+value_t sum(value_t dst, value_t src, void* ctx)
+{
+    (void) ctx;
+    return dst + src;
+}
+
+
+void* work_merged(void* arg)
+{
+    worker* w = arg;
+    hattrie_t* U = hattrie_create();
+    size_t i;
+    for (i = 0; i < w->n; ++i) {
+        hattrie_add(U, w->xs[i].key, w->xs[i].len, 1);
+        if ((i + 1) % w->period == 0 || i + 1 == w->n) {
+            pthread_mutex_lock(w->lock);
+            hattrie_merge_into(w->T, U, sum, NULL);
+            pthread_mutex_unlock(w->lock);
+        }
+    }
+    hattrie_free(U);
+    return NULL;
+}
+
+
+double run(hattrie_entry_t* xs, size_t n, size_t nthreads, size_t period)
+{
+    worker* ws = malloc(nthreads * sizeof(worker));
+    pthread_t* threads = malloc(nthreads * sizeof(pthread_t));
+    pthread_mutex_t lock;
+    pthread_mutex_init(&lock, NULL);
+    hattrie_t* T = hattrie_create();
+    size_t i;
+
+    double t0 = now();
+    for (i = 0; i < nthreads; ++i) {
+        ws[i].xs = xs + i * (n / nthreads);
+        ws[i].n = n / nthreads;
+        ws[i].period = period;
+        ws[i].T = T;
+        ws[i].lock = &lock;
+        pthread_create(&threads[i], NULL, period ? work_merged : work_locked, &ws[i]);
+    }
+    for (i = 0; i < nthreads; ++i) pthread_join(threads[i], NULL);
+    double t = now() - t0;
+
+    fprintf(stderr, "finished. (%0.2f seconds, %zu keys)\n", t, hattrie_size(T));
+
+    hattrie_free(T);
+    pthread_mutex_destroy(&lock);
+    free(ws);
+    free(threads);
+    return t;
+}
+
+
+int main(int argc, char* argv[])
+{
+    size_t n = 8000000;    // how many keys to count
+    size_t max_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t period = 100000;
+    if (argc > 1) n = strtoul(argv[1], NULL, 10);
+    if (argc > 2) max_threads = strtoul(argv[2], NULL, 10);
+    if (argc > 3) period = strtoul(argv[3], NULL, 10);
+    if (max_threads < 4) max_threads = 4;
+
+    /* keys like "<host>/<path>", drawn from a few million */
+    const size_t keysize = 32;
+    char* text = malloc(n * keysize);
+    hattrie_entry_t* xs = malloc(n * sizeof(hattrie_entry_t));
+    size_t i, nthreads;
+    for (i = 0; i < n; ++i) {
+        xs[i].key = text + i * keysize;
+        xs[i].len = snprintf(xs[i].key, keysize, "host%zu.net/%zu",
+                             (size_t) rand() % 1000, (size_t) rand() % 5000);
+        xs[i].val = i;
+    }
+
+    double t1 = 0.0, t;
+    for (nthreads = 1; nthreads <= max_threads; nthreads *= 2) {
+        fprintf(stderr, "%zu threads, global lock ... ", nthreads);
+        t = run(xs, n, nthreads, 0);
+        if (nthreads == 1) t1 = t;
+
+        fprintf(stderr, "%zu threads, merging every %zu keys ... ", nthreads, period);
+        t = run(xs, n, nthreads, period);
+        fprintf(stderr, "    %0.2fx the global lock on one thread\n", t1 / t);
+    }
+
+    free(text);
+    free(xs);
+
+    return 0;
+}
@@ -0,0 +1,83 @@
+/* Measure how building a trie from unsorted keys with hattrie_build_parallel
+ * scales from one thread to many, against inserting the keys one at a time.
+ * The number of keys and the most threads to use may be given as arguments.
+ * Times are wall clock times. */
+
+#include "../src/hat-trie.h"
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+
+double now()
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (double) t.tv_sec + 1e-9 * (double) t.tv_nsec;
+}
+
+
+int main(int argc, char* argv[])
+{
+    size_t n = 10000000;    // how many keys
+    size_t max_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (argc > 1) n = strtoul(argv[1], NULL, 10);
+    if (argc > 2) max_threads = strtoul(argv[2], NULL, 10);
+
+    /* keys like "<host>/<path>", with a quarter of them under one hot host */
+    const size_t keysize = 32;
+    char* text = malloc(n * keysize);
+    hattrie_entry_t* xs = malloc(n * sizeof(hattrie_entry_t));
+    size_t i;
+    for (i = 0; i < n; ++i) {
+        xs[i].key = text + i * keysize;
+        if (i % 4 == 0) {
+            xs[i].len = snprintf(xs[i].key, keysize, "www.example.com/%zu",
+                                 (size_t) rand() % n);
+        }
+        else {
+            xs[i].len = snprintf(xs[i].key, keysize, "host%zu.net/%zu",
+                                 (size_t) rand() % 1000, (size_t) rand() % n);
+        }
+        xs[i].val = i;
+    }
+
+    /* the builder reorders the keys, so each run gets a copy */
+    hattrie_entry_t* ys = malloc(n * sizeof(hattrie_entry_t));
+    hattrie_t* T;
+    double t0, t, t1 = 0.0;
+    size_t nthreads;
+
+    fprintf(stderr, "inserting %zu keys one at a time ... ", n);
+    t0 = now();
+    T = hattrie_create();
+    for (i = 0; i < n; ++i) {
+        *hattrie_get(T, xs[i].key, xs[i].len) = xs[i].val;
+    }
+    t = now();
+    fprintf(stderr, "finished. (%0.2f seconds)\n", t - t0);
+    hattrie_free(T);
+
+    for (nthreads = 1; nthreads <= max_threads; nthreads *= 2) {
+        memcpy(ys, xs, n * sizeof(hattrie_entry_t));
+        fprintf(stderr, "building with %zu threads ... ", nthreads);
+        t0 = now();
+        T = hattrie_build_parallel(0, ys, n, nthreads);
+        t = now();
+        if (nthreads == 1) t1 = t - t0;
+        fprintf(stderr, "finished. (%0.2f seconds, %0.2fx)\n", t - t0, t1 / (t - t0));
+        hattrie_free(T);
+
+        /* finish with the most threads, if not a power of two */
+        if (nthreads < max_threads && 2 * nthreads > max_threads) {
+            nthreads = max_threads / 2;
+        }
+    }
+
+    free(ys);
+    free(xs);
+    free(text);
+
+    return 0;
+}
@@ -0,0 +1,71 @@
+/* Measure scanning every key of a trie with one iterator, against
+ * hattrie_parallel_for_each on more and more threads. The number of keys and
+ * the most threads to use may be given as arguments. Times are wall clock
+ * times. */
+
+#include "../src/hat-trie.h"
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+
+double now()
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (double) t.tv_sec + 1e-9 * (double) t.tv_nsec;
+}
+
+
+void visit(const char* key, size_t len, value_t* val, void* ctx)
+{
+    (void) key;
+    __atomic_fetch_add((value_t*) ctx, *val + len, __ATOMIC_RELAXED);
+}
+
+
+int main(int argc, char* argv[])
+{
+    size_t n = 10000000;   // how many keys
+    size_t max_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (argc > 1) n = strtoul(argv[1], NULL, 10);
+    if (argc > 2) max_threads = strtoul(argv[2], NULL, 10);
+    if (max_threads < 4) max_threads = 4;
+
+    hattrie_t* T = hattrie_create();
+    char x[32];
+    size_t i, len, nthreads;
+    for (i = 0; i < n; ++i) {
+        len = snprintf(x, sizeof(x), "host%zu.net/%zu",
+                       (size_t) rand() % 10000, (size_t) rand() % 100000);
+        *hattrie_get(T, x, len) = i;
+    }
+
+    fprintf(stderr, "scanning %zu keys with one iterator ... ", hattrie_size(T));
+    value_t sum = 0;
+    double t0 = now();
+    hattrie_iter_t* it = hattrie_iter_begin(T, false);
+    while (!hattrie_iter_finished(it)) {
+        hattrie_iter_key(it, &len);
+        sum += *hattrie_iter_val(it) + len;
+        hattrie_iter_next(it);
+    }
+    hattrie_iter_free(it);
+    double t1 = now() - t0, t;
+    fprintf(stderr, "finished. (%0.2f seconds, sum %zu)\n", t1, (size_t) sum);
+
+    for (nthreads = 1; nthreads <= max_threads; nthreads *= 2) {
+        fprintf(stderr, "scanning with %zu threads ... ", nthreads);
+        sum = 0;
+        t0 = now();
+        hattrie_parallel_for_each(T, visit, &sum, nthreads);
+        t = now() - t0;
+        fprintf(stderr, "finished. (%0.2f seconds, sum %zu, %0.2fx)\n",
+                t, (size_t) sum, t1 / t);
+    }
+
+    hattrie_free(T);
+
+    return 0;
+}
@@ -0,0 +1,121 @@
+/* Measure dividing a trie into shards of equal size: finding the bounds with
+ * hattrie_quantiles against a sorted scan that stops at each rank, and moving
+ * each shard out with hattrie_extract_range against copying its keys into a
+ * new trie and deleting them. The number of keys and of shards may be given
+ * as arguments. */
+
+#include "../src/hat-trie.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+
+double now()
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (double) t.tv_sec + 1e-9 * (double) t.tv_nsec;
+}
+
+
+hattrie_t* build(size_t n)
+{
+    hattrie_t* T = hattrie_create_ex(HATTRIE_COUNTS);
+    char x[32];
+    size_t i, len;
+
+    srand(1);
+    for (i = 0; i < n; ++i) {
+        len = snprintf(x, sizeof(x), "host%zu.net/%zu",
+                       (size_t) rand() % 10000, (size_t) rand() % 100000);
+        *hattrie_get(T, x, len) = i;
+    }
+    return T;
+}
+
+
+int main(int argc, char* argv[])
+{
+    size_t n = 4000000;   // how many keys
+    size_t shards = 64;
+    if (argc > 1) n = strtoul(argv[1], NULL, 10);
+    if (argc > 2) shards = strtoul(argv[2], NULL, 10);
+
+    hattrie_t* T = build(n);
+    size_t m = hattrie_size(T);
+    hattrie_entry_t* cuts = malloc(shards * sizeof(hattrie_entry_t));
+    hattrie_iter_t* it;
+    const char* key;
+    size_t i, j, k, len;
+    double t0, t1, t2;
+
+    fprintf(stderr, "finding %zu shards of %zu keys by a sorted scan ... ", shards, m);
+    t0 = now();
+    it = hattrie_iter_begin(T, true);
+    for (i = 0, j = 1; j < shards && !hattrie_iter_finished(it); ++i) {
+        if (i == j * m / shards) {
+            hattrie_iter_key(it, &len);
+            ++j;
+        }
+        hattrie_iter_next(it);
+    }
+    hattrie_iter_free(it);
+    t1 = now() - t0;
+    fprintf(stderr, "finished. (%0.3f seconds)\n", t1);
+
+    fprintf(stderr, "finding them with hattrie_quantiles ... ");
+    t0 = now();
+    k = hattrie_quantiles(T, shards, cuts);
+    t2 = now() - t0;
+    fprintf(stderr, "finished. (%0.3f seconds, %0.0fx)\n", t2, t1 / t2);
+
+    /* copying each shard's keys out, and deleting them */
+    hattrie_t* S;
+    fprintf(stderr, "copying out the shards ... ");
+    t0 = now();
+    for (j = 0; j <= k; ++j) {
+        S = hattrie_create_ex(HATTRIE_COUNTS);
+        it = hattrie_iter_begin_range(T,
+                                      j > 0 ? cuts[j - 1].key : NULL,
+                                      j > 0 ? cuts[j - 1].len : 0,
+                                      j < k ? cuts[j].key : NULL,
+                                      j < k ? cuts[j].len : 0);
+        for (; !hattrie_iter_finished(it); hattrie_iter_next(it)) {
+            key = hattrie_iter_key(it, &len);
+            *hattrie_get(S, key, len) = *hattrie_iter_val(it);
+        }
+        hattrie_iter_free(it);
+
+        it = hattrie_iter_begin(S, false);
+        for (; !hattrie_iter_finished(it); hattrie_iter_next(it)) {
+            key = hattrie_iter_key(it, &len);
+            hattrie_del(T, key, len);
+        }
+        hattrie_iter_free(it);
+        hattrie_free(S);
+    }
+    t1 = now() - t0;
+    fprintf(stderr, "finished. (%0.3f seconds, %zu keys left)\n", t1, hattrie_size(T));
+    hattrie_free(T);
+
+    T = build(n);
+    fprintf(stderr, "extracting them with hattrie_extract_range ... ");
+    t0 = now();
+    for (j = 0; j <= k; ++j) {
+        S = hattrie_extract_range(T, j > 0 ? cuts[j - 1].key : NULL,
+                                  j > 0 ? cuts[j - 1].len : 0,
+                                  j < k ? cuts[j].key : NULL,
+                                  j < k ? cuts[j].len : 0);
+        hattrie_free(S);
+    }
+    t2 = now() - t0;
+    fprintf(stderr, "finished. (%0.3f seconds, %0.0fx, %zu keys left)\n",
+            t2, t1 / t2, hattrie_size(T));
+
+    for (j = 0; j < k; ++j) free((char*) cuts[j].key);
+    free(cuts);
+    hattrie_free(T);
+
+    return 0;
+}
@@ -0,0 +1,76 @@
+
+/* Compare finding the keys matching a pattern by scanning every key, against
+ * iterating with the pattern, which skips subtrees where it cannot match. */
+
+#include "../src/hat-trie.h"
+#include "../src/pattern.h"
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+
+/* Keys shaped like "user:<id>:<field>". */
+static const char* fields[] = { "session", "profile", "email", "settings" };
+
+
+void bench(hattrie_t* T, const char* glob)
+{
+    hattrie_pattern_t* P = hattrie_pattern_glob(glob, strlen(glob));
+    hattrie_iter_t* it;
+    const char* key;
+    size_t len, count;
+    clock_t t0, t;
+
+    fprintf(stderr, "'%s': scanning every key ... ", glob);
+    count = 0;
+    t0 = clock();
+    it = hattrie_iter_begin(T, false);
+    while (!hattrie_iter_finished(it)) {
+        key = hattrie_iter_key(it, &len);
+        if (hattrie_pattern_match(P, key, len)) ++count;
+        hattrie_iter_next(it);
+    }
+    hattrie_iter_free(it);
+    t = clock();
+    fprintf(stderr, "finished. (%0.2f seconds, %zu matches)\n",
+            (double) (t - t0) / (double) CLOCKS_PER_SEC, count);
+
+    fprintf(stderr, "'%s': iterating with the pattern ... ", glob);
+    count = 0;
+    t0 = clock();
+    it = hattrie_iter_begin_with_pattern(T, false, P);
+    while (!hattrie_iter_finished(it)) {
+        ++count;
+        hattrie_iter_next(it);
+    }
+    hattrie_iter_free(it);
+    t = clock();
+    fprintf(stderr, "finished. (%0.2f seconds, %zu matches)\n",
+            (double) (t - t0) / (double) CLOCKS_PER_SEC, count);
+
+    hattrie_pattern_free(P);
+}
+
+
+int main()
+{
+    hattrie_t* T = hattrie_create();
+    const size_t n = 4000000;   // how many keys
+    char x[64];
+    size_t i, len;
+
+    for (i = 0; i < n; ++i) {
+        len = snprintf(x, sizeof(x), "user:%zu:%s", (size_t) rand() % 1000000,
+                       fields[rand() % 4]);
+        *hattrie_get(T, x, len) = i;
+    }
+
+    bench(T, "user:*:session");
+    bench(T, "user:12*:*");
+    bench(T, "user:[0-4]?:email");
+    bench(T, "*:settings");
+
+    hattrie_free(T);
+
+    return 0;
+}
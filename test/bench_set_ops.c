@@ -0,0 +1,148 @@
+/* Measure the union, intersection, and difference of two tries, each shaped
+ * like a day of keys, many also seen the day before, with hattrie_union,
+ * hattrie_intersect, and hattrie_difference, against iterating one trie and
+ * looking each key up in the other. The number of keys in each may be given as
+ * an argument. */
+
+#include "../src/hat-trie.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+
+double now()
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (double) t.tv_sec + 1e-9 * (double) t.tv_nsec;
+}
+
+
+/* Keys of the day, drawn from a range half of which the day before drew from
+ * too. */
+hattrie_t* day(size_t n, size_t d)
+{
+    hattrie_t* T = hattrie_create();
+    char x[32];
+    size_t i, k, len;
+
+    srand(d);
+    for (i = 0; i < n; ++i) {
+        k = d * n + (size_t) rand() % (2 * n);
+        len = snprintf(x, sizeof(x), "host%zu.net/%zu", k % 10000, k / 10000);
+        *hattrie_get(T, x, len) = i;
+    }
+    return T;
+}
+
+
+hattrie_t* copy(hattrie_t* T)
+{
+    hattrie_t* U = hattrie_create();
+    hattrie_iter_t* it = hattrie_iter_begin(T, false);
+    const char* key;
+    size_t len;
+    for (; !hattrie_iter_finished(it); hattrie_iter_next(it)) {
+        key = hattrie_iter_key(it, &len);
+        *hattrie_get(U, key, len) = *hattrie_iter_val(it);
+    }
+    hattrie_iter_free(it);
+    return U;
+}
+
+
+value_t sum(value_t dst, value_t src, void* ctx)
+{
+    (void) ctx;
+    return dst + src;
+}
+
+
+int main(int argc, char* argv[])
+{
+    size_t n = 2000000;   // how many keys in each trie
+    if (argc > 1) n = strtoul(argv[1], NULL, 10);
+
+    hattrie_t* A = day(n, 2);
+    hattrie_t* B = day(n, 3);
+    hattrie_t *D, *K;
+    hattrie_iter_t* it;
+    const char* key;
+    size_t len;
+    value_t* u;
+    double t0, t1, t2;
+
+    fprintf(stderr, "%zu and %zu keys\n", hattrie_size(A), hattrie_size(B));
+
+    /* the union */
+    D = copy(A);
+    t0 = now();
+    it = hattrie_iter_begin(B, false);
+    for (; !hattrie_iter_finished(it); hattrie_iter_next(it)) {
+        key = hattrie_iter_key(it, &len);
+        *hattrie_get(D, key, len) += *hattrie_iter_val(it);
+    }
+    hattrie_iter_free(it);
+    t1 = now() - t0;
+    fprintf(stderr, "union by lookups ... %0.3f seconds, %zu keys\n", t1, hattrie_size(D));
+    hattrie_free(D);
+
+    D = copy(A);
+    t0 = now();
+    hattrie_union(D, B, sum, NULL);
+    t2 = now() - t0;
+    fprintf(stderr, "hattrie_union ... %0.3f seconds, %zu keys, %0.2fx\n",
+            t2, hattrie_size(D), t1 / t2);
+    hattrie_free(D);
+
+    /* the intersection, into a new trie as it would be without */
+    t0 = now();
+    K = hattrie_create();
+    it = hattrie_iter_begin(A, false);
+    for (; !hattrie_iter_finished(it); hattrie_iter_next(it)) {
+        key = hattrie_iter_key(it, &len);
+        u = hattrie_tryget(B, key, len);
+        if (u) *hattrie_get(K, key, len) = *hattrie_iter_val(it) + *u;
+    }
+    hattrie_iter_free(it);
+    t1 = now() - t0;
+    fprintf(stderr, "intersection by lookups ... %0.3f seconds, %zu keys\n",
+            t1, hattrie_size(K));
+    hattrie_free(K);
+
+    D = copy(A);
+    t0 = now();
+    hattrie_intersect(D, B, sum, NULL);
+    t2 = now() - t0;
+    fprintf(stderr, "hattrie_intersect ... %0.3f seconds, %zu keys, %0.2fx\n",
+            t2, hattrie_size(D), t1 / t2);
+    hattrie_free(D);
+
+    /* the difference */
+    D = copy(A);
+    t0 = now();
+    it = hattrie_iter_begin(B, false);
+    for (; !hattrie_iter_finished(it); hattrie_iter_next(it)) {
+        key = hattrie_iter_key(it, &len);
+        hattrie_del(D, key, len);
+    }
+    hattrie_iter_free(it);
+    t1 = now() - t0;
+    fprintf(stderr, "difference by lookups ... %0.3f seconds, %zu keys\n",
+            t1, hattrie_size(D));
+    hattrie_free(D);
+
+    D = copy(A);
+    t0 = now();
+    hattrie_difference(D, B);
+    t2 = now() - t0;
+    fprintf(stderr, "hattrie_difference ... %0.3f seconds, %zu keys, %0.2fx\n",
+            t2, hattrie_size(D), t1 / t2);
+    hattrie_free(D);
+
+    hattrie_free(A);
+    hattrie_free(B);
+
+    return 0;
+}
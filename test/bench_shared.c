@@ -0,0 +1,149 @@
+/* Measure how lookups from many readers scale while one writer changes the
+ * trie, with readers and writer sharing a read-write lock, against a trie
+ * created with HATTRIE_SHARED, which readers use without locks. The number of
+ * lookups and the most readers to use may be given as arguments. Times are
+ * wall clock times. */
+
+#include "../src/hat-trie.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+
+double now()
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (double) t.tv_sec + 1e-9 * (double) t.tv_nsec;
+}
+
+
+typedef struct {
+    hattrie_entry_t* xs;   // the keys this thread looks up, or changes
+    size_t n;
+
+    hattrie_t* T;
+    pthread_rwlock_t* lock;    // NULL for a shared trie
+    bool* done;                // set once the readers have finished
+
+    size_t found;
+} worker;
+
+
+void* work_read(void* arg)
+{
+    worker* w = arg;
+    hattrie_reader_t* r = w->lock ? NULL : hattrie_reader_create(w->T);
+    size_t i;
+    for (i = 0; i < w->n; ++i) {
+        if (w->lock) pthread_rwlock_rdlock(w->lock);
+        else if (i % 1024 == 0) hattrie_reader_enter(r);
+
+        if (hattrie_tryget(w->T, w->xs[i].key, w->xs[i].len)) ++w->found;
+
+        if (w->lock) pthread_rwlock_unlock(w->lock);
+        else if (i % 1024 == 1023 || i + 1 == w->n) hattrie_reader_leave(r);
+    }
+    hattrie_reader_free(r);
+    return NULL;
+}
+
+
+/* Insert and delete keys, round and round, until the readers are done. */
+void* work_write(void* arg)
+{
+    worker* w = arg;
+    size_t i;
+    for (i = 0; !__atomic_load_n(w->done, __ATOMIC_ACQUIRE); i = (i + 1) % w->n) {
+        if (w->lock) pthread_rwlock_wrlock(w->lock);
+        if (i % 2 == 0) hattrie_set(w->T, w->xs[i].key, w->xs[i].len, w->xs[i].val);
+        else            hattrie_del(w->T, w->xs[i - 1].key, w->xs[i - 1].len);
+        if (w->lock) pthread_rwlock_unlock(w->lock);
+    }
+    return NULL;
+}
+
+
+double run(hattrie_entry_t* xs, size_t n, hattrie_entry_t* ys, size_t m,
+           size_t nreaders, bool shared)
+{
+    worker* ws = malloc((nreaders + 1) * sizeof(worker));
+    pthread_t* threads = malloc((nreaders + 1) * sizeof(pthread_t));
+    pthread_rwlock_t lock;
+    pthread_rwlock_init(&lock, NULL);
+    hattrie_t* T = hattrie_create_ex(shared ? HATTRIE_SHARED : 0);
+    bool done = false;
+    size_t i, found = 0;
+
+    for (i = 0; i < m; ++i) hattrie_set(T, ys[i].key, ys[i].len, ys[i].val);
+
+    double t0 = now();
+    for (i = 0; i <= nreaders; ++i) {
+        ws[i].xs = i < nreaders ? xs + i * (n / nreaders) : ys + m;
+        ws[i].n = i < nreaders ? n / nreaders : m;
+        ws[i].T = T;
+        ws[i].lock = shared ? NULL : &lock;
+        ws[i].done = &done;
+        ws[i].found = 0;
+        pthread_create(&threads[i], NULL, i < nreaders ? work_read : work_write,
+                       &ws[i]);
+    }
+    for (i = 0; i < nreaders; ++i) {
+        pthread_join(threads[i], NULL);
+        found += ws[i].found;
+    }
+    double t = now() - t0;
+    __atomic_store_n(&done, true, __ATOMIC_RELEASE);
+    pthread_join(threads[nreaders], NULL);
+
+    fprintf(stderr, "finished. (%0.2f seconds, %0.1fM lookups/second, %zu found)\n",
+            t, 1e-6 * (double) n / t, found);
+
+    hattrie_free(T);
+    pthread_rwlock_destroy(&lock);
+    free(ws);
+    free(threads);
+    return t;
+}
+
+
+int main(int argc, char* argv[])
+{
+    size_t n = 8000000;    // how many lookups
+    size_t max_readers = sysconf(_SC_NPROCESSORS_ONLN);
+    if (argc > 1) n = strtoul(argv[1], NULL, 10);
+    if (argc > 2) max_readers = strtoul(argv[2], NULL, 10);
+    if (max_readers < 4) max_readers = 4;
+
+    /* a million keys like "<host>/<path>" in the trie, and as many more that
+     * the writer adds and removes */
+    const size_t keysize = 32, m = 1000000;
+    char* text = malloc((n + 2 * m) * keysize);
+    hattrie_entry_t* xs = malloc((n + 2 * m) * sizeof(hattrie_entry_t));
+    hattrie_entry_t* ys = xs + n;
+    size_t i, nreaders;
+    for (i = 0; i < n + 2 * m; ++i) {
+        xs[i].key = text + i * keysize;
+        xs[i].len = snprintf(xs[i].key, keysize, "host%zu.net/%zu",
+                             (size_t) rand() % 1000, (size_t) rand() % 2000);
+        xs[i].val = i;
+    }
+
+    double t1 = 0.0, t;
+    for (nreaders = 1; nreaders <= max_readers; nreaders *= 2) {
+        fprintf(stderr, "%zu readers, read-write lock ... ", nreaders);
+        t = run(xs, n, ys, m, nreaders, false);
+        if (nreaders == 1) t1 = t;
+
+        fprintf(stderr, "%zu readers, HATTRIE_SHARED ... ", nreaders);
+        t = run(xs, n, ys, m, nreaders, true);
+        fprintf(stderr, "    %0.2fx the read-write lock with one reader\n", t1 / t);
+    }
+
+    free(text);
+    free(xs);
+
+    return 0;
+}
@@ -0,0 +1,107 @@
+/* Measure taking a consistent view of a trie, with hattrie_snapshot against a
+ * copy made by iterating and inserting every key, and what a live snapshot
+ * costs the writes that follow, while another thread iterates through it. The
+ * number of keys may be given as an argument. */
+
+#include "../src/hat-trie.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+
+double now()
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (double) t.tv_sec + 1e-9 * (double) t.tv_nsec;
+}
+
+
+hattrie_t* copy(hattrie_t* T)
+{
+    hattrie_t* U = hattrie_create();
+    hattrie_iter_t* it = hattrie_iter_begin(T, false);
+    const char* key;
+    size_t len;
+    for (; !hattrie_iter_finished(it); hattrie_iter_next(it)) {
+        key = hattrie_iter_key(it, &len);
+        *hattrie_get(U, key, len) = *hattrie_iter_val(it);
+    }
+    hattrie_iter_free(it);
+    return U;
+}
+
+
+/* Set m random keys of the same shape as the trie's. */
+double set_keys(hattrie_t* T, size_t n, size_t m)
+{
+    char x[32];
+    size_t i, len;
+    double t0 = now();
+    for (i = 0; i < m; ++i) {
+        len = snprintf(x, sizeof(x), "host%zu.net/%zu", (size_t) rand() % 10000,
+                       (size_t) rand() % (n / 5000));
+        *hattrie_get(T, x, len) = i;
+    }
+    return now() - t0;
+}
+
+
+static void* export(void* arg)
+{
+    value_t sum = 0;
+    hattrie_iter_t* it = hattrie_iter_begin(arg, true);
+    for (; !hattrie_iter_finished(it); hattrie_iter_next(it)) {
+        sum += *hattrie_iter_val(it);
+    }
+    hattrie_iter_free(it);
+    fprintf(stderr, "  (exported a snapshot with values summing to %zu)\n", (size_t) sum);
+    return NULL;
+}
+
+
+int main(int argc, char* argv[])
+{
+    size_t n = 4000000;   // how many keys
+    if (argc > 1) n = strtoul(argv[1], NULL, 10);
+    const size_t m = n / 4; // how many keys are written after the view is taken
+
+    hattrie_t* T = hattrie_create();
+    hattrie_t *U, *S;
+    pthread_t reader;
+    double t0, t1, t2;
+
+    set_keys(T, n, n);
+    fprintf(stderr, "%zu keys\n", hattrie_size(T));
+
+    /* a view copied key by key, and the writes that follow */
+    t0 = now();
+    U = copy(T);
+    t1 = now() - t0;
+    fprintf(stderr, "copying every key ... %0.3f seconds\n", t1);
+    t2 = set_keys(U, n, m);
+    fprintf(stderr, "%zu writes ... %0.3f seconds\n", m, t2);
+    t1 += t2;
+
+    /* a snapshot, and the same writes, which copy the nodes they change, while
+     * another thread reads it */
+    t0 = now();
+    S = hattrie_snapshot(T);
+    t2 = now() - t0;
+    fprintf(stderr, "hattrie_snapshot ... %0.6f seconds\n", t2);
+
+    pthread_create(&reader, NULL, export, S);
+    t0 = set_keys(T, n, m);
+    pthread_join(reader, NULL);
+    t2 += t0;
+    fprintf(stderr, "%zu writes while the snapshot is read ... %0.3f seconds, "
+            "%0.2fx copying and writing\n", m, t0, t1 / t2);
+
+    hattrie_free(S);
+    hattrie_free(U);
+    hattrie_free(T);
+
+    return 0;
+}
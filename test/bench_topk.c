@@ -0,0 +1,107 @@
+
+/* Compare finding the highest valued keys under a prefix by iterating through
+ * every key with the prefix, against a top-k search using subtree maxima. */
+
+#include "../src/hat-trie.h"
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+
+void randstr(char* x, size_t len)
+{
+    x[len] = '\0';
+    while (len > 0) {
+        x[--len] = 'a' + (rand() % 26);
+    }
+}
+
+
+/* Keep the k largest values seen in a min-heap. */
+void heap_offer(value_t* heap, size_t* n, size_t k, value_t val)
+{
+    size_t i, c;
+    if (*n < k) {
+        i = (*n)++;
+        while (i > 0 && heap[(i - 1) / 2] > val) {
+            heap[i] = heap[(i - 1) / 2];
+            i = (i - 1) / 2;
+        }
+        heap[i] = val;
+    }
+    else if (val > heap[0]) {
+        i = 0;
+        while ((c = 2 * i + 1) < *n) {
+            if (c + 1 < *n && heap[c + 1] < heap[c]) ++c;
+            if (val <= heap[c]) break;
+            heap[i] = heap[c];
+            i = c;
+        }
+        heap[i] = val;
+    }
+}
+
+
+int main()
+{
+    hattrie_t* T = hattrie_create_ex(HATTRIE_MAXIMA);
+    const size_t n = 4000000;   // how many keys
+    const size_t m_low  = 4;    // minimum length of each key
+    const size_t m_high = 16;   // maximum length of each key
+    const size_t k = 10;
+    const size_t reps = 10;
+    char x[32];
+
+    size_t i, m;
+    value_t val;
+    for (i = 0; i < n; ++i) {
+        m = m_low + rand() % (m_high - m_low);
+        randstr(x, m);
+
+        /* popularity falls off steeply, as with query logs */
+        val = (value_t) rand() % 1000;
+        val = val * val * val;
+        hattrie_set(T, x, m, val);
+    }
+
+    static const char* prefixes[] = { "", "a", "ab", "abc" };
+    hattrie_entry_t out[10];
+    value_t heap[10];
+    hattrie_iter_t* it;
+    size_t p, r, found = 0;
+    clock_t t0, t;
+
+    for (p = 0; p < sizeof(prefixes) / sizeof(prefixes[0]); ++p) {
+        fprintf(stderr, "'%s': %zu keys\n", prefixes[p],
+                hattrie_count_prefix(T, prefixes[p], strlen(prefixes[p])));
+
+        fprintf(stderr, "  iterating through the prefix ... ");
+        t0 = clock();
+        for (r = 0; r < reps; ++r) {
+            found = 0;
+            it = hattrie_iter_begin_with_prefix(T, false, prefixes[p], strlen(prefixes[p]));
+            while (!hattrie_iter_finished(it)) {
+                heap_offer(heap, &found, k, *hattrie_iter_val(it));
+                hattrie_iter_next(it);
+            }
+            hattrie_iter_free(it);
+        }
+        t = clock();
+        fprintf(stderr, "finished. (%0.4f seconds per query, %zu keys)\n",
+                (double) (t - t0) / (double) CLOCKS_PER_SEC / reps, found);
+
+        fprintf(stderr, "  top-k search ... ");
+        t0 = clock();
+        for (r = 0; r < reps; ++r) {
+            found = hattrie_topk_prefix(T, prefixes[p], strlen(prefixes[p]), k, out);
+            for (i = 0; i < found; ++i) free(out[i].key);
+        }
+        t = clock();
+        fprintf(stderr, "finished. (%0.4f seconds per query, %zu keys)\n",
+                (double) (t - t0) / (double) CLOCKS_PER_SEC / reps, found);
+    }
+
+    hattrie_free(T);
+
+    return 0;
+}
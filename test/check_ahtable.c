@@ -103,6 +103,101 @@ bool test_ahtable_insert()
 }
 
 
+bool test_ahtable_upsert()
+{
+    fprintf(stderr, "upserting %zu keys ... \n", k);
+    bool passed = true;
+    size_t i, j;
+    value_t* u;
+    value_t  v, w;
+    bool inserted;
+
+    for (j = 0; j < k; ++j) {
+        i = rand() % n;
+
+        v = str_map_get(M, xs[i], strlen(xs[i]));
+        str_map_set(M, xs[i], strlen(xs[i]), v + 1 + i);
+
+        /* stored values are never 0, so 0 means the key is new */
+        if (j % 2 == 0) {
+            u = ahtable_get_ex(T, xs[i], strlen(xs[i]), &inserted);
+            if (inserted != (v == 0) || *u != v) {
+                fprintf(stderr, "[error] upsert reported inserted = %d for a key with value %lu\n",
+                        (int) inserted, v);
+                passed = false;
+            }
+            w = *u += 1 + i;
+        }
+        else {
+            w = ahtable_add(T, xs[i], strlen(xs[i]), 1 + i);
+        }
+
+        if (w != v + 1 + i) {
+            fprintf(stderr, "[error] tally mismatch (reported: %lu, correct: %lu)\n",
+                            w, v + 1 + i);
+            passed = false;
+        }
+    }
+
+    fprintf(stderr, "done.\n");
+    return passed;
+}
+
+
+bool test_ahtable_batch()
+{
+    fprintf(stderr, "inserting %zu keys in batches ... \n", k);
+    bool passed = true;
+    const size_t batch = 1000;
+    const char** keys = malloc(batch * sizeof(char*));
+    size_t* lens = malloc(batch * sizeof(size_t));
+    value_t** vals = malloc(batch * sizeof(value_t*));
+    size_t i, j, b;
+    value_t v;
+
+    for (j = 0; j < k; j += batch) {
+        /* keys are drawn with repeats, within a batch and across them */
+        for (b = 0; b < batch; ++b) {
+            i = rand() % n;
+            keys[b] = xs[i];
+            lens[b] = strlen(xs[i]);
+        }
+
+        ahtable_get_batch(T, keys, lens, batch, vals);
+
+        for (b = 0; b < batch; ++b) {
+            if (vals[b] != ahtable_tryget(T, keys[b], lens[b])) {
+                fprintf(stderr, "[error] batch found the wrong value for a key\n");
+                passed = false;
+            }
+        }
+
+        for (b = 0; b < batch; ++b) {
+            v = str_map_get(M, keys[b], lens[b]);
+            if (*vals[b] != v) {
+                fprintf(stderr, "[error] batch value mismatch (reported: %lu, correct: %lu)\n",
+                        *vals[b], v);
+                passed = false;
+            }
+            str_map_set(M, keys[b], lens[b], v + 1 + b);
+            *vals[b] += 1 + b;
+        }
+    }
+
+    if (ahtable_size(T) != M->m) {
+        fprintf(stderr, "[error] table holds %zu keys, expected %zu\n",
+                ahtable_size(T), M->m);
+        passed = false;
+    }
+
+    free(keys);
+    free(lens);
+    free(vals);
+    fprintf(stderr, "done.\n");
+    return passed;
+}
+
+
 bool test_ahtable_iteration()
 {
     fprintf(stderr, "iterating through %zu keys ... \n", k);
@@ -216,6 +311,69 @@ bool test_ahtable_sorted_iteration()
     return passed;
 }
 
+bool test_ahtable_range_iteration()
+{
+    fprintf(stderr, "iterating through key ranges ... \n");
+
+    bool passed = true;
+    size_t r, count, expected;
+    const char* key;
+    size_t len;
+    const char* lo;
+    const char* hi;
+    ahtable_iter_t* i;
+    bool sorted;
+
+    for (r = 0; r < 20; ++r) {
+        lo = xs[rand() % n];
+        hi = xs[rand() % n];
+        if (strcmp(lo, hi) > 0) {
+            key = lo;
+            lo = hi;
+            hi = key;
+        }
+
+        /* count keys in the range by brute force */
+        expected = 0;
+        i = ahtable_iter_begin(T, false);
+        while (!ahtable_iter_finished(i)) {
+            key = ahtable_iter_key(i, &len);
+            if (cmpkey(key, len, lo, strlen(lo)) >= 0 &&
+                cmpkey(key, len, hi, strlen(hi)) < 0) ++expected;
+            ahtable_iter_next(i);
+        }
+        ahtable_iter_free(i);
+
+        for (sorted = false; ; sorted = true) {
+            count = 0;
+            i = ahtable_iter_begin_range(T, sorted, lo, strlen(lo), hi, strlen(hi));
+            while (!ahtable_iter_finished(i)) {
+                key = ahtable_iter_key(i, &len);
+                if (cmpkey(key, len, lo, strlen(lo)) < 0 ||
+                    cmpkey(key, len, hi, strlen(hi)) >= 0) {
+                    fprintf(stderr, "[error] iterated over key outside of range.\n");
+                    passed = false;
+                }
+                ++count;
+                ahtable_iter_next(i);
+            }
+            ahtable_iter_free(i);
+
+            if (count != expected) {
+                fprintf(stderr, "[error] iterated through %zu keys in range, expected %zu\n",
+                        count, expected);
+                passed = false;
+            }
+
+            if (sorted) break;
+        }
+    }
+
+    fprintf(stderr, "done.\n");
+    return passed;
+}
+
+
 bool test_ahtable_save_load()
 {
     fprintf(stderr, "saving ahtable ... \n");
@@ -270,6 +428,127 @@ bool test_ahtable_save_load()
 }
 
 
+/* Check that every value in the table lies on a multiple of its size. */
+bool check_ahtable_aligned(ahtable_t* T, bool sorted)
+{
+    ahtable_iter_t* i = ahtable_iter_begin(T, sorted);
+    value_t* u;
+    size_t len;
+    while (!ahtable_iter_finished(i)) {
+        u = ahtable_iter_val(i);
+        if ((uintptr_t) u % sizeof(value_t) != 0) {
+            ahtable_iter_key(i, &len);
+            fprintf(stderr, "[error] value of a key of length %zu is not aligned.\n",
+                    len);
+            ahtable_iter_free(i);
+            return false;
+        }
+        ahtable_iter_next(i);
+    }
+    ahtable_iter_free(i);
+    return true;
+}
+
+
+bool test_ahtable_aligned()
+{
+    fprintf(stderr, "checking value alignment ... \n");
+
+    bool passed = check_ahtable_aligned(T, false) && check_ahtable_aligned(T, true);
+
+    /* keys of every length, short and long, and deleting some, which moves
+     * the ones after them */
+    ahtable_t* U = ahtable_create();
+    char x[300];
+    size_t i, len;
+    value_t* u;
+    for (i = 0; i < 20000; ++i) {
+        len = rand() % sizeof(x);
+        randstr(x, len);
+        u = ahtable_get(U, x, len);
+        if ((uintptr_t) u % sizeof(value_t) != 0) {
+            fprintf(stderr, "[error] value of a new key of length %zu is not aligned.\n",
+                    len);
+            passed = false;
+            break;
+        }
+        *u = i;
+        if (i % 3 == 0) ahtable_del(U, x, len);
+    }
+    passed = passed && check_ahtable_aligned(U, false);
+
+    ahtable_free(U);
+    fprintf(stderr, "done.\n");
+    return passed;
+}
+
+
+/* Check that every key of T has the same value in U, and U no others. */
+bool check_ahtable_same(ahtable_t* T, ahtable_t* U)
+{
+    ahtable_iter_t* i = ahtable_iter_begin(T, false);
+    const char* key;
+    value_t* u;
+    size_t len;
+    bool passed = ahtable_size(T) == ahtable_size(U);
+    while (passed && !ahtable_iter_finished(i)) {
+        key = ahtable_iter_key(i, &len);
+        u = ahtable_tryget(U, key, len);
+        if (u == NULL || *u != *ahtable_iter_val(i)) {
+            fprintf(stderr, "[error] copy of a key of length %zu differs.\n", len);
+            passed = false;
+        }
+        ahtable_iter_next(i);
+    }
+    ahtable_iter_free(i);
+
+    if (ahtable_size(T) != ahtable_size(U)) {
+        fprintf(stderr, "[error] copy holds %zu keys, expected %zu.\n",
+                ahtable_size(U), ahtable_size(T));
+    }
+    return passed;
+}
+
+
+static void retire_free(void* ptr, void* ctx)
+{
+    (void) ctx;
+    free(ptr);
+}
+
+
+bool test_ahtable_dup()
+{
+    fprintf(stderr, "copying ahtable ... \n");
+
+    ahtable_t* U = ahtable_dup(T);
+    bool passed = check_ahtable_same(T, U) && check_ahtable_aligned(U, true);
+
+    /* the copy changes apart from the original */
+    ahtable_t* V = ahtable_dup(T);
+    size_t i, len;
+    for (i = 0; i < 1000; ++i) {
+        len = strlen(xs[i]);
+        ahtable_del(V, xs[i], len);
+        *ahtable_get(V, xs[i], len / 2) = i;
+    }
+    passed = passed && check_ahtable_same(T, U);
+    ahtable_free(V);
+
+    /* a copy of a shared table is not shared */
+    ahtable_share(U, retire_free, NULL);
+    V = ahtable_dup(U);
+    passed = passed && check_ahtable_same(T, V) && check_ahtable_aligned(V, false);
+    for (i = 0; i < 1000; ++i) ahtable_del(V, xs[i], strlen(xs[i]));
+    passed = passed && check_ahtable_same(T, U);
+
+    ahtable_free(U);
+    ahtable_free(V);
+    fprintf(stderr, "done.\n");
+    return passed;
+}
+
+
 int main()
 {
     bool passed = true;
@@ -284,9 +563,24 @@ int main()
     passed &= test_ahtable_sorted_iteration();
     teardown();
 
+    setup();
+    passed &= test_ahtable_insert();
+    passed &= test_ahtable_range_iteration();
+    teardown();
+
     setup();
     passed &= test_ahtable_insert();
     passed &= test_ahtable_save_load();
+    passed &= test_ahtable_aligned();
+    passed &= test_ahtable_dup();
+    teardown();
+
+    setup();
+    passed &= test_ahtable_upsert();
+    teardown();
+
+    setup();
+    passed &= test_ahtable_batch();
     teardown();
 
     if (passed) return 0;
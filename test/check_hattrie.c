@@ -2,6 +2,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
+#include <pthread.h>
 
 #include "str_map.h"
 #include "../src/hat-trie.h"
@@ -115,6 +116,109 @@ bool test_hattrie_insert()
 }
 
 
+bool test_hattrie_upsert()
+{
+    fprintf(stderr, "upserting %zu keys ... \n", k);
+    bool passed = true;
+    size_t i, j;
+    value_t* u;
+    value_t  v, w;
+    bool inserted;
+
+    for (j = 0; j < k; ++j) {
+        i = rand() % n;
+
+        v = str_map_get(M, xs[i], strlen(xs[i]));
+        str_map_set(M, xs[i], strlen(xs[i]), v + 1 + i);
+
+        /* stored values are never 0, so 0 means the key is new */
+        if (j % 2 == 0) {
+            u = hattrie_get_ex(T, xs[i], strlen(xs[i]), &inserted);
+            if (inserted != (v == 0) || *u != v) {
+                fprintf(stderr, "[error] upsert reported inserted = %d for a key with value %lu\n",
+                        (int) inserted, v);
+                passed = false;
+            }
+            w = *u += 1 + i;
+        }
+        else {
+            w = hattrie_add(T, xs[i], strlen(xs[i]), 1 + i);
+        }
+
+        if (w != v + 1 + i) {
+            fprintf(stderr, "[error] tally mismatch (reported: %lu, correct: %lu)\n",
+                            w, v + 1 + i);
+            passed = false;
+        }
+    }
+
+    fprintf(stderr, "done.\n");
+    return passed;
+}
+
+
+/* Insert keys through a cursor, in sorted runs interleaved with jumps
+ * elsewhere, and check them against a trie built with hattrie_get. Enough keys
+ * go in that buckets on the cursor's path are split along the way. */
+bool test_hattrie_cursor()
+{
+    fprintf(stderr, "inserting through a cursor ... \n");
+    bool passed = true;
+    hattrie_t* T = hattrie_create_ex(HATTRIE_COUNTS);
+    hattrie_t* U = hattrie_create();
+    hattrie_cursor_t* c = hattrie_cursor_create(T);
+    const size_t m = 100000;
+    char x[32];
+    size_t i, len;
+    value_t* u;
+
+    for (i = 0; i < m; ++i) {
+        if (i % 7 == 0) len = snprintf(x, sizeof(x), "%zu", (size_t) rand() % m);
+        else            len = snprintf(x, sizeof(x), "key:%08zu", i);
+
+        u = hattrie_cursor_get(c, x, len);
+        *u += i;
+        *hattrie_get(U, x, len) += i;
+
+        /* the shorter keys are prefixes of others, so look some up again */
+        if (i % 5 == 0) len = snprintf(x, sizeof(x), "key:%06zu", i / 100);
+        u = hattrie_cursor_tryget(c, x, len);
+        if ((u == NULL) != (hattrie_tryget(U, x, len) == NULL) ||
+            (u && *u != *hattrie_tryget(U, x, len))) {
+            fprintf(stderr, "[error] cursor found the wrong value for '%s'.\n", x);
+            passed = false;
+        }
+    }
+
+    if (hattrie_size(T) != hattrie_size(U) ||
+        hattrie_count_prefix(T, "key:", 4) != hattrie_count_prefix(U, "key:", 4)) {
+        fprintf(stderr, "[error] cursor stored %zu keys, expected %zu.\n",
+                hattrie_size(T), hattrie_size(U));
+        passed = false;
+    }
+
+    hattrie_iter_t* it = hattrie_iter_begin(U, false);
+    const char* key;
+    while (!hattrie_iter_finished(it)) {
+        key = hattrie_iter_key(it, &len);
+        u = hattrie_cursor_tryget(c, key, len);
+        if (u == NULL || *u != *hattrie_iter_val(it)) {
+            fprintf(stderr, "[error] cursor lost a key.\n");
+            passed = false;
+        }
+        hattrie_iter_next(it);
+    }
+    hattrie_iter_free(it);
+
+    hattrie_cursor_free(c);
+    hattrie_free(T);
+    hattrie_free(U);
+
+    fprintf(stderr, "done.\n");
+    return passed;
+}
+
+
 bool test_hattrie_iteration()
 {
     fprintf(stderr, "iterating through %zu keys ... \n", k);
@@ -370,168 +474,2412 @@ bool test_hattrie_prefix_iteration()
 }
 
 
-bool test_hattrie_non_ascii()
+bool test_hattrie_sorted_prefix_iteration()
 {
-    fprintf(stderr, "checking non-ascii... \n");
+    fprintf(stderr, "iterating in order through keys by prefix ... \n");
+
     bool passed = true;
-    value_t* u;
-    hattrie_t* T = hattrie_create();
-    char* txt = "\x81\x70";
+    hattrie_iter_t* i;
+    size_t r, count, expected, len, prev_len, fix;
+    const char* key;
+    char prefix[8];
+    char* prev_key = malloc(m_high + 1);
 
-    u = hattrie_get(T, txt, strlen(txt));
-    *u = 10;
+    for (r = 0; r < 200; ++r) {
+        /* prefixes of stored keys, sometimes extended past them */
+        key = xs[rand() % n];
+        fix = rand() % 4;
+        memcpy(prefix, key, fix);
+        if (rand() % 4 == 0) prefix[fix++] = '\x7e';
 
-    u = hattrie_tryget(T, txt, strlen(txt));
-    if (*u != 10){
-        fprintf(stderr, "[error] can't store non-ascii strings\n");
-        passed = false;
+        expected = 0;
+        i = hattrie_iter_begin(T, false);
+        while (!hattrie_iter_finished(i)) {
+            key = hattrie_iter_key(i, &len);
+            if (len >= fix && memcmp(key, prefix, fix) == 0) ++expected;
+            hattrie_iter_next(i);
+        }
+        hattrie_iter_free(i);
+
+        count = 0;
+        prev_len = 0;
+        i = hattrie_iter_begin_with_prefix(T, true, prefix, fix);
+        while (!hattrie_iter_finished(i)) {
+            key = hattrie_iter_key(i, &len);
+            if (count > 0 && cmpkey(prev_key, prev_len, key, len) >= 0) {
+                fprintf(stderr, "[error] prefix iteration is not correctly ordered.\n");
+                passed = false;
+            }
+            if (hattrie_tryget(T, prefix, fix) == NULL && len == 0) {
+                fprintf(stderr, "[error] prefix iteration reported a missing key.\n");
+                passed = false;
+            }
+            memcpy(prev_key, key, len);
+            prev_len = len;
+            ++count;
+            hattrie_iter_next(i);
+        }
+        hattrie_iter_free(i);
+
+        if (count != expected) {
+            fprintf(stderr,
+                    "[error] iterated through %zu elements for prefix [%.*s], expected %zu.\n",
+                    count, (int)fix, prefix, expected);
+            passed = false;
+        }
     }
-    hattrie_free(T);
 
+    free(prev_key);
     fprintf(stderr, "done.\n");
     return passed;
 }
 
 
-typedef struct {
-    const char* test;
-    size_t length;
-    value_t value;
-    bool seen;
-    bool valid;
-    bool skip;
-    const char* name;
-} edge_case_test;
-
-
-bool test_hattrie_odd_keys()
+bool test_hattrie_range_iteration()
 {
-    fprintf(stderr, "checking edge-case keys...\n");
-    bool passed = true;
-    value_t* u;
-    hattrie_t* T = hattrie_create();
-
-    size_t test_count = 5;
-    edge_case_test tests[] = {
-        { .test = "", .length = 0, .value = 0,
-          .seen = false, .valid = false, .skip = false,
-          .name = "empty" },
-        { .test = "\x00", .length = 1, .value = 1,
-          .seen = false, .valid = false, .skip = false,
-          .name = "empty terminated" },
-        { .test = "\x00\x14", .length = 2, .value = 2,
-          .seen = false, .valid = false, .skip = false,
-          .name = "NUL byte initialized" },
-        { .test = "\x14\x00", .length = 3, .value = 3,
-          .seen = false, .valid = false, .skip = false,
-          .name = "NUL byte terminated" },
-        { .test = "\x00\x14\x00", .length = 4, .value = 4,
-          .seen = false, .valid = false, .skip = false,
-          .name = "NUL byte surrounded" }
-    };
+    fprintf(stderr, "iterating in order through key ranges ... \n");
 
-    for (size_t test_index = 0; test_index < test_count; test_index++) {
-        u = hattrie_get(T, tests[test_index].test, tests[test_index].length);
-        *u = tests[test_index].value;
-    }
+    bool passed = true;
+    hattrie_iter_t* i;
+    size_t r, count, expected, len, lo_len, hi_len, seek_len, first_len;
+    const char* key;
+    const char* lo;
+    const char* hi;
+    const char* seek;
+    char* first = malloc(m_high + 1);
+    char* prev_key = malloc(m_high + 1);
+    size_t prev_len = 0;
 
-    for (size_t test_index = 0; test_index < test_count; test_index++) {
-        u = hattrie_tryget(T, tests[test_index].test, tests[test_index].length);
-        if (*u != tests[test_index].value) {
-            fprintf(stderr,
-                    "[error] can't store %s string key with value %zu!\n",
-                    tests[test_index].name, tests[test_index].value);
-            tests[test_index].skip = true;
-            passed = false;
+    for (r = 0; r < 100; ++r) {
+        lo = xs[rand() % n];
+        hi = xs[rand() % n];
+        lo_len = rand() % 4;
+        hi_len = rand() % 4;
+        if (cmpkey(lo, lo_len, hi, hi_len) > 0) {
+            key = lo; lo = hi; hi = key;
+            len = lo_len; lo_len = hi_len; hi_len = len;
         }
-    }
-
-    hattrie_iter_t* i = hattrie_iter_begin(T, false);
-    size_t verify_len;
-    value_t* verify_ptr;
-    value_t verify_val;
-    const char* verify_key;
-    while (!hattrie_iter_finished(i)) {
-        verify_key = hattrie_iter_key(i, &verify_len);
-        verify_ptr = hattrie_iter_val(i);
-        verify_val = *verify_ptr;
+        seek = xs[rand() % n];
+        seek_len = strlen(seek);
 
-        edge_case_test* matched_test = NULL;
-        for (size_t test_index = 0; test_index < test_count; test_index++) {
-            if (verify_len == tests[test_index].length &&
-                    memcmp(verify_key, tests[test_index].test, tests[test_index].length) == 0) {
-                matched_test = &tests[test_index];
-                break;
+        /* brute force the size of the range and its first key >= seek */
+        expected = 0;
+        first_len = 0;
+        bool found = false;
+        i = hattrie_iter_begin(T, false);
+        while (!hattrie_iter_finished(i)) {
+            key = hattrie_iter_key(i, &len);
+            if (cmpkey(key, len, lo, lo_len) >= 0 && cmpkey(key, len, hi, hi_len) < 0) {
+                ++expected;
+                if (cmpkey(key, len, seek, seek_len) >= 0 &&
+                    (!found || cmpkey(key, len, first, first_len) < 0)) {
+                    memcpy(first, key, len);
+                    first_len = len;
+                    found = true;
+                }
             }
+            hattrie_iter_next(i);
         }
-        if (matched_test == NULL) {
-            fprintf(stderr, "[error] iterated over unknown edge-case key [ ");
-            for (size_t i = 0; i < verify_len; i++) {
-                fprintf(stderr, "0x%X ", verify_key[i]);
+        hattrie_iter_free(i);
+
+        count = 0;
+        i = hattrie_iter_begin_range(T, lo, lo_len, hi, hi_len);
+        while (!hattrie_iter_finished(i)) {
+            key = hattrie_iter_key(i, &len);
+            if (count > 0 && cmpkey(prev_key, prev_len, key, len) >= 0) {
+                fprintf(stderr, "[error] range iteration is not correctly ordered.\n");
+                passed = false;
             }
-            fprintf(stderr, "].\n");
+            memcpy(prev_key, key, len);
+            prev_len = len;
+            ++count;
+            hattrie_iter_next(i);
+        }
+
+        if (count != expected) {
+            fprintf(stderr, "[error] iterated through %zu elements in range, expected %zu.\n",
+                    count, expected);
             passed = false;
-        } else if (matched_test->seen) {
-            fprintf(stderr, "[error] iterated over key [ ");
-            for (size_t i = 0; i < verify_len; i++) {
-                fprintf(stderr, "0x%X ", verify_key[i]);
-            }
-            fprintf(stderr, "] more than once!\n");
+        }
+
+        hattrie_iter_seek(i, seek, seek_len);
+        if (hattrie_iter_finished(i) == found) {
+            fprintf(stderr, "[error] seek %s the end of the range.\n",
+                    found ? "reached" : "did not reach");
             passed = false;
-        } else {
-            matched_test->seen = true;
-            if (verify_val == matched_test->value) {
-                matched_test->valid = true;
-            } else {
-                fprintf(stderr, "[error] value stored for key [ ");
-                for (size_t i = 0; i < verify_len; i++) {
-                    fprintf(stderr, "0x%X ", verify_key[i]);
-                }
-                fprintf(stderr,
-                        "] was incorrect. (expected %zu, got %zu)\n",
-                        matched_test->value, verify_val);
+        }
+        else if (found) {
+            key = hattrie_iter_key(i, &len);
+            if (cmpkey(key, len, first, first_len) != 0) {
+                fprintf(stderr, "[error] seek did not find the first key >= [%.*s].\n",
+                        (int)seek_len, seek);
                 passed = false;
             }
         }
-        hattrie_iter_next(i);
+        hattrie_iter_free(i);
     }
 
-    for (uint8_t test_index = 0; test_index < test_count; test_index++) {
-        if (tests[test_index].skip)
-            continue;
-        if (!tests[test_index].seen) {
-            fprintf(stderr, "[error] key [ ");
-            for (size_t i = 0; i < tests[test_index].length; i++) {
-                fprintf(stderr, "0x%X ", tests[test_index].test[i]);
+    free(first);
+    free(prev_key);
+    fprintf(stderr, "done.\n");
+    return passed;
+}
+
+
+bool test_hattrie_reverse_iteration()
+{
+    fprintf(stderr, "iterating in reverse order through keys ... \n");
+
+    bool passed = true;
+    hattrie_iter_t* i;
+    size_t r, count, len, fix, j;
+    const char* key;
+    char prefix[4];
+    char** fwd = malloc(n * sizeof(char*));
+    size_t* fwd_len = malloc(n * sizeof(size_t));
+
+    for (r = 0; r < 50; ++r) {
+        key = xs[rand() % n];
+        fix = r == 0 ? 0 : rand() % 3;
+        memcpy(prefix, key, fix);
+
+        count = 0;
+        i = hattrie_iter_begin_with_prefix(T, true, prefix, fix);
+        while (!hattrie_iter_finished(i)) {
+            key = hattrie_iter_key(i, &len);
+            fwd[count] = malloc(len + 1);
+            memcpy(fwd[count], key, len);
+            fwd_len[count++] = len;
+            hattrie_iter_next(i);
+        }
+        hattrie_iter_free(i);
+
+        j = count;
+        i = fix == 0 ? hattrie_iter_begin_reverse(T) :
+                       hattrie_iter_begin_with_prefix_reverse(T, prefix, fix);
+        while (!hattrie_iter_finished(i)) {
+            key = hattrie_iter_key(i, &len);
+            if (j == 0) {
+                fprintf(stderr, "[error] reverse iteration visited extra keys.\n");
+                passed = false;
+                break;
             }
-            fprintf(stderr, "] was never iterated over.\n");
-            passed = false;
-        } else if (!tests[test_index].valid) {
-            fprintf(stderr, "[error] key [ ");
-            for (size_t i = 0; i < tests[test_index].length; i++) {
-                fprintf(stderr, "0x%X ", tests[test_index].test[i]);
+            --j;
+            if (cmpkey(key, len, fwd[j], fwd_len[j]) != 0) {
+                fprintf(stderr, "[error] reverse iteration is not correctly ordered.\n");
+                passed = false;
+                break;
             }
-            fprintf(stderr, "] was iterated, but with the wrong value.\n");
+            hattrie_iter_next(i);
+        }
+        hattrie_iter_free(i);
+
+        if (j != 0) {
+            fprintf(stderr, "[error] reverse iteration missed %zu keys.\n", j);
             passed = false;
         }
-    }
 
-    hattrie_iter_free(i);
-    hattrie_free(T);
+        for (j = 0; j < count; ++j) free(fwd[j]);
+    }
 
+    free(fwd);
+    free(fwd_len);
     fprintf(stderr, "done.\n");
     return passed;
 }
 
 
-int main()
+/* Short keys that are prefixes of one another end on trie nodes once their
+ * buckets burst, so they exercise the values stored on trie nodes. */
+bool test_hattrie_nested_keys()
 {
+    fprintf(stderr, "checking nested keys ... \n");
+
     bool passed = true;
+    hattrie_t* T = hattrie_create();
+    hattrie_iter_t* i;
+    char x[16];
+    size_t j, len, count = 0;
+    const char* key;
+    value_t* u;
 
-    if (passed)
-        passed &= test_hattrie_non_ascii();
-    if (passed)
+    for (j = 0; j < 200000; ++j) {
+        len = sprintf(x, "k%d", rand() % 1000000);
+        len = 1 + rand() % len;
+        *hattrie_get(T, x, len) = len;
+    }
+
+    i = hattrie_iter_begin(T, false);
+    while (!hattrie_iter_finished(i)) {
+        key = hattrie_iter_key(i, &len);
+        u = hattrie_tryget(T, key, len);
+        if (u == NULL || *u != len) {
+            fprintf(stderr, "[error] nested key [%.*s] was not stored.\n", (int)len, key);
+            passed = false;
+        }
+        ++count;
+        hattrie_iter_next(i);
+    }
+    hattrie_iter_free(i);
+
+    i = hattrie_iter_begin_reverse(T);
+    char* prev_key = malloc(16);
+    size_t prev_len = 0;
+    j = 0;
+    while (!hattrie_iter_finished(i)) {
+        key = hattrie_iter_key(i, &len);
+        if (j > 0 && cmpkey(prev_key, prev_len, key, len) <= 0) {
+            fprintf(stderr, "[error] reverse iteration is not correctly ordered.\n");
+            passed = false;
+        }
+        memcpy(prev_key, key, len);
+        prev_len = len;
+        ++j;
+        hattrie_iter_next(i);
+    }
+    hattrie_iter_free(i);
+    free(prev_key);
+
+    if (count != hattrie_size(T) || j != count) {
+        fprintf(stderr, "[error] iterated through %zu and %zu keys, expected %zu.\n",
+                count, j, hattrie_size(T));
+        passed = false;
+    }
+
+    hattrie_free(T);
+    fprintf(stderr, "done.\n");
+    return passed;
+}
+
+
+/* Check counting, rank, and select against sorted keys, for a trie that keeps
+ * counts and one that does not. */
+bool check_hattrie_counts(hattrie_t* T)
+{
+    bool passed = true;
+    size_t n = hattrie_size(T);
+    char** keys = malloc(n * sizeof(char*));
+    size_t* lens = malloc(n * sizeof(size_t));
+    hattrie_iter_t* i;
+    const char* key;
+    size_t j, r, len, lo, hi, mid, count;
+    char x[16];
+
+    i = hattrie_iter_begin(T, true);
+    for (j = 0; !hattrie_iter_finished(i); ++j, hattrie_iter_next(i)) {
+        key = hattrie_iter_key(i, &len);
+        keys[j] = malloc(len + 1);
+        memcpy(keys[j], key, len);
+        lens[j] = len;
+    }
+    hattrie_iter_free(i);
+
+    for (j = 0; j < 2000 && passed; ++j) {
+        /* a stored key and a random one, which may not be */
+        r = rand() % n;
+        if (hattrie_rank(T, keys[r], lens[r]) != r) {
+            fprintf(stderr, "[error] rank of stored key [%.*s] is not %zu.\n",
+                    (int) lens[r], keys[r], r);
+            passed = false;
+        }
+
+        i = hattrie_select(T, r);
+        key = i ? hattrie_iter_key(i, &len) : NULL;
+        if (key == NULL || len != lens[r] || memcmp(key, keys[r], len) != 0) {
+            fprintf(stderr, "[error] selected the wrong key of rank %zu.\n", r);
+            passed = false;
+        }
+        hattrie_iter_free(i);
+
+        len = sprintf(x, "k%d", rand() % 1000000);
+        len = 1 + rand() % len;
+        lo = 0;
+        hi = n;
+        while (lo < hi) {
+            mid = lo + (hi - lo) / 2;
+            if (cmpkey(keys[mid], lens[mid], x, len) < 0) lo = mid + 1;
+            else hi = mid;
+        }
+        if (hattrie_rank(T, x, len) != lo) {
+            fprintf(stderr, "[error] rank of key [%.*s] is not %zu.\n", (int) len, x, lo);
+            passed = false;
+        }
+
+        /* every key with x as a prefix follows it in order */
+        for (count = 0; lo + count < n; ++count) {
+            if (lens[lo + count] < len || memcmp(keys[lo + count], x, len) != 0) break;
+        }
+        if (hattrie_count_prefix(T, x, len) != count) {
+            fprintf(stderr, "[error] counted %zu keys with prefix [%.*s], expected %zu.\n",
+                    hattrie_count_prefix(T, x, len), (int) len, x, count);
+            passed = false;
+        }
+    }
+
+    if (hattrie_count_prefix(T, NULL, 0) != n || hattrie_select(T, n) != NULL) {
+        fprintf(stderr, "[error] counted the wrong number of keys in all.\n");
+        passed = false;
+    }
+
+    for (j = 0; j < n; ++j) free(keys[j]);
+    free(keys);
+    free(lens);
+    return passed;
+}
+
+
+bool test_hattrie_counts()
+{
+    fprintf(stderr, "checking counts, rank, and select ... \n");
+
+    bool passed = true;
+    hattrie_t* T  = hattrie_create_ex(HATTRIE_COUNTS);
+    hattrie_t* T0 = hattrie_create();
+    char x[16];
+    size_t j, len;
+
+    for (j = 0; j < 200000; ++j) {
+        len = sprintf(x, "k%d", rand() % 1000000);
+        len = 1 + rand() % len;
+        *hattrie_get(T, x, len) = len;
+        *hattrie_get(T0, x, len) = len;
+    }
+
+    for (j = 0; j < 50000; ++j) {
+        len = sprintf(x, "k%d", rand() % 1000000);
+        len = 1 + rand() % len;
+        hattrie_del(T, x, len);
+        hattrie_del(T0, x, len);
+    }
+
+    passed &= check_hattrie_counts(T);
+    passed &= check_hattrie_counts(T0);
+
+    hattrie_free(T);
+    hattrie_free(T0);
+    fprintf(stderr, "done.\n");
+    return passed;
+}
+
+
+static int cmpval_desc(const void* a_, const void* b_)
+{
+    value_t a = *(const value_t*) a_;
+    value_t b = *(const value_t*) b_;
+    return (a < b) - (a > b);
+}
+
+
+/* Check the top k values under random prefixes against those found by
+ * iterating through every key with the prefix. */
+bool check_hattrie_topk(hattrie_t* T)
+{
+    bool passed = true;
+    const size_t k = 10;
+    hattrie_entry_t out[10];
+    value_t* vals = malloc(hattrie_size(T) * sizeof(value_t));
+    hattrie_iter_t* i;
+    char x[16];
+    size_t j, l, len, m, found;
+    value_t* u;
+
+    for (j = 0; j < 500 && passed; ++j) {
+        len = sprintf(x, "k%d", rand() % 1000000);
+        len = rand() % (len + 1);
+
+        m = 0;
+        i = hattrie_iter_begin_with_prefix(T, false, x, len);
+        while (!hattrie_iter_finished(i)) {
+            vals[m++] = *hattrie_iter_val(i);
+            hattrie_iter_next(i);
+        }
+        hattrie_iter_free(i);
+        qsort(vals, m, sizeof(value_t), cmpval_desc);
+
+        found = hattrie_topk_prefix(T, x, len, k, out);
+        if (found != (m < k ? m : k)) {
+            fprintf(stderr, "[error] found %zu of the top keys with prefix [%.*s], expected %zu.\n",
+                    found, (int) len, x, m < k ? m : k);
+            passed = false;
+        }
+
+        for (l = 0; l < found; ++l) {
+            u = hattrie_tryget(T, out[l].key, out[l].len);
+            if (passed && (out[l].val != vals[l] || u == NULL || *u != out[l].val ||
+                           out[l].len < len || memcmp(out[l].key, x, len) != 0)) {
+                fprintf(stderr, "[error] top key %zu with prefix [%.*s] is wrong.\n",
+                        l, (int) len, x);
+                passed = false;
+            }
+            free(out[l].key);
+        }
+    }
+
+    free(vals);
+    return passed;
+}
+
+
+bool test_hattrie_topk()
+{
+    fprintf(stderr, "checking top-k by value ... \n");
+
+    bool passed = true;
+    hattrie_t* T  = hattrie_create_ex(HATTRIE_MAXIMA);
+    hattrie_t* T0 = hattrie_create();
+    char x[16];
+    size_t j, len;
+    value_t val;
+
+    /* values rise, fall, and are deleted, moving the maxima both ways */
+    for (j = 0; j < 300000; ++j) {
+        len = sprintf(x, "k%d", rand() % 1000000);
+        len = 1 + rand() % len;
+        if (j % 5 == 4) {
+            hattrie_del(T, x, len);
+            hattrie_del(T0, x, len);
+        }
+        else {
+            val = rand() % 100000;
+            hattrie_set(T, x, len, val);
+            hattrie_set(T0, x, len, val);
+        }
+    }
+
+    passed &= check_hattrie_topk(T);
+    passed &= check_hattrie_topk(T0);
+
+    hattrie_free(T);
+    hattrie_free(T0);
+    fprintf(stderr, "done.\n");
+    return passed;
+}
+
+
+bool test_hattrie_aggregates()
+{
+    fprintf(stderr, "checking prefix aggregates ... \n");
+
+    bool passed = true;
+    hattrie_t* T = hattrie_create_ex(HATTRIE_AGGREGATES);
+    hattrie_iter_t* i;
+    hattrie_aggregate_t a, b;
+    char x[16];
+    size_t j, len;
+    value_t val;
+
+    /* counters that are added to, reset, and deleted */
+    for (j = 0; j < 300000; ++j) {
+        len = sprintf(x, "k%d", rand() % 1000000);
+        len = 1 + rand() % len;
+        if (j % 7 == 6)      hattrie_del(T, x, len);
+        else if (j % 7 == 5) hattrie_set(T, x, len, rand() % 1000);
+        else                 hattrie_add(T, x, len, 1 + rand() % 10);
+    }
+
+    for (j = 0; j < 2000 && passed; ++j) {
+        len = sprintf(x, "k%d", rand() % 1000000);
+        len = rand() % (len + 1);
+
+        b.count = 0;
+        b.sum = b.min = b.max = 0;
+        i = hattrie_iter_begin_with_prefix(T, false, x, len);
+        while (!hattrie_iter_finished(i)) {
+            val = *hattrie_iter_val(i);
+            if (b.count == 0 || val < b.min) b.min = val;
+            if (b.count == 0 || val > b.max) b.max = val;
+            b.sum += val;
+            ++b.count;
+            hattrie_iter_next(i);
+        }
+        hattrie_iter_free(i);
+
+        a = hattrie_aggregate_prefix(T, x, len);
+        if (a.count != b.count || a.sum != b.sum || a.min != b.min || a.max != b.max) {
+            fprintf(stderr, "[error] aggregate of prefix [%.*s] is (%zu, %zu, %zu, %zu), "
+                            "expected (%zu, %zu, %zu, %zu).\n", (int) len, x,
+                    a.count, (size_t) a.sum, (size_t) a.min, (size_t) a.max,
+                    b.count, (size_t) b.sum, (size_t) b.min, (size_t) b.max);
+            passed = false;
+        }
+    }
+
+    hattrie_free(T);
+    fprintf(stderr, "done.\n");
+    return passed;
+}
+
+
+typedef struct {
+    hattrie_entry_t e;
+    size_t order;
+} ordered_entry;
+
+
+/* Sort by key, keeping equal keys in the order they were drawn. */
+static int cmpentry(const void* a_, const void* b_)
+{
+    const ordered_entry* a = a_;
+    const ordered_entry* b = b_;
+    int c = cmpkey(a->e.key, a->e.len, b->e.key, b->e.len);
+    if (c != 0) return c;
+    return a->order < b->order ? -1 : a->order > b->order;
+}
+
+
+/* Write a random key beginning with c into x, cut short one time in cut when
+ * cut is nonzero, and return its length. */
+static size_t random_key(char* x, char c, int cut)
+{
+    size_t len = sprintf(x, "%c%d", c, rand() % 1000000);
+    if (cut > 0 && rand() % cut == 0) len = rand() % (len + 1);
+    return len;
+}
+
+
+/* Set n random keys in T to values from 1 to 1000, three in four beginning
+ * with 'k' and the rest with one of span bytes from first. Every ones-th key
+ * continues with '1', when ones is nonzero, and one in cut is cut short. */
+static void fill_trie(hattrie_t* T, size_t n, char first, int span, size_t ones, int cut)
+{
+    char x[16];
+    size_t i, len;
+    for (i = 0; i < n; ++i) {
+        len = random_key(x, rand() % 4 ? 'k' : first + rand() % span, cut);
+        if (ones > 0 && i % ones == 0) x[1] = '1';
+        hattrie_set(T, x, len, 1 + rand() % 1000);
+    }
+}
+
+
+/* A trie with the given flags holding the keys and values of T. */
+static hattrie_t* copy_trie(hattrie_t* T, unsigned int flags)
+{
+    hattrie_t* U = hattrie_create_ex(flags);
+    hattrie_iter_t* it = hattrie_iter_begin(T, false);
+    const char* key;
+    size_t len;
+    for (; !hattrie_iter_finished(it); hattrie_iter_next(it)) {
+        key = hattrie_iter_key(it, &len);
+        hattrie_set(U, key, len, *hattrie_iter_val(it));
+    }
+    hattrie_iter_free(it);
+    return U;
+}
+
+
+/* Check that two tries hold the same keys and values, in the same order. */
+bool check_hattrie_same(hattrie_t* T, hattrie_t* U)
+{
+    bool passed = true;
+    hattrie_iter_t* i = hattrie_iter_begin(T, true);
+    hattrie_iter_t* j = hattrie_iter_begin(U, true);
+    const char *a, *b;
+    size_t alen, blen;
+
+    while (!hattrie_iter_finished(i) && !hattrie_iter_finished(j)) {
+        a = hattrie_iter_key(i, &alen);
+        b = hattrie_iter_key(j, &blen);
+        if (cmpkey(a, alen, b, blen) != 0 || *hattrie_iter_val(i) != *hattrie_iter_val(j)) {
+            fprintf(stderr, "[error] found [%.*s] = %zu, expected [%.*s] = %zu.\n",
+                    (int) alen, a, (size_t) *hattrie_iter_val(i),
+                    (int) blen, b, (size_t) *hattrie_iter_val(j));
+            passed = false;
+            break;
+        }
+        hattrie_iter_next(i);
+        hattrie_iter_next(j);
+    }
+
+    if (passed && (!hattrie_iter_finished(i) || !hattrie_iter_finished(j) ||
+                   hattrie_size(T) != hattrie_size(U))) {
+        fprintf(stderr, "[error] found %zu keys, expected %zu.\n",
+                hattrie_size(T), hattrie_size(U));
+        passed = false;
+    }
+
+    hattrie_iter_free(i);
+    hattrie_iter_free(j);
+    return passed;
+}
+
+
+/* Check that a trie built with HATTRIE_SHARED, holding the keys of U, may be
+ * read by a reader while it changes, and frees T. */
+bool check_hattrie_built_shared(hattrie_t* T, hattrie_t* U)
+{
+    bool passed = true;
+    hattrie_t* C = copy_trie(U, 0);
+    hattrie_reader_t* r = hattrie_reader_create(T);
+    char x[16];
+    size_t i, len;
+
+    hattrie_reader_enter(r);
+    passed &= check_hattrie_same(T, C);
+    for (i = 0; i < 20000; ++i) {
+        len = random_key(x, 'k', 4);
+        hattrie_add(T, x, len, i);
+        hattrie_add(C, x, len, i);
+    }
+    hattrie_reader_leave(r);
+
+    hattrie_reader_enter(r);
+    passed &= check_hattrie_same(T, C);
+    hattrie_reader_leave(r);
+
+    hattrie_reader_free(r);
+    hattrie_free(T);
+    hattrie_free(C);
+    return passed;
+}
+
+
+bool test_hattrie_build_sorted()
+{
+    fprintf(stderr, "building from sorted keys ... \n");
+
+    bool passed = true;
+    const size_t m = 300000;
+    ordered_entry* xs = malloc(m * sizeof(ordered_entry));
+    hattrie_entry_t* es = malloc(m * sizeof(hattrie_entry_t));
+    hattrie_t* U = hattrie_create();
+    hattrie_t* T;
+    hattrie_aggregate_t a, b;
+    char x[16];
+    size_t j, len;
+
+    /* many short keys that are prefixes of others, and repeated keys */
+    for (j = 0; j < m; ++j) {
+        len = sprintf(x, "k%d", rand() % 1000000);
+        len = rand() % (len + 1);
+        xs[j].e.key = malloc(len + 1);
+        memcpy(xs[j].e.key, x, len);
+        xs[j].e.len = len;
+        xs[j].e.val = rand() % 1000;
+        xs[j].order = j;
+        hattrie_set(U, x, len, xs[j].e.val);
+    }
+
+    qsort(xs, m, sizeof(ordered_entry), cmpentry);
+    for (j = 0; j < m; ++j) es[j] = xs[j].e;
+
+    T = hattrie_build_sorted(HATTRIE_AGGREGATES, es, m);
+    passed &= check_hattrie_same(T, U);
+
+    for (j = 0; j < 2000 && passed; ++j) {
+        len = sprintf(x, "k%d", rand() % 1000000);
+        len = rand() % (len + 1);
+        a = hattrie_aggregate_prefix(T, x, len);
+        b = hattrie_aggregate_prefix(U, x, len);
+        if (a.count != b.count || a.sum != b.sum || a.min != b.min || a.max != b.max) {
+            fprintf(stderr, "[error] aggregate of prefix [%.*s] is (%zu, %zu, %zu, %zu), "
+                            "expected (%zu, %zu, %zu, %zu).\n", (int) len, x,
+                    a.count, (size_t) a.sum, (size_t) a.min, (size_t) a.max,
+                    b.count, (size_t) b.sum, (size_t) b.min, (size_t) b.max);
+            passed = false;
+        }
+    }
+
+    passed &= check_hattrie_built_shared(hattrie_build_sorted(HATTRIE_SHARED, es, m), U);
+
+    /* the built trie goes on to be changed like any other */
+    for (j = 0; j < m && passed; ++j) {
+        len = sprintf(x, "k%d", rand() % 1000000);
+        len = rand() % (len + 1);
+        if (j % 3 == 0) {
+            hattrie_del(T, x, len);
+            hattrie_del(U, x, len);
+        }
+        else {
+            hattrie_add(T, x, len, j);
+            hattrie_add(U, x, len, j);
+        }
+    }
+    passed &= check_hattrie_same(T, U);
+    hattrie_free(T);
+
+    /* an empty trie */
+    T = hattrie_build_sorted(0, es, 0);
+    if (hattrie_size(T) != 0 || hattrie_tryget(T, "k", 1) != NULL) {
+        fprintf(stderr, "[error] built a nonempty trie from no keys.\n");
+        passed = false;
+    }
+    *hattrie_get(T, "k", 1) = 1;
+    hattrie_free(T);
+
+    for (j = 0; j < m; ++j) free(xs[j].e.key);
+    free(xs);
+    free(es);
+    hattrie_free(U);
+    fprintf(stderr, "done.\n");
+    return passed;
+}
+
+
+bool test_hattrie_build_parallel()
+{
+    fprintf(stderr, "building in parallel ... \n");
+
+    bool passed = true;
+    const size_t m = 300000;
+    hattrie_entry_t* xs = malloc(m * sizeof(hattrie_entry_t));
+    hattrie_t* U = hattrie_create();
+    hattrie_t* T;
+    char x[32];
+    size_t j, len, nthreads;
+
+    /* most keys share a hot prefix, and many are repeated */
+    for (j = 0; j < m; ++j) {
+        if (j % 10 < 7) len = sprintf(x, "hot:%d", rand() % 500000);
+        else            len = sprintf(x, "k%d", rand() % 1000000);
+        len = rand() % (len + 1);
+        xs[j].key = malloc(len + 1);
+        memcpy(xs[j].key, x, len);
+        xs[j].len = len;
+        xs[j].val = rand() % 1000;
+        hattrie_set(U, x, len, xs[j].val);
+    }
+
+    for (nthreads = 1; nthreads <= 4 && passed; nthreads *= 4) {
+        T = hattrie_build_parallel(HATTRIE_COUNTS, xs, m, nthreads);
+        passed &= check_hattrie_same(T, U);
+
+        if (hattrie_count_prefix(T, "hot:1", 5) != hattrie_count_prefix(U, "hot:1", 5)) {
+            fprintf(stderr, "[error] wrong count of keys beginning 'hot:1'.\n");
+            passed = false;
+        }
+
+        hattrie_free(T);
+
+        T = hattrie_build_parallel(HATTRIE_SHARED, xs, m, nthreads);
+        passed &= check_hattrie_built_shared(T, U);
+    }
+
+    for (j = 0; j < m; ++j) free(xs[j].key);
+    free(xs);
+    hattrie_free(U);
+    fprintf(stderr, "done.\n");
+    return passed;
+}
+
+
+/* Check that aggregates over random prefixes agree between two tries. */
+bool check_hattrie_aggregates_same(hattrie_t* T, hattrie_t* U)
+{
+    bool passed = true;
+    hattrie_aggregate_t a, b;
+    char x[16];
+    size_t j, len;
+
+    for (j = 0; j < 2000 && passed; ++j) {
+        len = sprintf(x, "k%d", rand() % 1000000);
+        len = rand() % (len + 1);
+        a = hattrie_aggregate_prefix(T, x, len);
+        b = hattrie_aggregate_prefix(U, x, len);
+        if (a.count != b.count || a.sum != b.sum || a.min != b.min || a.max != b.max) {
+            fprintf(stderr, "[error] aggregate of prefix [%.*s] is (%zu, %zu, %zu, %zu), "
+                            "expected (%zu, %zu, %zu, %zu).\n", (int) len, x,
+                    a.count, (size_t) a.sum, (size_t) a.min, (size_t) a.max,
+                    b.count, (size_t) b.sum, (size_t) b.min, (size_t) b.max);
+            passed = false;
+        }
+    }
+
+    return passed;
+}
+
+
+bool test_hattrie_batch()
+{
+    fprintf(stderr, "inserting in batches ... \n");
+
+    bool passed = true;
+    const size_t m = 60000;
+    hattrie_t* T = hattrie_create_ex(HATTRIE_AGGREGATES);
+    hattrie_t* U = hattrie_create();
+    hattrie_entry_t* xs = malloc(m * sizeof(hattrie_entry_t));
+    const char** keys = malloc(m * sizeof(char*));
+    size_t* lens = malloc(m * sizeof(size_t));
+    value_t** vals = malloc(m * sizeof(value_t*));
+    char x[16];
+    size_t i, j, n, len, round = 0;
+
+    /* batches of growing size, which overflow buckets more and more */
+    for (n = 10; n <= m && passed; n *= 2) {
+        for (i = 0; i < n; ++i) {
+            len = sprintf(x, "k%d", rand() % 1000000);
+            len = rand() % (len + 1);
+            xs[i].key = malloc(len + 1);
+            memcpy(xs[i].key, x, len);
+            xs[i].len = len;
+            xs[i].val = 1 + rand() % 1000;
+            keys[i] = xs[i].key;
+            lens[i] = len;
+        }
+
+        /* every other batch only finds the keys */
+        if (round++ % 2 == 0) {
+            hattrie_get_batch(T, keys, lens, n, vals);
+            for (i = 0; i < n; ++i) {
+                if (vals[i] != hattrie_tryget(T, keys[i], lens[i])) {
+                    fprintf(stderr, "[error] batch found the wrong value for [%.*s].\n",
+                            (int) lens[i], keys[i]);
+                    passed = false;
+                    break;
+                }
+            }
+            for (i = 0; i < n; ++i) hattrie_get(U, keys[i], lens[i]);
+        }
+        else {
+            hattrie_insert_batch(T, xs, n);
+            for (i = 0; i < n; ++i) hattrie_set(U, xs[i].key, xs[i].len, xs[i].val);
+        }
+
+        passed &= check_hattrie_same(T, U);
+        passed &= check_hattrie_aggregates_same(T, U);
+        if (hattrie_count_prefix(T, "k1", 2) != hattrie_count_prefix(U, "k1", 2)) {
+            fprintf(stderr, "[error] wrong count of keys beginning 'k1'.\n");
+            passed = false;
+        }
+
+        for (j = 0; j < n; ++j) free(xs[j].key);
+    }
+
+    free(xs);
+    free(keys);
+    free(lens);
+    free(vals);
+    hattrie_free(T);
+    hattrie_free(U);
+    fprintf(stderr, "done.\n");
+    return passed;
+}
+
+
+/* Check that splitting the keys with a prefix gives at most n parts of about
+ * the same size, which, sorted, follow one another as one sorted iterator. */
+bool check_hattrie_split(hattrie_t* T, const char* prefix, size_t len, size_t n)
+{
+    bool passed = true;
+    hattrie_iter_t** parts = malloc(n * sizeof(hattrie_iter_t*));
+    hattrie_iter_t* all = hattrie_iter_begin_with_prefix(T, true, prefix, len);
+    size_t m = hattrie_count_prefix(T, prefix, len);
+    size_t j, k, count, alen, blen, total = 0;
+    const char *a, *b;
+    char x[64];
+    value_t* u;
+
+    k = hattrie_iter_split(T, true, prefix, len, n, parts);
+    if (k == 0 || k > n || (k < n && k < m)) {
+        fprintf(stderr, "[error] split [%.*s] into %zu parts, asked for %zu.\n",
+                (int) len, prefix, k, n);
+        passed = false;
+    }
+
+    for (j = 0; j < k; ++j) {
+        for (count = 0; !hattrie_iter_finished(parts[j]); ++count) {
+            a = hattrie_iter_key(parts[j], &alen);
+            b = hattrie_iter_finished(all) ? NULL : hattrie_iter_key(all, &blen);
+            if (passed && (b == NULL || cmpkey(a, alen, b, blen) != 0 ||
+                           *hattrie_iter_val(parts[j]) != *hattrie_iter_val(all))) {
+                fprintf(stderr, "[error] part %zu of [%.*s] visited [%.*s] out of order.\n",
+                        j, (int) len, prefix, (int) alen, a);
+                passed = false;
+            }
+            hattrie_iter_next(parts[j]);
+            hattrie_iter_next(all);
+        }
+
+        /* a part may be off by the slack at either end */
+        if (count > m / n + m / n / 4 + 1) {
+            fprintf(stderr, "[error] part %zu of [%.*s] holds %zu keys, of %zu in %zu.\n",
+                    j, (int) len, prefix, count, m, n);
+            passed = false;
+        }
+        total += count;
+        hattrie_iter_free(parts[j]);
+    }
+
+    if (total != m) {
+        fprintf(stderr, "[error] parts of [%.*s] held %zu keys, expected %zu.\n",
+                (int) len, prefix, total, m);
+        passed = false;
+    }
+
+    /* unsorted parts visit the same keys */
+    k = hattrie_iter_split(T, false, prefix, len, n, parts);
+    total = 0;
+    memcpy(x, prefix, len);
+    for (j = 0; j < k; ++j) {
+        for (; !hattrie_iter_finished(parts[j]); hattrie_iter_next(parts[j])) {
+            a = hattrie_iter_key(parts[j], &alen);
+            memcpy(x + len, a, alen);
+            u = hattrie_tryget(T, x, len + alen);
+            if (passed && (u == NULL || *u != *hattrie_iter_val(parts[j]))) {
+                fprintf(stderr, "[error] unsorted part %zu of [%.*s] visited [%.*s], "
+                                "which is not stored.\n",
+                        j, (int) len, prefix, (int) alen, a);
+                passed = false;
+            }
+            ++total;
+        }
+        hattrie_iter_free(parts[j]);
+    }
+
+    if (total != m) {
+        fprintf(stderr, "[error] unsorted parts of [%.*s] held %zu keys, expected %zu.\n",
+                (int) len, prefix, total, m);
+        passed = false;
+    }
+
+    hattrie_iter_free(all);
+    free(parts);
+    return passed;
+}
+
+
+static void sum_visit(const char* key, size_t len, value_t* val, void* ctx)
+{
+    __atomic_fetch_add((value_t*) ctx, *val + len, __ATOMIC_RELAXED);
+    (void) key;
+}
+
+
+static void inc_visit(const char* key, size_t len, value_t* val, void* ctx)
+{
+    ++*val;
+    (void) key; (void) len; (void) ctx;
+}
+
+
+bool test_hattrie_split()
+{
+    fprintf(stderr, "splitting into parts ... \n");
+
+    bool passed = true;
+    hattrie_t* T = hattrie_create();
+    hattrie_t* U = hattrie_create_ex(HATTRIE_COUNTS);
+    char x[16];
+    size_t i, len;
+    value_t val;
+
+    for (i = 0; i < 200000; ++i) {
+        len = sprintf(x, "k%d", rand() % 1000000);
+        if (rand() % 4 == 0) len = rand() % (len + 1);
+        val = 1 + rand() % 1000;
+        hattrie_set(T, x, len, val);
+        hattrie_set(U, x, len, val);
+    }
+
+    /* prefixes ending on trie nodes, inside buckets, and holding no keys */
+    static const char* prefixes[] = { "", "k", "k1", "k12", "k123", "k5555", "x", NULL };
+    static const size_t ns[] = { 1, 2, 3, 7, 16, 100, 1000 };
+    const char** p;
+    for (p = prefixes; *p && passed; ++p) {
+        for (i = 0; i < sizeof(ns) / sizeof(ns[0]) && passed; ++i) {
+            passed &= check_hattrie_split(T, *p, strlen(*p), ns[i]);
+            passed &= check_hattrie_split(U, *p, strlen(*p), ns[i]);
+        }
+    }
+
+    /* every key is visited once, from however many threads */
+    value_t expected = 0, sum;
+    hattrie_iter_t* it = hattrie_iter_begin(T, false);
+    for (; !hattrie_iter_finished(it); hattrie_iter_next(it)) {
+        hattrie_iter_key(it, &len);
+        expected += *hattrie_iter_val(it) + len;
+    }
+    hattrie_iter_free(it);
+
+    for (i = 1; i <= 8 && passed; i *= 2) {
+        sum = 0;
+        hattrie_parallel_for_each(T, sum_visit, &sum, i);
+        if (sum != expected) {
+            fprintf(stderr, "[error] for each on %zu threads summed %zu, expected %zu.\n",
+                    i, (size_t) sum, (size_t) expected);
+            passed = false;
+        }
+    }
+
+    /* values may be changed, including those kept on trie nodes */
+    hattrie_parallel_for_each(T, inc_visit, NULL, 4);
+    sum = 0;
+    hattrie_parallel_for_each(T, sum_visit, &sum, 1);
+    if (sum != expected + hattrie_size(T)) {
+        fprintf(stderr, "[error] for each changed values to sum %zu, expected %zu.\n",
+                (size_t) sum, (size_t) (expected + hattrie_size(T)));
+        passed = false;
+    }
+
+    hattrie_free(T);
+    hattrie_free(U);
+    fprintf(stderr, "done.\n");
+    return passed;
+}
+
+
+static value_t merge_sum(value_t dst, value_t src, void* ctx)
+{
+    ++*(size_t*) ctx;
+    return dst + src;
+}
+
+
+bool test_hattrie_merge()
+{
+    fprintf(stderr, "merging tries ... \n");
+
+    bool passed = true;
+    hattrie_t* T = hattrie_create_ex(HATTRIE_AGGREGATES);
+    hattrie_t* P = hattrie_create();
+    hattrie_t* U = hattrie_create();
+    hattrie_t* S;
+    hattrie_iter_t* it;
+    const char* key;
+    char x[16];
+    size_t i, n, len, round, combined, expected;
+    int c;
+
+    /* Sources of growing size, with and without the summaries dst keeps. Half
+     * their keys begin with a byte dst holds none under, and most of the rest
+     * with one it holds many under. */
+    for (round = 0, n = 100; n <= 100000 && passed; ++round, n *= 3) {
+        S = hattrie_create_ex(round % 2 == 0 ? HATTRIE_AGGREGATES : 0);
+        for (i = 0; i < n; ++i) {
+            switch (rand() % 8) {
+                case 0:  c = 'l' + rand() % (round + 1); break;
+                case 1:
+                case 2:
+                case 3:  c = 'k'; break;
+                default: c = 'a' + round;
+            }
+            len = random_key(x, c, 4);
+            hattrie_add(S, x, len, 1 + rand() % 1000);
+        }
+
+        expected = 0;
+        it = hattrie_iter_begin(S, false);
+        for (; !hattrie_iter_finished(it); hattrie_iter_next(it)) {
+            key = hattrie_iter_key(it, &len);
+            if (hattrie_tryget(U, key, len)) ++expected;
+            hattrie_add(U, key, len, *hattrie_iter_val(it));
+        }
+        hattrie_iter_free(it);
+
+        /* the plain trie gets a copy, merged without combining */
+        hattrie_t* Q = copy_trie(S, 0);
+
+        combined = 0;
+        hattrie_merge_into(T, S, merge_sum, &combined);
+        hattrie_merge_into(P, Q, NULL, NULL);
+
+        if (combined != expected) {
+            fprintf(stderr, "[error] merge combined %zu values, expected %zu.\n",
+                    combined, expected);
+            passed = false;
+        }
+        if (hattrie_size(S) != 0 || hattrie_size(Q) != 0) {
+            fprintf(stderr, "[error] merge left keys in the source.\n");
+            passed = false;
+        }
+
+        passed &= check_hattrie_same(T, U);
+
+        /* the emptied source may be filled again */
+        hattrie_set(S, "a", 1, 1);
+        if (hattrie_size(S) != 1 || *hattrie_tryget(S, "a", 1) != 1) {
+            fprintf(stderr, "[error] emptied source could not be reused.\n");
+            passed = false;
+        }
+
+        hattrie_free(S);
+        hattrie_free(Q);
+    }
+
+    if (passed) {
+        passed &= check_hattrie_aggregates_same(T, U);
+        passed &= check_hattrie_counts(T);
+    }
+
+    /* the plain trie holds the same keys, with the last value set */
+    it = hattrie_iter_begin(U, false);
+    for (; !hattrie_iter_finished(it) && passed; hattrie_iter_next(it)) {
+        key = hattrie_iter_key(it, &len);
+        if (hattrie_tryget(P, key, len) == NULL) {
+            fprintf(stderr, "[error] merge lost [%.*s].\n", (int) len, key);
+            passed = false;
+        }
+    }
+    hattrie_iter_free(it);
+    if (hattrie_size(P) != hattrie_size(U)) {
+        fprintf(stderr, "[error] merge left %zu keys, expected %zu.\n",
+                hattrie_size(P), hattrie_size(U));
+        passed = false;
+    }
+
+    hattrie_free(T);
+    hattrie_free(P);
+    hattrie_free(U);
+    fprintf(stderr, "done.\n");
+    return passed;
+}
+
+
+/* Combines values asymmetrically, so that swapping them shows. */
+static value_t set_combine(value_t dst, value_t src, void* ctx)
+{
+    ++*(size_t*) ctx;
+    return 2 * dst + src;
+}
+
+
+/* Apply a set operation to a copy of A, with the given flags, and B, and
+ * check it against the same worked out a key at a time. */
+bool check_hattrie_set_op(hattrie_t* A, hattrie_t* B, unsigned int flags, char op)
+{
+    bool passed = true;
+    hattrie_t* D = copy_trie(A, flags);
+    hattrie_t* C = copy_trie(B, 0);
+    hattrie_t* R = hattrie_create();
+    hattrie_iter_t* it;
+    const char* key;
+    size_t len, combined = 0, expected = 0;
+    value_t* u;
+
+    it = hattrie_iter_begin(A, false);
+    for (; !hattrie_iter_finished(it); hattrie_iter_next(it)) {
+        key = hattrie_iter_key(it, &len);
+        u = hattrie_tryget(B, key, len);
+        if (u) ++expected;
+        if (op == '|' || (op == '&' && u) || (op == '-' && !u)) {
+            hattrie_set(R, key, len, u && op != '-' ? 2 * *hattrie_iter_val(it) + *u
+                                                    : *hattrie_iter_val(it));
+        }
+    }
+    hattrie_iter_free(it);
+
+    if (op == '|') {
+        it = hattrie_iter_begin(B, false);
+        for (; !hattrie_iter_finished(it); hattrie_iter_next(it)) {
+            key = hattrie_iter_key(it, &len);
+            if (!hattrie_tryget(A, key, len)) hattrie_set(R, key, len, *hattrie_iter_val(it));
+        }
+        hattrie_iter_free(it);
+        hattrie_union(D, B, set_combine, &combined);
+    }
+    else if (op == '&') hattrie_intersect(D, B, set_combine, &combined);
+    else {
+        hattrie_difference(D, B);
+        expected = 0;
+    }
+
+    if (combined != expected) {
+        fprintf(stderr, "[error] '%c' combined %zu values, expected %zu.\n",
+                op, combined, expected);
+        passed = false;
+    }
+
+    passed &= check_hattrie_same(D, R);
+    if (passed && flags == HATTRIE_AGGREGATES) {
+        passed &= check_hattrie_aggregates_same(D, R);
+    }
+
+    /* the source is left as it was */
+    passed &= check_hattrie_same(B, C);
+
+    hattrie_free(D);
+    hattrie_free(C);
+    hattrie_free(R);
+    return passed;
+}
+
+
+bool test_hattrie_set_ops()
+{
+    fprintf(stderr, "union, intersection, and difference ... \n");
+
+    bool passed = true;
+    hattrie_t* A = hattrie_create();
+    hattrie_t* B = hattrie_create_ex(HATTRIE_COUNTS);
+    hattrie_t* E = hattrie_create();
+    size_t i;
+
+    /* Both hold many keys beginning with 'k', and more with "k1", B fewer, so
+     * that its trie nodes end sooner, and each some beginning with bytes the
+     * other has none of. */
+    fill_trie(A, 60000, 'a', 6, 3, 4);
+    fill_trie(B, 24000, 'd', 6, 2, 4);
+
+    /* with the summaries of the destination, whole subtrees are copied */
+    hattrie_t* G = copy_trie(A, HATTRIE_AGGREGATES);
+
+    static const char ops[] = { '|', '&', '-' };
+    for (i = 0; i < sizeof(ops) && passed; ++i) {
+        passed &= check_hattrie_set_op(A, B, 0, ops[i]);
+        passed &= check_hattrie_set_op(B, A, 0, ops[i]);
+        passed &= check_hattrie_set_op(A, B, HATTRIE_AGGREGATES, ops[i]);
+        passed &= check_hattrie_set_op(B, A, HATTRIE_AGGREGATES, ops[i]);
+        passed &= check_hattrie_set_op(A, A, 0, ops[i]);
+        passed &= check_hattrie_set_op(A, E, 0, ops[i]);
+        passed &= check_hattrie_set_op(E, A, HATTRIE_AGGREGATES, ops[i]);
+        passed &= check_hattrie_set_op(E, A, 0, ops[i]);
+        passed &= check_hattrie_set_op(E, G, HATTRIE_AGGREGATES, ops[i]);
+        passed &= check_hattrie_set_op(B, G, HATTRIE_AGGREGATES, ops[i]);
+    }
+
+    hattrie_free(A);
+    hattrie_free(B);
+    hattrie_free(E);
+    hattrie_free(G);
+    fprintf(stderr, "done.\n");
+    return passed;
+}
+
+
+/* Check that the quantiles of T divide it into n ranges by rank. */
+bool check_hattrie_quantiles(hattrie_t* T, size_t n)
+{
+    bool passed = true;
+    size_t m = hattrie_size(T);
+    hattrie_entry_t* out = malloc(n * sizeof(hattrie_entry_t));
+    size_t j, k;
+
+    k = hattrie_quantiles(T, n, out);
+    if (k >= n || (n <= m && k != n - 1)) {
+        fprintf(stderr, "[error] found %zu quantiles of %zu keys, asked for %zu.\n",
+                k, m, n);
+        passed = false;
+    }
+
+    for (j = 0; j < k; ++j) {
+        if (passed && n <= m && out[j].val != (j + 1) * m / n) {
+            fprintf(stderr, "[error] quantile %zu of %zu has rank %zu, expected %zu.\n",
+                    j, n, (size_t) out[j].val, (j + 1) * m / n);
+            passed = false;
+        }
+        /* ranks of a sample, if there are many */
+        if (passed && ((j % (k / 256 + 1) == 0 &&
+                        hattrie_rank(T, out[j].key, out[j].len) != out[j].val) ||
+                       (j > 0 && cmpkey(out[j - 1].key, out[j - 1].len,
+                                        out[j].key, out[j].len) >= 0))) {
+            fprintf(stderr, "[error] quantile %zu of %zu, [%.*s], is out of order.\n",
+                    j, n, (int) out[j].len, out[j].key);
+            passed = false;
+        }
+    }
+
+    for (j = 0; j < k; ++j) free((char*) out[j].key);
+    free(out);
+    return passed;
+}
+
+
+/* Extract [lo, hi) from T and check both parts against filtered copies. */
+bool check_hattrie_extract(hattrie_t* T, unsigned int flags, const char* lo, size_t lo_len,
+                           const char* hi, size_t hi_len)
+{
+    bool passed = true;
+    hattrie_t* in  = hattrie_create_ex(flags);
+    hattrie_t* out = hattrie_create_ex(flags);
+    hattrie_t* E;
+    hattrie_iter_t* it;
+    const char* key;
+    size_t len, combined = 0;
+
+    it = hattrie_iter_begin(T, false);
+    for (; !hattrie_iter_finished(it); hattrie_iter_next(it)) {
+        key = hattrie_iter_key(it, &len);
+        if ((lo == NULL || cmpkey(key, len, lo, lo_len) >= 0) &&
+            (hi == NULL || cmpkey(key, len, hi, hi_len) < 0)) {
+            hattrie_set(in, key, len, *hattrie_iter_val(it));
+        }
+        else hattrie_set(out, key, len, *hattrie_iter_val(it));
+    }
+    hattrie_iter_free(it);
+
+    E = hattrie_extract_range(T, lo, lo_len, hi, hi_len);
+    passed &= check_hattrie_same(E, in);
+    passed &= check_hattrie_same(T, out);
+    if (passed && flags == HATTRIE_AGGREGATES) {
+        passed &= check_hattrie_aggregates_same(E, in);
+        passed &= check_hattrie_aggregates_same(T, out);
+    }
+
+    /* the keys go back without meeting any left behind */
+    hattrie_merge_into(T, E, merge_sum, &combined);
+    if (combined != 0 || hattrie_size(T) != hattrie_size(in) + hattrie_size(out)) {
+        fprintf(stderr, "[error] extracted keys overlapped %zu left behind.\n", combined);
+        passed = false;
+    }
+
+    hattrie_free(E);
+    hattrie_free(in);
+    hattrie_free(out);
+    return passed;
+}
+
+
+bool test_hattrie_partition()
+{
+    fprintf(stderr, "partitioning by key range ... \n");
+
+    bool passed = true;
+    hattrie_t* T = hattrie_create();
+    hattrie_t* V = hattrie_create();
+    size_t i, j, k, len;
+
+    fill_trie(T, 50000, 'a', 26, 0, 4);
+    hattrie_t* U = copy_trie(T, HATTRIE_AGGREGATES);
+
+    static const size_t ns[] = { 1, 2, 3, 7, 16, 100, 1000, 200000 };
+    for (i = 0; i < sizeof(ns) / sizeof(ns[0]) && passed; ++i) {
+        passed &= check_hattrie_quantiles(T, ns[i]);
+        passed &= check_hattrie_quantiles(U, ns[i]);
+        passed &= check_hattrie_quantiles(V, ns[i]);
+    }
+
+    /* bounds on trie nodes, inside buckets, open, and enclosing nothing */
+    static const char* bounds[][2] = {
+        { NULL, NULL }, { "", NULL }, { NULL, "" }, { "k", "l" }, { "k1", "k2" },
+        { "k12", "k125" }, { "k5", "k5" }, { "b", "k3" }, { "k77", NULL },
+        { NULL, "k0" }, { "z", NULL }, { "k123456", "k1234567" }
+    };
+    const char *lo, *hi;
+    for (i = 0; i < sizeof(bounds) / sizeof(bounds[0]) && passed; ++i) {
+        lo = bounds[i][0];
+        hi = bounds[i][1];
+        passed &= check_hattrie_extract(T, 0, lo, lo ? strlen(lo) : 0, hi, hi ? strlen(hi) : 0);
+        passed &= check_hattrie_extract(U, HATTRIE_AGGREGATES, lo, lo ? strlen(lo) : 0, hi, hi ? strlen(hi) : 0);
+    }
+
+    /* shards cut at the quantiles hold equal numbers of keys */
+    hattrie_entry_t cuts[7];
+    hattrie_t* shard;
+    size_t m = hattrie_size(U);
+    k = hattrie_quantiles(U, 8, cuts);
+    for (j = 0; j <= k && passed; ++j) {
+        shard = hattrie_extract_range(U, j > 0 ? cuts[j - 1].key : NULL,
+                                      j > 0 ? cuts[j - 1].len : 0,
+                                      j < k ? cuts[j].key : NULL,
+                                      j < k ? cuts[j].len : 0);
+        len = hattrie_size(shard);
+        if (len != (j < k ? cuts[j].val : m) - (j > 0 ? cuts[j - 1].val : 0)) {
+            fprintf(stderr, "[error] shard %zu holds %zu keys of %zu.\n", j, len, m);
+            passed = false;
+        }
+        if (j % 4 == 0) passed &= check_hattrie_counts(shard);
+        hattrie_merge_into(V, shard, NULL, NULL);
+        hattrie_free(shard);
+    }
+    for (j = 0; j < k; ++j) free((char*) cuts[j].key);
+
+    if (passed && (hattrie_size(U) != 0 || hattrie_size(V) != m)) {
+        fprintf(stderr, "[error] shards left %zu keys, moved %zu of %zu.\n",
+                hattrie_size(U), hattrie_size(V), m);
+        passed = false;
+    }
+    passed &= check_hattrie_same(V, T);
+
+    hattrie_free(T);
+    hattrie_free(U);
+    hattrie_free(V);
+    fprintf(stderr, "done.\n");
+    return passed;
+}
+
+
+
+/* One thread's share of the operations on a concurrent trie: adding to keys
+ * all threads share, and setting and deleting keys of its own. */
+typedef struct {
+    hattrie_concurrent_t* C;
+    hattrie_t* U;   // where to replay the operations, if not NULL
+    unsigned int id;
+    unsigned int seed;
+    size_t m;
+    bool passed;
+} concurrent_worker;
+
+
+static void* concurrent_work(void* arg)
+{
+    concurrent_worker* w = arg;
+    unsigned int seed = w->seed, r;
+    char x[32];
+    size_t i, len;
+    value_t v, u;
+
+    for (i = 0; i < w->m; ++i) {
+        seed = seed * 1103515245 + 12345;
+        r = (seed >> 8) % 1000000;
+
+        if (r % 4 != 0) {
+            len = sprintf(x, "k%u", r % 20000);
+            if (w->U) {
+                hattrie_add(w->U, x, len, i);
+                continue;
+            }
+
+            v = hattrie_concurrent_add(w->C, x, len, i);
+            if (!hattrie_concurrent_tryget(w->C, x, len, &u) || u < v) {
+                fprintf(stderr, "[error] value of [%s] went back.\n", x);
+                w->passed = false;
+            }
+        }
+        else {
+            len = sprintf(x, "t%u:%u", w->id, r % 20000);
+            if (i % 3 == 0) {
+                if (w->U) hattrie_del(w->U, x, len);
+                else      hattrie_concurrent_del(w->C, x, len);
+            }
+            else {
+                if (w->U) hattrie_set(w->U, x, len, i);
+                else      hattrie_concurrent_set(w->C, x, len, i);
+            }
+        }
+    }
+
+    return NULL;
+}
+
+
+bool test_hattrie_concurrent(unsigned int flags)
+{
+    fprintf(stderr, "inserting from several threads%s ... \n",
+            flags & HATTRIE_OPTIMISTIC ? ", optimistically" : "");
+
+    bool passed = true;
+    hattrie_concurrent_t* C = hattrie_concurrent_create_ex(flags);
+    hattrie_t* U = hattrie_create();
+    concurrent_worker ws[4];
+    pthread_t threads[4];
+    unsigned int t;
+
+    for (t = 0; t < 4; ++t) {
+        ws[t].C = C;
+        ws[t].U = NULL;
+        ws[t].id = t;
+        ws[t].seed = rand();
+        ws[t].m = 100000;
+        ws[t].passed = true;
+        pthread_create(&threads[t], NULL, concurrent_work, &ws[t]);
+    }
+    for (t = 0; t < 4; ++t) {
+        pthread_join(threads[t], NULL);
+        passed &= ws[t].passed;
+    }
+
+    /* Replay each thread's operations in turn. Additions commute, and the
+     * other keys are changed by one thread only, so the result is the same. */
+    for (t = 0; t < 4; ++t) {
+        ws[t].U = U;
+        concurrent_work(&ws[t]);
+    }
+
+    if (hattrie_concurrent_size(C) != hattrie_size(U)) {
+        fprintf(stderr, "[error] concurrent trie holds %zu keys, expected %zu.\n",
+                hattrie_concurrent_size(C), hattrie_size(U));
+        passed = false;
+    }
+    passed &= check_hattrie_same(hattrie_concurrent_trie(C), U);
+
+    hattrie_concurrent_free(C);
+    hattrie_free(U);
+    fprintf(stderr, "done.\n");
+    return passed;
+}
+
+
+/* One thread's share of counting into a trie with atomic operations. */
+typedef struct {
+    hattrie_t* T;
+    unsigned int seed;
+    size_t m;
+} atomic_worker;
+
+
+static const size_t atomic_keys = 20000;
+
+
+static void* atomic_work(void* arg)
+{
+    atomic_worker* w = arg;
+    char x[32];
+    size_t i, len;
+    value_t old;
+
+    for (i = 0; i < w->m; ++i) {
+        w->seed = w->seed * 1103515245 + 12345;
+        len = sprintf(x, "c%zu", (size_t) (w->seed >> 8) % atomic_keys);
+
+        /* half the time add with fetch_add, and half with compare-exchange */
+        if (i % 2 == 0) {
+            hattrie_fetch_add(w->T, x, len, 1, NULL);
+        }
+        else {
+            old = __atomic_load_n(hattrie_tryget(w->T, x, len), __ATOMIC_RELAXED);
+            while (!hattrie_compare_exchange(w->T, x, len, &old, old + 1));
+        }
+    }
+
+    return NULL;
+}
+
+
+bool test_hattrie_atomic()
+{
+    fprintf(stderr, "counting with atomic operations ... \n");
+
+    bool passed = true;
+    hattrie_t* T = hattrie_create();
+    char x[32];
+    size_t i, len;
+
+    for (i = 0; i < atomic_keys; ++i) {
+        len = sprintf(x, "c%zu", i);
+        hattrie_get(T, x, len);
+    }
+
+    /* keys that do not exist are left alone */
+    value_t expected = 7;
+    if (hattrie_fetch_add(T, "missing", 7, 1, NULL) ||
+        hattrie_compare_exchange(T, "missing", 7, &expected, 1) || expected != 7 ||
+        hattrie_tryget(T, "missing", 7) != NULL) {
+        fprintf(stderr, "[error] atomic operation on a missing key.\n");
+        passed = false;
+    }
+
+    /* The second time, the threads count into a trie with a snapshot, so
+     * they copy the paths of the keys as they go, which leaves the snapshot
+     * with the first count. */
+    atomic_worker ws[4];
+    pthread_t threads[4];
+    hattrie_t* S = NULL;
+    value_t total, s_total;
+    unsigned int t, round;
+    for (round = 1; round <= 2; ++round) {
+        if (round == 2) S = hattrie_snapshot(T);
+
+        for (t = 0; t < 4; ++t) {
+            ws[t].T = T;
+            ws[t].seed = rand();
+            ws[t].m = 100000;
+            pthread_create(&threads[t], NULL, atomic_work, &ws[t]);
+        }
+        for (t = 0; t < 4; ++t) pthread_join(threads[t], NULL);
+
+        total = s_total = 0;
+        for (i = 0; i < atomic_keys; ++i) {
+            len = sprintf(x, "c%zu", i);
+            total += *hattrie_tryget(T, x, len);
+            if (S) s_total += *hattrie_tryget(S, x, len);
+        }
+        if (total != round * 4 * 100000) {
+            fprintf(stderr, "[error] counted %zu, expected %zu.\n", (size_t) total,
+                    (size_t) round * 4 * 100000);
+            passed = false;
+        }
+        if (S && s_total != 4 * 100000) {
+            fprintf(stderr, "[error] counted %zu into the snapshot, expected %zu.\n",
+                    (size_t) s_total, (size_t) 4 * 100000);
+            passed = false;
+        }
+    }
+    hattrie_free(S);
+
+    /* a failed exchange reports the value it found */
+    expected = 0;
+    value_t found = *hattrie_tryget(T, "c0", 2);
+    if (hattrie_compare_exchange(T, "c0", 2, &expected, 1) != (found == 0) ||
+        (found != 0 && expected != found)) {
+        fprintf(stderr, "[error] compare-exchange on [c0] reported the wrong value.\n");
+        passed = false;
+    }
+
+    hattrie_free(T);
+    fprintf(stderr, "done.\n");
+    return passed;
+}
+
+
+typedef struct {
+    hattrie_t* T;
+    unsigned int seed;
+    bool done;
+    bool passed;
+} shared_reader;
+
+
+/* Stable keys, "s<u>", are never deleted while the others, "s<u>:<v>", come
+ * and go around them, so a reader must always find all of them, and nothing
+ * twice. */
+static const size_t shared_stable = 20000;
+
+
+static void* shared_read(void* arg)
+{
+    shared_reader* w = arg;
+    hattrie_reader_t* r = hattrie_reader_create(w->T);
+    hattrie_iter_t* it;
+    const char* key;
+    char x[32], prev[32];
+    size_t i, len, prev_len, count, round;
+    bool sorted;
+    int cmp;
+
+    for (round = 0; !__atomic_load_n(&w->done, __ATOMIC_ACQUIRE); ++round) {
+        hattrie_reader_enter(r);
+
+        for (i = 0; i < 100; ++i) {
+            w->seed = w->seed * 1103515245 + 12345;
+            len = sprintf(x, "s%zu", (size_t) (w->seed >> 8) % shared_stable);
+            if (hattrie_tryget(w->T, x, len) == NULL) {
+                fprintf(stderr, "[error] reader missed stable key [%s].\n", x);
+                w->passed = false;
+            }
+        }
+
+        if (round % 16 == 0) {
+            /* every other time, sorted, where each key must exceed the last */
+            sorted = round % 32 == 0;
+            count = 0;
+            prev_len = SIZE_MAX;
+            it = hattrie_iter_begin_with_prefix(w->T, sorted, "s", 1);
+            while (!hattrie_iter_finished(it)) {
+                key = hattrie_iter_key(it, &len);
+                if (memchr(key, ':', len) == NULL) ++count;
+                if (sorted && prev_len != SIZE_MAX) {
+                    cmp = memcmp(prev, key, len < prev_len ? len : prev_len);
+                    if (cmp > 0 || (cmp == 0 && prev_len >= len)) {
+                        fprintf(stderr, "[error] reader saw keys out of order.\n");
+                        w->passed = false;
+                    }
+                }
+                memcpy(prev, key, len);
+                prev_len = len;
+                hattrie_iter_next(it);
+            }
+            hattrie_iter_free(it);
+
+            if (count != shared_stable) {
+                fprintf(stderr, "[error] reader iterated %zu stable keys, expected %zu.\n",
+                        count, shared_stable);
+                w->passed = false;
+            }
+        }
+
+        hattrie_reader_leave(r);
+    }
+
+    hattrie_reader_free(r);
+    return NULL;
+}
+
+
+bool test_hattrie_shared()
+{
+    fprintf(stderr, "reading a shared trie while it changes ... \n");
+
+    bool passed = true;
+    hattrie_t* T = hattrie_create_ex(HATTRIE_SHARED);
+    char x[32];
+    size_t i, len, round;
+
+    for (i = 0; i < shared_stable; ++i) {
+        len = sprintf(x, "s%zu", i);
+        hattrie_set(T, x, len, i);
+    }
+
+    shared_reader ws[3];
+    pthread_t threads[3];
+    unsigned int t;
+    for (t = 0; t < 3; ++t) {
+        ws[t].T = T;
+        ws[t].seed = rand();
+        ws[t].done = false;
+        ws[t].passed = true;
+        pthread_create(&threads[t], NULL, shared_read, &ws[t]);
+    }
+
+    /* add keys among the stable ones, splitting their buckets, and remove
+     * them again */
+    for (round = 0; round < 4; ++round) {
+        for (i = 0; i < 50000; ++i) {
+            len = sprintf(x, "s%zu:%zu", (size_t) rand() % shared_stable, round);
+            hattrie_set(T, x, len, i);
+        }
+        for (i = 0; i < 50000; ++i) {
+            len = sprintf(x, "t%zu", (size_t) rand() % 100000);
+            hattrie_set(T, x, len, i);
+        }
+        for (i = 0; i < shared_stable; ++i) {
+            len = sprintf(x, "s%zu:%zu", i, round);
+            hattrie_del(T, x, len);
+        }
+    }
+
+    for (t = 0; t < 3; ++t) {
+        __atomic_store_n(&ws[t].done, true, __ATOMIC_RELEASE);
+        pthread_join(threads[t], NULL);
+        passed &= ws[t].passed;
+    }
+
+    /* the owner sees every key it left */
+    for (i = 0; i < shared_stable; ++i) {
+        len = sprintf(x, "s%zu", i);
+        value_t* u = hattrie_tryget(T, x, len);
+        if (u == NULL || *u != i) {
+            fprintf(stderr, "[error] shared trie lost key [%s].\n", x);
+            passed = false;
+            break;
+        }
+    }
+
+    size_t count = 0;
+    hattrie_iter_t* it = hattrie_iter_begin(T, false);
+    while (!hattrie_iter_finished(it)) {
+        ++count;
+        hattrie_iter_next(it);
+    }
+    hattrie_iter_free(it);
+    if (count != hattrie_size(T)) {
+        fprintf(stderr, "[error] shared trie iterated %zu keys, expected %zu.\n",
+                count, hattrie_size(T));
+        passed = false;
+    }
+
+    hattrie_clear(T);
+    if (hattrie_size(T) != 0 || hattrie_tryget(T, "s0", 2) != NULL) {
+        fprintf(stderr, "[error] shared trie not empty after clearing.\n");
+        passed = false;
+    }
+
+    hattrie_free(T);
+    fprintf(stderr, "done.\n");
+    return passed;
+}
+
+
+/* A digest of the keys and values, in order, to tell one trie from another. */
+static size_t snapshot_digest(hattrie_t* T)
+{
+    size_t digest = 0;
+    size_t i, len;
+    const char* key;
+    hattrie_iter_t* it = hattrie_iter_begin(T, true);
+    for (; !hattrie_iter_finished(it); hattrie_iter_next(it)) {
+        key = hattrie_iter_key(it, &len);
+        for (i = 0; i < len; ++i) digest = 31 * digest + (unsigned char) key[i];
+        digest = 31 * digest + *hattrie_iter_val(it);
+    }
+    hattrie_iter_free(it);
+    return digest;
+}
+
+
+typedef struct {
+    hattrie_t* S;
+    size_t digest;
+    bool passed;
+} snapshot_reader;
+
+
+static void* snapshot_read(void* arg)
+{
+    snapshot_reader* w = arg;
+    size_t round;
+    for (round = 0; round < 8; ++round) {
+        if (snapshot_digest(w->S) != w->digest) {
+            fprintf(stderr, "[error] snapshot changed while it was read.\n");
+            w->passed = false;
+        }
+    }
+    return NULL;
+}
+
+
+/* Change T and R alike, with the given flags, through the functions that
+ * change a key, never writing through a value pointer. */
+static void snapshot_change(hattrie_t* T, hattrie_t* R, unsigned int flags)
+{
+    hattrie_entry_t batch[1000];
+    char x[16], keys[1000][16];
+    size_t i, len, m;
+
+    for (i = 0; i < 10000; ++i) {
+        len = random_key(x, rand() % 4 ? 'k' : 'a' + rand() % 6, 0);
+        switch (i % 5) {
+            case 0:
+                hattrie_set(T, x, len, i);
+                hattrie_set(R, x, len, i);
+                break;
+            case 1:
+                hattrie_add(T, x, len / 2, 3);
+                hattrie_add(R, x, len / 2, 3);
+                break;
+            case 2:
+                hattrie_del(T, x, len - 1);
+                hattrie_del(R, x, len - 1);
+                break;
+            case 3:
+                /* fetch_add keeps no summaries */
+                if (flags & (HATTRIE_MAXIMA | HATTRIE_SUMS)) {
+                    hattrie_add(T, x, len - 1, 1);
+                    hattrie_add(R, x, len - 1, 1);
+                }
+                else if (hattrie_fetch_add(T, x, len - 1, 1, NULL)) {
+                    hattrie_add(R, x, len - 1, 1);
+                }
+                break;
+            case 4:
+                if (hattrie_longest_prefix(T, x, len, &m)) {
+                    hattrie_add(T, x, m, 1);
+                    hattrie_add(R, x, m, 1);
+                }
+                break;
+        }
+    }
+
+    for (i = 0; i < 1000; ++i) {
+        batch[i].len = sprintf(keys[i], "b%d", rand() % 100000);
+        batch[i].key = keys[i];
+        batch[i].val = i;
+    }
+    hattrie_insert_batch(T, batch, 1000);
+    hattrie_insert_batch(R, batch, 1000);
+}
+
+
+/* Check that T and S match their copies R and C, summaries too. */
+static bool check_hattrie_snapshot_pair(hattrie_t* T, hattrie_t* R,
+                                        hattrie_t* S, hattrie_t* C,
+                                        unsigned int flags)
+{
+    bool passed = true;
+    passed &= check_hattrie_same(T, R);
+    passed &= check_hattrie_same(S, C);
+    if (passed && flags == HATTRIE_AGGREGATES) {
+        passed &= check_hattrie_aggregates_same(T, R);
+        passed &= check_hattrie_aggregates_same(S, C);
+    }
+    return passed;
+}
+
+
+bool check_hattrie_snapshot(unsigned int flags)
+{
+    bool passed = true;
+    hattrie_t* T = hattrie_create_ex(flags);
+    hattrie_t *S, *U, *V, *W, *C, *D, *E, *R;
+    size_t combined = 0;
+
+    fill_trie(T, 30000, 'a', 6, 0, 0);
+
+    /* the trie changes while another thread reads its snapshot */
+    S = hattrie_snapshot(T);
+    C = copy_trie(T, flags);
+    R = copy_trie(T, flags);
+
+    snapshot_reader w = { S, snapshot_digest(C), true };
+    pthread_t reader;
+    pthread_create(&reader, NULL, snapshot_read, &w);
+    snapshot_change(T, R, flags);
+    pthread_join(reader, NULL);
+    passed &= w.passed;
+    passed &= check_hattrie_snapshot_pair(T, R, S, C, flags);
+
+    /* a snapshot may be changed in turn, and a snapshot taken of it */
+    U = hattrie_snapshot(S);
+    D = copy_trie(S, flags);
+    snapshot_change(S, C, flags);
+    passed &= check_hattrie_snapshot_pair(T, R, S, C, flags);
+    passed &= check_hattrie_same(U, D);
+    hattrie_free(U);
+    hattrie_free(D);
+
+    /* merging and the set operations copy what they change */
+    V = hattrie_snapshot(T);
+    D = copy_trie(R, flags);
+    hattrie_union(V, S, merge_sum, &combined);
+    hattrie_union(D, C, merge_sum, &combined);
+    passed &= check_hattrie_snapshot_pair(T, R, S, C, flags);
+    passed &= check_hattrie_same(V, D);
+
+    U = hattrie_snapshot(S);
+    E = copy_trie(C, flags);
+    hattrie_difference(S, T);
+    hattrie_difference(C, R);
+    passed &= check_hattrie_snapshot_pair(T, R, S, C, flags);
+    passed &= check_hattrie_same(U, E);
+    hattrie_merge_into(S, U, merge_sum, &combined);
+    hattrie_merge_into(C, E, merge_sum, &combined);
+    passed &= check_hattrie_snapshot_pair(T, R, S, C, flags);
+    passed &= hattrie_size(U) == 0;
+    hattrie_free(U);
+    hattrie_free(E);
+
+    W = hattrie_snapshot(T);
+    U = hattrie_extract_range(T, "k", 1, "l", 1);
+    hattrie_merge_into(T, U, merge_sum, &combined);
+    passed &= check_hattrie_snapshot_pair(T, R, W, R, flags);
+    hattrie_free(U);
+
+    /* clearing a trie leaves its snapshot, which may outlive it */
+    hattrie_clear(T);
+    hattrie_set(T, "k", 1, 1);
+    hattrie_free(T);
+    passed &= check_hattrie_same(W, R);
+
+    hattrie_free(W);
+    hattrie_free(V);
+    hattrie_free(S);
+    hattrie_free(C);
+    hattrie_free(D);
+    hattrie_free(R);
+    return passed;
+}
+
+
+bool test_hattrie_snapshot()
+{
+    fprintf(stderr, "taking snapshots ... \n");
+
+    bool passed = true;
+    passed &= check_hattrie_snapshot(0);
+    passed &= check_hattrie_snapshot(HATTRIE_AGGREGATES);
+
+    fprintf(stderr, "done.\n");
+    return passed;
+}
+
+
+/* Check copies of T, made with one thread and with several, then change
+ * them, which must leave T as it was. */
+bool check_hattrie_dup(hattrie_t* T, unsigned int flags)
+{
+    bool passed = true;
+    hattrie_t* C = copy_trie(T, flags);
+    hattrie_t* U = hattrie_dup(T);
+    hattrie_t* V = hattrie_dup_parallel(T, 4);
+    char x[16];
+    size_t i, len;
+
+    passed &= check_hattrie_same(U, T);
+    passed &= check_hattrie_same(V, T);
+    if (passed && flags == HATTRIE_AGGREGATES) {
+        passed &= check_hattrie_aggregates_same(V, C);
+    }
+
+    for (i = 0; i < 5000; ++i) {
+        len = random_key(x, 'k', 0);
+        hattrie_set(U, x, len, i);
+        hattrie_del(V, x, len - 1);
+        hattrie_add(V, x, len / 2, 1);
+    }
+    hattrie_clear(U);
+    passed &= check_hattrie_same(T, C);
+
+    hattrie_free(U);
+    hattrie_free(V);
+    hattrie_free(C);
+    return passed;
+}
+
+
+bool test_hattrie_dup()
+{
+    fprintf(stderr, "copying tries ... \n");
+
+    static const unsigned int flags[] = { 0, HATTRIE_AGGREGATES, HATTRIE_SHARED };
+    bool passed = true;
+    hattrie_t *T, *S;
+    size_t j;
+
+    for (j = 0; j < sizeof(flags) / sizeof(flags[0]) && passed; ++j) {
+        T = hattrie_create_ex(flags[j]);
+        passed &= check_hattrie_dup(T, flags[j]);
+
+        /* Most keys begin with "k1", so the trie nodes for 'k' and '1' are
+         * both bigger than a thread's share, and some end on trie nodes. */
+        fill_trie(T, 60000, 'a', 6, 2, 8);
+        passed &= check_hattrie_dup(T, flags[j]);
+
+        /* a trie sharing its nodes with a snapshot is copied whole */
+        if (!(flags[j] & HATTRIE_SHARED)) {
+            S = hattrie_snapshot(T);
+            hattrie_set(T, "k1", 2, 1);
+            passed &= check_hattrie_dup(S, flags[j]);
+            passed &= check_hattrie_dup(T, flags[j]);
+            hattrie_free(S);
+        }
+
+        hattrie_free(T);
+    }
+
+    fprintf(stderr, "done.\n");
+    return passed;
+}
+
+
+typedef struct {
+    size_t lens[16];
+    size_t count;
+} prefix_matches;
+
+
+static int collect_prefix(size_t len, value_t* val, void* ctx)
+{
+    prefix_matches* m = ctx;
+    (void) val;
+    m->lens[m->count++] = len;
+    return 0;
+}
+
+
+bool test_hattrie_prefix_matching()
+{
+    fprintf(stderr, "checking prefix matching ... \n");
+
+    bool passed = true;
+    hattrie_t* T = hattrie_create();
+    char x[16];
+    size_t j, len, l, best, matched;
+    value_t* u;
+    prefix_matches m;
+
+    for (j = 0; j < 100000; ++j) {
+        len = sprintf(x, "k%d", rand() % 1000000);
+        len = 1 + rand() % len;
+        *hattrie_get(T, x, len) = len;
+    }
+
+    for (j = 0; j < 10000; ++j) {
+        len = sprintf(x, "k%d%d", rand() % 1000000, rand() % 100);
+
+        /* brute force, one lookup per length */
+        best = 0;
+        m.count = 0;
+        hattrie_prefixes(T, x, len, collect_prefix, &m);
+        size_t found = 0;
+        for (l = 1; l <= len; ++l) {
+            if (hattrie_tryget(T, x, l) == NULL) continue;
+            best = l;
+            if (found >= m.count || m.lens[found] != l) {
+                fprintf(stderr, "[error] prefix of length %zu of [%s] was not reported.\n", l, x);
+                passed = false;
+            }
+            ++found;
+        }
+
+        if (found != m.count) {
+            fprintf(stderr, "[error] %zu prefixes of [%s] reported, expected %zu.\n",
+                    m.count, x, found);
+            passed = false;
+        }
+
+        matched = 0;
+        u = hattrie_longest_prefix(T, x, len, &matched);
+        if ((u == NULL) != (best == 0) || (u && (matched != best || *u != best))) {
+            fprintf(stderr, "[error] longest prefix of [%s] is %zu, reported %zu.\n",
+                    x, best, matched);
+            passed = false;
+        }
+    }
+
+    hattrie_free(T);
+    fprintf(stderr, "done.\n");
+    return passed;
+}
+
+
+static size_t edit_distance(const char* a, size_t n, const char* b, size_t m)
+{
+    size_t* row = malloc((m + 1) * sizeof(size_t));
+    size_t i, j, diag, d;
+    for (j = 0; j <= m; ++j) row[j] = j;
+    for (i = 1; i <= n; ++i) {
+        diag = row[0];
+        row[0] = i;
+        for (j = 1; j <= m; ++j) {
+            d = diag + (a[i - 1] != b[j - 1]);
+            if (row[j] + 1 < d) d = row[j] + 1;
+            if (row[j - 1] + 1 < d) d = row[j - 1] + 1;
+            diag = row[j];
+            row[j] = d;
+        }
+    }
+    d = row[m];
+    free(row);
+    return d;
+}
+
+
+bool test_hattrie_fuzzy()
+{
+    fprintf(stderr, "checking approximate search ... \n");
+
+    bool passed = true;
+    hattrie_t* T = hattrie_create();
+    hattrie_iter_t* i;
+    hattrie_fuzzy_iter_t* f;
+    char x[128];
+    size_t j, r, len, qlen, k, expected, count, dist;
+    const char* key;
+    value_t* u;
+
+    for (j = 0; j < 50000; ++j) {
+        len = 1 + rand() % 10;
+        if (rand() % 100 == 0) len += 60;
+        for (r = 0; r < len; ++r) x[r] = 'a' + rand() % 4;
+        *hattrie_get(T, x, len) = len;
+    }
+
+    for (r = 0; r < 40; ++r) {
+        qlen = rand() % 10;
+        if (r % 10 == 0) qlen += 60;
+        for (j = 0; j < qlen; ++j) x[j] = 'a' + rand() % 4;
+        k = rand() % 3;
+
+        expected = 0;
+        i = hattrie_iter_begin(T, false);
+        while (!hattrie_iter_finished(i)) {
+            key = hattrie_iter_key(i, &len);
+            if (edit_distance(key, len, x, qlen) <= k) ++expected;
+            hattrie_iter_next(i);
+        }
+        hattrie_iter_free(i);
+
+        count = 0;
+        f = hattrie_fuzzy_iter_begin(T, x, qlen, k);
+        while (!hattrie_fuzzy_iter_finished(f)) {
+            key  = hattrie_fuzzy_iter_key(f, &len);
+            dist = hattrie_fuzzy_iter_dist(f);
+            u    = hattrie_fuzzy_iter_val(f);
+            if (dist != edit_distance(key, len, x, qlen) || dist > k || *u != len) {
+                fprintf(stderr, "[error] key [%.*s] reported at distance %zu from [%.*s].\n",
+                        (int)len, key, dist, (int)qlen, x);
+                passed = false;
+            }
+            ++count;
+            hattrie_fuzzy_iter_next(f);
+        }
+        hattrie_fuzzy_iter_free(f);
+
+        if (count != expected) {
+            fprintf(stderr, "[error] found %zu keys within %zu edits of [%.*s], expected %zu.\n",
+                    count, k, (int)qlen, x, expected);
+            passed = false;
+        }
+    }
+
+    hattrie_free(T);
+    fprintf(stderr, "done.\n");
+    return passed;
+}
+
+
+bool test_hattrie_non_ascii()
+{
+    fprintf(stderr, "checking non-ascii... \n");
+    bool passed = true;
+    value_t* u;
+    hattrie_t* T = hattrie_create();
+    char* txt = "\x81\x70";
+
+    u = hattrie_get(T, txt, strlen(txt));
+    *u = 10;
+
+    u = hattrie_tryget(T, txt, strlen(txt));
+    if (*u != 10){
+        fprintf(stderr, "[error] can't store non-ascii strings\n");
+        passed = false;
+    }
+    hattrie_free(T);
+
+    fprintf(stderr, "done.\n");
+    return passed;
+}
+
+
+typedef struct {
+    const char* test;
+    size_t length;
+    value_t value;
+    bool seen;
+    bool valid;
+    bool skip;
+    const char* name;
+} edge_case_test;
+
+
+bool test_hattrie_odd_keys()
+{
+    fprintf(stderr, "checking edge-case keys...\n");
+    bool passed = true;
+    value_t* u;
+    hattrie_t* T = hattrie_create();
+
+    size_t test_count = 5;
+    edge_case_test tests[] = {
+        { .test = "", .length = 0, .value = 0,
+          .seen = false, .valid = false, .skip = false,
+          .name = "empty" },
+        { .test = "\x00", .length = 1, .value = 1,
+          .seen = false, .valid = false, .skip = false,
+          .name = "empty terminated" },
+        { .test = "\x00\x14", .length = 2, .value = 2,
+          .seen = false, .valid = false, .skip = false,
+          .name = "NUL byte initialized" },
+        { .test = "\x14\x00", .length = 3, .value = 3,
+          .seen = false, .valid = false, .skip = false,
+          .name = "NUL byte terminated" },
+        { .test = "\x00\x14\x00", .length = 4, .value = 4,
+          .seen = false, .valid = false, .skip = false,
+          .name = "NUL byte surrounded" }
+    };
+
+    for (size_t test_index = 0; test_index < test_count; test_index++) {
+        u = hattrie_get(T, tests[test_index].test, tests[test_index].length);
+        *u = tests[test_index].value;
+    }
+
+    for (size_t test_index = 0; test_index < test_count; test_index++) {
+        u = hattrie_tryget(T, tests[test_index].test, tests[test_index].length);
+        if (*u != tests[test_index].value) {
+            fprintf(stderr,
+                    "[error] can't store %s string key with value %zu!\n",
+                    tests[test_index].name, tests[test_index].value);
+            tests[test_index].skip = true;
+            passed = false;
+        }
+    }
+
+    hattrie_iter_t* i = hattrie_iter_begin(T, false);
+    size_t verify_len;
+    value_t* verify_ptr;
+    value_t verify_val;
+    const char* verify_key;
+    while (!hattrie_iter_finished(i)) {
+        verify_key = hattrie_iter_key(i, &verify_len);
+        verify_ptr = hattrie_iter_val(i);
+        verify_val = *verify_ptr;
+
+        edge_case_test* matched_test = NULL;
+        for (size_t test_index = 0; test_index < test_count; test_index++) {
+            if (verify_len == tests[test_index].length &&
+                    memcmp(verify_key, tests[test_index].test, tests[test_index].length) == 0) {
+                matched_test = &tests[test_index];
+                break;
+            }
+        }
+        if (matched_test == NULL) {
+            fprintf(stderr, "[error] iterated over unknown edge-case key [ ");
+            for (size_t i = 0; i < verify_len; i++) {
+                fprintf(stderr, "0x%X ", verify_key[i]);
+            }
+            fprintf(stderr, "].\n");
+            passed = false;
+        } else if (matched_test->seen) {
+            fprintf(stderr, "[error] iterated over key [ ");
+            for (size_t i = 0; i < verify_len; i++) {
+                fprintf(stderr, "0x%X ", verify_key[i]);
+            }
+            fprintf(stderr, "] more than once!\n");
+            passed = false;
+        } else {
+            matched_test->seen = true;
+            if (verify_val == matched_test->value) {
+                matched_test->valid = true;
+            } else {
+                fprintf(stderr, "[error] value stored for key [ ");
+                for (size_t i = 0; i < verify_len; i++) {
+                    fprintf(stderr, "0x%X ", verify_key[i]);
+                }
+                fprintf(stderr,
+                        "] was incorrect. (expected %zu, got %zu)\n",
+                        matched_test->value, verify_val);
+                passed = false;
+            }
+        }
+        hattrie_iter_next(i);
+    }
+
+    for (uint8_t test_index = 0; test_index < test_count; test_index++) {
+        if (tests[test_index].skip)
+            continue;
+        if (!tests[test_index].seen) {
+            fprintf(stderr, "[error] key [ ");
+            for (size_t i = 0; i < tests[test_index].length; i++) {
+                fprintf(stderr, "0x%X ", tests[test_index].test[i]);
+            }
+            fprintf(stderr, "] was never iterated over.\n");
+            passed = false;
+        } else if (!tests[test_index].valid) {
+            fprintf(stderr, "[error] key [ ");
+            for (size_t i = 0; i < tests[test_index].length; i++) {
+                fprintf(stderr, "0x%X ", tests[test_index].test[i]);
+            }
+            fprintf(stderr, "] was iterated, but with the wrong value.\n");
+            passed = false;
+        }
+    }
+
+    hattrie_iter_free(i);
+    hattrie_free(T);
+
+    fprintf(stderr, "done.\n");
+    return passed;
+}
+
+
+int main()
+{
+    bool passed = true;
+
+    if (passed)
+        passed &= test_hattrie_non_ascii();
+    if (passed)
         passed &= test_hattrie_odd_keys();
+    if (passed)
+        passed &= test_hattrie_nested_keys();
+    if (passed)
+        passed &= test_hattrie_prefix_matching();
+    if (passed)
+        passed &= test_hattrie_fuzzy();
+    if (passed)
+        passed &= test_hattrie_counts();
+    if (passed)
+        passed &= test_hattrie_topk();
+    if (passed)
+        passed &= test_hattrie_aggregates();
+    if (passed)
+        passed &= test_hattrie_cursor();
+    if (passed)
+        passed &= test_hattrie_build_sorted();
+    if (passed)
+        passed &= test_hattrie_build_parallel();
+    if (passed)
+        passed &= test_hattrie_batch();
+    if (passed)
+        passed &= test_hattrie_merge();
+    if (passed)
+        passed &= test_hattrie_set_ops();
+    if (passed)
+        passed &= test_hattrie_split();
+    if (passed)
+        passed &= test_hattrie_partition();
+    if (passed)
+        passed &= test_hattrie_concurrent(0);
+    if (passed)
+        passed &= test_hattrie_concurrent(HATTRIE_OPTIMISTIC);
+    if (passed)
+        passed &= test_hattrie_atomic();
+    if (passed)
+        passed &= test_hattrie_shared();
+    if (passed)
+        passed &= test_hattrie_snapshot();
+    if (passed)
+        passed &= test_hattrie_dup();
 
     if (passed) {
         setup();
@@ -554,6 +2902,21 @@ int main()
         teardown();
     }
 
+    if (passed) {
+        setup();
+        passed &= test_hattrie_insert();
+        passed &= test_hattrie_sorted_prefix_iteration();
+        passed &= test_hattrie_range_iteration();
+        passed &= test_hattrie_reverse_iteration();
+        teardown();
+    }
+
+    if (passed) {
+        setup();
+        passed &= test_hattrie_upsert();
+        teardown();
+    }
+
     if (passed) return 0;
     return 1;
 }
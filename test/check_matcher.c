@@ -0,0 +1,203 @@
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+#include "../src/hat-trie.h"
+#include "../src/matcher.h"
+
+/* Random strings over a small alphabet, so that keys overlap often. */
+void randstr(char* x, size_t len)
+{
+    x[len] = '\0';
+    while (len > 0) {
+        x[--len] = 'a' + (rand() % 4);
+    }
+}
+
+
+const size_t n = 50000;     // how many keys
+const size_t m_low  = 1;    // minimum length of each key
+const size_t m_high = 12;   // maximum length of each key
+const size_t text_len = 200000;
+
+hattrie_t* T;
+char* text;
+
+
+typedef struct {
+    size_t offset;
+    size_t len;
+    value_t val;
+} match;
+
+
+typedef struct {
+    match* xs;
+    size_t n;
+    size_t size;
+} match_list;
+
+
+int add_match(size_t offset, size_t len, value_t val, void* ctx)
+{
+    match_list* l = ctx;
+    if (l->n == l->size) {
+        l->size *= 2;
+        l->xs = realloc(l->xs, l->size * sizeof(match));
+    }
+    l->xs[l->n].offset = offset;
+    l->xs[l->n].len    = len;
+    l->xs[l->n].val    = val;
+    ++l->n;
+    return 0;
+}
+
+
+/* Add a match, stopping the scan after every seventh. */
+int add_match_stop(size_t offset, size_t len, value_t val, void* ctx)
+{
+    add_match(offset, len, val, ctx);
+    return ((match_list*) ctx)->n % 7 == 0;
+}
+
+
+void match_list_init(match_list* l)
+{
+    l->n = 0;
+    l->size = 1024;
+    l->xs = malloc(l->size * sizeof(match));
+}
+
+
+void setup()
+{
+    fprintf(stderr, "generating %zu keys ... ", n);
+    char x[32];
+    size_t i, m;
+
+    T = hattrie_create();
+    for (i = 0; i < n; ++i) {
+        m = m_low + rand() % (m_high - m_low + 1);
+        randstr(x, m);
+        *hattrie_get(T, x, m) = m + 1000 * i;
+    }
+
+    text = malloc(text_len + 1);
+    randstr(text, text_len);
+    fprintf(stderr, "done.\n");
+}
+
+
+void teardown()
+{
+    hattrie_free(T);
+    free(text);
+}
+
+
+bool check_matches(const match_list* expected, const match_list* found, const char* what)
+{
+    size_t i;
+
+    if (expected->n != found->n) {
+        fprintf(stderr, "[error] %s found %zu matches, expected %zu.\n",
+                what, found->n, expected->n);
+        return false;
+    }
+
+    for (i = 0; i < expected->n; ++i) {
+        if (expected->xs[i].offset != found->xs[i].offset ||
+            expected->xs[i].len    != found->xs[i].len ||
+            expected->xs[i].val    != found->xs[i].val) {
+            fprintf(stderr, "[error] %s match %zu is (%zu, %zu), expected (%zu, %zu).\n",
+                    what, i, found->xs[i].offset, found->xs[i].len,
+                    expected->xs[i].offset, expected->xs[i].len);
+            return false;
+        }
+    }
+
+    return true;
+}
+
+
+bool test_matcher_scan()
+{
+    fprintf(stderr, "scanning a text of %zu characters ... \n", text_len);
+
+    bool passed = true;
+    hattrie_matcher_t* M = hattrie_matcher_create(T);
+    match_list expected, found;
+    match_list_init(&expected);
+    match_list_init(&found);
+
+    /* every match, ordered by where it ends, longest first */
+    size_t end, len;
+    value_t* u;
+    for (end = 1; end <= text_len; ++end) {
+        for (len = end < m_high ? end : m_high; len > 0; --len) {
+            u = hattrie_tryget(T, text + end - len, len);
+            if (u) add_match(end - len, len, *u, &expected);
+        }
+    }
+
+    hattrie_matcher_scan(M, text, text_len, add_match, &found);
+    passed &= check_matches(&expected, &found, "scan");
+
+    /* the same text in chunks of random size */
+    found.n = 0;
+    hattrie_match_stream_t* S = hattrie_match_stream_begin(M);
+    size_t pos = 0, chunk;
+    while (pos < text_len) {
+        chunk = rand() % 20;
+        if (chunk > text_len - pos) chunk = text_len - pos;
+        hattrie_match_stream_feed(S, text + pos, chunk, add_match, &found);
+        pos += chunk;
+    }
+    hattrie_match_stream_free(S);
+    passed &= check_matches(&expected, &found, "stream");
+
+    /* stopping the scan, then feeding the rest of the chunk, misses nothing */
+    found.n = 0;
+    S = hattrie_match_stream_begin(M);
+    size_t used;
+    pos = 0;
+    while (pos < text_len) {
+        chunk = rand() % 20;
+        if (chunk > text_len - pos) chunk = text_len - pos;
+        while (hattrie_match_stream_feed(S, text + pos, chunk, add_match_stop, &found)) {
+            used = hattrie_match_stream_offset(S) - pos;
+            pos += used;
+            chunk -= used;
+        }
+        pos += chunk;
+        if (hattrie_match_stream_offset(S) != pos) {
+            fprintf(stderr, "[error] stream consumed %zu characters, expected %zu.\n",
+                    hattrie_match_stream_offset(S), pos);
+            passed = false;
+            break;
+        }
+    }
+    hattrie_match_stream_free(S);
+    passed &= check_matches(&expected, &found, "stopped stream");
+
+    free(expected.xs);
+    free(found.xs);
+    hattrie_matcher_free(M);
+
+    fprintf(stderr, "done.\n");
+    return passed;
+}
+
+
+int main()
+{
+    bool passed = true;
+
+    setup();
+    passed &= test_matcher_scan();
+    teardown();
+
+    if (passed) return 0;
+    return 1;
+}
@@ -0,0 +1,298 @@
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+#include "../src/hat-trie.h"
+#include "../src/pattern.h"
+
+/* Random strings over a small alphabet, so that patterns match often. */
+void randstr(char* x, size_t len)
+{
+    x[len] = '\0';
+    while (len > 0) {
+        x[--len] = 'a' + (rand() % 4);
+    }
+}
+
+
+const size_t n = 100000;    // how many keys
+const size_t m_low  = 0;    // minimum length of each key
+const size_t m_high = 12;   // maximum length of each key
+
+hattrie_t* T;
+
+
+void setup()
+{
+    fprintf(stderr, "generating %zu keys ... ", n);
+    char x[32];
+    size_t i, m;
+
+    T = hattrie_create();
+    for (i = 0; i < n; ++i) {
+        m = m_low + rand() % (m_high - m_low + 1);
+        randstr(x, m);
+        *hattrie_get(T, x, m) = m + 1000 * i;
+    }
+    fprintf(stderr, "done.\n");
+}
+
+
+void teardown()
+{
+    hattrie_free(T);
+}
+
+
+typedef struct {
+    const char* pattern;
+    const char* key;
+    bool matches;
+} pattern_case;
+
+
+static const pattern_case glob_cases[] = {
+    { "",          "",        true  },
+    { "",          "a",       false },
+    { "abc",       "abc",     true  },
+    { "abc",       "abcd",    false },
+    { "a*",        "a",       true  },
+    { "a*",        "abcabc",  true  },
+    { "a*",        "ba",      false },
+    { "*c",        "abc",     true  },
+    { "a*b*c",     "aXbYbc",  true  },
+    { "a*b*c",     "acb",     false },
+    { "a?c",       "abc",     true  },
+    { "a?c",       "ac",      false },
+    { "[a-c]x",    "bx",      true  },
+    { "[a-c]x",    "dx",      false },
+    { "[!a-c]x",   "dx",      true  },
+    { "[^a-c]x",   "ax",      false },
+    { "[]]",       "]",       true  },
+    { "[a-]",      "-",       true  },
+    { "\\*",       "*",       true  },
+    { "\\*",       "a",       false },
+    { NULL,        NULL,      false }
+};
+
+
+static const pattern_case regex_cases[] = {
+    { "",            "",        true  },
+    { "abc",         "abc",     true  },
+    { "abc",         "ab",      false },
+    { "ab|cd",       "cd",      true  },
+    { "ab|cd",       "abcd",    false },
+    { "a(b|c)*d",    "ad",      true  },
+    { "a(b|c)*d",    "abccbd",  true  },
+    { "a(b|c)*d",    "abxd",    false },
+    { "a+",          "",        false },
+    { "a+",          "aaa",     true  },
+    { "ab?c",        "ac",      true  },
+    { "ab?c",        "abbc",    false },
+    { ".*x.*",       "aaxaa",   true  },
+    { "[0-9]+",      "2011",    true  },
+    { "[0-9]+",      "20a1",    false },
+    { "(a|)b",       "b",       true  },
+    { "a\\.b",       "a.b",     true  },
+    { "a\\.b",       "axb",     false },
+    { "(a*)*",       "aaaa",    true  },
+    { NULL,          NULL,      false }
+};
+
+
+static const char* malformed_regexes[] = {
+    "(ab", "ab)", "*a", "a|+", "[abc", "a\\", NULL
+};
+
+
+bool test_pattern_cases(const pattern_case* cases, bool glob)
+{
+    bool passed = true;
+    hattrie_pattern_t* P;
+    bool matches;
+
+    for (; cases->pattern; ++cases) {
+        P = glob ? hattrie_pattern_glob(cases->pattern, strlen(cases->pattern))
+                 : hattrie_pattern_regex(cases->pattern, strlen(cases->pattern));
+        if (P == NULL) {
+            fprintf(stderr, "[error] failed to compile '%s'.\n", cases->pattern);
+            passed = false;
+            continue;
+        }
+
+        matches = hattrie_pattern_match(P, cases->key, strlen(cases->key));
+        if (matches != cases->matches) {
+            fprintf(stderr, "[error] '%s' %s '%s'.\n", cases->pattern,
+                    matches ? "matched" : "did not match", cases->key);
+            passed = false;
+        }
+
+        hattrie_pattern_free(P);
+    }
+
+    return passed;
+}
+
+
+bool test_pattern_syntax()
+{
+    fprintf(stderr, "compiling patterns ... \n");
+
+    bool passed = true;
+    passed &= test_pattern_cases(glob_cases, true);
+    passed &= test_pattern_cases(regex_cases, false);
+
+    const char** re;
+    hattrie_pattern_t* P;
+    for (re = malformed_regexes; *re; ++re) {
+        P = hattrie_pattern_regex(*re, strlen(*re));
+        if (P != NULL) {
+            fprintf(stderr, "[error] malformed regex '%s' compiled.\n", *re);
+            hattrie_pattern_free(P);
+            passed = false;
+        }
+    }
+
+    /* the literal prefix every match begins with */
+    const char* prefix;
+    size_t len;
+
+    P = hattrie_pattern_glob("user:*:session", 14);
+    len = hattrie_pattern_prefix(P, &prefix);
+    if (len != 5 || memcmp(prefix, "user:", 5) != 0) {
+        fprintf(stderr, "[error] wrong prefix for 'user:*:session'.\n");
+        passed = false;
+    }
+    hattrie_pattern_free(P);
+
+    P = hattrie_pattern_regex("ab(cd|ce)+", 10);
+    len = hattrie_pattern_prefix(P, &prefix);
+    if (len != 3 || memcmp(prefix, "abc", 3) != 0) {
+        fprintf(stderr, "[error] wrong prefix for 'ab(cd|ce)+'.\n");
+        passed = false;
+    }
+    hattrie_pattern_free(P);
+
+    fprintf(stderr, "done.\n");
+    return passed;
+}
+
+
+/* Check that iterating with the pattern visits exactly the keys that a full
+ * iteration, filtered by the pattern, does, and in the same order. */
+bool check_pattern_iteration(hattrie_pattern_t* P, const char* pattern)
+{
+    bool passed = true;
+    hattrie_iter_t* all = hattrie_iter_begin(T, true);
+    hattrie_iter_t* it  = hattrie_iter_begin_with_pattern(T, true, P);
+    const char *key, *expected;
+    size_t len, expected_len, count = 0;
+
+    while (!hattrie_iter_finished(all)) {
+        expected = hattrie_iter_key(all, &expected_len);
+        if (!hattrie_pattern_match(P, expected, expected_len)) {
+            hattrie_iter_next(all);
+            continue;
+        }
+
+        if (hattrie_iter_finished(it)) {
+            fprintf(stderr, "[error] '%s' missed key '%s'.\n", pattern, expected);
+            passed = false;
+            break;
+        }
+
+        key = hattrie_iter_key(it, &len);
+        if (len != expected_len || memcmp(key, expected, len) != 0 ||
+            *hattrie_iter_val(it) != *hattrie_iter_val(all)) {
+            fprintf(stderr, "[error] '%s' visited '%s', expected '%s'.\n",
+                    pattern, key, expected);
+            passed = false;
+            break;
+        }
+
+        ++count;
+        hattrie_iter_next(all);
+        hattrie_iter_next(it);
+    }
+
+    if (passed && !hattrie_iter_finished(it)) {
+        key = hattrie_iter_key(it, &len);
+        fprintf(stderr, "[error] '%s' visited extra key '%s'.\n", pattern, key);
+        passed = false;
+    }
+
+    hattrie_iter_free(all);
+    hattrie_iter_free(it);
+
+    /* unsorted iteration visits the same number of keys */
+    size_t unsorted = 0;
+    it = hattrie_iter_begin_with_pattern(T, false, P);
+    while (!hattrie_iter_finished(it)) {
+        key = hattrie_iter_key(it, &len);
+        if (!hattrie_pattern_match(P, key, len)) {
+            fprintf(stderr, "[error] '%s' visited unmatched key '%s'.\n", pattern, key);
+            passed = false;
+        }
+        ++unsorted;
+        hattrie_iter_next(it);
+    }
+    hattrie_iter_free(it);
+
+    if (unsorted != count) {
+        fprintf(stderr, "[error] '%s' visited %zu keys unsorted, expected %zu.\n",
+                pattern, unsorted, count);
+        passed = false;
+    }
+
+    return passed;
+}
+
+
+bool test_pattern_iteration()
+{
+    fprintf(stderr, "iterating by pattern ... \n");
+
+    static const char* globs[] = {
+        "", "*", "abc*", "a*b", "*dd*", "?b?c*", "[ab]*[cd]", "cab?", "dddddddddddd",
+        NULL
+    };
+
+    static const char* regexes[] = {
+        "(ab)+", "a(b|c)*d?", "[^a]*", "b.c.d.*", "(a|b)(c|d)(a|b)(c|d)*", NULL
+    };
+
+    bool passed = true;
+    const char** p;
+    hattrie_pattern_t* P;
+
+    for (p = globs; *p; ++p) {
+        P = hattrie_pattern_glob(*p, strlen(*p));
+        passed &= check_pattern_iteration(P, *p);
+        hattrie_pattern_free(P);
+    }
+
+    for (p = regexes; *p; ++p) {
+        P = hattrie_pattern_regex(*p, strlen(*p));
+        passed &= check_pattern_iteration(P, *p);
+        hattrie_pattern_free(P);
+    }
+
+    fprintf(stderr, "done.\n");
+    return passed;
+}
+
+
+int main()
+{
+    bool passed = true;
+
+    passed &= test_pattern_syntax();
+
+    setup();
+    passed &= test_pattern_iteration();
+    teardown();
+
+    if (passed) return 0;
+    return 1;
+}